@@ -0,0 +1,177 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include <libhzr.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void PrintUsage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [options] c|d INFILE OUTFILE\n"
+          "\n"
+          "Commands:\n"
+          "  c     Compress INFILE to OUTFILE\n"
+          "  d     Decompress INFILE to OUTFILE\n"
+          "\n"
+          "Options:\n"
+          "  -t N  Use N threads (default: 1)\n"
+          "  -b N  Use N bytes per block (compress, default: %d)\n"
+          "  -i    Add a block index (compress)\n"
+          "  -C    Use canonical Huffman codes (compress)\n"
+          "  -m    Use multiple Huffman streams per block (compress)\n"
+          "  -r    Reuse Huffman trees between blocks (compress)\n"
+          "  -f N  Filter the data before compressing it (compress), where N\n"
+          "        is 0 (none), 1 (delta), 2 (16-bit delta) or 3 (auto)\n"
+          "  -s N  Use a filter stride of N elements (compress, default: 1)\n"
+          "  -w    Code the data as 16-bit samples (compress)\n"
+          "  -k    Check the CRC of each block (decompress)\n"
+          "  -v    Print statistics\n",
+          prog, HZR_DEFAULT_BLOCK_SIZE);
+}
+
+static void PrintStats(const hzr_stats_t* stats) {
+  fprintf(stderr,
+          "Blocks: %llu copy, %llu fill, %llu tree, %llu reuse, %llu table "
+          "(%llu filtered)\n"
+          "Bytes: %llu decoded, %llu encoded\n",
+          (unsigned long long)stats->copy_blocks,
+          (unsigned long long)stats->fill_blocks,
+          (unsigned long long)stats->tree_blocks,
+          (unsigned long long)stats->reuse_blocks,
+          (unsigned long long)stats->table_blocks,
+          (unsigned long long)stats->filtered_blocks,
+          (unsigned long long)stats->decoded_bytes,
+          (unsigned long long)stats->encoded_bytes);
+  if (stats->coded_symbols > 0) {
+    fprintf(stderr, "Average code length: %.2f bits\n",
+            (double)stats->coded_bits / (double)stats->coded_symbols);
+  }
+  if (stats->lut_lookups > 0) {
+    fprintf(stderr, "LUT miss rate: %.4f%%\n",
+            100.0 * (double)stats->lut_misses / (double)stats->lut_lookups);
+  }
+  fprintf(stderr,
+          "Ticks: %llu filter, %llu histogram, %llu tree, %llu coding, "
+          "%llu crc\n",
+          (unsigned long long)stats->filter_ticks,
+          (unsigned long long)stats->histogram_ticks,
+          (unsigned long long)stats->tree_ticks,
+          (unsigned long long)stats->coding_ticks,
+          (unsigned long long)stats->crc_ticks);
+}
+
+int main(int argc, const char** argv) {
+  hzr_encode_options_t encode_options;
+  hzr_decode_options_t decode_options;
+  hzr_init_encode_options(&encode_options);
+  hzr_init_decode_options(&decode_options);
+  hzr_stats_t stats;
+  hzr_init_stats(&stats);
+  int print_stats = 0;
+
+  // Parse the options.
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+    const char* option = argv[arg];
+    if (strcmp(option, "-t") == 0 && arg + 1 < argc) {
+      int num_threads = atoi(argv[++arg]);
+      if (num_threads < 1) {
+        fprintf(stderr, "Invalid number of threads: %s\n", argv[arg]);
+        return 1;
+      }
+      encode_options.num_threads = num_threads;
+      decode_options.num_threads = num_threads;
+    } else if (strcmp(option, "-b") == 0 && arg + 1 < argc) {
+      long block_size = atol(argv[++arg]);
+      if (block_size < HZR_MIN_BLOCK_SIZE || block_size > HZR_MAX_BLOCK_SIZE ||
+          (block_size & (block_size - 1)) != 0) {
+        fprintf(stderr, "Invalid block size: %s\n", argv[arg]);
+        return 1;
+      }
+      encode_options.block_size = (size_t)block_size;
+    } else if (strcmp(option, "-i") == 0) {
+      encode_options.add_index = 1;
+    } else if (strcmp(option, "-C") == 0) {
+      encode_options.canonical_codes = 1;
+    } else if (strcmp(option, "-m") == 0) {
+      encode_options.multi_stream = 1;
+    } else if (strcmp(option, "-r") == 0) {
+      encode_options.reuse_trees = 1;
+    } else if (strcmp(option, "-f") == 0 && arg + 1 < argc) {
+      int filter = atoi(argv[++arg]);
+      if (filter < HZR_FILTER_NONE || filter > HZR_FILTER_AUTO) {
+        fprintf(stderr, "Invalid filter: %s\n", argv[arg]);
+        return 1;
+      }
+      encode_options.filter = filter;
+    } else if (strcmp(option, "-s") == 0 && arg + 1 < argc) {
+      int stride = atoi(argv[++arg]);
+      if (stride < 1 || stride > HZR_MAX_FILTER_STRIDE) {
+        fprintf(stderr, "Invalid filter stride: %s\n", argv[arg]);
+        return 1;
+      }
+      encode_options.filter_stride = stride;
+    } else if (strcmp(option, "-w") == 0) {
+      encode_options.wide_symbols = 1;
+    } else if (strcmp(option, "-k") == 0) {
+      decode_options.check_crc = 1;
+    } else if (strcmp(option, "-v") == 0) {
+      encode_options.stats = &stats;
+      decode_options.stats = &stats;
+      print_stats = 1;
+    } else {
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Parse the command.
+  if (argc - arg != 3 || strlen(argv[arg]) != 1) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  const char command = argv[arg][0];
+  const char* in_path = argv[arg + 1];
+  const char* out_path = argv[arg + 2];
+
+  hzr_status_t status;
+  if (command == 'c') {
+    status = hzr_encode_file(in_path, out_path, &encode_options);
+  } else if (command == 'd') {
+    status = hzr_decode_file(in_path, out_path, &decode_options);
+  } else {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  if (status != HZR_OK) {
+    fprintf(stderr, "Unable to %s %s\n",
+            command == 'c' ? "compress" : "decompress", in_path);
+    return 1;
+  }
+  if (print_stats) {
+    PrintStats(&stats);
+  }
+  return 0;
+}
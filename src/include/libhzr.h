@@ -25,6 +25,7 @@
 #define LIBHZR_H_
 
 #include <stddef.h> /* For size_t */
+#include <stdint.h> /* For uint64_t */
 
 #ifdef __cplusplus
 extern "C" {
@@ -38,6 +39,270 @@ typedef enum {
   HZR_OK = 1    /**< Success (non-zero). */
 } hzr_status_t;
 
+/** @brief The default block size (in bytes). */
+#define HZR_DEFAULT_BLOCK_SIZE 65536
+
+/** @brief The smallest supported block size (in bytes). */
+#define HZR_MIN_BLOCK_SIZE 1024
+
+/** @brief The largest supported block size (in bytes). */
+#define HZR_MAX_BLOCK_SIZE 16777216
+
+/** @brief The recommended input and output padding (in bytes) for the
+ * decoder. */
+#define HZR_DECODE_PADDING 32
+
+/** @brief No filter (see hzr_encode_options_t::filter). */
+#define HZR_FILTER_NONE 0
+
+/** @brief Byte delta filter (see hzr_encode_options_t::filter). */
+#define HZR_FILTER_DELTA 1
+
+/** @brief 16-bit little endian delta filter (see
+ * hzr_encode_options_t::filter). */
+#define HZR_FILTER_DELTA16 2
+
+/** @brief Pick the filter for each block (see hzr_encode_options_t::filter). */
+#define HZR_FILTER_AUTO 3
+
+/** @brief The largest filter stride (see hzr_encode_options_t::filter). */
+#define HZR_MAX_FILTER_STRIDE 255
+
+/**
+ * @brief A shared Huffman table.
+ *
+ * A shared table is trained from sample data, and is known to both the encoder
+ * and the decoder, so that it does not have to be stored in the encoded data
+ * (only its ID is stored). This gives good compression for small buffers, for
+ * which a per-block Huffman tree is too costly.
+ */
+typedef struct hzr_table_struct hzr_table_t;
+
+/**
+ * @brief Statistics of encoding or decoding calls.
+ *
+ * Set the stats member of the encoder or decoder options to collect
+ * statistics. The statistics of each call are added to the counters, so a
+ * single struct can collect the statistics of many calls (use hzr_init_stats()
+ * to clear it). The times of the phases are summed over all the threads, and
+ * are given in timer ticks: timestamp counter cycles on x86, and nanoseconds on
+ * other POSIX systems. The streaming decoder and hzr_decode_range() do not
+ * collect statistics.
+ */
+typedef struct {
+  /** Number of blocks that are stored as plain copies. */
+  uint64_t copy_blocks;
+
+  /** Number of blocks that hold a single repeated byte value. */
+  uint64_t fill_blocks;
+
+  /** Number of Huffman coded blocks with a Huffman tree of their own. */
+  uint64_t tree_blocks;
+
+  /** Number of Huffman coded blocks that reuse the tree of an earlier block. */
+  uint64_t reuse_blocks;
+
+  /** Number of Huffman coded blocks that use a shared table. */
+  uint64_t table_blocks;
+
+  /** Number of blocks (of any of the kinds above) that are filtered. */
+  uint64_t filtered_blocks;
+
+  /** Number of decoded (uncompressed) bytes of the blocks. */
+  uint64_t decoded_bytes;
+
+  /** Number of encoded bytes of the blocks, including the block headers. */
+  uint64_t encoded_bytes;
+
+  /** Number of Huffman coded symbols (encoder only). */
+  uint64_t coded_symbols;
+
+  /** Number of bits of the Huffman coded symbols, including the extra bits of
+   * zero runs (encoder only). The average code length is
+   * coded_bits / coded_symbols. */
+  uint64_t coded_bits;
+
+  /** Time spent on selecting and applying (or undoing) the filters. For the
+   * encoder this includes the incompressibility check, while the filters are
+   * applied on the fly as part of histogram_ticks. For the decoder, the
+   * filters of single stream blocks are mostly undone while decoding, as part
+   * of coding_ticks. */
+  uint64_t filter_ticks;
+
+  /** Time spent on tokenizing the data and building histograms (encoder
+   * only). */
+  uint64_t histogram_ticks;
+
+  /** Time spent on building Huffman codes (encoder) or on recovering Huffman
+   * trees and building decoding tables (decoder). */
+  uint64_t tree_ticks;
+
+  /** Time spent on emitting (encoder) or decoding (decoder) the Huffman coded
+   * data, plain copies and fills. */
+  uint64_t coding_ticks;
+
+  /** Time spent on calculating and checking CRCs of the blocks. */
+  uint64_t crc_ticks;
+
+  /** Number of lookups in the decoding tables (decoder only). Only counted if
+   * the library is built with HZR_ENABLE_STATS. */
+  uint64_t lut_lookups;
+
+  /** Number of table lookups that missed the root table, and continued in a
+   * sub table for a long code (decoder only). Only counted if the library is
+   * built with HZR_ENABLE_STATS. */
+  uint64_t lut_misses;
+} hzr_stats_t;
+
+/**
+ * @brief Encoder options.
+ *
+ * Use hzr_init_encode_options() to set all the options to their default
+ * values before changing individual options.
+ */
+typedef struct {
+  /** Maximum number of threads to use, including the calling thread (default:
+   * 1). */
+  int num_threads;
+
+  /** Non-zero to append a block index to the encoded data (default: 0). The
+   * index enables fast random access with hzr_decode_range(). */
+  int add_index;
+
+  /** Non-zero to use length-limited canonical Huffman codes (default: 0).
+   * This gives smaller block headers and faster decoding, at the cost of
+   * slightly less compression for skewed data. */
+  int canonical_codes;
+
+  /** Non-zero to split each block into several independent Huffman streams
+   * (default: 0). This gives faster decoding, since the streams are decoded in
+   * an interleaved fashion, at the cost of a few bytes per block. */
+  int multi_stream;
+
+  /** A shared Huffman table to encode all blocks with, or NULL (default:
+   * NULL). The same table must be given to the decoder. Blocks that are
+   * encoded with a shared table always use a single stream. For large buffers,
+   * per-block Huffman trees usually give better compression. */
+  const hzr_table_t* table;
+
+  /** Non-zero to write the extended header, which holds a 64-bit decoded size
+   * and format flags (default: 0). The extended header is always used for
+   * buffers of 4 GiB or more. It takes 18 more bytes than the plain header,
+   * and can not be decoded by versions of HZR that predate it. */
+  int extended_header;
+
+  /** Number of bytes per block, which must be a power of two in the range
+   * [HZR_MIN_BLOCK_SIZE, HZR_MAX_BLOCK_SIZE] (default: HZR_DEFAULT_BLOCK_SIZE).
+   * Larger blocks have less per-block overhead, and smaller blocks give finer
+   * grained multi-threading and random access. Other block sizes than the
+   * default require the extended header (see extended_header), and block sizes
+   * larger than the default use slightly larger block headers. The streaming
+   * encoder always uses the default block size. */
+  size_t block_size;
+
+  /** Non-zero to let a block use the Huffman codes of a previous block when
+   * that is estimated to give smaller output than a new tree (default: 0).
+   * This improves compression for data with similar statistics across blocks,
+   * and such blocks decode faster since there is no tree to recover. A block
+   * only reuses codes from the same group of eight consecutive blocks, so
+   * random access stays cheap, and multi-threaded encoding works with whole
+   * groups. */
+  int reuse_trees;
+
+  /** The smallest saving (in percent of the block size) that Huffman coding
+   * must give for a block, or the block is stored as a plain copy instead
+   * (default: 0). Plain copies are very fast to decode. Blocks that look
+   * random (e.g. already compressed data) are detected from a sample of their
+   * bytes and stored as plain copies without even building a Huffman tree. */
+  int min_savings;
+
+  /** A reversible filter that is applied to each block before it is Huffman
+   * coded (default: HZR_FILTER_NONE). HZR_FILTER_DELTA replaces each byte by
+   * its difference from the byte filter_stride bytes before it, and
+   * HZR_FILTER_DELTA16 does the same for 16-bit little endian words (e.g.
+   * audio samples). This usually improves compression a lot for smooth data,
+   * such as images and audio. With HZR_FILTER_AUTO, the filter of each block
+   * (no filter, HZR_FILTER_DELTA or HZR_FILTER_DELTA16) is picked from an
+   * estimate of the resulting entropy. The filter is recorded in each block,
+   * so the decoder needs no options, but filtered data can not be decoded by
+   * versions of HZR that predate filters. */
+  int filter;
+
+  /** The distance (in bytes for HZR_FILTER_DELTA, and in 16-bit words for
+   * HZR_FILTER_DELTA16) to the element that the delta filter subtracts, e.g.
+   * the number of interleaved channels (1 to HZR_MAX_FILTER_STRIDE, default:
+   * 1). */
+  int filter_stride;
+
+  /** Non-zero to Huffman code the data as 16-bit little endian samples instead
+   * of as bytes (default: 0). For 16-bit data with mostly small values, such
+   * as audio or depth map residuals (e.g. with HZR_FILTER_DELTA16), this keeps
+   * the statistics of the samples intact, which gives better compression, and
+   * the decoder gets a whole sample per code. Blocks of odd size and blocks
+   * that use a shared table are coded as bytes, and blocks with 16-bit samples
+   * always use Huffman trees (not canonical codes). Such data can not be
+   * decoded by versions of HZR that predate 16-bit samples. */
+  int wide_symbols;
+
+  /** Statistics to update, or NULL (default: NULL). See hzr_stats_t. */
+  hzr_stats_t* stats;
+} hzr_encode_options_t;
+
+/**
+ * @brief Decoder options.
+ *
+ * Use hzr_init_decode_options() to set all the options to their default
+ * values before changing individual options.
+ */
+typedef struct {
+  /** Maximum number of threads to use, including the calling thread (default:
+   * 1). */
+  int num_threads;
+
+  /** Non-zero to check the CRC32 of each block just before it is decoded
+   * (default: 0). This detects corrupt data without the separate pass over
+   * the encoded data that hzr_verify() makes. */
+  int check_crc;
+
+  /** The shared Huffman table that the data was encoded with, or NULL
+   * (default: NULL). */
+  const hzr_table_t* table;
+
+  /** The number of writable bytes after the decoded data in the output buffer
+   * that the decoder may overwrite with arbitrary data (default: 0). With at
+   * least HZR_DECODE_PADDING bytes of padding, the decoder can use its fast
+   * (wide store) loops all the way to the end of the output. */
+  size_t out_padding;
+
+  /** The number of readable bytes after the end of the input buffer that the
+   * decoder may read, but never decodes (default: 0). With at least
+   * HZR_DECODE_PADDING bytes of padding, the decoder can use its fast loops
+   * until the last few bytes of every block (otherwise the last block ends
+   * with a slower, checked loop). */
+  size_t in_padding;
+
+  /** Statistics to update, or NULL (default: NULL). See hzr_stats_t. */
+  hzr_stats_t* stats;
+} hzr_decode_options_t;
+
+/**
+ * @brief Set all encoder options to their default values.
+ * @param[out] options The options to initialize.
+ */
+void hzr_init_encode_options(hzr_encode_options_t* options);
+
+/**
+ * @brief Set all decoder options to their default values.
+ * @param[out] options The options to initialize.
+ */
+void hzr_init_decode_options(hzr_decode_options_t* options);
+
+/**
+ * @brief Clear all the counters of a statistics struct.
+ * @param[out] stats The statistics to clear.
+ */
+void hzr_init_stats(hzr_stats_t* stats);
+
 /**
  * @brief Determine the maximum (worst case) size of an HZR encoded buffer.
  * @param uncompressed_size Size of the uncompressed buffer in bytes.
@@ -45,6 +310,16 @@ typedef enum {
  */
 size_t hzr_max_compressed_size(size_t uncompressed_size);
 
+/**
+ * @brief Determine the maximum (worst case) size of an HZR encoded buffer
+ * that is encoded with the given options.
+ * @param uncompressed_size Size of the uncompressed buffer in bytes.
+ * @param options Encoder options (NULL for default options).
+ * @returns The maximum size (in bytes) of the compressed buffer.
+ */
+size_t hzr_max_compressed_size_ex(size_t uncompressed_size,
+                                  const hzr_encode_options_t* options);
+
 /**
  * @brief Compress a buffer using the HZR compression scheme.
  * @param in Input (uncompressed) buffer.
@@ -60,6 +335,26 @@ hzr_status_t hzr_encode(const void* in,
                         size_t out_size,
                         size_t* encoded_size);
 
+/**
+ * @brief Compress a buffer using the HZR compression scheme, with options.
+ * @param in Input (uncompressed) buffer.
+ * @param in_size Size of the input buffer in bytes.
+ * @param[out] out Output (compressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param[out] encoded_size Size of the encoded data in bytes.
+ * @param options Encoder options (NULL for default options).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * Use hzr_max_compressed_size_ex() to determine the required size of the
+ * output buffer.
+ */
+hzr_status_t hzr_encode_ex(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           size_t* encoded_size,
+                           const hzr_encode_options_t* options);
+
 /**
  * @brief Verify that a buffer is a valid HZR encoded buffer.
  * @param in Input (compressed) buffer.
@@ -79,14 +374,590 @@ hzr_status_t hzr_verify(const void* in, size_t in_size, size_t* decoded_size);
  * @param[out] out Output (uncompressed) buffer.
  * @param out_size Size of the output buffer in bytes.
  * @returns HZR_OK on success, else HZR_FAIL.
- * @note It is expected that the input buffer is a valid HZR encoded buffer,
- * which should be verified by calling hzr_verify() first.
+ * @note The decoder never reads or writes outside of the given buffers, even if
+ * the input buffer is corrupt, but corrupt data is not always detected. For
+ * trusted input (e.g. data from integrity checked storage) it is safe to skip
+ * hzr_verify(). Otherwise call hzr_verify() first, or use hzr_decode_ex() with
+ * the check_crc option.
  */
 hzr_status_t hzr_decode(const void* in,
                         size_t in_size,
                         void* out,
                         size_t out_size);
 
+/**
+ * @brief Decode an HZR encoded buffer, with options.
+ * @param in Input (compressed) buffer.
+ * @param in_size Size of the input buffer in bytes.
+ * @param[out] out Output (uncompressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param options Decoder options (NULL for default options).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ * @note See hzr_decode() regarding corrupt input data.
+ */
+hzr_status_t hzr_decode_ex(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           const hzr_decode_options_t* options);
+
+/**
+ * @brief Decode a range of an HZR encoded buffer.
+ * @param in Input (compressed) buffer.
+ * @param in_size Size of the input buffer in bytes.
+ * @param byte_offset Offset (in bytes) into the decoded data of the first byte
+ * to decode.
+ * @param length Number of bytes to decode.
+ * @param[out] out Output (uncompressed) buffer, which must be at least length
+ * bytes large.
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * Only the blocks that cover the requested range are decoded. If the buffer
+ * has a block index (see hzr_encode_options_t), the first block is located
+ * directly, otherwise the block headers preceding it are traversed.
+ * @note See hzr_decode() regarding corrupt input data.
+ */
+hzr_status_t hzr_decode_range(const void* in,
+                              size_t in_size,
+                              size_t byte_offset,
+                              size_t length,
+                              void* out);
+
+/**
+ * @brief Compress a buffer using several threads.
+ * @param in Input (uncompressed) buffer.
+ * @param in_size Size of the input buffer in bytes.
+ * @param[out] out Output (compressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param[out] encoded_size Size of the encoded data in bytes.
+ * @param num_threads Maximum number of threads to use (including the calling
+ * thread).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * The encoded data is identical to the data produced by hzr_encode(). The work
+ * is only spread across several threads if out_size is at least
+ * hzr_max_compressed_size(in_size) and the input consists of more than one
+ * block, otherwise this is equivalent to calling hzr_encode().
+ */
+hzr_status_t hzr_encode_mt(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           size_t* encoded_size,
+                           int num_threads);
+
+/**
+ * @brief Decode an HZR encoded buffer using several threads.
+ * @param in Input (compressed) buffer.
+ * @param in_size Size of the input buffer in bytes.
+ * @param[out] out Output (uncompressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param num_threads Maximum number of threads to use (including the calling
+ * thread).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ * @note See hzr_decode() regarding corrupt input data.
+ */
+hzr_status_t hzr_decode_mt(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           int num_threads);
+
+/**
+ * @brief A streaming encoder.
+ *
+ * The streaming encoder produces HZR encoded data incrementally, without
+ * knowing the size of the uncompressed data up front. The encoded data can be
+ * decoded with hzr_decode() or with a streaming decoder (hzr_decoder_t).
+ */
+typedef struct hzr_encoder_struct hzr_encoder_t;
+
+/**
+ * @brief Create a streaming encoder.
+ * @param options Encoder options (NULL for default options). The num_threads
+ * and add_index options are ignored.
+ * @returns A new encoder, or NULL on failure.
+ */
+hzr_encoder_t* hzr_encoder_create(const hzr_encode_options_t* options);
+
+/**
+ * @brief Destroy a streaming encoder.
+ * @param encoder The encoder to destroy (may be NULL).
+ */
+void hzr_encoder_destroy(hzr_encoder_t* encoder);
+
+/**
+ * @brief Feed uncompressed data to a streaming encoder.
+ * @param encoder The encoder.
+ * @param in Input (uncompressed) data.
+ * @param in_size Size of the input data in bytes.
+ * @param[out] in_consumed Number of input bytes that were consumed.
+ * @param[out] out Output (compressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param[out] out_written Number of bytes that were written to the output
+ * buffer.
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * Input data is encoded one block at a time, and the encoder holds on to at
+ * most one block of input data and one block of encoded data. Consumption of
+ * input data stops when the output buffer is full, so the remaining input data
+ * has to be passed again in a later call.
+ */
+hzr_status_t hzr_encode_update(hzr_encoder_t* encoder,
+                               const void* in,
+                               size_t in_size,
+                               size_t* in_consumed,
+                               void* out,
+                               size_t out_size,
+                               size_t* out_written);
+
+/**
+ * @brief Finish the encoded stream.
+ * @param encoder The encoder.
+ * @param[out] out Output (compressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param[out] out_written Number of bytes that were written to the output
+ * buffer.
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * This encodes any buffered input data and terminates the stream. If
+ * out_written equals out_size, there may be more encoded data to deliver, and
+ * hzr_encode_finish() should be called again. No more input data can be added
+ * after calling this function.
+ */
+hzr_status_t hzr_encode_finish(hzr_encoder_t* encoder,
+                               void* out,
+                               size_t out_size,
+                               size_t* out_written);
+
+/**
+ * @brief A streaming decoder.
+ *
+ * The streaming decoder decodes HZR encoded data incrementally, e.g. data from
+ * a hzr_encoder_t or from hzr_encode().
+ * @note Data that an older version of HZR encoded from exactly 4 GiB - 1 bytes
+ * can not be decoded incrementally (it looks like streamed data until the
+ * end), but it can be decoded with hzr_decode().
+ */
+typedef struct hzr_decoder_struct hzr_decoder_t;
+
+/**
+ * @brief Create a streaming decoder.
+ * @returns A new decoder, or NULL on failure.
+ */
+hzr_decoder_t* hzr_decoder_create(void);
+
+/**
+ * @brief Destroy a streaming decoder.
+ * @param decoder The decoder to destroy (may be NULL).
+ */
+void hzr_decoder_destroy(hzr_decoder_t* decoder);
+
+/**
+ * @brief Feed compressed data to a streaming decoder.
+ * @param decoder The decoder.
+ * @param in Input (compressed) data.
+ * @param in_size Size of the input data in bytes.
+ * @param[out] in_consumed Number of input bytes that were consumed.
+ * @param[out] out Output (uncompressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param[out] out_written Number of bytes that were written to the output
+ * buffer.
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * Each block is decoded as soon as all of its encoded data is available, and
+ * its checksum is checked before it is decoded. Consumption of input data
+ * stops when the output buffer is full (so the remaining input data has to be
+ * passed again in a later call), or when the end of the encoded data has been
+ * reached. If out_written equals out_size, there may be more decoded data to
+ * deliver.
+ */
+hzr_status_t hzr_decode_update(hzr_decoder_t* decoder,
+                               const void* in,
+                               size_t in_size,
+                               size_t* in_consumed,
+                               void* out,
+                               size_t out_size,
+                               size_t* out_written);
+
+/**
+ * @brief Check that a streaming decoder is done.
+ * @param decoder The decoder.
+ * @returns HZR_OK if the end of the encoded data has been reached and all the
+ * decoded data has been delivered, else HZR_FAIL (e.g. if the encoded data was
+ * truncated).
+ */
+hzr_status_t hzr_decode_finish(const hzr_decoder_t* decoder);
+
+/**
+ * @brief A workspace for encoding and decoding.
+ *
+ * A workspace holds the tables and scratch memory that the encoder and decoder
+ * need, so that they do not have to be allocated (on the heap or on the stack)
+ * for every call. A workspace must only be used by one thread at a time.
+ */
+typedef struct hzr_workspace_struct hzr_workspace_t;
+
+/**
+ * @brief Create a workspace.
+ * @returns A new workspace, or NULL on failure.
+ */
+hzr_workspace_t* hzr_workspace_create(void);
+
+/**
+ * @brief Destroy a workspace.
+ * @param workspace The workspace to destroy (may be NULL).
+ */
+void hzr_workspace_destroy(hzr_workspace_t* workspace);
+
+/**
+ * @brief Compress a buffer using a workspace.
+ * @param in Input (uncompressed) buffer.
+ * @param in_size Size of the input buffer in bytes.
+ * @param[out] out Output (compressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param[out] encoded_size Size of the encoded data in bytes.
+ * @param options Encoder options (NULL for default options).
+ * @param workspace The workspace to use.
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * This is the same as hzr_encode_ex(), except that the scratch memory of the
+ * workspace is used. The multi-threaded code path (options->num_threads > 1)
+ * allocates scratch memory for each thread, and does not use the workspace.
+ * If the blocks (see options->block_size) do not fit in the scratch memory of
+ * the workspace, it is replaced by larger scratch memory that is kept for
+ * later calls.
+ */
+hzr_status_t hzr_encode_ws(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           size_t* encoded_size,
+                           const hzr_encode_options_t* options,
+                           hzr_workspace_t* workspace);
+
+/**
+ * @brief Decode an HZR encoded buffer using a workspace.
+ * @param in Input (compressed) buffer.
+ * @param in_size Size of the input buffer in bytes.
+ * @param[out] out Output (uncompressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param options Decoder options (NULL for default options).
+ * @param workspace The workspace to use.
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * This is the same as hzr_decode_ex(), except that the scratch memory of the
+ * workspace is used. The multi-threaded code path (options->num_threads > 1)
+ * allocates scratch memory for each thread, and does not use the workspace.
+ */
+hzr_status_t hzr_decode_ws(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           const hzr_decode_options_t* options,
+                           hzr_workspace_t* workspace);
+
+/**
+ * @brief A buffer of a batch of buffers to encode or decode.
+ */
+typedef struct {
+  /** Input buffer. */
+  const void* in;
+
+  /** Size of the input buffer in bytes. */
+  size_t in_size;
+
+  /** Output buffer. */
+  void* out;
+
+  /** Size of the output buffer in bytes. */
+  size_t out_size;
+
+  /** [out] Size of the encoded or decoded data in bytes. */
+  size_t result_size;
+
+  /** [out] HZR_OK if the buffer was encoded or decoded, else HZR_FAIL. */
+  hzr_status_t status;
+} hzr_batch_item_t;
+
+/**
+ * @brief Compress a batch of buffers.
+ * @param[in,out] items The buffers to compress.
+ * @param num_items Number of buffers.
+ * @param options Encoder options (NULL for default options).
+ * @param workspace The workspace to use.
+ * @returns HZR_OK if all the buffers were compressed, else HZR_FAIL.
+ *
+ * Each buffer is compressed into a separate HZR stream, exactly as with
+ * hzr_encode_ws(), and the status and encoded size of each buffer are stored
+ * in its item. The options are only checked once for the whole batch. With
+ * options->num_threads > 1 the buffers (rather than the blocks of each buffer)
+ * are distributed between the threads, and every thread but the calling
+ * thread allocates its own scratch memory. The scratch memory of the
+ * workspace is grown to fit the blocks of the largest buffer if necessary.
+ */
+hzr_status_t hzr_encode_batch(hzr_batch_item_t* items,
+                              size_t num_items,
+                              const hzr_encode_options_t* options,
+                              hzr_workspace_t* workspace);
+
+/**
+ * @brief Decode a batch of HZR encoded buffers.
+ * @param[in,out] items The buffers to decode.
+ * @param num_items Number of buffers.
+ * @param options Decoder options (NULL for default options).
+ * @param workspace The workspace to use.
+ * @returns HZR_OK if all the buffers were decoded, else HZR_FAIL.
+ *
+ * Each buffer is decoded exactly as with hzr_decode_ws(), and the status and
+ * decoded size of each buffer are stored in its item. With
+ * options->num_threads > 1 the buffers are distributed between the threads.
+ * @note See hzr_decode() regarding corrupt input data.
+ */
+hzr_status_t hzr_decode_batch(hzr_batch_item_t* items,
+                              size_t num_items,
+                              const hzr_decode_options_t* options,
+                              hzr_workspace_t* workspace);
+
+/**
+ * @brief A memory segment, for scatter / gather I/O.
+ */
+typedef struct {
+  /** Start of the segment (never written to by hzr_encode_iov()). */
+  void* data;
+
+  /** Size of the segment in bytes. */
+  size_t size;
+} hzr_iovec_t;
+
+/**
+ * @brief A sink for decoded blocks (see hzr_decode_sink()), or for the output
+ * of a pipeline (see hzr_encode_pipeline()).
+ * @param data The decoded (or encoded) data.
+ * @param size Size of the data in bytes.
+ * @param user The user pointer that was passed along with the sink.
+ * @returns HZR_OK to continue, or HZR_FAIL to stop.
+ *
+ * The data is only valid until the sink returns.
+ */
+typedef hzr_status_t (*hzr_block_sink_t)(const void* data,
+                                         size_t size,
+                                         void* user);
+
+/**
+ * @brief Compress a list of buffers as a single buffer (gather).
+ * @param in Input (uncompressed) segments.
+ * @param in_count Number of input segments.
+ * @param[out] out Output (compressed) buffer.
+ * @param out_size Size of the output buffer in bytes.
+ * @param[out] encoded_size Size of the encoded data in bytes.
+ * @param options Encoder options (NULL for default options).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * The result is the same as for hzr_encode_ex() with the concatenation of the
+ * input segments. Blocks that are contained in a single segment are encoded
+ * in place, and only blocks that span several segments are copied.
+ */
+hzr_status_t hzr_encode_iov(const hzr_iovec_t* in,
+                            size_t in_count,
+                            void* out,
+                            size_t out_size,
+                            size_t* encoded_size,
+                            const hzr_encode_options_t* options);
+
+/**
+ * @brief Decode an HZR encoded buffer into a list of buffers (scatter).
+ * @param in Input (compressed) buffer.
+ * @param in_size Size of the input buffer in bytes.
+ * @param[out] out Output (uncompressed) segments, which are filled in order.
+ * @param out_count Number of output segments.
+ * @param options Decoder options (NULL for default options).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * Blocks that are contained in a single segment are decoded in place, and
+ * only blocks that span several segments are copied. The decoding is done in
+ * the calling thread (options->num_threads and options->out_padding are
+ * ignored), and no data is written past the end of the decoded data.
+ * @note See hzr_decode() regarding corrupt input data.
+ */
+hzr_status_t hzr_decode_iov(const void* in,
+                            size_t in_size,
+                            const hzr_iovec_t* out,
+                            size_t out_count,
+                            const hzr_decode_options_t* options);
+
+/**
+ * @brief Decode an HZR encoded buffer block by block, to a sink.
+ * @param in Input (compressed) buffer.
+ * @param in_size Size of the input buffer in bytes.
+ * @param on_block The sink, which is called once for every decoded block.
+ * @param user A user pointer that is passed to the sink.
+ * @param options Decoder options (NULL for default options).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * The blocks are decoded into an internal block buffer and delivered in
+ * order. The decoding is done in the calling thread (options->num_threads and
+ * options->out_padding are ignored).
+ * @note See hzr_decode() regarding corrupt input data. A block is only
+ * delivered to the sink after it has been decoded, but with corrupt input
+ * data the decoding may fail after some blocks have been delivered.
+ */
+hzr_status_t hzr_decode_sink(const void* in,
+                             size_t in_size,
+                             hzr_block_sink_t on_block,
+                             void* user,
+                             const hzr_decode_options_t* options);
+
+/**
+ * @brief A source of input data for a pipeline (see hzr_encode_pipeline()).
+ * @param[out] buf Buffer to read the data into.
+ * @param size Size of the buffer in bytes.
+ * @param[out] read_size Number of bytes that were read (1 to size), or zero at
+ * the end of the input data.
+ * @param user The user pointer that was passed along with the source.
+ * @returns HZR_OK on success, else HZR_FAIL (which stops the pipeline).
+ */
+typedef hzr_status_t (*hzr_source_t)(void* buf,
+                                     size_t size,
+                                     size_t* read_size,
+                                     void* user);
+
+/**
+ * @brief Compress a stream of data with a pipeline of threads.
+ * @param source The source of the input (uncompressed) data.
+ * @param source_user A user pointer that is passed to the source.
+ * @param sink The sink for the output (compressed) data.
+ * @param sink_user A user pointer that is passed to the sink.
+ * @param options Encoder options (NULL for default options).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * The input data is read by a thread of its own, the blocks are compressed by
+ * options->num_threads worker threads, and the compressed data is delivered
+ * in order to the sink by the calling thread. Hence reading, compression and
+ * writing overlap. The number of blocks in flight is bounded (a couple of
+ * blocks per worker thread), and the source blocks when all of them are busy.
+ * The output is the same as that of a streaming encoder (see
+ * hzr_encoder_create()). Without thread support, the calling thread does all
+ * the work.
+ */
+hzr_status_t hzr_encode_pipeline(hzr_source_t source,
+                                 void* source_user,
+                                 hzr_block_sink_t sink,
+                                 void* sink_user,
+                                 const hzr_encode_options_t* options);
+
+/**
+ * @brief Decode a stream of HZR encoded data with a pipeline of threads.
+ * @param source The source of the input (compressed) data.
+ * @param source_user A user pointer that is passed to the source.
+ * @param sink The sink for the output (uncompressed) data.
+ * @param sink_user A user pointer that is passed to the sink.
+ * @param options Decoder options (NULL for default options).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * The pipeline works like hzr_encode_pipeline(). Any HZR encoded data can be
+ * decoded (not only streamed data), and no input data is read after the end
+ * of the encoded data. Like the streaming decoder, the CRC of every block is
+ * checked, and data that an older version of HZR encoded from exactly
+ * 4 GiB - 1 bytes is not supported.
+ * @note See hzr_decode() regarding corrupt input data. With corrupt input
+ * data the decoding may fail after some data has been delivered to the sink.
+ */
+hzr_status_t hzr_decode_pipeline(hzr_source_t source,
+                                 void* source_user,
+                                 hzr_block_sink_t sink,
+                                 void* sink_user,
+                                 const hzr_decode_options_t* options);
+
+/** @brief The largest ID of a shared table. */
+#define HZR_MAX_TABLE_ID 65535
+
+/** @brief The size of a saved shared table (in bytes). */
+#define HZR_SAVED_TABLE_SIZE 141
+
+/**
+ * @brief Train a shared Huffman table.
+ * @param sample Sample data.
+ * @param sample_size Size of the sample data in bytes.
+ * @param id The ID of the table (0 to HZR_MAX_TABLE_ID).
+ * @returns A new table, or NULL on failure.
+ *
+ * The sample data should be representative of the data that will be encoded
+ * with the table. All byte values get codes, so any data can be encoded with
+ * the table (but data that does not resemble the sample data compresses
+ * poorly).
+ */
+hzr_table_t* hzr_table_train(const void* sample,
+                             size_t sample_size,
+                             unsigned id);
+
+/**
+ * @brief Destroy a shared Huffman table.
+ * @param table The table to destroy (may be NULL).
+ */
+void hzr_table_destroy(hzr_table_t* table);
+
+/**
+ * @brief Get the ID of a shared Huffman table.
+ * @param table The table.
+ * @returns The ID of the table.
+ */
+unsigned hzr_table_id(const hzr_table_t* table);
+
+/**
+ * @brief Save a shared Huffman table to a buffer.
+ * @param table The table.
+ * @param[out] out Output buffer.
+ * @param out_size Size of the output buffer in bytes (at least
+ * HZR_SAVED_TABLE_SIZE).
+ * @param[out] saved_size Size of the saved table in bytes.
+ * @returns HZR_OK on success, else HZR_FAIL.
+ */
+hzr_status_t hzr_table_save(const hzr_table_t* table,
+                            void* out,
+                            size_t out_size,
+                            size_t* saved_size);
+
+/**
+ * @brief Load a shared Huffman table from a buffer.
+ * @param in Input buffer (a table that was saved with hzr_table_save()).
+ * @param in_size Size of the input buffer in bytes.
+ * @returns A new table, or NULL on failure (e.g. if the data is corrupt).
+ */
+hzr_table_t* hzr_table_load(const void* in, size_t in_size);
+
+/**
+ * @brief Compress a file.
+ * @param in_path Path to the input (uncompressed) file.
+ * @param out_path Path to the output (compressed) file.
+ * @param options Encoder options (NULL for default options).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * The files are memory mapped (where supported), so the data is encoded
+ * directly from the input file into the output file without any intermediate
+ * copies. Any existing output file is overwritten, and on failure the output
+ * file is removed.
+ */
+hzr_status_t hzr_encode_file(const char* in_path,
+                             const char* out_path,
+                             const hzr_encode_options_t* options);
+
+/**
+ * @brief Decompress a file.
+ * @param in_path Path to the input (compressed) file.
+ * @param out_path Path to the output (uncompressed) file.
+ * @param options Decoder options (NULL for default options).
+ * @returns HZR_OK on success, else HZR_FAIL.
+ *
+ * The size of the output file is read from the header of the input file, and
+ * the input is not verified with hzr_verify() first. Set options->check_crc to
+ * detect corrupt data (see hzr_decode()). Any existing output file is
+ * overwritten, and on failure the output file is removed.
+ */
+hzr_status_t hzr_decode_file(const char* in_path,
+                             const char* out_path,
+                             const hzr_decode_options_t* options);
+
 #ifdef __cplusplus
 }
 #endif
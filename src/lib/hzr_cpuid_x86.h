@@ -0,0 +1,75 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#ifndef HZR_CPUID_X86_H_
+#define HZR_CPUID_X86_H_
+
+#if defined(__GNUC__) || defined(__clang__)
+#include <cpuid.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "hzr_internal.h"
+
+#define CPUID_VENDOR_ID 0x00000000
+#define CPUID_FEATURES 0x00000001
+#define CPUID_EXTENDED_FEATURES 0x00000007
+
+// A fairly portable x86 cpuid() implementation.
+FORCE_INLINE static void _hzr_cpuid(unsigned func,
+                                    unsigned subfunc,
+                                    unsigned* a,
+                                    unsigned* b,
+                                    unsigned* c,
+                                    unsigned* d) {
+#if defined(__GNUC__) || defined(__clang__)
+  __cpuid_count(func, subfunc, *a, *b, *c, *d);
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuidex(info, (int)func, (int)subfunc);
+  *a = (unsigned)info[0];
+  *b = (unsigned)info[1];
+  *c = (unsigned)info[2];
+  *d = (unsigned)info[3];
+#else
+  (void)func;
+  (void)subfunc;
+  *a = *b = *c = *d = 0;
+#endif
+}
+
+// Get the OS-enabled CPU state (the XCR0 register).
+FORCE_INLINE static uint64_t _hzr_xgetbv(void) {
+#if defined(__GNUC__) || defined(__clang__)
+  unsigned a, d;
+  __asm__ volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+  return ((uint64_t)d << 32) | a;
+#elif defined(_MSC_VER)
+  return (uint64_t)_xgetbv(0);
+#else
+  return 0;
+#endif
+}
+
+#endif  // HZR_CPUID_X86_H_
@@ -26,6 +26,20 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// The three-way CRC kernels compute the CRCs of three consecutive streams of
+// HZR_CRC32C_STREAM_SIZE bytes in parallel (since a single chain of CRC
+// instructions is latency bound), and then combine them. To combine the CRCs,
+// the CRC of a stream is shifted past the n bytes of the following streams,
+// which is a carry-less multiplication by x^(8 * n - 33) mod P (in bit
+// reflected form), followed by a CRC reduction of the 64-bit product.
+#define HZR_CRC32C_STREAM_SIZE 256
+#define HZR_CRC32C_SHIFT_1 0xb9e02b86U  // n = HZR_CRC32C_STREAM_SIZE
+#define HZR_CRC32C_SHIFT_2 0xdd7e3b0cU  // n = 2 * HZR_CRC32C_STREAM_SIZE
+
 uint32_t _hzr_crc32(const void* data, size_t length);
 
+// Copy data from src to dst, and calculate the CRC32 of the data. The buffers
+// must not overlap.
+uint32_t _hzr_crc32_copy(void* dst, const void* src, size_t length);
+
 #endif  // HZR_CRC32C_H_
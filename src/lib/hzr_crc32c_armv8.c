@@ -27,6 +27,8 @@
 
 #include <arm_acle.h>
 
+#include "hzr_crc32c.h"
+
 #ifdef __linux__
 #include <sys/auxv.h>
 
@@ -49,36 +51,91 @@ hzr_bool _hzr_can_use_armv8crc(void) {
 
 #endif  // __linux__
 
-// ARMv8 + CRC32 optimized CRC32 implementation.
-uint32_t _hzr_crc32c_armv8crc(const uint8_t* buf, size_t size) {
-  const size_t ALIGN_TO_BYTES = 8;
+// Carry-less multiplication of two 32-bit numbers. This is only used for
+// combining the CRCs of the three-way kernel, once per 3 * 256 bytes, so it
+// does not have to be fast (and then we do not need the PMULL instruction).
+static uint64_t ClMul32(uint32_t a, uint32_t b) {
+  uint64_t product = 0U;
+  for (int i = 0; i < 32; ++i) {
+    if ((b >> i) & 1U) {
+      product ^= (uint64_t)a << i;
+    }
+  }
+  return product;
+}
 
+// Shift a CRC past n bytes, where k = x^(8 * n - 33) mod P (see
+// HZR_CRC32C_SHIFT_1).
+static uint32_t ShiftCrc(uint32_t crc, uint32_t k) {
+  return __crc32cd(0U, ClMul32(crc, k));
+}
+
+// Three-way CRC32 implementation, that optionally copies the data too (copy
+// must be a compile time constant).
+FORCE_INLINE static uint32_t Crc32c3Way(uint8_t* dst,
+                                        const uint8_t* src,
+                                        size_t size,
+                                        const hzr_bool copy) {
+  const size_t kStreamSize = HZR_CRC32C_STREAM_SIZE;
   uint32_t crc = ~0U;
 
-  // Align...
-  size_t align = (size_t)buf & (ALIGN_TO_BYTES - 1);
-  if (align != 0U) {
-    align = ALIGN_TO_BYTES - align;
-    align = align > size ? size : align;
-    size -= align;
-    for (; align; --align) {
-      crc = __crc32cb(crc, *buf++);
+  // Do three streams at a time, eight bytes per stream and iteration.
+  for (; size >= 3 * kStreamSize; size -= 3 * kStreamSize) {
+    uint32_t crc0 = crc;
+    uint32_t crc1 = 0U;
+    uint32_t crc2 = 0U;
+    for (size_t i = 0; i < kStreamSize; i += 8) {
+      uint64_t x0 = _hzr_load64le(&src[i]);
+      uint64_t x1 = _hzr_load64le(&src[kStreamSize + i]);
+      uint64_t x2 = _hzr_load64le(&src[2 * kStreamSize + i]);
+      crc0 = __crc32cd(crc0, x0);
+      crc1 = __crc32cd(crc1, x1);
+      crc2 = __crc32cd(crc2, x2);
+      if (copy) {
+        _hzr_store64le(&dst[i], x0);
+        _hzr_store64le(&dst[kStreamSize + i], x1);
+        _hzr_store64le(&dst[2 * kStreamSize + i], x2);
+      }
+    }
+    crc = ShiftCrc(crc0, HZR_CRC32C_SHIFT_2) ^
+          ShiftCrc(crc1, HZR_CRC32C_SHIFT_1) ^ crc2;
+    src += 3 * kStreamSize;
+    if (copy) {
+      dst += 3 * kStreamSize;
     }
   }
 
-  // Do eight bytes per iteration.
-  for (; size >= 8; size -= 8, buf += 8) {
-    crc = __crc32cd(crc, *(const uint64_t*)buf);
+  // Handle the tail in a single stream.
+  for (; size >= 8; size -= 8, src += 8) {
+    uint64_t x = _hzr_load64le(src);
+    crc = __crc32cd(crc, x);
+    if (copy) {
+      _hzr_store64le(dst, x);
+      dst += 8;
+    }
   }
-
-  // Handle tail.
-  while (size--) {
-    crc = __crc32cb(crc, *buf++);
+  for (; size > 0; --size, ++src) {
+    crc = __crc32cb(crc, *src);
+    if (copy) {
+      *dst++ = *src;
+    }
   }
 
   return ~crc;
 }
 
+// ARMv8 + CRC32 optimized CRC32 implementation.
+uint32_t _hzr_crc32c_armv8crc(const uint8_t* buf, size_t size) {
+  return Crc32c3Way(NULL, buf, size, HZR_FALSE);
+}
+
+// ARMv8 + CRC32 optimized CRC32 implementation that also copies the data.
+uint32_t _hzr_crc32c_copy_armv8crc(uint8_t* dst,
+                                   const uint8_t* src,
+                                   size_t size) {
+  return Crc32c3Way(dst, src, size, HZR_TRUE);
+}
+
 #else
 
 hzr_bool _hzr_can_use_armv8crc(void) {
@@ -91,4 +148,13 @@ uint32_t _hzr_crc32c_armv8crc(const uint8_t* buf, size_t size) {
   return 0;
 }
 
+uint32_t _hzr_crc32c_copy_armv8crc(uint8_t* dst,
+                                   const uint8_t* src,
+                                   size_t size) {
+  (void)dst;
+  (void)src;
+  (void)size;
+  return 0;
+}
+
 #endif  // __ARM_FEATURE_CRC32
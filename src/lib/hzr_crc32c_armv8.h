@@ -30,5 +30,8 @@
 
 hzr_bool _hzr_can_use_armv8crc(void);
 uint32_t _hzr_crc32c_armv8crc(const uint8_t* buf, size_t size);
+uint32_t _hzr_crc32c_copy_armv8crc(uint8_t* dst,
+                                   const uint8_t* src,
+                                   size_t size);
 
 #endif  // HZR_CRC32C_ARMV8_H_
@@ -27,43 +27,14 @@
 
 #include <nmmintrin.h>
 
-#if defined(__GNUC__) || defined(__clang__)
-#include <cpuid.h>
-#endif
-#if defined(_MSC_VER)
-#include <intrin.h>
-#endif
-
-#define CPUID_VENDOR_ID 0x00000000
-#define CPUID_FEATURES 0x00000001
-
-// A fairly portable x86 cpuid() implementation.
-static void cpuid(unsigned func,
-                  unsigned* a,
-                  unsigned* b,
-                  unsigned* c,
-                  unsigned* d) {
-#if defined(__GNUC__) || defined(__clang__)
-  __cpuid(func, *a, *b, *c, *d);
-#elif defined(_MSC_VER)
-  int info[4];
-  __cpuid(info, (int)func);
-  *a = (unsigned)info[0];
-  *b = (unsigned)info[1];
-  *c = (unsigned)info[2];
-  *d = (unsigned)info[3];
-#else
-  (void)func;
-  *a = *b = *c = *d = 0;
-#endif
-}
+#include "hzr_cpuid_x86.h"
 
 // Check if we can use SSE 4.2, at runtime.
 hzr_bool _hzr_can_use_sse4_2(void) {
   unsigned a, b, c, d;
-  cpuid(CPUID_VENDOR_ID, &a, &b, &c, &d);
+  _hzr_cpuid(CPUID_VENDOR_ID, 0, &a, &b, &c, &d);
   if (a >= CPUID_FEATURES) {
-    cpuid(CPUID_FEATURES, &a, &b, &c, &d);
+    _hzr_cpuid(CPUID_FEATURES, 0, &a, &b, &c, &d);
     return (c & (1U << 20)) ? HZR_TRUE : HZR_FALSE;
   }
   return HZR_FALSE;
@@ -105,6 +76,37 @@ uint32_t _hzr_crc32c_sse4_2(const uint8_t* buf, size_t size) {
   return ~crc;
 }
 
+// SSE 4.2 optimized CRC32 implementation that also copies the data.
+uint32_t _hzr_crc32c_copy_sse4_2(uint8_t* dst,
+                                 const uint8_t* src,
+                                 size_t size) {
+  uint32_t crc = ~0U;
+
+  // Use as big chunks as possible.
+#if defined(__x86_64__) || defined(_M_X64)
+  for (; size >= 8; size -= 8, src += 8, dst += 8) {
+    uint64_t x = _hzr_load64le(src);
+    crc = (uint32_t)_mm_crc32_u64(crc, x);
+    _hzr_store64le(dst, x);
+  }
+#else
+  for (; size >= 4; size -= 4, src += 4, dst += 4) {
+    uint32_t x;
+    memcpy(&x, src, 4);
+    crc = _mm_crc32_u32(crc, x);
+    memcpy(dst, &x, 4);
+  }
+#endif
+
+  // Handle tail.
+  while (size--) {
+    crc = _mm_crc32_u8(crc, *src);
+    *dst++ = *src++;
+  }
+
+  return ~crc;
+}
+
 #else
 
 hzr_bool _hzr_can_use_sse4_2(void) {
@@ -117,4 +119,132 @@ uint32_t _hzr_crc32c_sse4_2(const uint8_t* buf, size_t size) {
   return 0;
 }
 
+uint32_t _hzr_crc32c_copy_sse4_2(uint8_t* dst,
+                                 const uint8_t* src,
+                                 size_t size) {
+  (void)dst;
+  (void)src;
+  (void)size;
+  return 0;
+}
+
 #endif  // SSE 4.2
+
+// Check if we are compiling with PCLMUL support (the three-way kernels also use
+// the 64-bit CRC instruction).
+#if defined(__SSE4_2__) && defined(__PCLMUL__) && \
+    (defined(__x86_64__) || defined(_M_X64))
+
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+#include "hzr_cpuid_x86.h"
+#include "hzr_crc32c.h"
+
+// Check if we can use PCLMUL, at runtime.
+hzr_bool _hzr_can_use_pclmul(void) {
+  unsigned a, b, c, d;
+  _hzr_cpuid(CPUID_VENDOR_ID, 0, &a, &b, &c, &d);
+  if (a >= CPUID_FEATURES) {
+    _hzr_cpuid(CPUID_FEATURES, 0, &a, &b, &c, &d);
+    return (c & (1U << 1)) ? HZR_TRUE : HZR_FALSE;
+  }
+  return HZR_FALSE;
+}
+
+// Shift a CRC past n bytes, where k = x^(8 * n - 33) mod P (see
+// HZR_CRC32C_SHIFT_1).
+FORCE_INLINE static uint32_t ShiftCrc(uint32_t crc, uint32_t k) {
+  __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc),
+                                         _mm_cvtsi32_si128((int)k), 0);
+  return (uint32_t)_mm_crc32_u64(0U, (uint64_t)_mm_cvtsi128_si64(product));
+}
+
+// Three-way CRC32 implementation, that optionally copies the data too (copy
+// must be a compile time constant).
+FORCE_INLINE static uint32_t Crc32c3Way(uint8_t* dst,
+                                        const uint8_t* src,
+                                        size_t size,
+                                        const hzr_bool copy) {
+  const size_t kStreamSize = HZR_CRC32C_STREAM_SIZE;
+  uint32_t crc = ~0U;
+
+  // Do three streams at a time, eight bytes per stream and iteration.
+  for (; size >= 3 * kStreamSize; size -= 3 * kStreamSize) {
+    uint64_t crc0 = crc;
+    uint64_t crc1 = 0U;
+    uint64_t crc2 = 0U;
+    for (size_t i = 0; i < kStreamSize; i += 8) {
+      uint64_t x0 = _hzr_load64le(&src[i]);
+      uint64_t x1 = _hzr_load64le(&src[kStreamSize + i]);
+      uint64_t x2 = _hzr_load64le(&src[2 * kStreamSize + i]);
+      crc0 = _mm_crc32_u64(crc0, x0);
+      crc1 = _mm_crc32_u64(crc1, x1);
+      crc2 = _mm_crc32_u64(crc2, x2);
+      if (copy) {
+        _hzr_store64le(&dst[i], x0);
+        _hzr_store64le(&dst[kStreamSize + i], x1);
+        _hzr_store64le(&dst[2 * kStreamSize + i], x2);
+      }
+    }
+    crc = ShiftCrc((uint32_t)crc0, HZR_CRC32C_SHIFT_2) ^
+          ShiftCrc((uint32_t)crc1, HZR_CRC32C_SHIFT_1) ^ (uint32_t)crc2;
+    src += 3 * kStreamSize;
+    if (copy) {
+      dst += 3 * kStreamSize;
+    }
+  }
+
+  // Handle the tail in a single stream.
+  for (; size >= 8; size -= 8, src += 8) {
+    uint64_t x = _hzr_load64le(src);
+    crc = (uint32_t)_mm_crc32_u64(crc, x);
+    if (copy) {
+      _hzr_store64le(dst, x);
+      dst += 8;
+    }
+  }
+  for (; size > 0; --size, ++src) {
+    crc = _mm_crc32_u8(crc, *src);
+    if (copy) {
+      *dst++ = *src;
+    }
+  }
+
+  return ~crc;
+}
+
+// SSE 4.2 + PCLMUL optimized CRC32 implementation.
+uint32_t _hzr_crc32c_pclmul(const uint8_t* buf, size_t size) {
+  return Crc32c3Way(NULL, buf, size, HZR_FALSE);
+}
+
+// SSE 4.2 + PCLMUL optimized CRC32 implementation that also copies the data.
+uint32_t _hzr_crc32c_copy_pclmul(uint8_t* dst,
+                                 const uint8_t* src,
+                                 size_t size) {
+  return Crc32c3Way(dst, src, size, HZR_TRUE);
+}
+
+#else
+
+hzr_bool _hzr_can_use_pclmul(void) {
+  return HZR_FALSE;
+}
+
+uint32_t _hzr_crc32c_pclmul(const uint8_t* buf, size_t size) {
+  (void)buf;
+  (void)size;
+  return 0;
+}
+
+uint32_t _hzr_crc32c_copy_pclmul(uint8_t* dst,
+                                 const uint8_t* src,
+                                 size_t size) {
+  (void)dst;
+  (void)src;
+  (void)size;
+  return 0;
+}
+
+#endif  // PCLMUL
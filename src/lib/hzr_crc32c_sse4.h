@@ -30,5 +30,15 @@
 
 hzr_bool _hzr_can_use_sse4_2(void);
 uint32_t _hzr_crc32c_sse4_2(const uint8_t* buf, size_t size);
+uint32_t _hzr_crc32c_copy_sse4_2(uint8_t* dst,
+                                 const uint8_t* src,
+                                 size_t size);
+
+// Three-way versions, which require PCLMUL (and a 64-bit CPU).
+hzr_bool _hzr_can_use_pclmul(void);
+uint32_t _hzr_crc32c_pclmul(const uint8_t* buf, size_t size);
+uint32_t _hzr_crc32c_copy_pclmul(uint8_t* dst,
+                                 const uint8_t* src,
+                                 size_t size);
 
 #endif  // HZR_CRC32C_SSE4_H_
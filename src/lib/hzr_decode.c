@@ -22,33 +22,79 @@
 
 #include "libhzr.h"
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "hzr_crc32c.h"
+#include "hzr_filter.h"
 #include "hzr_internal.h"
+#include "hzr_stats.h"
+#include "hzr_table.h"
+#include "hzr_thread.h"
+#include "hzr_workspace.h"
 
 // A helper for decoding binary data.
+// The bit cache holds the (up to) eight bytes that start at byte_ptr, and
+// bit_pos is the number of bits of the bit cache that have been consumed.
+// The read_end pointer is the end of the memory that the fast decoding loop may
+// read from, which may extend past end_ptr (e.g. into the following blocks, or
+// into padding after the input buffer). Only corrupt data makes the decoder
+// read bits past end_ptr, which is detected after the fast loop.
+// With HZR_ENABLE_STATS, the stream also counts the LUT lookups of the decoder.
 typedef struct {
   const uint8_t* byte_ptr;
   const uint8_t* end_ptr;
+  const uint8_t* read_end;
   int bit_pos;
-  uint32_t bit_cache;
+  uint64_t bit_cache;
   hzr_bool read_failed;
+#if defined(HZR_ENABLE_STATS)
+  uint64_t lut_lookups;
+  uint64_t lut_misses;
+#endif
 } ReadStream;
 
+// Refill the bit cache. After a refill, the bit cache holds at least 57 unread
+// bits.
+// Note: This must only be used when there are at least eight bytes left in
+// the stream after the new byte position.
+FORCE_INLINE static void RefillBitCache(ReadStream* stream) {
+  stream->byte_ptr += stream->bit_pos >> 3;
+  stream->bit_pos &= 7;
+  stream->bit_cache = _hzr_load64le(stream->byte_ptr);
+}
+
+// Refill the bit cache without reading past the end of the stream. Bits that
+// are past the end of the stream are read as zeros.
+FORCE_INLINE static void RefillBitCacheSafe(ReadStream* stream) {
+  stream->byte_ptr += stream->bit_pos >> 3;
+  stream->bit_pos &= 7;
+  if (LIKELY(stream->end_ptr - stream->byte_ptr >= 8)) {
+    stream->bit_cache = _hzr_load64le(stream->byte_ptr);
+  } else {
+    stream->bit_cache = 0U;
+    for (int i = 0; stream->byte_ptr + i < stream->end_ptr; ++i) {
+      stream->bit_cache |= ((uint64_t)stream->byte_ptr[i]) << (8 * i);
+    }
+  }
+}
+
 // Initialize a bitstream.
 static void InitReadStream(ReadStream* stream, const void* buf, size_t size) {
   stream->byte_ptr = (const uint8_t*)buf;
   stream->end_ptr = ((const uint8_t*)buf) + size;
+  stream->read_end = stream->end_ptr;
   stream->bit_pos = 0;
   stream->read_failed = HZR_FALSE;
+#if defined(HZR_ENABLE_STATS)
+  stream->lut_lookups = 0U;
+  stream->lut_misses = 0U;
+#endif
 
   // Pre-fill the bit cache.
-  stream->bit_cache = 0U;
-  for (size_t i = 0; i < 4 && i < size; ++i) {
-    stream->bit_cache |= ((uint32_t)stream->byte_ptr[i]) << (8 * i);
-  }
+  RefillBitCacheSafe(stream);
 }
 
 static void ReInitBitCache(ReadStream* stream) {
@@ -58,53 +104,21 @@ static void ReInitBitCache(ReadStream* stream) {
     return;
   }
 
-  stream->bit_cache = 0U;
-  size_t bytes_left = (size_t)(stream->end_ptr - stream->byte_ptr);
-  size_t bytes_to_read = hzr_min(4, bytes_left);
-  for (size_t i = 0; i < bytes_to_read; ++i) {
-    stream->bit_cache |= ((uint32_t)stream->byte_ptr[i]) << (8 * i);
-  }
-}
-
-// Copy the read state from one stream to another without altering the end
-// pointer.
-static void CopyReadState(ReadStream* stream, const ReadStream* src_stream) {
-  stream->byte_ptr = src_stream->byte_ptr;
-  stream->bit_pos = src_stream->bit_pos;
-  stream->bit_cache = src_stream->bit_cache;
-  stream->read_failed = src_stream->read_failed;
+  RefillBitCacheSafe(stream);
 }
 
 FORCE_INLINE static const uint8_t* GetBytePtr(ReadStream* stream) {
   return stream->byte_ptr + (stream->bit_pos >> 3);
 }
 
-FORCE_INLINE static void UpdateBitCache(ReadStream* stream) {
-  while (stream->bit_pos >= 8) {
-    stream->bit_cache =
-        (stream->bit_cache >> 8) | (((uint32_t)stream->byte_ptr[4]) << 24);
-    stream->bit_pos -= 8;
-    stream->byte_ptr++;
-  }
-}
-
-FORCE_INLINE static void UpdateBitCacheSafe(ReadStream* stream) {
-  while (stream->bit_pos >= 8) {
-    stream->bit_cache >>= 8;
-    if ((stream->byte_ptr + 4) < stream->end_ptr) {
-      stream->bit_cache |= ((uint32_t)stream->byte_ptr[4]) << 24;
-    }
-    stream->byte_ptr++;
-    stream->bit_pos -= 8;
-  }
-}
-
-// Read one bit from a bitstream.
-FORCE_INLINE static int ReadBit(ReadStream* stream) {
-  int x = (stream->bit_cache >> stream->bit_pos) & 1;
-  stream->bit_pos++;
-  UpdateBitCache(stream);
-  return x;
+// Check if advancing the stream by N bits would move it past the end.
+FORCE_INLINE static hzr_bool WouldOverrun(const ReadStream* stream, int N) {
+  int new_bit_pos = stream->bit_pos + N;
+  const uint8_t* new_byte_ptr = stream->byte_ptr + (new_bit_pos >> 3);
+  return (new_byte_ptr > stream->end_ptr ||
+          (new_byte_ptr == stream->end_ptr && ((new_bit_pos & 7) != 0)))
+             ? HZR_TRUE
+             : HZR_FALSE;
 }
 
 // Read one bit from a bitstream, with checking.
@@ -116,101 +130,65 @@ FORCE_INLINE static int ReadBitChecked(ReadStream* stream) {
   }
 
   // Ok, read...
-  int x = (stream->bit_cache >> stream->bit_pos) & 1;
+  int x = (int)((stream->bit_cache >> stream->bit_pos) & 1U);
   stream->bit_pos++;
-  UpdateBitCacheSafe(stream);
+  RefillBitCacheSafe(stream);
   return x;
 }
 
 static const uint32_t s_bits_mask[33] = {
-    0,  // Index zero is never used, since the index is in the range [1,32].
-    0x00000001U, 0x00000003U, 0x00000007U, 0x0000000fU, 0x0000001fU,
-    0x0000003fU, 0x0000007fU, 0x000000ffU, 0x000001ffU, 0x000003ffU,
-    0x000007ffU, 0x00000fffU, 0x00001fffU, 0x00003fffU, 0x00007fffU,
-    0x0000ffffU, 0x0001ffffU, 0x0003ffffU, 0x0007ffffU, 0x000fffffU,
-    0x001fffffU, 0x003fffffU, 0x007fffffU, 0x00ffffffU, 0x01ffffffU,
-    0x03ffffffU, 0x07ffffffU, 0x0fffffffU, 0x1fffffffU, 0x3fffffffU,
-    0x7fffffffU, 0xffffffffU};
-
-// Read multiple bits from a bitstream.
-FORCE_INLINE static uint32_t ReadBits(ReadStream* stream, int bits) {
-  // Read up to 32 bits at once.
-  int bits_to_read = hzr_min(32 - stream->bit_pos, bits);
-  uint32_t x =
-      (stream->bit_cache >> stream->bit_pos) & s_bits_mask[bits_to_read];
-  stream->bit_pos += bits_to_read;
-  bits -= bits_to_read;
-  UpdateBitCache(stream);
-
-  // In the very unlikely case that we didn't get all the bits in the first
-  // pass, we have to do a second pass (the caller has to request *at least*
-  // 24 bits at once for this to ever happen).
-  if (UNLIKELY(bits > 0)) {
-    x |= (stream->bit_cache & s_bits_mask[bits]) << bits_to_read;
-    stream->bit_pos += bits;
-    UpdateBitCache(stream);
-  }
+    0x00000000U, 0x00000001U, 0x00000003U, 0x00000007U, 0x0000000fU,
+    0x0000001fU, 0x0000003fU, 0x0000007fU, 0x000000ffU, 0x000001ffU,
+    0x000003ffU, 0x000007ffU, 0x00000fffU, 0x00001fffU, 0x00003fffU,
+    0x00007fffU, 0x0000ffffU, 0x0001ffffU, 0x0003ffffU, 0x0007ffffU,
+    0x000fffffU, 0x001fffffU, 0x003fffffU, 0x007fffffU, 0x00ffffffU,
+    0x01ffffffU, 0x03ffffffU, 0x07ffffffU, 0x0fffffffU, 0x1fffffffU,
+    0x3fffffffU, 0x7fffffffU, 0xffffffffU};
+
+// Peek up to 32 bits from a bitstream (read without advancing the pointer).
+// Note: The bits must be in the bit cache (bit_pos + bits <= 64).
+FORCE_INLINE static uint32_t PeekBits(const ReadStream* stream, int bits) {
+  return ((uint32_t)(stream->bit_cache >> stream->bit_pos)) & s_bits_mask[bits];
+}
+
+// Advance the pointer by N bits, without refilling the bit cache.
+FORCE_INLINE static void Advance(ReadStream* stream, int N) {
+  stream->bit_pos += N;
+}
 
+// Read up to 32 bits from a bitstream, without refilling the bit cache.
+FORCE_INLINE static uint32_t ReadBits(ReadStream* stream, int bits) {
+  uint32_t x = PeekBits(stream, bits);
+  Advance(stream, bits);
   return x;
 }
 
-// Read multiple bits from a bitstream, with checking.
+// Read up to 32 bits from a bitstream, with checking.
 FORCE_INLINE static uint32_t ReadBitsChecked(ReadStream* stream, int bits) {
   // Check that we don't read past the end.
-  int new_bit_pos = stream->bit_pos + bits;
-  const uint8_t* new_byte_ptr = stream->byte_ptr + (new_bit_pos >> 3);
-  if (UNLIKELY(new_byte_ptr > stream->end_ptr ||
-               (new_byte_ptr == stream->end_ptr && ((new_bit_pos & 7) != 0)))) {
+  if (UNLIKELY(WouldOverrun(stream, bits))) {
     stream->read_failed = HZR_TRUE;
     return 0;
   }
 
-  // Ok, read up to 32 bits at once.
-  int bits_to_read = hzr_min(32 - stream->bit_pos, bits);
-  uint32_t x =
-      (stream->bit_cache >> stream->bit_pos) & s_bits_mask[bits_to_read];
-  stream->bit_pos += bits_to_read;
-  bits -= bits_to_read;
-  UpdateBitCacheSafe(stream);
-
-  // In the very unlikely case that we didn't get all the bits in the first
-  // pass, we have to do a second pass (the caller has to request *at least*
-  // 24 bits at once for this to ever happen).
-  if (UNLIKELY(bits > 0)) {
-    x |= (stream->bit_cache & s_bits_mask[bits]) << bits_to_read;
-    stream->bit_pos += bits;
-    UpdateBitCacheSafe(stream);
-  }
-
+  // Ok, read (the bit cache always holds at least 57 bits here).
+  uint32_t x = PeekBits(stream, bits);
+  stream->bit_pos += bits;
+  RefillBitCacheSafe(stream);
   return x;
 }
 
-// Peek eight bits from a bitstream (read without advancing the pointer).
-FORCE_INLINE static uint8_t Peek8Bits(const ReadStream* stream) {
-  return (uint8_t)(stream->bit_cache >> stream->bit_pos);
-}
-
-// Advance the pointer by N bits.
-FORCE_INLINE static void Advance(ReadStream* stream, int N) {
-  stream->bit_pos += N;
-  UpdateBitCache(stream);
-}
-
 // Advance the pointer by N bits, with checking.
 FORCE_INLINE static void AdvanceChecked(ReadStream* stream, int N) {
-  int new_bit_pos = stream->bit_pos + N;
-  const uint8_t* new_byte_ptr = stream->byte_ptr + (new_bit_pos >> 3);
-
   // Check that we don't advance past the end.
-  if (UNLIKELY(new_byte_ptr > stream->end_ptr ||
-               (new_byte_ptr == stream->end_ptr && ((new_bit_pos & 7) != 0)))) {
+  if (UNLIKELY(WouldOverrun(stream, N))) {
     stream->read_failed = HZR_TRUE;
     return;
   }
 
   // Ok, advance...
-  stream->bit_pos = new_bit_pos;
-  UpdateBitCacheSafe(stream);
+  stream->bit_pos += N;
+  RefillBitCacheSafe(stream);
 }
 
 // Advance the pointer by N bytes, with checking.
@@ -241,396 +219,2229 @@ FORCE_INLINE static hzr_bool AtTheEnd(const ReadStream* stream) {
              : HZR_FALSE;
 }
 
-typedef struct DecodeNode_struct DecodeNode;
-struct DecodeNode_struct {
-  DecodeNode* child_a;
-  DecodeNode* child_b;
-  int symbol;
-};
+// The decoder uses a two level look-up-table (LUT) for decoding symbols. The
+// root LUT is indexed by up to kDecodeLutBits bits from the stream. Codes that
+// are longer than that are resolved through smaller sub tables of up to
+// kDecodeSubLutBits index bits each, which are stored after the root LUT.
+#define kDecodeLutBits 11
+#define kDecodeSubLutBits 4
+
+// Filling and combining the root LUT costs time that is proportional to its
+// size, which does not pay off for small blocks. The root LUT is limited to
+// one entry per kDecodedBytesPerLutEntry decoded bytes (but it is never
+// smaller than kMinDecodeLutBits index bits), and its entries are only
+// combined into multi-byte entries if the block holds at least
+// kDecodedBytesPerCombinedEntry bytes per entry.
+#define kDecodedBytesPerLutEntry 4
+#define kDecodedBytesPerCombinedEntry 8
+#define kMinDecodeLutBits 8
+
+// The maximum size of the LUT, including all sub tables. Every sub table of N
+// index bits covers at least N branch nodes of the Huffman tree that are not
+// covered by any other table, and a Huffman tree has at most kNumSymbols - 1
+// branch nodes, which gives us an upper bound for the sub table sizes.
+#define kMaxDecodeLutSize \
+  ((1 << kDecodeLutBits) + \
+   (((kNumSymbols - 1) / kDecodeSubLutBits) + 1) * (1 << kDecodeSubLutBits))
+
+// The maximum number of decoded bytes that a single LUT entry can hold.
+#define kMaxLutBytes 4
+
+// The number of root LUT entries that the fast decoding loop decodes per bit
+// cache refill, and the input and output margins that the loop requires.
+#define kDecodeBatchSize 4
+#define kDecodeInMargin 24
+#define kDecodeOutMargin (kPlainShortBatchSize * kMaxLutBytes)
+
+// Zero runs of up to this length are written by the fast loop with a single
+// fixed size store (which may write past the end of the run), provided that
+// there is room for it in the output buffer.
+#define kShortZeroRun 16
+
+#if kDecodeInMargin > HZR_DECODE_PADDING || \
+    kDecodeOutMargin > HZR_DECODE_PADDING || kShortZeroRun > HZR_DECODE_PADDING
+#error "HZR_DECODE_PADDING is too small."
+#endif
+
+// Decoding kernels, which are selected per tree. The plain kernels are used
+// when all the root LUT entries are plain bytes (no sub tables and no RLE
+// symbols), so that they can decode a fixed number of entries per bit cache
+// refill (which holds at least 57 bits) without looking at the entry kinds.
+#define kKernelGeneric 0
+#define kKernelPlain 1       // Codes of up to 11 bits: 5 * 11 <= 57.
+#define kKernelPlainShort 2  // Codes of up to 8 bits: 7 * 8 <= 57.
+#define kPlainBatchSize 5
+#define kPlainShortBatchSize 7
+
+// LUT entry kinds.
+#define kLutBytes 0     // One or more decoded bytes.
+#define kLutZeros 1     // A run of zeros.
+#define kLutRle 2       // An RLE symbol that needs more bits from the stream.
+#define kLutSubTable 3  // A reference to a sub table.
+#define kLutEscape 4    // A 16-bit sample that needs more bits from the stream.
 
 typedef struct {
-  DecodeNode* node;
-  int symbol;
-  int bits;
+  // The decoded bytes (kLutBytes), the number of index bits for the sub table
+  // in bytes[0] (kLutSubTable), or the number of extra bits in bytes[0]
+  // (kLutRle and kLutEscape). For kLutRle, bytes[1] holds the log2 of the
+  // number of bytes per zero (1 for 16-bit samples).
+  uint8_t bytes[kMaxLutBytes];
+
+  // The number of decoded bytes (kLutBytes), the number of zeros (kLutZeros),
+  // the smallest number of zeros (kLutRle), the smallest zigzag value
+  // (kLutEscape) or the offset of the sub table (kLutSubTable).
+  uint16_t value;
+
+  // The number of bits to consume from the stream.
+  uint8_t bits;
+
+  // The kind of entry.
+  uint8_t kind;
 } DecodeLutEntry;
 
 typedef struct {
-  DecodeNode nodes[kMaxTreeNodes];
-  DecodeLutEntry decode_lut[256];
+  uint32_t code;
+  int bits;
+  int symbol;
+} DecodeLeaf;
+
+// The decoding tables for a block. Only the parts that are used by a block are
+// initialized, so a tree can be reused for many blocks without clearing it.
+typedef struct {
+  // The decoding LUT (the root LUT, followed by the sub tables). It comes
+  // first, so that it is cache line aligned in a workspace.
+  DecodeLutEntry lut[kMaxDecodeLutSize];
+  int lut_bits;
+  int lut_size;
+
+  // The leaf nodes of the Huffman tree, in tree order.
+  DecodeLeaf leaves[kNumSymbols];
+  int num_leaves;
+
+  // True if the symbols are 16-bit samples (see kSymEscape16).
+  hzr_bool wide;
+
+  // The decoding kernel to use for this tree (kKernel*).
+  int kernel;
 } DecodeTree;
 
-// Recursively recover a Huffman tree from a bitstream.
-static DecodeNode* RecoverTree(DecodeTree* tree,
-                               int* node_num,
-                               uint32_t code,
-                               int bits,
-                               ReadStream* stream) {
-  // Pick a node from the node array.
-  DecodeNode* this_node = &tree->nodes[*node_num];
-  *node_num = *node_num + 1;
-  if (UNLIKELY(*node_num) >= kMaxTreeNodes) {
-    return NULL;
+void* _hzr_create_decode_scratch(void) {
+  void* tree = _hzr_aligned_alloc(sizeof(DecodeTree));
+  if (UNLIKELY(!tree)) {
+    DLOG("Out of memory.");
   }
+  return tree;
+}
+
+// Number of extra bits and the smallest zero count for each RLE symbol.
+static const int s_rle_bits[kNumSymbols - 256] = {0, 2, 4, 8, 14};
+static const int s_rle_base[kNumSymbols - 256] = {2, 3, 7, 23, 279};
 
-  // Clear the node.
-  this_node->symbol = -1;
-  this_node->child_a = NULL;
-  this_node->child_b = NULL;
+// Recursively recover a Huffman tree from a bitstream.
+// Note: The tree is made up of many short reads, so the bit cache is only
+// refilled when it can not hold the next node, and the caller must refill the
+// bit cache afterwards (see RecoverBlockTree()).
+static hzr_bool RecoverTree(DecodeTree* tree,
+                            uint32_t code,
+                            int bits,
+                            ReadStream* stream) {
+  if (stream->bit_pos > 64 - (1 + kSymbolSize)) {
+    RefillBitCacheSafe(stream);
+  }
 
   // Is this a leaf node?
-  int is_leaf = ReadBitChecked(stream);
-  if (UNLIKELY(stream->read_failed)) {
-    return NULL;
+  if (UNLIKELY(WouldOverrun(stream, 1))) {
+    stream->read_failed = HZR_TRUE;
+    return HZR_FALSE;
   }
-  if (is_leaf != 0) {
-    // Get symbol from tree description and store in lead node.
-    int symbol = (int)(ReadBitsChecked(stream, kSymbolSize));
-    if (UNLIKELY(stream->read_failed)) {
-      return NULL;
+  const uint32_t is_leaf = ReadBits(stream, 1);
+  if (is_leaf != 0U) {
+    // Get symbol from tree description and store it in the leaf array.
+    if (UNLIKELY(WouldOverrun(stream, kSymbolSize))) {
+      stream->read_failed = HZR_TRUE;
+      return HZR_FALSE;
     }
-
-    this_node->symbol = symbol;
-
-    if (bits <= 8) {
-      // Fill out the LUT for this symbol, including all permutations of the
-      // upper bits.
-      uint32_t dups = 256 >> bits;
-      for (uint32_t i = 0; i < dups; ++i) {
-        DecodeLutEntry* lut_entry = &tree->decode_lut[(i << bits) | code];
-        lut_entry->node = NULL;
-        lut_entry->bits = hzr_max(bits, 1);  // Special case for single symbol.
-        lut_entry->symbol = symbol;
-      }
+    int symbol = (int)ReadBits(stream, kSymbolSize);
+    if (UNLIKELY(symbol >= kNumSymbols || tree->num_leaves >= kNumSymbols)) {
+      return HZR_FALSE;
     }
-
-    return this_node;
+    DecodeLeaf* leaf = &tree->leaves[tree->num_leaves++];
+    leaf->code = code;
+    leaf->bits = bits;
+    leaf->symbol = symbol;
+    return HZR_TRUE;
   }
 
-  if (bits == 8) {
-    // This is a branch node with children that have > 8 bits per code. Add a
-    // non-terminated entry in the LUT (i.e. one that points into the tree
-    // rather than giving a symbol).
-    DecodeLutEntry* lut_entry = &tree->decode_lut[code];
-    lut_entry->node = this_node;
-    lut_entry->bits = 8;
-    lut_entry->symbol = 0;
+  // This is a branch node.
+  if (UNLIKELY(bits >= kMaxCodeLength)) {
+    return HZR_FALSE;
   }
+  return (RecoverTree(tree, code, bits + 1, stream) &&
+          RecoverTree(tree, code | (1U << bits), bits + 1, stream))
+             ? HZR_TRUE
+             : HZR_FALSE;
+}
 
-  // Get branch A.
-  this_node->child_a = RecoverTree(tree, node_num, code, bits + 1, stream);
-  if (UNLIKELY(!this_node->child_a)) {
-    return NULL;
+// Generate the leaves of the Huffman tree (in tree order) for the code lengths
+// of a canonical Huffman code.
+static hzr_bool MakeCanonicalLeaves(DecodeTree* tree, const uint8_t* lengths) {
+  // Count the number of codes of each length, and check that the code is
+  // complete (a single code is a special case).
+  int length_count[kMaxCanonicalCodeLength + 1] = {0};
+  for (int symbol = 0; symbol < kNumSymbols; ++symbol) {
+    if (UNLIKELY(lengths[symbol] > kMaxCanonicalCodeLength)) {
+      return HZR_FALSE;
+    }
+    length_count[lengths[symbol]]++;
   }
-
-  // Get branch B.
-  this_node->child_b =
-      RecoverTree(tree, node_num, code + (1 << bits), bits + 1, stream);
-  if (UNLIKELY(!this_node->child_b)) {
-    return NULL;
+  length_count[0] = 0;
+  uint32_t kraft_sum = 0U;
+  int num_leaves = 0;
+  for (int bits = 1; bits <= kMaxCanonicalCodeLength; ++bits) {
+    kraft_sum += ((uint32_t)length_count[bits])
+                 << (kMaxCanonicalCodeLength - bits);
+    num_leaves += length_count[bits];
   }
-
-  return this_node;
-}
-
-static hzr_status_t DecodeSingleBlock(ReadStream* stream,
-                                      uint8_t* out_ptr,
-                                      size_t out_size) {
-  // Re-init the bit cache.
-  ReInitBitCache(stream);
-
-  // Read the block header.
-  size_t encoded_size = (size_t)(ReadBitsChecked(stream, 16) + 1);
-  (void)ReadBitsChecked(stream, 32);  // Skip CRC32.
-  uint8_t encoding_mode = (uint8_t)ReadBitsChecked(stream, 8);
-  if (UNLIKELY(stream->read_failed)) {
-    DLOG("Premature end of the input stream.");
-    return HZR_FAIL;
+  if (num_leaves == 1) {
+    if (UNLIKELY(length_count[1] != 1)) {
+      return HZR_FALSE;
+    }
+  } else if (UNLIKELY(kraft_sum != (1U << kMaxCanonicalCodeLength))) {
+    return HZR_FALSE;
   }
 
-  // Plain copy?
-  if (encoding_mode == HZR_ENCODING_COPY) {
-    if (encoded_size != out_size) {
-      DLOG("Encoded / decoded size mismatch (COPY).");
-      return HZR_FAIL;
+  // Sort the leaves by code length (and symbol order for each code length),
+  // which gives the tree order for canonical codes.
+  int offset[kMaxCanonicalCodeLength + 1];
+  offset[1] = 0;
+  for (int bits = 1; bits < kMaxCanonicalCodeLength; ++bits) {
+    offset[bits + 1] = offset[bits] + length_count[bits];
+  }
+  for (int symbol = 0; symbol < kNumSymbols; ++symbol) {
+    int bits = lengths[symbol];
+    if (bits > 0) {
+      DecodeLeaf* leaf = &tree->leaves[offset[bits]++];
+      leaf->bits = bits;
+      leaf->symbol = symbol;
     }
-    memcpy(out_ptr, stream->byte_ptr, out_size);
-    stream->byte_ptr += out_size;
-    return HZR_OK;
   }
 
-  // Fill?
-  if (encoding_mode == HZR_ENCODING_FILL) {
-    uint8_t fill_value = (uint8_t)ReadBitsChecked(stream, 8);
-    if (UNLIKELY(stream->read_failed)) {
-      DLOG("Premature end of the input stream.");
-      return HZR_FAIL;
+  // Assign the codes (bit reversed, since the stream is read LSB first).
+  uint32_t code = 0U;
+  int prev_bits = 1;
+  for (int i = 0; i < num_leaves; ++i) {
+    DecodeLeaf* leaf = &tree->leaves[i];
+    code <<= leaf->bits - prev_bits;
+    prev_bits = leaf->bits;
+    uint32_t reversed = 0U;
+    for (int k = 0; k < leaf->bits; ++k) {
+      reversed = (reversed << 1) | ((code >> k) & 1U);
     }
-    memset(out_ptr, (int)fill_value, out_size);
-    return HZR_OK;
+    leaf->code = reversed;
+    ++code;
   }
+  tree->num_leaves = num_leaves;
 
-  // Check that the encoding mode is valid.
-  if (UNLIKELY(encoding_mode != HZR_ENCODING_HUFF_RLE)) {
-    DLOG("Invalid encoding mode.");
-    return HZR_FAIL;
-  }
+  return HZR_TRUE;
+}
 
-  // Create a stream that is limited to this block.
-  ReadStream block_stream = *stream;
-  block_stream.end_ptr = GetBytePtr(&block_stream) + encoded_size;
-  if (UNLIKELY(block_stream.end_ptr > stream->end_ptr)) {
-    DLOG("Premature end of input stream.");
-    return HZR_FAIL;
+// Read the code lengths of a canonical Huffman code from a bitstream, and
+// generate the leaves of the corresponding Huffman tree (in tree order).
+static hzr_bool RecoverCanonicalCodes(DecodeTree* tree, ReadStream* stream) {
+  // Read the code lengths.
+  uint8_t lengths[kNumSymbols];
+  int prev = 0;
+  for (int symbol = 0; symbol < kNumSymbols;) {
+    int bits;
+    if (ReadBitChecked(stream) == 0) {
+      bits = prev;
+    } else if (ReadBitChecked(stream) == 0) {
+      bits = (ReadBitChecked(stream) == 0) ? prev + 1 : prev - 1;
+    } else {
+      bits = (int)ReadBitsChecked(stream, 4);
+      if (bits == 0) {
+        int run = (int)ReadBitsChecked(stream, 8) + 1;
+        if (UNLIKELY(stream->read_failed || symbol + run > kNumSymbols)) {
+          return HZR_FALSE;
+        }
+        memset(&lengths[symbol], 0, (size_t)run);
+        symbol += run;
+        prev = 0;
+        continue;
+      }
+    }
+    if (UNLIKELY(stream->read_failed || bits < 0 ||
+                 bits > kMaxCanonicalCodeLength)) {
+      return HZR_FALSE;
+    }
+    lengths[symbol++] = (uint8_t)bits;
+    prev = bits;
   }
 
-  // Recover the Huffman tree.
-  DecodeTree tree;
-  int node_count = 0;
-  DecodeNode* tree_root = RecoverTree(&tree, &node_count, 0, 0, &block_stream);
-  if (UNLIKELY(tree_root == NULL)) {
-    DLOG("Unable to decode the Huffman tree.");
-    return HZR_FAIL;
-  }
+  return MakeCanonicalLeaves(tree, lengths);
+}
 
-  // Decode the input stream.
-  const uint8_t* out_end = out_ptr + out_size;
+// Store a 16-bit sample, given its zigzag value.
+FORCE_INLINE static void StoreSample16(uint8_t* ptr, uint32_t z) {
+  uint32_t sample = (z >> 1) ^ (0U - (z & 1U));
+  ptr[0] = (uint8_t)sample;
+  ptr[1] = (uint8_t)(sample >> 8);
+}
 
-  // We do the majority of the decoding in a fast, unchecked loop. During this
-  // loop, we use a bit cache.
-  // Note: The longest supported code + RLE encoding is 32 + 14 bits < 6 bytes.
-  // Additionally, the bit cache needs four bytes look-ahead.
-  const uint8_t* in_fast_end = block_stream.end_ptr - 10;
-  while (block_stream.byte_ptr < in_fast_end) {
-    int symbol;
+// Load and store the decoded bytes of a LUT entry as a little endian word (the
+// first byte in the lowest bits), so that the bytes of two entries can be
+// concatenated with a shift.
+FORCE_INLINE static uint32_t LoadLutBytes(const DecodeLutEntry* entry) {
+  return ((uint32_t)entry->bytes[0]) | (((uint32_t)entry->bytes[1]) << 8) |
+         (((uint32_t)entry->bytes[2]) << 16) |
+         (((uint32_t)entry->bytes[3]) << 24);
+}
 
-    // Peek 8 bits from the stream and use it to look up a potential symbol in
-    // the LUT (codes that are eight bits or shorter are very common, so we have
-    // a high hit rate in the LUT).
-    const DecodeLutEntry* lut_entry =
-        &tree.decode_lut[Peek8Bits(&block_stream)];
-    Advance(&block_stream, lut_entry->bits);
-    if (LIKELY(lut_entry->node == NULL)) {
-      // Fast case: We found the symbol in the LUT.
-      symbol = lut_entry->symbol;
-    } else {
-      // Slow case: Traverse the tree from 8 bits code length until we find a
-      // leaf node.
-      DecodeNode* node = lut_entry->node;
-      while (node->symbol < 0) {
-        if (UNLIKELY(block_stream.byte_ptr >= block_stream.end_ptr)) {
-          DLOG("Input buffer ended prematurely.");
-          return HZR_FAIL;
-        }
+FORCE_INLINE static void StoreLutBytes(DecodeLutEntry* entry, uint32_t x) {
+  entry->bytes[0] = (uint8_t)x;
+  entry->bytes[1] = (uint8_t)(x >> 8);
+  entry->bytes[2] = (uint8_t)(x >> 16);
+  entry->bytes[3] = (uint8_t)(x >> 24);
+}
 
-        // Get next node.
-        if (ReadBit(&block_stream)) {
-          node = node->child_b;
-        } else {
-          node = node->child_a;
-        }
+// Fill out a LUT entry for a single symbol (a byte, or a 16-bit sample if wide
+// is true). The code is followed by num_next_bits known bits (next_bits) in the
+// stream, which are used for resolving the zero count of RLE symbols and the
+// value of escape symbols directly in the LUT when possible.
+static void MakeLutEntry(DecodeLutEntry* entry,
+                         int symbol,
+                         int bits,
+                         uint32_t next_bits,
+                         int num_next_bits,
+                         hzr_bool wide) {
+  entry->kind = kLutBytes;
+  entry->bits = (uint8_t)bits;
+  memset(entry->bytes, 0, sizeof(entry->bytes));
+
+  // Plain symbol?
+  if (!wide && symbol <= 255) {
+    entry->bytes[0] = (uint8_t)symbol;
+    entry->value = 1;
+    return;
+  }
+
+  // 16-bit sample: Can we resolve the value of an escape symbol from the LUT
+  // index?
+  if (symbol <= 255) {
+    uint32_t z = (uint32_t)symbol;
+    if (symbol >= kSymEscape16) {
+      int extra_bits = symbol - kSymEscape16;
+      uint32_t base = (kSymEscape16 - 1) + (1U << extra_bits);
+      if (extra_bits > num_next_bits) {
+        entry->kind = kLutEscape;
+        entry->bytes[0] = (uint8_t)extra_bits;
+        entry->value = (uint16_t)base;
+        return;
       }
-      symbol = node->symbol;
+      z = base + (next_bits & ((1U << extra_bits) - 1U));
+      entry->bits = (uint8_t)(bits + extra_bits);
     }
+    StoreSample16(entry->bytes, z);
+    entry->value = 2;
+    return;
+  }
 
-    // Decode as RLE or plain copy.
-    if (LIKELY(symbol <= 255)) {
-      // Plain copy.
-      if (UNLIKELY(out_ptr >= out_end)) {
-        DLOG("Output buffer full.");
-        return HZR_FAIL;
+  // RLE symbol: Can we resolve the zero count from the LUT index?
+  const int shift = wide ? 1 : 0;
+  int extra_bits = s_rle_bits[symbol - 256];
+  if (extra_bits > num_next_bits) {
+    entry->kind = kLutRle;
+    entry->bytes[0] = (uint8_t)extra_bits;
+    entry->bytes[1] = (uint8_t)shift;
+    entry->value = (uint16_t)(s_rle_base[symbol - 256] << shift);
+    return;
+  }
+  uint32_t zero_count = ((uint32_t)s_rle_base[symbol - 256] +
+                         (next_bits & ((1U << extra_bits) - 1U)))
+                        << shift;
+  entry->bits = (uint8_t)(bits + extra_bits);
+  entry->value = (uint16_t)zero_count;
+  if (zero_count > kMaxLutBytes) {
+    entry->kind = kLutZeros;
+  }
+}
+
+// Fill out a LUT (or sub table) with the given leaves, which must all share
+// the same prefix of prefix_bits bits, and be in tree order.
+static hzr_bool FillLut(DecodeTree* tree,
+                        int table_offset,
+                        int table_bits,
+                        const DecodeLeaf* leaves,
+                        int num_leaves,
+                        int prefix_bits) {
+  DecodeLutEntry* table = &tree->lut[table_offset];
+  const uint32_t table_mask = (1U << table_bits) - 1U;
+  int i = 0;
+  while (i < num_leaves) {
+    const DecodeLeaf* leaf = &leaves[i];
+    uint32_t code = leaf->code >> prefix_bits;
+    int bits = leaf->bits - prefix_bits;
+
+    if (bits <= table_bits) {
+      // Fill out the entries for this symbol, including all permutations of
+      // the upper bits. Unless the entry resolves extra bits from the upper
+      // bits, all the permutations get the same entry.
+      uint32_t dups = 1U << (table_bits - bits);
+      DecodeLutEntry entry;
+      if (!tree->wide && leaf->symbol <= 255) {
+        // Plain byte (the common case).
+        StoreLutBytes(&entry, (uint32_t)leaf->symbol);
+        entry.value = 1;
+        entry.bits = (uint8_t)bits;
+        entry.kind = kLutBytes;
+      } else {
+        MakeLutEntry(&entry, leaf->symbol, bits, 0U, table_bits - bits,
+                     tree->wide);
       }
-      *out_ptr++ = (uint8_t)symbol;
-    } else {
-      // Symbols >= 256 are RLE tokens.
-      size_t zero_count;
-      switch (symbol) {
-        case kSymTwoZeros: {
-          zero_count = 2;
-          break;
-        }
-        case kSymUpTo6Zeros: {
-          zero_count = ((size_t)ReadBits(&block_stream, 2)) + 3;
-          break;
+      if (entry.bits == bits) {
+        for (uint32_t k = 0; k < dups; ++k) {
+          table[code | (k << bits)] = entry;
         }
-        case kSymUpTo22Zeros: {
-          zero_count = ((size_t)ReadBits(&block_stream, 4)) + 7;
-          break;
-        }
-        case kSymUpTo278Zeros: {
-          zero_count = ((size_t)ReadBits(&block_stream, 8)) + 23;
-          break;
-        }
-        case kSymUpTo16662Zeros: {
-          zero_count = ((size_t)ReadBits(&block_stream, 14)) + 279;
-          break;
-        }
-        default: {
-          // Note: This should never happen -> abort!
-          return HZR_FAIL;
+      } else {
+        for (uint32_t k = 0; k < dups; ++k) {
+          MakeLutEntry(&table[code | (k << bits)], leaf->symbol, bits, k,
+                       table_bits - bits, tree->wide);
         }
       }
+      ++i;
+      continue;
+    }
 
-      if (UNLIKELY(out_ptr + zero_count > out_end)) {
-        DLOG("Output buffer full.");
-        return HZR_FAIL;
+    // This leaf is too deep for this table. Collect all the leaves that share
+    // the same prefix (they are adjacent in tree order) into a sub table.
+    uint32_t sub_prefix = code & table_mask;
+    int max_bits = bits;
+    int j = i + 1;
+    for (; j < num_leaves; ++j) {
+      int next_bits = leaves[j].bits - prefix_bits;
+      if (next_bits <= table_bits ||
+          ((leaves[j].code >> prefix_bits) & table_mask) != sub_prefix) {
+        break;
       }
-      memset(out_ptr, 0, zero_count);
-      out_ptr += zero_count;
+      max_bits = hzr_max(max_bits, next_bits);
+    }
+    int sub_bits = hzr_min(max_bits - table_bits, kDecodeSubLutBits);
+    int sub_offset = tree->lut_size;
+    if (UNLIKELY(sub_offset + (1 << sub_bits) > kMaxDecodeLutSize)) {
+      return HZR_FALSE;
+    }
+    tree->lut_size += 1 << sub_bits;
+
+    DecodeLutEntry* entry = &table[sub_prefix];
+    memset(entry->bytes, 0, sizeof(entry->bytes));
+    entry->bytes[0] = (uint8_t)sub_bits;
+    entry->value = (uint16_t)sub_offset;
+    entry->bits = (uint8_t)table_bits;
+    entry->kind = kLutSubTable;
+    if (!FillLut(tree, sub_offset, sub_bits, &leaves[i], j - i,
+                 prefix_bits + table_bits)) {
+      return HZR_FALSE;
     }
+    i = j;
   }
+  return HZR_TRUE;
+}
 
-  // ...and we do the tail of the decoding in a slower, checked loop.
-  while (out_ptr < out_end) {
-    // Traverse the tree until we find a leaf node.
-    DecodeNode* node = tree_root;
-
-    // Special case: Only one symbol in the entire tree -> root node is a leaf
-    // node.
-    if (node->symbol >= 0) {
-      AdvanceChecked(&block_stream, 1);
-
-      if (UNLIKELY(block_stream.read_failed)) {
-        DLOG("Input buffer ended prematurely.");
-        return HZR_FAIL;
-      }
+// Combine consecutive short codes in the root LUT into multi-byte entries.
+static void CombineLutEntries(DecodeTree* tree) {
+  const int lut_bits = tree->lut_bits;
+  const DecodeLutEntry first_entry = tree->lut[0];
+
+  // Note: Entry i is combined with entries with lower indices (i >> bits), so
+  // we go backwards in order to always combine with uncombined entries.
+  for (int i = (1 << lut_bits) - 1; i >= 0; --i) {
+    DecodeLutEntry entry = tree->lut[i];
+    if (entry.kind != kLutBytes) {
+      continue;
     }
-
-    while (node->symbol < 0) {
-      // Get next node.
-      if (ReadBitChecked(&block_stream)) {
-        node = node->child_b;
-      } else {
-        node = node->child_a;
+    while (entry.bits < lut_bits) {
+      int next_idx = i >> entry.bits;
+      const DecodeLutEntry* next =
+          (next_idx == 0) ? &first_entry : &tree->lut[next_idx];
+
+      // We can only append an entry if all of its bits are in the LUT index,
+      // and if we have room for its bytes.
+      if (next->kind != kLutBytes || next->bits > lut_bits - entry.bits ||
+          entry.value + next->value > kMaxLutBytes) {
+        break;
       }
+      StoreLutBytes(&entry, LoadLutBytes(&entry) |
+                                (LoadLutBytes(next) << (8 * entry.value)));
+      entry.value = (uint16_t)(entry.value + next->value);
+      entry.bits = (uint8_t)(entry.bits + next->bits);
+    }
+    tree->lut[i] = entry;
+  }
+}
 
-      if (UNLIKELY(block_stream.read_failed)) {
-        DLOG("Input buffer ended prematurely.");
-        return HZR_FAIL;
-      }
+// Pair up the short codes in the root LUT into two-symbol entries. This is a
+// cheaper alternative to CombineLutEntries() for small blocks, since it only
+// writes the entries that get paired (it does not visit every entry).
+static void PairLutEntries(DecodeTree* tree, int min_bits) {
+  const int lut_bits = tree->lut_bits;
+
+  // Collect the plain entries of the codes that leave room for another code in
+  // the LUT index (before the root LUT is overwritten).
+  DecodeLutEntry entries[kNumSymbols];
+  uint32_t codes[kNumSymbols];
+  int num_short = 0;
+  for (int i = 0; i < tree->num_leaves; ++i) {
+    // Note: Longer codes may index past the end of the LUT.
+    const DecodeLeaf* leaf = &tree->leaves[i];
+    if (leaf->bits > lut_bits - min_bits) {
+      continue;
     }
-    int symbol = node->symbol;
+    const DecodeLutEntry* entry = &tree->lut[leaf->code];
+    if (entry->kind == kLutBytes && entry->bits == leaf->bits) {
+      entries[num_short] = *entry;
+      codes[num_short] = leaf->code;
+      ++num_short;
+    }
+  }
 
-    // Decode as RLE or plain copy.
-    if (LIKELY(symbol <= 255)) {
-      // Plain copy.
-      *out_ptr++ = (uint8_t)symbol;
-    } else {
-      // Symbols >= 256 are RLE tokens.
-      size_t zero_count;
-      switch (symbol) {
-        case kSymTwoZeros: {
-          zero_count = 2;
-          break;
-        }
-        case kSymUpTo6Zeros: {
-          zero_count = ((size_t)ReadBitsChecked(&block_stream, 2)) + 3;
-          break;
-        }
-        case kSymUpTo22Zeros: {
-          zero_count = ((size_t)ReadBitsChecked(&block_stream, 4)) + 7;
-          break;
-        }
-        case kSymUpTo278Zeros: {
-          zero_count = ((size_t)ReadBitsChecked(&block_stream, 8)) + 23;
-          break;
-        }
-        case kSymUpTo16662Zeros: {
-          zero_count = ((size_t)ReadBitsChecked(&block_stream, 14)) + 279;
-          break;
-        }
-        default: {
-          // Note: This should never happen -> abort!
-          return HZR_FAIL;
-        }
+  // Fill out the entries for each pair of codes that fits in the LUT index,
+  // including all permutations of the upper bits.
+  for (int i = 0; i < num_short; ++i) {
+    const DecodeLutEntry* first = &entries[i];
+    for (int j = 0; j < num_short; ++j) {
+      const DecodeLutEntry* second = &entries[j];
+      const int bits = first->bits + second->bits;
+      if (bits > lut_bits || first->value + second->value > kMaxLutBytes) {
+        continue;
       }
-
-      if (UNLIKELY(block_stream.read_failed ||
-                   out_ptr + zero_count > out_end)) {
-        DLOG("Output buffer full.");
-        return HZR_FAIL;
+      DecodeLutEntry entry;
+      StoreLutBytes(&entry, LoadLutBytes(first) |
+                                (LoadLutBytes(second) << (8 * first->value)));
+      entry.value = (uint16_t)(first->value + second->value);
+      entry.bits = (uint8_t)bits;
+      entry.kind = kLutBytes;
+      const uint32_t code = codes[i] | (codes[j] << first->bits);
+      const uint32_t dups = 1U << (lut_bits - bits);
+      tree->lut[code] = entry;
+      for (uint32_t k = 1; k < dups; ++k) {
+        tree->lut[code | (k << bits)] = tree->lut[code];
       }
-      memset(out_ptr, 0, zero_count);
-      out_ptr += zero_count;
     }
   }
-
-  // Commit the stream state.
-  CopyReadState(stream, &block_stream);
-
-  // Align the stream pointer to the next byte boundary.
-  if (stream->bit_pos != 0) {
-    stream->byte_ptr += (stream->bit_pos + 7) >> 3;
-    stream->bit_pos = 0;
-  }
-
-  return HZR_OK;
 }
 
-hzr_status_t hzr_verify(const void* in, size_t in_size, size_t* decoded_size) {
-  // Check input parameters.
-  if (!in || !decoded_size) {
-    DLOG("Invalid input arguments.");
-    return HZR_FAIL;
+// Build the decoding LUT from the recovered Huffman tree, for decoding
+// decoded_size bytes.
+static hzr_bool BuildDecodeLut(DecodeTree* tree, size_t decoded_size) {
+  if (UNLIKELY(tree->num_leaves < 1)) {
+    return HZR_FALSE;
   }
 
-  // Initialize the stream.
-  ReadStream stream;
-  InitReadStream(&stream, in, in_size);
+  // Special case: Only one symbol in the entire tree -> root node is a leaf
+  // node, which is encoded as a single bit.
+  if (tree->num_leaves == 1) {
+    tree->lut_bits = 1;
+    tree->lut_size = 2;
+    tree->kernel = kKernelGeneric;
+    MakeLutEntry(&tree->lut[0], tree->leaves[0].symbol, 1, 0U, 0, tree->wide);
+    MakeLutEntry(&tree->lut[1], tree->leaves[0].symbol, 1, 0U, 0, tree->wide);
+    return HZR_TRUE;
+  }
 
-  // Parse the master header.
-  *decoded_size = (size_t)ReadBitsChecked(&stream, 32);
-  if (stream.read_failed) {
-    DLOG("Could not read the header.");
-    return HZR_FAIL;
+  // Size the root LUT to fit the tree and the block.
+  int max_bits = 0;
+  int min_bits = kMaxCodeLength;
+  for (int i = 0; i < tree->num_leaves; ++i) {
+    max_bits = hzr_max(max_bits, tree->leaves[i].bits);
+    min_bits = hzr_min(min_bits, tree->leaves[i].bits);
+  }
+  int lut_bits = hzr_min(max_bits, kDecodeLutBits);
+  while (lut_bits > kMinDecodeLutBits &&
+         (decoded_size >> lut_bits) < kDecodedBytesPerLutEntry) {
+    --lut_bits;
   }
+  tree->lut_bits = lut_bits;
+  tree->lut_size = 1 << lut_bits;
 
-  // Traverse all the blocks.
-  size_t decoded_bytes_left = *decoded_size;
-  while (decoded_bytes_left > 0) {
-    size_t block_size = hzr_min(decoded_bytes_left, HZR_MAX_BLOCK_SIZE);
+  if (!FillLut(tree, 0, lut_bits, tree->leaves, tree->num_leaves, 0)) {
+    return HZR_FALSE;
+  }
+  if ((decoded_size >> lut_bits) >= kDecodedBytesPerCombinedEntry) {
+    CombineLutEntries(tree);
+  } else if (2 * min_bits <= lut_bits) {
+    PairLutEntries(tree, min_bits);
+  }
 
-    // Parse the block header.
-    size_t encoded_size = ((size_t)ReadBitsChecked(&stream, 16)) + 1;
-    uint32_t expected_crc32 = ReadBitsChecked(&stream, 32);
-    uint8_t encoding_mode = (uint8_t)ReadBitsChecked(&stream, 8);
-    if (stream.read_failed) {
-      DLOG("Could not read the block header.");
-      return HZR_FAIL;
+  // Select the decoding kernel. Without sub tables, RLE symbols and escape
+  // symbols with extra bits, all the root LUT entries are plain bytes.
+  tree->kernel = kKernelGeneric;
+  if (max_bits <= lut_bits) {
+    const int max_plain_symbol = tree->wide ? kSymEscape16 : 255;
+    hzr_bool has_rle = HZR_FALSE;
+    for (int i = 0; i < tree->num_leaves; ++i) {
+      if (tree->leaves[i].symbol > max_plain_symbol) {
+        has_rle = HZR_TRUE;
+        break;
+      }
     }
-    if (encoding_mode > HZR_ENCODING_LAST) {
-      DLOG("Unsupported encoding.");
-      return HZR_FAIL;
+    if (!has_rle) {
+      tree->kernel = (max_bits <= 8) ? kKernelPlainShort : kKernelPlain;
     }
+  }
+  return HZR_TRUE;
+}
 
-    // Check the checksum.
-    const uint8_t* block_data = GetBytePtr(&stream);
-    uint32_t actual_crc32 = _hzr_crc32(block_data, encoded_size);
-    if (actual_crc32 != expected_crc32) {
-      DLOG("CRC32 check failed.");
-      return HZR_FAIL;
-    }
+void* _hzr_create_decode_table(const uint8_t* lengths) {
+  DecodeTree* tree = (DecodeTree*)malloc(sizeof(DecodeTree));
+  if (UNLIKELY(!tree)) {
+    DLOG("Out of memory.");
+    return NULL;
+  }
+  tree->wide = HZR_FALSE;
+  if (UNLIKELY(!MakeCanonicalLeaves(tree, lengths) ||
+               !BuildDecodeLut(tree, SIZE_MAX))) {
+    DLOG("Invalid table code lengths.");
+    free(tree);
+    return NULL;
+  }
+  return tree;
+}
 
-    // Skip past the encoded data of this buffer.
-    AdvanceBytesChecked(&stream, encoded_size);
-    if (stream.read_failed) {
-      DLOG("Premature end of input buffer.");
-      return HZR_FAIL;
-    }
+// Look up an entry in the sub tables.
+FORCE_INLINE static const DecodeLutEntry* LookupSubTable(
+    const DecodeTree* tree,
+    const DecodeLutEntry* entry,
+    ReadStream* stream) {
+  HZR_STATS_COUNT(stream->lut_misses, 1);
+  do {
+    Advance(stream, entry->bits);
+    int sub_bits = entry->bytes[0];
+    entry = &tree->lut[entry->value + PeekBits(stream, sub_bits)];
+  } while (entry->kind == kLutSubTable);
+  return entry;
+}
 
-    decoded_bytes_left -= block_size;
-  }
+// Look up an entry in the sub tables, with checking.
+FORCE_INLINE static const DecodeLutEntry* LookupSubTableChecked(
+    const DecodeTree* tree,
+    const DecodeLutEntry* entry,
+    ReadStream* stream) {
+  HZR_STATS_COUNT(stream->lut_misses, 1);
+  do {
+    AdvanceChecked(stream, entry->bits);
+    int sub_bits = entry->bytes[0];
+    entry = &tree->lut[entry->value + PeekBits(stream, sub_bits)];
+  } while (entry->kind == kLutSubTable);
+  return entry;
+}
 
-  return HZR_OK;
+// Check if a stream can be decoded by the fast, unchecked loop. The store_end
+// pointer is the end of the memory that the decoder may write to, which
+// includes any slack after the end of the output.
+FORCE_INLINE static hzr_bool CanDecodeFast(const ReadStream* stream,
+                                           const uint8_t* out_ptr,
+                                           const uint8_t* store_end) {
+  return ((stream->end_ptr - stream->byte_ptr > kDecodeInMargin) &&
+          (store_end - out_ptr >= kDecodeOutMargin))
+             ? HZR_TRUE
+             : HZR_FALSE;
 }
 
-hzr_status_t hzr_decode(const void* in,
-                        size_t in_size,
-                        void* out,
-                        size_t out_size) {
-  // Check input parameters.
-  if (!in || !out) {
-    DLOG("Invalid input arguments.");
-    return HZR_FAIL;
+// Check if the fast loop can continue into the readable memory after the end
+// of the stream. An iteration that starts kDecodeOutMargin bytes or more from
+// the end of the output never decodes past the last code of a valid stream, so
+// only corrupt data makes the loop read past the end of the stream.
+FORCE_INLINE static hzr_bool CanDecodeFastToEnd(const ReadStream* stream,
+                                                const uint8_t* out_ptr,
+                                                const uint8_t* out_end) {
+  return ((stream->read_end - stream->byte_ptr > kDecodeInMargin) &&
+          (out_end - out_ptr >= kDecodeOutMargin))
+             ? HZR_TRUE
+             : HZR_FALSE;
+}
+
+// A single iteration of the fast, unchecked decoding loop. The iteration
+// refills the bit cache once and decodes a batch of up to kDecodeBatchSize
+// plain LUT entries, which always fit in the refilled bit cache (7 + 4 * 11
+// bits, plus the look-ahead of the next entry). Any other entry (a long code or
+// a zero run) gets a refill of its own, which is enough for the longest
+// supported code + RLE or escape bits: 32 + 15 bits.
+// Note: A refill may read up to 15 bytes ahead of the byte pointer, and we may
+// refill twice per iteration.
+// Note: Each LUT entry may write up to kMaxLutBytes bytes to the output, and
+// short zero runs write kShortZeroRun bytes, so the output pointer may pass
+// out_end (but never store_end) when the data is corrupt.
+// Note: The kernel must be a compile time constant, so that each kernel gets a
+// loop of its own without any kernel checks.
+FORCE_INLINE static hzr_bool DecodeFastIteration(const DecodeTree* tree,
+                                                 ReadStream* stream,
+                                                 uint8_t** out_ptr_ref,
+                                                 const uint8_t* out_end,
+                                                 const uint8_t* store_end,
+                                                 const int kernel) {
+  uint8_t* out_ptr = *out_ptr_ref;
+  const int lut_bits = tree->lut_bits;
+  RefillBitCache(stream);
+
+  // Plain kernels: All the entries are plain bytes in the root LUT.
+  if (kernel != kKernelGeneric) {
+    const int batch_size =
+        (kernel == kKernelPlainShort) ? kPlainShortBatchSize : kPlainBatchSize;
+    for (int k = 0; k < batch_size; ++k) {
+      const DecodeLutEntry* entry = &tree->lut[PeekBits(stream, lut_bits)];
+      Advance(stream, entry->bits);
+      memcpy(out_ptr, entry->bytes, kMaxLutBytes);
+      out_ptr += entry->value;
+    }
+    HZR_STATS_COUNT(stream->lut_lookups, batch_size);
+    *out_ptr_ref = out_ptr;
+    return HZR_TRUE;
+  }
+
+  // Peek bits from the stream and use them to look up one or more symbols in
+  // the LUT (short codes are very common, so we usually get a direct hit in
+  // the root LUT).
+  const DecodeLutEntry* entry = &tree->lut[PeekBits(stream, lut_bits)];
+  for (int k = 0; k < kDecodeBatchSize && LIKELY(entry->kind == kLutBytes);
+       ++k) {
+    HZR_STATS_COUNT(stream->lut_lookups, 1);
+    Advance(stream, entry->bits);
+    memcpy(out_ptr, entry->bytes, kMaxLutBytes);
+    out_ptr += entry->value;
+    entry = &tree->lut[PeekBits(stream, lut_bits)];
+  }
+  if (LIKELY(entry->kind == kLutBytes)) {
+    *out_ptr_ref = out_ptr;
+    return HZR_TRUE;
+  }
+
+  // The entry is a long code or a run of zeros.
+  HZR_STATS_COUNT(stream->lut_lookups, 1);
+  RefillBitCache(stream);
+  if (entry->kind == kLutSubTable) {
+    entry = LookupSubTable(tree, entry, stream);
+  }
+  Advance(stream, entry->bits);
+
+  if (entry->kind == kLutBytes) {
+    memcpy(out_ptr, entry->bytes, kMaxLutBytes);
+    out_ptr += entry->value;
+  } else if (entry->kind == kLutEscape) {
+    StoreSample16(out_ptr, ReadBits(stream, entry->bytes[0]) + entry->value);
+    out_ptr += 2;
+  } else {
+    size_t zero_count;
+    if (entry->kind == kLutZeros) {
+      zero_count = entry->value;
+    } else {
+      zero_count = (((size_t)ReadBits(stream, entry->bytes[0]))
+                    << entry->bytes[1]) +
+                   (size_t)entry->value;
+    }
+
+    if (UNLIKELY((ptrdiff_t)zero_count > out_end - out_ptr)) {
+      DLOG("Output buffer full.");
+      return HZR_FALSE;
+    }
+    if (LIKELY(zero_count <= kShortZeroRun &&
+               store_end - out_ptr >= kShortZeroRun)) {
+      memset(out_ptr, 0, kShortZeroRun);
+    } else {
+      memset(out_ptr, 0, zero_count);
+    }
+    out_ptr += zero_count;
+  }
+  *out_ptr_ref = out_ptr;
+  return HZR_TRUE;
+}
+
+// The fast, unchecked decoding loop of a single stream, for a given kernel.
+// The loop stops at fast_end (at most store_end), so that the output can be
+// decoded in chunks. It only continues into the readable memory after the
+// stream for the last chunk (fast_end == store_end).
+FORCE_INLINE static hzr_bool DecodeFastLoop(const DecodeTree* tree,
+                                            ReadStream* stream,
+                                            uint8_t** out_ptr_ref,
+                                            const uint8_t* out_end,
+                                            const uint8_t* store_end,
+                                            const uint8_t* fast_end,
+                                            const int kernel) {
+  // Keep the stream state in local variables, so that the compiler can keep
+  // it in registers (the output stores may otherwise alias the stream).
+  ReadStream s = *stream;
+  uint8_t* out_ptr = *out_ptr_ref;
+  hzr_bool ok = HZR_TRUE;
+
+  // Note: Compare the remaining sizes rather than forming end - margin
+  // pointers, which may point before the start of short buffers.
+  while (ok && CanDecodeFast(&s, out_ptr, fast_end)) {
+    ok = DecodeFastIteration(tree, &s, &out_ptr, out_end, store_end, kernel);
+  }
+
+  // Use the readable memory after the stream (if any) to decode all but the
+  // last few bytes of the output with the fast loop too.
+  if (fast_end == store_end) {
+    while (ok && CanDecodeFastToEnd(&s, out_ptr, out_end)) {
+      ok = DecodeFastIteration(tree, &s, &out_ptr, out_end, store_end, kernel);
+    }
+  }
+
+  *stream = s;
+  *out_ptr_ref = out_ptr;
+  return ok;
+}
+
+// The decoded bytes of a filtered block are unfiltered in chunks of this size
+// while the block is decoded, so that each chunk is still in the L1 cache.
+#define kUnfilterChunkSize 4096
+
+// The state of undoing the filter of a block while it is decoded.
+typedef struct {
+  uint8_t* block;
+  size_t done;
+  int filter;
+  size_t stride;
+} BlockUnfilter;
+
+// Undo the filter of the decoded bytes before ptr (all the bytes if ptr is the
+// end of the block, otherwise whole HZR_UNFILTER_ALIGN byte units).
+static void UnfilterDecoded(BlockUnfilter* unfilter,
+                            const uint8_t* ptr,
+                            const uint8_t* block_end) {
+  size_t end = (size_t)(ptr - unfilter->block);
+  if (ptr != block_end) {
+    end &= ~(size_t)(HZR_UNFILTER_ALIGN - 1);
+  }
+  if (end > unfilter->done) {
+    _hzr_unfilter(unfilter->block, unfilter->done, end, unfilter->filter,
+                  unfilter->stride);
+    unfilter->done = end;
+  }
+}
+
+// Decode a Huffman coded stream into out_ptr...out_end. The decoder may write
+// arbitrary data to out_end...store_end (the slack after the output).
+// If unfilter is not NULL, the filter of the block is undone in chunks as the
+// stream is decoded (the caller undoes the filter of the last chunk).
+static hzr_status_t DecodeStream(const DecodeTree* tree,
+                                 ReadStream* stream,
+                                 uint8_t* out_ptr,
+                                 uint8_t* out_end,
+                                 uint8_t* store_end,
+                                 BlockUnfilter* unfilter) {
+  const int lut_bits = tree->lut_bits;
+
+  // We do the majority of the decoding in a fast, unchecked loop...
+  if (CanDecodeFast(stream, out_ptr, store_end) ||
+      CanDecodeFastToEnd(stream, out_ptr, out_end)) {
+    hzr_bool ok;
+    const uint8_t* fast_end;
+    do {
+      // Note: Only stop at a chunk end that the fast loop can reach, so that
+      // every pass makes progress.
+      fast_end = store_end;
+      if (unfilter && store_end - out_ptr > kUnfilterChunkSize &&
+          CanDecodeFast(stream, out_ptr, store_end)) {
+        fast_end = out_ptr + kUnfilterChunkSize;
+      }
+      switch (tree->kernel) {
+        case kKernelPlainShort:
+          ok = DecodeFastLoop(tree, stream, &out_ptr, out_end, store_end,
+                              fast_end, kKernelPlainShort);
+          break;
+        case kKernelPlain:
+          ok = DecodeFastLoop(tree, stream, &out_ptr, out_end, store_end,
+                              fast_end, kKernelPlain);
+          break;
+        default:
+          ok = DecodeFastLoop(tree, stream, &out_ptr, out_end, store_end,
+                              fast_end, kKernelGeneric);
+          break;
+      }
+      if (unfilter && ok && out_ptr <= out_end) {
+        UnfilterDecoded(unfilter, out_ptr, out_end);
+      }
+    } while (ok && fast_end != store_end);
+    if (UNLIKELY(!ok)) {
+      return HZR_FAIL;
+    }
+
+    // Prepare the bit cache for the checked loop.
+    RefillBitCacheSafe(stream);
+  }
+
+  // The fast loop may run past the end of the output (into the slack) and past
+  // the end of the stream (into the readable memory after it) if the data is
+  // corrupt.
+  if (UNLIKELY(out_ptr > out_end)) {
+    DLOG("Output buffer full.");
+    return HZR_FAIL;
+  }
+  if (UNLIKELY(WouldOverrun(stream, 0))) {
+    DLOG("Input buffer ended prematurely.");
+    return HZR_FAIL;
+  }
+
+  // ...and we do the tail of the decoding in a slower, checked loop.
+  while (out_ptr < out_end) {
+    HZR_STATS_COUNT(stream->lut_lookups, 1);
+    const DecodeLutEntry* entry = &tree->lut[PeekBits(stream, lut_bits)];
+    if (entry->kind == kLutSubTable) {
+      entry = LookupSubTableChecked(tree, entry, stream);
+    }
+    if (UNLIKELY(stream->read_failed)) {
+      DLOG("Input buffer ended prematurely.");
+      return HZR_FAIL;
+    }
+
+    // The last entry of the stream may hold more bytes than we need, since
+    // the LUT index may extend past the last code of the stream.
+    // Note: Use fixed size copies when there is room for them, since the
+    // tail is short and variable size copies are library calls.
+    const hzr_bool has_room =
+        (store_end - out_ptr >= kShortZeroRun) ? HZR_TRUE : HZR_FALSE;
+    size_t bytes_left = (size_t)(out_end - out_ptr);
+    if (entry->kind == kLutBytes && entry->value >= bytes_left) {
+      if (has_room) {
+        memcpy(out_ptr, entry->bytes, kMaxLutBytes);
+      } else {
+        memcpy(out_ptr, entry->bytes, bytes_left);
+      }
+      break;
+    }
+
+    AdvanceChecked(stream, entry->bits);
+    if (UNLIKELY(stream->read_failed)) {
+      DLOG("Input buffer ended prematurely.");
+      return HZR_FAIL;
+    }
+
+    size_t count = entry->value;
+    uint32_t z = 0U;
+    if (entry->kind == kLutRle) {
+      count = (((size_t)ReadBitsChecked(stream, entry->bytes[0]))
+               << entry->bytes[1]) +
+              (size_t)entry->value;
+    } else if (entry->kind == kLutEscape) {
+      z = ReadBitsChecked(stream, entry->bytes[0]) + entry->value;
+      count = 2;
+    }
+    if (UNLIKELY(stream->read_failed || count > bytes_left)) {
+      DLOG("Output buffer full.");
+      return HZR_FAIL;
+    }
+    if (entry->kind == kLutBytes) {
+      if (has_room) {
+        memcpy(out_ptr, entry->bytes, kMaxLutBytes);
+      } else {
+        memcpy(out_ptr, entry->bytes, count);
+      }
+    } else if (entry->kind == kLutEscape) {
+      StoreSample16(out_ptr, z);
+    } else if (has_room && count <= kShortZeroRun) {
+      memset(out_ptr, 0, kShortZeroRun);
+    } else {
+      memset(out_ptr, 0, count);
+    }
+    out_ptr += count;
+  }
+
+  return HZR_OK;
+}
+
+// Decode kNumMultiStreams streams in lockstep while all of them can use the
+// fast loop, since the streams are independent of each other. The stream
+// states are kept in local variables so that the compiler can keep them in
+// registers.
+#if kNumMultiStreams != 4
+#error "The lockstep loop assumes four streams."
+#endif
+FORCE_INLINE static hzr_bool DecodeLockstep(const DecodeTree* tree,
+                                            ReadStream* streams,
+                                            uint8_t** out_ptrs,
+                                            uint8_t* const* out_ends,
+                                            uint8_t* const* store_ends,
+                                            const int kernel) {
+  ReadStream s0 = streams[0], s1 = streams[1], s2 = streams[2],
+             s3 = streams[3];
+  uint8_t *o0 = out_ptrs[0], *o1 = out_ptrs[1], *o2 = out_ptrs[2],
+          *o3 = out_ptrs[3];
+  while (CanDecodeFast(&s0, o0, store_ends[0]) &&
+         CanDecodeFast(&s1, o1, store_ends[1]) &&
+         CanDecodeFast(&s2, o2, store_ends[2]) &&
+         CanDecodeFast(&s3, o3, store_ends[3])) {
+    if (UNLIKELY(!DecodeFastIteration(tree, &s0, &o0, out_ends[0],
+                                      store_ends[0], kernel) ||
+                 !DecodeFastIteration(tree, &s1, &o1, out_ends[1],
+                                      store_ends[1], kernel) ||
+                 !DecodeFastIteration(tree, &s2, &o2, out_ends[2],
+                                      store_ends[2], kernel) ||
+                 !DecodeFastIteration(tree, &s3, &o3, out_ends[3],
+                                      store_ends[3], kernel))) {
+      return HZR_FALSE;
+    }
+  }
+  streams[0] = s0;
+  streams[1] = s1;
+  streams[2] = s2;
+  streams[3] = s3;
+  out_ptrs[0] = o0;
+  out_ptrs[1] = o1;
+  out_ptrs[2] = o2;
+  out_ptrs[3] = o3;
+  return HZR_TRUE;
+}
+
+// Decode kNumMultiStreams Huffman coded streams, that follow the tree
+// description in the stream. Only the last stream can use the out_slack bytes
+// after the output, since the streams are decoded in lockstep.
+static hzr_status_t DecodeMultiStream(const DecodeTree* tree,
+                                      ReadStream* stream,
+                                      const BlockLayout* layout,
+                                      uint8_t* out,
+                                      size_t out_size,
+                                      size_t out_slack) {
+  // Read the sizes of the streams, which start at the next byte boundary.
+  const uint8_t* ptr = stream->byte_ptr + ((stream->bit_pos + 7) >> 3);
+  const int size_bytes = layout->size_bits / 8;
+  const size_t sizes_size = (size_t)size_bytes * (kNumMultiStreams - 1);
+  if (UNLIKELY((size_t)(stream->end_ptr - ptr) < sizes_size)) {
+    DLOG("Premature end of input stream.");
+    return HZR_FAIL;
+  }
+  size_t sizes[kNumMultiStreams];
+  uint64_t total_size = sizes_size;
+  for (int i = 0; i < kNumMultiStreams - 1; ++i) {
+    uint64_t size = 0;
+    for (int k = 0; k < size_bytes; ++k) {
+      size |= ((uint64_t)*ptr++) << (8 * k);
+    }
+    sizes[i] = (size_t)size;
+    total_size += size;
+  }
+  if (UNLIKELY((uint64_t)(stream->end_ptr - ptr) < total_size - sizes_size)) {
+    DLOG("Invalid stream sizes.");
+    return HZR_FAIL;
+  }
+  sizes[kNumMultiStreams - 1] =
+      (size_t)(stream->end_ptr - ptr) - (size_t)(total_size - sizes_size);
+
+  // Set up the streams, and the output segment of each stream.
+  ReadStream streams[kNumMultiStreams];
+  uint8_t* out_ptrs[kNumMultiStreams];
+  uint8_t* out_ends[kNumMultiStreams];
+  uint8_t* store_ends[kNumMultiStreams];
+  for (int i = 0; i < kNumMultiStreams; ++i) {
+    InitReadStream(&streams[i], ptr, sizes[i]);
+    streams[i].read_end = stream->read_end;
+    ptr += sizes[i];
+    out_ptrs[i] = out + (tree->wide ? _hzr_segment_start16(out_size, i)
+                                    : _hzr_segment_start(out_size, i));
+    out_ends[i] = out + (tree->wide ? _hzr_segment_start16(out_size, i + 1)
+                                    : _hzr_segment_start(out_size, i + 1));
+    store_ends[i] = out_ends[i];
+  }
+  store_ends[kNumMultiStreams - 1] += out_slack;
+
+  // Decode the streams in lockstep while all of them can use the fast loop.
+  hzr_bool ok;
+  switch (tree->kernel) {
+    case kKernelPlainShort:
+      ok = DecodeLockstep(tree, streams, out_ptrs, out_ends, store_ends,
+                          kKernelPlainShort);
+      break;
+    case kKernelPlain:
+      ok = DecodeLockstep(tree, streams, out_ptrs, out_ends, store_ends,
+                          kKernelPlain);
+      break;
+    default:
+      ok = DecodeLockstep(tree, streams, out_ptrs, out_ends, store_ends,
+                          kKernelGeneric);
+      break;
+  }
+  if (UNLIKELY(!ok)) {
+    return HZR_FAIL;
+  }
+
+  // Finish the streams one by one.
+  for (int i = 0; i < kNumMultiStreams; ++i) {
+    RefillBitCacheSafe(&streams[i]);
+    if (DecodeStream(tree, &streams[i], out_ptrs[i], out_ends[i],
+                     store_ends[i], NULL) != HZR_OK) {
+      return HZR_FAIL;
+    }
+    HZR_STATS_COUNT(stream->lut_lookups, streams[i].lut_lookups);
+    HZR_STATS_COUNT(stream->lut_misses, streams[i].lut_misses);
+  }
+
+  return HZR_OK;
+}
+
+// Check if blocks with the given encoding mode have their own Huffman tree.
+static hzr_bool HasOwnTree(int encoding_mode) {
+  return ((encoding_mode == HZR_ENCODING_HUFF_RLE) ||
+          (encoding_mode == HZR_ENCODING_CANONICAL) ||
+          (encoding_mode == HZR_ENCODING_HUFF_RLE_MULTI) ||
+          (encoding_mode == HZR_ENCODING_CANONICAL_MULTI) ||
+          (encoding_mode == HZR_ENCODING_HUFF16) ||
+          (encoding_mode == HZR_ENCODING_HUFF16_MULTI))
+             ? HZR_TRUE
+             : HZR_FALSE;
+}
+
+// Check if blocks with the given encoding mode use the tree of a previous
+// block.
+static hzr_bool ReusesTree(int encoding_mode) {
+  return ((encoding_mode == HZR_ENCODING_REUSE) ||
+          (encoding_mode == HZR_ENCODING_REUSE_MULTI))
+             ? HZR_TRUE
+             : HZR_FALSE;
+}
+
+// Recover the Huffman tree of a block that has its own tree, and build the
+// decoding LUT for decoding decoded_size bytes. If this fails, the tree is left
+// empty (so that it can not be reused by later blocks).
+static hzr_bool RecoverBlockTree(DecodeTree* tree,
+                                 ReadStream* block_stream,
+                                 int encoding_mode,
+                                 size_t decoded_size) {
+  tree->num_leaves = 0;
+  tree->wide = ((encoding_mode == HZR_ENCODING_HUFF16) ||
+                (encoding_mode == HZR_ENCODING_HUFF16_MULTI))
+                   ? HZR_TRUE
+                   : HZR_FALSE;
+  hzr_bool tree_ok;
+  if ((encoding_mode == HZR_ENCODING_CANONICAL) ||
+      (encoding_mode == HZR_ENCODING_CANONICAL_MULTI)) {
+    tree_ok = RecoverCanonicalCodes(tree, block_stream);
+  } else {
+    tree_ok = RecoverTree(tree, 0U, 0, block_stream);
+    RefillBitCacheSafe(block_stream);
+  }
+  if (UNLIKELY(!tree_ok || !BuildDecodeLut(tree, decoded_size))) {
+    tree->num_leaves = 0;
+    return HZR_FALSE;
+  }
+  return HZR_TRUE;
+}
+
+// Forget the tree of the previous blocks at the start of each tree reuse group.
+FORCE_INLINE static void StartTreeReuseGroup(DecodeTree* tree, size_t block) {
+  if ((block % HZR_TREE_REUSE_GROUP_SIZE) == 0) {
+    tree->num_leaves = 0;
+  }
+}
+
+// Decode a single block with the given block layout. The decoder never reads or
+// writes outside of the stream and the output buffer, even if the encoded data
+// is corrupt. The out_slack bytes after the output buffer are writable memory
+// that the decoder may overwrite with arbitrary data (e.g. the output of the
+// following blocks, if they are decoded later by the same thread). If
+// check_crc is true, the CRC of the encoded data is checked before the block
+// is decoded (while the data is fresh in the cache). The tree is scratch
+// memory for the decoding tables, and the table is the shared table (if any)
+// that the data was encoded with. Decoded blocks are counted in the statistics
+// (if any).
+static hzr_status_t DecodeSingleBlock(ReadStream* stream,
+                                      const BlockLayout* layout,
+                                      uint8_t* out_ptr,
+                                      size_t out_size,
+                                      size_t out_slack,
+                                      hzr_bool check_crc,
+                                      DecodeTree* tree,
+                                      const hzr_table_t* table,
+                                      hzr_stats_t* stats) {
+  uint64_t start_ticks = _hzr_stats_start(stats);
+
+  // Re-init the bit cache.
+  ReInitBitCache(stream);
+
+  // Read the block header.
+  size_t encoded_size =
+      ((size_t)ReadBitsChecked(stream, layout->size_bits)) + 1;
+  uint32_t expected_crc32 = ReadBitsChecked(stream, 32);
+  uint8_t encoding_mode = (uint8_t)ReadBitsChecked(stream, 8);
+  const int mode_byte = (int)encoding_mode;
+  const uint8_t* encoded_data = GetBytePtr(stream);
+  if (UNLIKELY(stream->read_failed ||
+               ((size_t)(stream->end_ptr - encoded_data) < encoded_size))) {
+    DLOG("Premature end of the input stream.");
+    return HZR_FAIL;
+  }
+  const int filter = encoding_mode >> HZR_FILTER_SHIFT;
+  encoding_mode &= HZR_ENCODING_MASK;
+
+  // Plain copy?
+  if (encoding_mode == HZR_ENCODING_COPY) {
+    if (encoded_size != out_size || filter != HZR_BLOCK_FILTER_NONE) {
+      DLOG("Encoded / decoded size mismatch (COPY).");
+      return HZR_FAIL;
+    }
+    if (check_crc) {
+      if (UNLIKELY(_hzr_crc32_copy(out_ptr, encoded_data, out_size) !=
+                   expected_crc32)) {
+        DLOG("CRC32 check failed.");
+        return HZR_FAIL;
+      }
+      HZR_STATS_LAP(stats, crc_ticks, start_ticks);
+    } else {
+      memcpy(out_ptr, encoded_data, out_size);
+      HZR_STATS_LAP(stats, coding_ticks, start_ticks);
+    }
+    stream->byte_ptr = encoded_data + encoded_size;
+    stream->bit_pos = 0;
+    if (stats) {
+      _hzr_stats_add_block(stats, mode_byte, out_size,
+                           layout->header_size + encoded_size);
+    }
+    return HZR_OK;
+  }
+
+  // Check the checksum.
+  if (check_crc) {
+    if (UNLIKELY(_hzr_crc32(encoded_data, encoded_size) != expected_crc32)) {
+      DLOG("CRC32 check failed.");
+      return HZR_FAIL;
+    }
+    HZR_STATS_LAP(stats, crc_ticks, start_ticks);
+  }
+
+  // Filtered blocks start with the filter stride.
+  size_t stride = 0;
+  if (filter != HZR_BLOCK_FILTER_NONE) {
+    if (UNLIKELY(filter > HZR_BLOCK_FILTER_LAST || encoded_size < 2 ||
+                 encoded_data[0] == 0)) {
+      DLOG("Invalid filter.");
+      return HZR_FAIL;
+    }
+    stride = (size_t)encoded_data[0];
+  }
+  const uint8_t* data = encoded_data + (stride ? 1 : 0);
+  const uint8_t* data_end = encoded_data + encoded_size;
+
+  // Fill?
+  if (encoding_mode == HZR_ENCODING_FILL) {
+    if (UNLIKELY(data_end - data != 1)) {
+      DLOG("Invalid encoded size (FILL).");
+      return HZR_FAIL;
+    }
+    memset(out_ptr, (int)data[0], out_size);
+    HZR_STATS_LAP(stats, coding_ticks, start_ticks);
+    _hzr_unfilter(out_ptr, 0, out_size, filter, stride);
+    HZR_STATS_LAP(stats, filter_ticks, start_ticks);
+    stream->byte_ptr = data_end;
+    stream->bit_pos = 0;
+    if (stats) {
+      _hzr_stats_add_block(stats, mode_byte, out_size,
+                           layout->header_size + encoded_size);
+    }
+    return HZR_OK;
+  }
+
+  // Check that the encoding mode is valid.
+  if (UNLIKELY(!HasOwnTree(encoding_mode) && !ReusesTree(encoding_mode) &&
+               encoding_mode != HZR_ENCODING_TABLE)) {
+    DLOG("Invalid encoding mode.");
+    return HZR_FAIL;
+  }
+
+  // Create a stream that is limited to this block.
+  ReadStream block_stream;
+  InitReadStream(&block_stream, data, (size_t)(data_end - data));
+  block_stream.read_end = stream->read_end;
+
+  if (encoding_mode == HZR_ENCODING_TABLE) {
+    // Use the prebuilt decoding LUT of the shared table.
+    unsigned table_id = (unsigned)ReadBitsChecked(&block_stream, 16);
+    if (UNLIKELY(!table || block_stream.read_failed ||
+                 table_id != table->id)) {
+      DLOG("The shared table of the block is not available.");
+      return HZR_FAIL;
+    }
+    tree = (DecodeTree*)table->decode_table;
+  } else if (ReusesTree(encoding_mode)) {
+    // Use the tree of a previous block, which is still in the tree.
+    if (UNLIKELY(tree->num_leaves == 0)) {
+      DLOG("There is no Huffman tree to reuse.");
+      return HZR_FAIL;
+    }
+  } else {
+    // Recover the Huffman tree, and build the decoding LUT.
+    if (UNLIKELY(!RecoverBlockTree(tree, &block_stream, encoding_mode,
+                                   out_size))) {
+      DLOG("Unable to decode the Huffman tree.");
+      return HZR_FAIL;
+    }
+    HZR_STATS_LAP(stats, tree_ticks, start_ticks);
+  }
+
+  // Blocks of 16-bit samples must have whole samples.
+  if (UNLIKELY(tree->wide && (out_size & 1U) != 0U)) {
+    DLOG("Odd decoded size for 16-bit samples.");
+    return HZR_FAIL;
+  }
+
+  // Decode the Huffman coded stream(s). The filter of a single stream block is
+  // undone chunk by chunk while the decoded data is still in the L1 cache (the
+  // streams of a multi-stream block are decoded in lockstep, so their output
+  // is only complete at the end).
+  BlockUnfilter unfilter = {out_ptr, 0, filter, stride};
+  hzr_status_t status;
+  if ((encoding_mode == HZR_ENCODING_HUFF_RLE_MULTI) ||
+      (encoding_mode == HZR_ENCODING_CANONICAL_MULTI) ||
+      (encoding_mode == HZR_ENCODING_REUSE_MULTI) ||
+      (encoding_mode == HZR_ENCODING_HUFF16_MULTI)) {
+    status = DecodeMultiStream(tree, &block_stream, layout, out_ptr, out_size,
+                               out_slack);
+  } else {
+    status = DecodeStream(
+        tree, &block_stream, out_ptr, out_ptr + out_size,
+        out_ptr + out_size + out_slack,
+        (filter != HZR_BLOCK_FILTER_NONE) ? &unfilter : NULL);
+  }
+  if (status != HZR_OK) {
+    return status;
+  }
+  HZR_STATS_LAP(stats, coding_ticks, start_ticks);
+
+  // Undo the filter of the rest of the block.
+  if (filter != HZR_BLOCK_FILTER_NONE) {
+    UnfilterDecoded(&unfilter, out_ptr + out_size, out_ptr + out_size);
+    HZR_STATS_LAP(stats, filter_ticks, start_ticks);
+  }
+
+  // Skip to the end of the block.
+  stream->byte_ptr = block_stream.end_ptr;
+  stream->bit_pos = 0;
+
+  if (stats) {
+    _hzr_stats_add_block(stats, mode_byte, out_size,
+                         layout->header_size + encoded_size);
+    HZR_STATS_COUNT(stats->lut_lookups, block_stream.lut_lookups);
+    HZR_STATS_COUNT(stats->lut_misses, block_stream.lut_misses);
+  }
+
+  return HZR_OK;
+}
+
+// Read little endian integers from a byte buffer.
+static uint32_t ReadLE32(const uint8_t* ptr) {
+  return ((uint32_t)ptr[0]) | (((uint32_t)ptr[1]) << 8) |
+         (((uint32_t)ptr[2]) << 16) | (((uint32_t)ptr[3]) << 24);
+}
+
+static uint64_t ReadLE64(const uint8_t* ptr) {
+  return ((uint64_t)ReadLE32(ptr)) | (((uint64_t)ReadLE32(ptr + 4)) << 32);
+}
+
+// Skip past a block without decoding it.
+static void SkipBlock(ReadStream* stream, const BlockLayout* layout) {
+  size_t encoded_size =
+      ((size_t)ReadBitsChecked(stream, layout->size_bits)) + 1;
+  (void)ReadBitsChecked(stream, 32);  // Skip CRC32.
+  (void)ReadBitsChecked(stream, 8);   // Skip encoding mode.
+  AdvanceBytesChecked(stream, encoded_size);
+}
+
+// Get the encoding mode of the block that starts at the given position, or -1
+// if there is no room for a block header.
+static int PeekEncodingMode(const uint8_t* block,
+                            size_t size,
+                            const BlockLayout* layout) {
+  return (size >= layout->header_size)
+             ? (int)(block[layout->header_size - 1] & HZR_ENCODING_MASK)
+             : -1;
+}
+
+// Load the Huffman tree of a block that has its own tree, without decoding the
+// block.
+static hzr_status_t LoadBlockTree(const uint8_t* block,
+                                  size_t size,
+                                  const BlockLayout* layout,
+                                  DecodeTree* tree) {
+  ReadStream stream;
+  InitReadStream(&stream, block, size);
+  size_t encoded_size =
+      ((size_t)ReadBitsChecked(&stream, layout->size_bits)) + 1;
+  (void)ReadBitsChecked(&stream, 32);  // Skip CRC32.
+  int encoding_mode = (int)ReadBitsChecked(&stream, 8);
+  const uint8_t* encoded_data = GetBytePtr(&stream);
+  if (UNLIKELY(stream.read_failed ||
+               ((size_t)(stream.end_ptr - encoded_data) < encoded_size) ||
+               !HasOwnTree(encoding_mode & (int)HZR_ENCODING_MASK))) {
+    DLOG("Invalid Huffman tree block.");
+    return HZR_FAIL;
+  }
+  stream.end_ptr = encoded_data + encoded_size;
+
+  // Skip the filter stride of filtered blocks.
+  if ((encoding_mode >> HZR_FILTER_SHIFT) != HZR_BLOCK_FILTER_NONE) {
+    (void)ReadBitsChecked(&stream, 8);
+  }
+  encoding_mode &= (int)HZR_ENCODING_MASK;
+  if (UNLIKELY(!RecoverBlockTree(tree, &stream, encoding_mode,
+                                 layout->block_size))) {
+    DLOG("Unable to decode the Huffman tree.");
+    return HZR_FAIL;
+  }
+  return HZR_OK;
+}
+
+// Prepare the tree for decoding a block that is not decoded right after the
+// blocks before it in its tree reuse group. The block offsets are the offsets
+// of the blocks from the start of the group, up to and including the block to
+// decode. Unless that block has a tree of its own, the tree is loaded from the
+// closest preceding block that has one, since that block or one of the blocks
+// after it (e.g. after a plain copy) may reuse the tree.
+static hzr_status_t PrepareTree(const uint8_t* in,
+                                size_t in_size,
+                                const BlockLayout* layout,
+                                const size_t* group_offsets,
+                                size_t num_blocks,
+                                DecodeTree* tree) {
+  tree->num_leaves = 0;
+  size_t offset = group_offsets[num_blocks - 1];
+  if (HasOwnTree(PeekEncodingMode(&in[offset], in_size - offset, layout))) {
+    return HZR_OK;
+  }
+  for (size_t i = num_blocks - 1; i-- > 0;) {
+    offset = group_offsets[i];
+    if (HasOwnTree(PeekEncodingMode(&in[offset], in_size - offset, layout))) {
+      return LoadBlockTree(&in[offset], in_size - offset, layout, tree);
+    }
+  }
+
+  // There is no tree to reuse, which is detected when the block is decoded.
+  return HZR_OK;
+}
+
+// The end_block value for data that does not have an end marker.
+#define kNoEndMarker SIZE_MAX
+
+// Read the end marker of streamed data. The stream must be positioned at the
+// end marker.
+static hzr_status_t ReadEndMarker(ReadStream* stream, uint64_t* decoded_size) {
+  size_t encoded_size = ((size_t)ReadBitsChecked(stream, 16)) + 1;
+  uint32_t expected_crc32 = ReadBitsChecked(stream, 32);
+  uint8_t encoding_mode = (uint8_t)ReadBitsChecked(stream, 8);
+  const uint8_t* payload = GetBytePtr(stream);
+  AdvanceBytesChecked(stream, 8);
+  if (UNLIKELY(stream->read_failed || (encoding_mode != HZR_ENCODING_END) ||
+               (encoded_size != 8))) {
+    DLOG("Invalid end marker.");
+    return HZR_FAIL;
+  }
+  if (UNLIKELY(_hzr_crc32(payload, 8) != expected_crc32)) {
+    DLOG("End marker CRC32 check failed.");
+    return HZR_FAIL;
+  }
+  *decoded_size = ReadLE64(payload);
+  return HZR_OK;
+}
+
+// The decoded size and layout of the encoded data, as given by the master
+// header.
+typedef struct {
+  size_t decoded_size;
+
+  // The number of the block that the end marker precedes (or kNoEndMarker if
+  // the data is not streamed data).
+  size_t end_block;
+
+  // HZR_HEADER_FLAG_* flags (zero unless there is an extended header).
+  unsigned flags;
+
+  BlockLayout layout;
+} MasterHeader;
+
+// Read an extended header. The stream must be positioned at the extended header
+// block (right after the master header).
+static hzr_status_t ReadExtendedHeader(ReadStream* stream,
+                                       uint64_t* decoded_size,
+                                       unsigned* flags,
+                                       BlockLayout* layout) {
+  size_t encoded_size = ((size_t)ReadBitsChecked(stream, 16)) + 1;
+  uint32_t expected_crc32 = ReadBitsChecked(stream, 32);
+  uint8_t encoding_mode = (uint8_t)ReadBitsChecked(stream, 8);
+  const uint8_t* data = GetBytePtr(stream);
+  AdvanceBytesChecked(stream, encoded_size);
+  if (UNLIKELY(stream->read_failed ||
+               (encoding_mode != HZR_ENCODING_HEADER) ||
+               (encoded_size < HZR_EXT_HEADER_DATA_SIZE))) {
+    DLOG("Invalid extended header.");
+    return HZR_FAIL;
+  }
+  if (UNLIKELY(_hzr_crc32(data, encoded_size) != expected_crc32)) {
+    DLOG("Extended header CRC32 check failed.");
+    return HZR_FAIL;
+  }
+
+  // Any trailing data is ignored, but unknown versions and flags are not.
+  if (UNLIKELY((data[0] != HZR_FORMAT_VERSION) ||
+               ((data[1] & ~HZR_HEADER_FLAGS_KNOWN) != 0U) ||
+               (data[2] < HZR_MIN_BLOCK_SIZE_LOG2) ||
+               (data[2] > HZR_MAX_BLOCK_SIZE_LOG2))) {
+    DLOG("Unsupported format version, flags or block size.");
+    return HZR_FAIL;
+  }
+  *flags = data[1];
+  _hzr_init_block_layout(layout, (int)data[2]);
+  *decoded_size = ReadLE64(&data[3]);
+  return HZR_OK;
+}
+
+// Check if the stream is positioned at an extended header block.
+static hzr_bool AtExtendedHeader(const ReadStream* stream) {
+  return (stream->end_ptr - stream->byte_ptr >= HZR_BLOCK_HEADER_SIZE &&
+          stream->byte_ptr[6] == HZR_ENCODING_HEADER)
+             ? HZR_TRUE
+             : HZR_FALSE;
+}
+
+// Read the master header (and the extended header, if any). For streamed data,
+// the decoded size is found by following the chain of block headers to the end
+// marker.
+static hzr_status_t ReadMasterHeader(ReadStream* stream, MasterHeader* header) {
+  uint32_t size = ReadBitsChecked(stream, 32);
+  if (UNLIKELY(stream->read_failed)) {
+    DLOG("Unable to read the header.");
+    return HZR_FAIL;
+  }
+  header->end_block = kNoEndMarker;
+  header->flags = 0U;
+  _hzr_init_block_layout(&header->layout, HZR_DEFAULT_BLOCK_SIZE_LOG2);
+  if (size != HZR_SIZE_STREAMED) {
+    header->decoded_size = (size_t)size;
+    return HZR_OK;
+  }
+
+  // An extended header?
+  if (AtExtendedHeader(stream)) {
+    uint64_t size64;
+    if (ReadExtendedHeader(stream, &size64, &header->flags,
+                           &header->layout) != HZR_OK) {
+      return HZR_FAIL;
+    }
+    if (UNLIKELY(size64 > (uint64_t)SIZE_MAX)) {
+      DLOG("The decoded size is too large.");
+      return HZR_FAIL;
+    }
+    header->decoded_size = (size_t)size64;
+    return HZR_OK;
+  }
+
+  // Find the end marker. If the blocks are not followed by an end marker, this
+  // is regular data from an older version of HZR, with the decoded size
+  // 0xffffffff.
+  ReadStream scan = *stream;
+  for (size_t block = 0;; ++block) {
+    const uint8_t* block_start = GetBytePtr(&scan);
+    if (scan.end_ptr - block_start < HZR_BLOCK_HEADER_SIZE) {
+      break;
+    }
+    if (block_start[6] == HZR_ENCODING_END) {
+      uint64_t size64;
+      if (ReadEndMarker(&scan, &size64) != HZR_OK) {
+        return HZR_FAIL;
+      }
+      if (UNLIKELY((size64 / HZR_DEFAULT_BLOCK_SIZE != (uint64_t)block) ||
+                   (size64 > (uint64_t)SIZE_MAX))) {
+        DLOG("The end marker does not match the number of blocks.");
+        return HZR_FAIL;
+      }
+      header->decoded_size = (size_t)size64;
+      header->end_block = block;
+      return HZR_OK;
+    }
+    SkipBlock(&scan, &header->layout);
+    if (scan.read_failed) {
+      break;
+    }
+  }
+  header->decoded_size = (size_t)size;
+  return HZR_OK;
+}
+
+// Skip past the end marker of streamed data, if it precedes the given block.
+static void SkipEndMarker(ReadStream* stream, size_t block, size_t end_block) {
+  if (block == end_block) {
+    AdvanceBytesChecked(stream, HZR_END_MARKER_SIZE);
+  }
+}
+
+// Locate the block index at the end of the input buffer. Returns a pointer to
+// the first index entry, or NULL if the buffer does not have an index.
+static const uint8_t* FindIndex(const uint8_t* in,
+                                size_t in_size,
+                                size_t num_blocks) {
+  size_t index_size =
+      num_blocks * HZR_INDEX_ENTRY_SIZE + HZR_INDEX_FOOTER_SIZE;
+  if (in_size < (HZR_HEADER_SIZE + index_size)) {
+    return NULL;
+  }
+  const uint8_t* footer = &in[in_size - HZR_INDEX_FOOTER_SIZE];
+  if ((ReadLE32(&footer[8]) != HZR_INDEX_SIGNATURE) ||
+      ((size_t)ReadLE32(&footer[0]) != num_blocks)) {
+    return NULL;
+  }
+  return &in[in_size - index_size];
+}
+
+// Get the offset of a block from the block index.
+static hzr_status_t GetIndexedOffset(const uint8_t* in,
+                                     const uint8_t* index,
+                                     const BlockLayout* layout,
+                                     size_t block,
+                                     size_t* block_offset) {
+  const uint8_t* entry = &index[block * HZR_INDEX_ENTRY_SIZE];
+  uint64_t offset = ReadLE64(&entry[0]);
+  uint64_t decoded_offset = ReadLE64(&entry[8]);
+
+  // Check that the index entry is sane.
+  uint64_t max_offset = (uint64_t)(index - in) - layout->header_size;
+  if (UNLIKELY((decoded_offset != (uint64_t)block * layout->block_size) ||
+               (offset < HZR_HEADER_SIZE) || (offset > max_offset))) {
+    DLOG("Invalid block index entry.");
+    return HZR_FAIL;
+  }
+
+  *block_offset = (size_t)offset;
+  return HZR_OK;
+}
+
+// Find the offsets of all the blocks. The stream must be positioned at the
+// first block.
+static hzr_status_t FindBlockOffsets(ReadStream* stream,
+                                     const uint8_t* in,
+                                     size_t in_size,
+                                     const BlockLayout* layout,
+                                     size_t num_blocks,
+                                     size_t end_block,
+                                     size_t* block_offsets) {
+  // Use the block index if there is one (streamed data has no index).
+  const uint8_t* index =
+      (end_block == kNoEndMarker) ? FindIndex(in, in_size, num_blocks) : NULL;
+  if (index) {
+    for (size_t block = 0; block < num_blocks; ++block) {
+      if (GetIndexedOffset(in, index, layout, block, &block_offsets[block]) !=
+          HZR_OK) {
+        return HZR_FAIL;
+      }
+    }
+    return HZR_OK;
+  }
+
+  // ...otherwise follow the chain of block headers.
+  for (size_t block = 0; block < num_blocks; ++block) {
+    SkipEndMarker(stream, block, end_block);
+    block_offsets[block] = (size_t)(stream->byte_ptr - in);
+    SkipBlock(stream, layout);
+    if (UNLIKELY(stream->read_failed)) {
+      DLOG("Premature end of input buffer.");
+      return HZR_FAIL;
+    }
+  }
+  SkipEndMarker(stream, num_blocks, end_block);
+  if (UNLIKELY(!AtTheEnd(stream))) {
+    DLOG("Decoder did not reach the end of the input buffer.");
+    return HZR_FAIL;
+  }
+  return HZR_OK;
+}
+
+hzr_status_t _hzr_get_decoded_size(const void* in,
+                                   size_t in_size,
+                                   size_t* decoded_size) {
+  ReadStream stream;
+  InitReadStream(&stream, in, in_size);
+  MasterHeader header;
+  if (ReadMasterHeader(&stream, &header) != HZR_OK) {
+    return HZR_FAIL;
+  }
+  *decoded_size = header.decoded_size;
+  return HZR_OK;
+}
+
+hzr_status_t hzr_verify(const void* in, size_t in_size, size_t* decoded_size) {
+  // Check input parameters.
+  if (!in || !decoded_size) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  // Initialize the stream.
+  ReadStream stream;
+  InitReadStream(&stream, in, in_size);
+
+  // Parse the master header.
+  MasterHeader header;
+  if (ReadMasterHeader(&stream, &header) != HZR_OK) {
+    return HZR_FAIL;
+  }
+  const size_t end_block = header.end_block;
+  const BlockLayout* layout = &header.layout;
+  *decoded_size = header.decoded_size;
+
+  // Is there a block index (streamed data has no index)?
+  size_t num_blocks = _hzr_num_blocks(layout, *decoded_size);
+  const uint8_t* index =
+      (end_block == kNoEndMarker)
+          ? FindIndex((const uint8_t*)in, in_size, num_blocks)
+          : NULL;
+  if (UNLIKELY(((header.flags & HZR_HEADER_FLAG_INDEX) != 0U) && !index)) {
+    DLOG("The block index is missing.");
+    return HZR_FAIL;
+  }
+
+  // Traverse all the blocks.
+  hzr_bool group_has_tree = HZR_FALSE;
+  for (size_t block = 0; block < num_blocks; ++block) {
+    // The end marker has already been checked by ReadMasterHeader().
+    SkipEndMarker(&stream, block, end_block);
+
+    // Check that the block index agrees with the actual block offset.
+    if (index) {
+      size_t indexed_offset;
+      if (UNLIKELY((GetIndexedOffset((const uint8_t*)in, index, layout, block,
+                                     &indexed_offset) != HZR_OK) ||
+                   ((const uint8_t*)in + indexed_offset != stream.byte_ptr))) {
+        DLOG("Block index mismatch.");
+        return HZR_FAIL;
+      }
+    }
+
+    // Parse the block header.
+    size_t encoded_size =
+        ((size_t)ReadBitsChecked(&stream, layout->size_bits)) + 1;
+    uint32_t expected_crc32 = ReadBitsChecked(&stream, 32);
+    uint8_t encoding_mode = (uint8_t)ReadBitsChecked(&stream, 8);
+    if (stream.read_failed) {
+      DLOG("Could not read the block header.");
+      return HZR_FAIL;
+    }
+    const int filter = encoding_mode >> HZR_FILTER_SHIFT;
+    encoding_mode &= HZR_ENCODING_MASK;
+    if (encoding_mode > HZR_ENCODING_LAST || filter > HZR_BLOCK_FILTER_LAST ||
+        (encoding_mode == HZR_ENCODING_COPY &&
+         filter != HZR_BLOCK_FILTER_NONE)) {
+      DLOG("Unsupported encoding.");
+      return HZR_FAIL;
+    }
+    if ((block % HZR_TREE_REUSE_GROUP_SIZE) == 0) {
+      group_has_tree = HZR_FALSE;
+    }
+    if (HasOwnTree(encoding_mode)) {
+      group_has_tree = HZR_TRUE;
+    } else if (UNLIKELY(ReusesTree(encoding_mode) && !group_has_tree)) {
+      DLOG("There is no Huffman tree to reuse.");
+      return HZR_FAIL;
+    }
+
+    // Check the checksum.
+    const uint8_t* block_data = GetBytePtr(&stream);
+    if ((size_t)(stream.end_ptr - block_data) < encoded_size) {
+      DLOG("Premature end of input buffer.");
+      return HZR_FAIL;
+    }
+    uint32_t actual_crc32 = _hzr_crc32(block_data, encoded_size);
+    if (actual_crc32 != expected_crc32) {
+      DLOG("CRC32 check failed.");
+      return HZR_FAIL;
+    }
+
+    // Skip past the encoded data of this buffer.
+    AdvanceBytesChecked(&stream, encoded_size);
+    if (stream.read_failed) {
+      DLOG("Premature end of input buffer.");
+      return HZR_FAIL;
+    }
+  }
+
+  SkipEndMarker(&stream, num_blocks, end_block);
+  if (stream.read_failed) {
+    DLOG("Premature end of input buffer.");
+    return HZR_FAIL;
+  }
+
+  // Check the block index.
+  if (index) {
+    size_t index_size = num_blocks * HZR_INDEX_ENTRY_SIZE + 4;
+    if (stream.byte_ptr != index) {
+      DLOG("The block index does not follow the last block.");
+      return HZR_FAIL;
+    }
+    if (_hzr_crc32(index, index_size) != ReadLE32(&index[index_size])) {
+      DLOG("Block index CRC32 check failed.");
+      return HZR_FAIL;
+    }
+  }
+
+  return HZR_OK;
+}
+
+hzr_status_t hzr_decode_range(const void* in,
+                              size_t in_size,
+                              size_t byte_offset,
+                              size_t length,
+                              void* out) {
+  // Check input parameters.
+  if (!in || (!out && length > 0)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  // To little input data?
+  if (in_size < HZR_HEADER_SIZE) {
+    return HZR_FAIL;
+  }
+
+  // Read the header.
+  ReadStream stream;
+  InitReadStream(&stream, in, in_size);
+  MasterHeader header;
+  if (ReadMasterHeader(&stream, &header) != HZR_OK) {
+    return HZR_FAIL;
+  }
+  const size_t decoded_size = header.decoded_size;
+  const size_t end_block = header.end_block;
+  const BlockLayout* layout = &header.layout;
+  if ((byte_offset > decoded_size) || (length > decoded_size - byte_offset)) {
+    DLOG("The requested range is outside of the decoded data.");
+    return HZR_FAIL;
+  }
+  if (length == 0) {
+    return HZR_OK;
+  }
+
+  // Locate the first block of the range.
+  const size_t range_end = byte_offset + length;
+  const size_t first_block = byte_offset >> layout->block_size_log2;
+  const size_t last_block = (range_end - 1) >> layout->block_size_log2;
+  // Also collect the offsets of the blocks from the start of its tree reuse
+  // group, since it may need a tree from one of them.
+  const size_t group_start =
+      first_block - (first_block % HZR_TREE_REUSE_GROUP_SIZE);
+  const size_t num_group_blocks = first_block - group_start + 1;
+  size_t group_offsets[HZR_TREE_REUSE_GROUP_SIZE];
+  const uint8_t* index =
+      (end_block == kNoEndMarker)
+          ? FindIndex((const uint8_t*)in, in_size,
+                      _hzr_num_blocks(layout, decoded_size))
+          : NULL;
+  if (index) {
+    for (size_t i = 0; i < num_group_blocks; ++i) {
+      if (GetIndexedOffset((const uint8_t*)in, index, layout, group_start + i,
+                           &group_offsets[i]) != HZR_OK) {
+        return HZR_FAIL;
+      }
+    }
+    size_t block_offset = group_offsets[num_group_blocks - 1];
+    InitReadStream(&stream, (const uint8_t*)in + block_offset,
+                   in_size - block_offset);
+  } else {
+    for (size_t block = 0; block < first_block; ++block) {
+      SkipEndMarker(&stream, block, end_block);
+      if (block >= group_start) {
+        group_offsets[block - group_start] =
+            (size_t)(GetBytePtr(&stream) - (const uint8_t*)in);
+      }
+      SkipBlock(&stream, layout);
+    }
+    ReadStream first = stream;
+    SkipEndMarker(&first, first_block, end_block);
+    if (UNLIKELY(first.read_failed)) {
+      DLOG("Premature end of input buffer.");
+      return HZR_FAIL;
+    }
+    group_offsets[num_group_blocks - 1] =
+        (size_t)(GetBytePtr(&first) - (const uint8_t*)in);
+  }
+
+  // Decode the blocks of the range. Blocks that are only partially covered by
+  // the range are decoded into a temporary buffer. The output of the following
+  // blocks is slack for the decoder, since it is overwritten later.
+  DecodeTree tree;
+  if (PrepareTree((const uint8_t*)in, in_size, layout, group_offsets,
+                  num_group_blocks, &tree) != HZR_OK) {
+    return HZR_FAIL;
+  }
+  uint8_t* out_data = (uint8_t*)out;
+  uint8_t* const out_end = out_data + length;
+  uint8_t* block_buf = NULL;
+  hzr_status_t status = HZR_OK;
+  for (size_t block = first_block; block <= last_block; ++block) {
+    size_t block_start = block * layout->block_size;
+    size_t block_size = hzr_min(decoded_size - block_start, layout->block_size);
+    size_t copy_start = hzr_max(byte_offset, block_start) - block_start;
+    size_t copy_end = hzr_min(range_end, block_start + block_size) - block_start;
+    SkipEndMarker(&stream, block, end_block);
+    StartTreeReuseGroup(&tree, block);
+    if (copy_start == 0 && copy_end == block_size) {
+      status = DecodeSingleBlock(&stream, layout, out_data, block_size,
+                                 (size_t)(out_end - out_data) - block_size,
+                                 HZR_FALSE, &tree, NULL, NULL);
+    } else {
+      if (!block_buf) {
+        block_buf = (uint8_t*)malloc(layout->block_size);
+        if (UNLIKELY(!block_buf)) {
+          DLOG("Out of memory.");
+          status = HZR_FAIL;
+          break;
+        }
+      }
+      status = DecodeSingleBlock(&stream, layout, block_buf, block_size,
+                                 layout->block_size - block_size, HZR_FALSE,
+                                 &tree, NULL, NULL);
+      if (status == HZR_OK) {
+        memcpy(out_data, &block_buf[copy_start], copy_end - copy_start);
+      }
+    }
+    if (status != HZR_OK) {
+      break;
+    }
+    out_data += copy_end - copy_start;
+  }
+
+  free(block_buf);
+  return status;
+}
+
+// Shared state for a multi-threaded decode job. If statistics are collected,
+// each thread has its own statistics.
+typedef struct {
+  const uint8_t* in;
+  size_t in_size;
+  uint8_t* out;
+  size_t out_size;
+  const size_t* block_offsets;
+  size_t in_padding;
+  size_t out_padding;
+  const BlockLayout* layout;
+  hzr_bool check_crc;
+  const hzr_table_t* table;
+  hzr_stats_t* stats;
+} DecodeJob;
+
+static hzr_status_t DecodeBlocksTask(void* context,
+                                     int thread_no,
+                                     size_t begin,
+                                     size_t end) {
+  DecodeJob* job = (DecodeJob*)context;
+  hzr_stats_t* stats = job->stats ? &job->stats[thread_no] : NULL;
+  const BlockLayout* layout = job->layout;
+  DecodeTree tree;
+  const size_t group_start = begin - (begin % HZR_TREE_REUSE_GROUP_SIZE);
+  if (PrepareTree(job->in, job->in_size, layout,
+                  &job->block_offsets[group_start], begin - group_start + 1,
+                  &tree) != HZR_OK) {
+    return HZR_FAIL;
+  }
+
+  // The output of the following blocks of this task is slack for the decoder,
+  // but the output of other tasks is not (it may be written concurrently).
+  const size_t task_out_end = hzr_min(job->out_size, end * layout->block_size);
+  const size_t task_slack =
+      (task_out_end == job->out_size) ? job->out_padding : 0;
+  for (size_t block = begin; block < end; ++block) {
+    StartTreeReuseGroup(&tree, block);
+    size_t out_offset = block * layout->block_size;
+    size_t this_block_size =
+        hzr_min(job->out_size - out_offset, layout->block_size);
+    size_t out_slack =
+        task_out_end - (out_offset + this_block_size) + task_slack;
+    size_t in_offset = job->block_offsets[block];
+    ReadStream stream;
+    InitReadStream(&stream, &job->in[in_offset], job->in_size - in_offset);
+    stream.read_end += job->in_padding;
+    hzr_status_t status =
+        DecodeSingleBlock(&stream, layout, &job->out[out_offset],
+                          this_block_size, out_slack, job->check_crc, &tree,
+                          job->table, stats);
+    if (status != HZR_OK) {
+      return status;
+    }
+  }
+  return HZR_OK;
+}
+
+// An output sink for decoded blocks: either a list of output segments that
+// the decoded data is scattered over (when on_block is NULL), or a block
+// callback. The segment cursor is the segment and the position in it where the
+// next block starts. Blocks that are not contained in a single segment, and
+// all the blocks for a callback, are decoded into the block buffer (which has
+// HZR_DECODE_PADDING bytes of slack).
+typedef struct {
+  const hzr_iovec_t* segments;
+  size_t num_segments;
+  size_t segment;
+  size_t segment_pos;
+  hzr_block_sink_t on_block;
+  void* user;
+  uint8_t* block_buf;
+  size_t block_buf_size;
+} BlockSink;
+
+static void InitBlockSink(BlockSink* sink) {
+  sink->segments = NULL;
+  sink->num_segments = 0;
+  sink->segment = 0;
+  sink->segment_pos = 0;
+  sink->on_block = NULL;
+  sink->user = NULL;
+  sink->block_buf = NULL;
+  sink->block_buf_size = 0;
+}
+
+// Get the memory that the next block should be decoded into, and the slack
+// after it. At most max_slack bytes after the block may be overwritten (i.e.
+// the decoded data that follows the block). Returns NULL on failure.
+static uint8_t* StartSinkBlock(BlockSink* sink,
+                               size_t size,
+                               size_t max_slack,
+                               size_t* slack) {
+  // Decode the block directly into the current segment if it fits.
+  if (!sink->on_block) {
+    while (sink->segment < sink->num_segments &&
+           sink->segment_pos == sink->segments[sink->segment].size) {
+      ++sink->segment;
+      sink->segment_pos = 0;
+    }
+    if (sink->segment < sink->num_segments) {
+      const hzr_iovec_t* segment = &sink->segments[sink->segment];
+      size_t left = segment->size - sink->segment_pos;
+      if (left >= size) {
+        *slack = hzr_min(left - size, max_slack);
+        return ((uint8_t*)segment->data) + sink->segment_pos;
+      }
+    }
+  }
+
+  // ...otherwise use the block buffer.
+  if (sink->block_buf_size < size) {
+    free(sink->block_buf);
+    sink->block_buf = (uint8_t*)malloc(size + HZR_DECODE_PADDING);
+    sink->block_buf_size = sink->block_buf ? size : 0;
+    if (UNLIKELY(!sink->block_buf)) {
+      DLOG("Out of memory.");
+      return NULL;
+    }
+  }
+  *slack = HZR_DECODE_PADDING;
+  return sink->block_buf;
+}
+
+// Deliver a decoded block (from StartSinkBlock()) to the sink.
+static hzr_status_t FinishSinkBlock(BlockSink* sink,
+                                    const uint8_t* data,
+                                    size_t size) {
+  if (sink->on_block) {
+    if (UNLIKELY(sink->on_block(data, size, sink->user) != HZR_OK)) {
+      DLOG("The block sink failed.");
+      return HZR_FAIL;
+    }
+    return HZR_OK;
+  }
+
+  // Scatter the block over the segments, unless it was decoded in place.
+  if (data != sink->block_buf) {
+    sink->segment_pos += size;
+    return HZR_OK;
+  }
+  while (size > 0) {
+    if (UNLIKELY(sink->segment >= sink->num_segments)) {
+      DLOG("Insufficient space in the output segments.");
+      return HZR_FAIL;
+    }
+    const hzr_iovec_t* segment = &sink->segments[sink->segment];
+    size_t count = hzr_min(segment->size - sink->segment_pos, size);
+    if (count > 0) {
+      memcpy(((uint8_t*)segment->data) + sink->segment_pos, data, count);
+    }
+    data += count;
+    size -= count;
+    sink->segment_pos += count;
+    if (sink->segment_pos == segment->size) {
+      ++sink->segment;
+      sink->segment_pos = 0;
+    }
+  }
+  return HZR_OK;
+}
+
+// Decode all the blocks in the calling thread. The stream must be positioned
+// at the first block. The out_padding bytes after the decoded data may be
+// overwritten. If a sink is given, the blocks are delivered to the sink instead
+// of the output buffer (and out is NULL). The blocks are counted in the
+// statistics (if any).
+static hzr_status_t DecodeBlocks(ReadStream* stream,
+                                 const uint8_t* in,
+                                 size_t in_size,
+                                 uint8_t* out,
+                                 BlockSink* sink,
+                                 size_t out_padding,
+                                 const MasterHeader* header,
+                                 hzr_bool check_crc,
+                                 DecodeTree* tree,
+                                 const hzr_table_t* table,
+                                 hzr_stats_t* stats) {
+  // Decompress the input data block by block.
+  const BlockLayout* layout = &header->layout;
+  const size_t end_block = header->end_block;
+  const size_t num_blocks = _hzr_num_blocks(layout, header->decoded_size);
+  size_t output_bytes_left = header->decoded_size;
+  for (size_t block = 0; output_bytes_left > 0; ++block) {
+    SkipEndMarker(stream, block, end_block);
+    StartTreeReuseGroup(tree, block);
+    size_t this_block_size = hzr_min(output_bytes_left, layout->block_size);
+    size_t out_slack = output_bytes_left - this_block_size + out_padding;
+    uint8_t* block_out = out;
+    if (sink) {
+      block_out = StartSinkBlock(sink, this_block_size,
+                                 output_bytes_left - this_block_size,
+                                 &out_slack);
+      if (UNLIKELY(!block_out)) {
+        return HZR_FAIL;
+      }
+    }
+    hzr_status_t status =
+        DecodeSingleBlock(stream, layout, block_out, this_block_size,
+                          out_slack, check_crc, tree, table, stats);
+    if (status != HZR_OK) {
+      return status;
+    }
+    if (sink) {
+      status = FinishSinkBlock(sink, block_out, this_block_size);
+      if (status != HZR_OK) {
+        return status;
+      }
+    } else {
+      out += this_block_size;
+    }
+    output_bytes_left -= this_block_size;
+  }
+  SkipEndMarker(stream, num_blocks, end_block);
+
+  // TODO: Better check!
+  if (UNLIKELY(!AtTheEnd(stream))) {
+    // The blocks may be followed by a block index.
+    const uint8_t* index = (end_block == kNoEndMarker)
+                               ? FindIndex(in, in_size, num_blocks)
+                               : NULL;
+    if (!index || (index != stream->byte_ptr)) {
+      DLOG("Decoder did not reach the end of the input buffer.");
+      return HZR_FAIL;
+    }
+  }
+
+  return HZR_OK;
+}
+
+// Decode all the blocks using several threads. The stream must be positioned
+// at the first block.
+static hzr_status_t DecodeBlocksMT(ReadStream* stream,
+                                   const uint8_t* in,
+                                   size_t in_size,
+                                   uint8_t* out,
+                                   const MasterHeader* header,
+                                   const hzr_decode_options_t* options) {
+  // Find the start of each block.
+  const BlockLayout* layout = &header->layout;
+  size_t num_blocks = _hzr_num_blocks(layout, header->decoded_size);
+  size_t* block_offsets = (size_t*)malloc(sizeof(size_t) * num_blocks);
+  if (UNLIKELY(!block_offsets)) {
+    DLOG("Out of memory.");
+    return HZR_FAIL;
+  }
+  hzr_status_t status =
+      FindBlockOffsets(stream, in, in_size, layout, num_blocks,
+                       header->end_block, block_offsets);
+  const size_t num_threads = (size_t)options->num_threads;
+  hzr_stats_t* stats =
+      options->stats ? (hzr_stats_t*)calloc(num_threads, sizeof(hzr_stats_t))
+                     : NULL;
+  if (UNLIKELY(options->stats && !stats)) {
+    DLOG("Out of memory.");
+    status = HZR_FAIL;
+  }
+
+  // Decode all the blocks in parallel.
+  if (status == HZR_OK) {
+    DecodeJob job;
+    job.in = in;
+    job.in_size = in_size;
+    job.out = out;
+    job.out_size = header->decoded_size;
+    job.in_padding = options->in_padding;
+    job.out_padding = options->out_padding;
+    job.block_offsets = block_offsets;
+    job.layout = layout;
+    job.check_crc = options->check_crc ? HZR_TRUE : HZR_FALSE;
+    job.table = options->table;
+    job.stats = stats;
+    status = _hzr_parallel_for(DecodeBlocksTask, &job, num_blocks,
+                               options->num_threads);
+  }
+
+  if (stats) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      _hzr_stats_add(options->stats, &stats[i]);
+    }
+  }
+  free(stats);
+  free(block_offsets);
+  return status;
+}
+
+void hzr_init_decode_options(hzr_decode_options_t* options) {
+  options->num_threads = 1;
+  options->check_crc = 0;
+  options->table = NULL;
+  options->out_padding = 0;
+  options->in_padding = 0;
+  options->stats = NULL;
+}
+
+hzr_status_t hzr_decode(const void* in,
+                        size_t in_size,
+                        void* out,
+                        size_t out_size) {
+  return hzr_decode_ex(in, in_size, out, out_size, NULL);
+}
+
+hzr_status_t hzr_decode_mt(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           int num_threads) {
+  hzr_decode_options_t options;
+  hzr_init_decode_options(&options);
+  options.num_threads = num_threads;
+  return hzr_decode_ex(in, in_size, out, out_size, &options);
+}
+
+// Decode a buffer into an output buffer, or to a sink (out is NULL, and
+// out_size is the capacity of the sink). Decoding to a sink is single threaded.
+// The tree is used by the single threaded decoder. If decoded_size is not NULL,
+// the size of the decoded data is stored in it.
+static hzr_status_t Decode(const void* in,
+                           size_t in_size,
+                           void* out,
+                           BlockSink* sink,
+                           size_t out_size,
+                           const hzr_decode_options_t* options,
+                           DecodeTree* tree,
+                           size_t* decoded_size) {
+  // Check input parameters.
+  if (!in || (!out && !sink)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  // Use the default options if none were given.
+  hzr_decode_options_t default_options;
+  if (!options) {
+    hzr_init_decode_options(&default_options);
+    options = &default_options;
   }
 
   // To little input data?
@@ -638,37 +2449,799 @@ hzr_status_t hzr_decode(const void* in,
     return HZR_FAIL;
   }
 
-  // Read the header.
+  // Read the header. The fast decoding loops may read the padding after the
+  // input buffer.
   ReadStream stream;
   InitReadStream(&stream, in, in_size);
-  size_t actual_out_size = (size_t)ReadBitsChecked(&stream, 32);
-  if (stream.read_failed) {
-    DLOG("Unable to read the header.");
+  stream.read_end += options->in_padding;
+  MasterHeader header;
+  if (ReadMasterHeader(&stream, &header) != HZR_OK) {
     return HZR_FAIL;
   }
-  if (out_size < actual_out_size) {
+  if (out_size < header.decoded_size) {
     DLOG("Insufficient space in the output buffer.");
     return HZR_FAIL;
   }
+  if (decoded_size) {
+    *decoded_size = header.decoded_size;
+  }
 
-  // Decompress the input data block by block.
-  uint8_t* out_data = (uint8_t*)out;
-  size_t output_bytes_left = actual_out_size;
-  while (output_bytes_left > 0) {
-    size_t this_block_size = hzr_min(output_bytes_left, HZR_MAX_BLOCK_SIZE);
-    hzr_status_t status = DecodeSingleBlock(&stream, out_data, this_block_size);
+  // Only use several threads if there is enough work for them.
+  if (options->num_threads > 1 && !sink &&
+      _hzr_num_blocks(&header.layout, header.decoded_size) > 1) {
+    return DecodeBlocksMT(&stream, (const uint8_t*)in, in_size, (uint8_t*)out,
+                          &header, options);
+  }
+  return DecodeBlocks(&stream, (const uint8_t*)in, in_size, (uint8_t*)out,
+                      sink, options->out_padding, &header,
+                      options->check_crc ? HZR_TRUE : HZR_FALSE, tree,
+                      options->table, options->stats);
+}
+
+hzr_status_t hzr_decode_ex(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           const hzr_decode_options_t* options) {
+  DecodeTree tree;
+  return Decode(in, in_size, out, NULL, out_size, options, &tree, NULL);
+}
+
+hzr_status_t hzr_decode_ws(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           const hzr_decode_options_t* options,
+                           hzr_workspace_t* workspace) {
+  if (UNLIKELY(!workspace)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+  return Decode(in, in_size, out, NULL, out_size, options,
+                (DecodeTree*)workspace->decode_scratch, NULL);
+}
+
+hzr_status_t hzr_decode_iov(const void* in,
+                            size_t in_size,
+                            const hzr_iovec_t* out,
+                            size_t out_count,
+                            const hzr_decode_options_t* options) {
+  // Check input arguments, and get the total output size.
+  if (UNLIKELY(!out && out_count > 0)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+  size_t out_size = 0;
+  for (size_t i = 0; i < out_count; ++i) {
+    if (UNLIKELY(!out[i].data && out[i].size > 0)) {
+      DLOG("Invalid output segment.");
+      return HZR_FAIL;
+    }
+    out_size += hzr_min(out[i].size, SIZE_MAX - out_size);
+  }
+
+  BlockSink sink;
+  InitBlockSink(&sink);
+  sink.segments = out;
+  sink.num_segments = out_count;
+  DecodeTree tree;
+  hzr_status_t status =
+      Decode(in, in_size, NULL, &sink, out_size, options, &tree, NULL);
+  free(sink.block_buf);
+  return status;
+}
+
+hzr_status_t hzr_decode_sink(const void* in,
+                             size_t in_size,
+                             hzr_block_sink_t on_block,
+                             void* user,
+                             const hzr_decode_options_t* options) {
+  if (UNLIKELY(!on_block)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  BlockSink sink;
+  InitBlockSink(&sink);
+  sink.on_block = on_block;
+  sink.user = user;
+  DecodeTree tree;
+  hzr_status_t status =
+      Decode(in, in_size, NULL, &sink, SIZE_MAX, options, &tree, NULL);
+  free(sink.block_buf);
+  return status;
+}
+
+// State of a batch decoding job. If statistics are collected, each thread has
+// its own statistics.
+typedef struct {
+  hzr_batch_item_t* items;
+  DecodeTree* tree;
+  hzr_stats_t* stats;
+  const hzr_decode_options_t* options;
+} DecodeBatchJob;
+
+static hzr_status_t DecodeBatchTask(void* context,
+                                    int thread_no,
+                                    size_t begin,
+                                    size_t end) {
+  DecodeBatchJob* job = (DecodeBatchJob*)context;
+
+  // The calling thread uses the tree of the workspace.
+  DecodeTree own_tree;
+  DecodeTree* tree = (thread_no == 0) ? job->tree : &own_tree;
+  hzr_decode_options_t options = *job->options;
+  if (job->stats) {
+    options.stats = &job->stats[thread_no];
+  }
+  for (size_t i = begin; i < end; ++i) {
+    // A failing item does not stop the other items from being decoded.
+    hzr_batch_item_t* item = &job->items[i];
+    item->result_size = 0;
+    item->status = Decode(item->in, item->in_size, item->out, NULL,
+                          item->out_size, &options, tree, &item->result_size);
+  }
+  return HZR_OK;
+}
+
+hzr_status_t hzr_decode_batch(hzr_batch_item_t* items,
+                              size_t num_items,
+                              const hzr_decode_options_t* options,
+                              hzr_workspace_t* workspace) {
+  if (UNLIKELY((!items && num_items > 0) || !workspace)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  // Each item is decoded by a single thread.
+  hzr_decode_options_t item_options;
+  if (options) {
+    item_options = *options;
+  } else {
+    hzr_init_decode_options(&item_options);
+  }
+  const int num_threads = hzr_max(item_options.num_threads, 1);
+  item_options.num_threads = 1;
+  hzr_stats_t* stats =
+      item_options.stats
+          ? (hzr_stats_t*)calloc((size_t)num_threads, sizeof(hzr_stats_t))
+          : NULL;
+  if (UNLIKELY(item_options.stats && !stats)) {
+    DLOG("Out of memory.");
+    return HZR_FAIL;
+  }
+
+  DecodeBatchJob job;
+  job.items = items;
+  job.tree = (DecodeTree*)workspace->decode_scratch;
+  job.stats = stats;
+  job.options = &item_options;
+  hzr_status_t status =
+      _hzr_parallel_for(DecodeBatchTask, &job, num_items, num_threads);
+  for (size_t i = 0; status == HZR_OK && i < num_items; ++i) {
+    if (items[i].status != HZR_OK) {
+      status = HZR_FAIL;
+    }
+  }
+
+  if (stats) {
+    for (int i = 0; i < num_threads; ++i) {
+      _hzr_stats_add(item_options.stats, &stats[i]);
+    }
+  }
+  free(stats);
+  return status;
+}
+
+// State of a streaming decoder.
+struct hzr_decoder_struct {
+  DecodeTree* tree;
+  BlockLayout layout;
+
+  // Buffered input (a master header, a block or an end marker).
+  uint8_t* in_buf;
+  size_t in_fill;
+
+  // Decoded data that has not been delivered yet.
+  uint8_t* out_buf;
+  size_t out_pos;
+  size_t out_len;
+
+  hzr_bool header_read;
+  hzr_bool size_known;
+  hzr_bool done;
+  uint64_t decoded_size;
+  uint64_t decoded_so_far;
+};
+
+hzr_decoder_t* hzr_decoder_create(void) {
+  hzr_decoder_t* decoder = (hzr_decoder_t*)malloc(sizeof(hzr_decoder_t));
+  if (UNLIKELY(!decoder)) {
+    DLOG("Out of memory.");
+    return NULL;
+  }
+  _hzr_init_block_layout(&decoder->layout, HZR_DEFAULT_BLOCK_SIZE_LOG2);
+  decoder->tree = (DecodeTree*)_hzr_aligned_alloc(sizeof(DecodeTree));
+  decoder->in_buf =
+      (uint8_t*)malloc(decoder->layout.header_size + HZR_DEFAULT_BLOCK_SIZE);
+  decoder->out_buf = (uint8_t*)malloc(HZR_DEFAULT_BLOCK_SIZE);
+  if (UNLIKELY(!decoder->tree || !decoder->in_buf || !decoder->out_buf)) {
+    DLOG("Out of memory.");
+    hzr_decoder_destroy(decoder);
+    return NULL;
+  }
+  decoder->in_fill = 0;
+  decoder->out_pos = 0;
+  decoder->out_len = 0;
+  decoder->header_read = HZR_FALSE;
+  decoder->size_known = HZR_FALSE;
+  decoder->done = HZR_FALSE;
+  decoder->decoded_size = 0;
+  decoder->decoded_so_far = 0;
+  return decoder;
+}
+
+void hzr_decoder_destroy(hzr_decoder_t* decoder) {
+  if (decoder) {
+    _hzr_aligned_free(decoder->tree);
+    free(decoder->in_buf);
+    free(decoder->out_buf);
+    free(decoder);
+  }
+}
+
+// Get the number of bytes that are needed to tell the size of the next unit
+// of input data.
+static size_t UnitSizeBytes(const hzr_decoder_t* decoder) {
+  return decoder->header_read ? (size_t)(decoder->layout.size_bits / 8) : 0;
+}
+
+// Get the size of the next unit of input data (the master header, a block or
+// an end marker), or zero if more data is needed to tell.
+static size_t NextUnitSize(const hzr_decoder_t* decoder,
+                           const uint8_t* data,
+                           size_t size) {
+  if (!decoder->header_read) {
+    return HZR_HEADER_SIZE;
+  }
+  const size_t size_bytes = UnitSizeBytes(decoder);
+  if (size < size_bytes) {
+    return 0;
+  }
+  size_t encoded_size = 0;
+  for (size_t i = 0; i < size_bytes; ++i) {
+    encoded_size |= ((size_t)data[i]) << (8 * i);
+  }
+  return decoder->layout.header_size + encoded_size + 1;
+}
+
+// Switch the decoder to the block layout of an extended header.
+static hzr_status_t SetLayout(hzr_decoder_t* decoder,
+                              const BlockLayout* layout) {
+  if (layout->block_size > decoder->layout.block_size) {
+    uint8_t* in_buf = (uint8_t*)realloc(
+        decoder->in_buf, layout->header_size + layout->block_size);
+    if (in_buf) {
+      decoder->in_buf = in_buf;
+    }
+    uint8_t* out_buf = (uint8_t*)realloc(decoder->out_buf, layout->block_size);
+    if (out_buf) {
+      decoder->out_buf = out_buf;
+    }
+    if (UNLIKELY(!in_buf || !out_buf)) {
+      DLOG("Out of memory.");
+      return HZR_FAIL;
+    }
+  }
+  decoder->layout = *layout;
+  return HZR_OK;
+}
+
+// Check if a unit of input data is a block. The unit must hold at least a
+// block header.
+static hzr_bool IsBlockUnit(const hzr_decoder_t* decoder, const uint8_t* unit) {
+  // Data with wide block headers has no extended header or end marker.
+  if (!decoder->header_read) {
+    return HZR_FALSE;
+  }
+  if (decoder->layout.header_size != HZR_BLOCK_HEADER_SIZE) {
+    return HZR_TRUE;
+  }
+  return ((unit[6] != HZR_ENCODING_HEADER) && (unit[6] != HZR_ENCODING_END))
+             ? HZR_TRUE
+             : HZR_FALSE;
+}
+
+// Get the decoded size of the next block.
+static size_t NextBlockSize(const hzr_decoder_t* decoder) {
+  size_t block_size = decoder->layout.block_size;
+  if (decoder->size_known) {
+    uint64_t bytes_left = decoder->decoded_size - decoder->decoded_so_far;
+    block_size = (size_t)hzr_min(bytes_left, (uint64_t)block_size);
+  }
+  return block_size;
+}
+
+// Count a decoded block of the given size.
+static void CountBlock(hzr_decoder_t* decoder, size_t block_size) {
+  decoder->decoded_so_far += block_size;
+  if (decoder->size_known &&
+      (decoder->decoded_so_far == decoder->decoded_size)) {
+    decoder->done = HZR_TRUE;
+  }
+}
+
+// Process a complete unit of input data that is not a block (the master
+// header, the extended header or the end marker).
+static hzr_status_t ProcessInfoUnit(hzr_decoder_t* decoder,
+                                    const uint8_t* unit,
+                                    size_t unit_size) {
+  // The master header?
+  if (!decoder->header_read) {
+    uint32_t size = ReadLE32(unit);
+    decoder->header_read = HZR_TRUE;
+    if (size != HZR_SIZE_STREAMED) {
+      decoder->decoded_size = size;
+      decoder->size_known = HZR_TRUE;
+      decoder->done = (size == 0U) ? HZR_TRUE : HZR_FALSE;
+    }
+    return HZR_OK;
+  }
+
+  // The extended header? It may only follow the master header.
+  ReadStream stream;
+  InitReadStream(&stream, unit, unit_size);
+  if (unit[6] == HZR_ENCODING_HEADER) {
+    uint64_t size;
+    unsigned flags;
+    BlockLayout layout;
+    if (UNLIKELY(decoder->size_known || decoder->decoded_so_far > 0)) {
+      DLOG("Unexpected extended header.");
+      return HZR_FAIL;
+    }
+    if ((ReadExtendedHeader(&stream, &size, &flags, &layout) != HZR_OK) ||
+        (SetLayout(decoder, &layout) != HZR_OK)) {
+      return HZR_FAIL;
+    }
+    decoder->decoded_size = size;
+    decoder->size_known = HZR_TRUE;
+    decoder->done = (size == 0U) ? HZR_TRUE : HZR_FALSE;
+    return HZR_OK;
+  }
+
+  // The end marker.
+  uint64_t size;
+  if (UNLIKELY(decoder->size_known)) {
+    DLOG("Unexpected end marker.");
+    return HZR_FAIL;
+  }
+  if (ReadEndMarker(&stream, &size) != HZR_OK) {
+    return HZR_FAIL;
+  }
+  if (UNLIKELY((size < decoder->decoded_so_far) ||
+               (size - decoder->decoded_so_far >=
+                decoder->layout.block_size))) {
+    DLOG("The end marker does not match the number of blocks.");
+    return HZR_FAIL;
+  }
+  decoder->decoded_size = size;
+  decoder->size_known = HZR_TRUE;
+  decoder->done = (size == decoder->decoded_so_far) ? HZR_TRUE : HZR_FALSE;
+  return HZR_OK;
+}
+
+// Process a complete unit of input data. Decoded data is written to out if it
+// fits, otherwise it is written to the output buffer of the decoder.
+static hzr_status_t ProcessUnit(hzr_decoder_t* decoder,
+                                const uint8_t* unit,
+                                size_t unit_size,
+                                uint8_t* out,
+                                size_t out_size,
+                                size_t* out_written) {
+  *out_written = 0;
+  if (!IsBlockUnit(decoder, unit)) {
+    return ProcessInfoUnit(decoder, unit, unit_size);
+  }
+
+  // Decode the block. The stream has not been verified, so we check the CRC.
+  ReadStream stream;
+  InitReadStream(&stream, unit, unit_size);
+  size_t block_size = NextBlockSize(decoder);
+  uint8_t* block_out = (out_size >= block_size) ? out : decoder->out_buf;
+  StartTreeReuseGroup(decoder->tree,
+                      (size_t)(decoder->decoded_so_far >>
+                               decoder->layout.block_size_log2));
+  size_t out_slack = (block_out == out)
+                         ? out_size - block_size
+                         : decoder->layout.block_size - block_size;
+  if (DecodeSingleBlock(&stream, &decoder->layout, block_out, block_size,
+                        out_slack, HZR_TRUE, decoder->tree, NULL,
+                        NULL) != HZR_OK) {
+    return HZR_FAIL;
+  }
+  if (block_out == out) {
+    *out_written = block_size;
+  } else {
+    decoder->out_pos = 0;
+    decoder->out_len = block_size;
+  }
+  CountBlock(decoder, block_size);
+  return HZR_OK;
+}
+
+hzr_status_t hzr_decode_update(hzr_decoder_t* decoder,
+                               const void* in,
+                               size_t in_size,
+                               size_t* in_consumed,
+                               void* out,
+                               size_t out_size,
+                               size_t* out_written) {
+  // Check input parameters.
+  if (UNLIKELY(!decoder || (!in && in_size > 0) || (!out && out_size > 0) ||
+               !in_consumed || !out_written)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  const uint8_t* in_ptr = (const uint8_t*)in;
+  const uint8_t* in_end = (in_size > 0) ? in_ptr + in_size : in_ptr;
+  uint8_t* out_ptr = (uint8_t*)out;
+  uint8_t* out_end = (out_size > 0) ? out_ptr + out_size : out_ptr;
+  hzr_status_t status = HZR_OK;
+  for (;;) {
+    // Deliver pending decoded data.
+    size_t count = hzr_min(decoder->out_len - decoder->out_pos,
+                           (size_t)(out_end - out_ptr));
+    if (count > 0) {
+      memcpy(out_ptr, &decoder->out_buf[decoder->out_pos], count);
+      decoder->out_pos += count;
+      out_ptr += count;
+    }
+    if ((decoder->out_pos < decoder->out_len) || decoder->done) {
+      break;
+    }
+
+    // Get the next complete unit of input data. Use the input data directly if
+    // possible, otherwise collect the unit in the input buffer.
+    const uint8_t* unit = NULL;
+    size_t unit_size = 0;
+    if (decoder->in_fill == 0) {
+      unit_size = NextUnitSize(decoder, in_ptr, (size_t)(in_end - in_ptr));
+      if ((unit_size > 0) && (unit_size <= (size_t)(in_end - in_ptr))) {
+        unit = in_ptr;
+        in_ptr += unit_size;
+      }
+    }
+    if (!unit) {
+      unit_size = NextUnitSize(decoder, decoder->in_buf, decoder->in_fill);
+      if (unit_size == 0) {
+        count = hzr_min(UnitSizeBytes(decoder) - decoder->in_fill,
+                        (size_t)(in_end - in_ptr));
+        if (count > 0) {
+          memcpy(&decoder->in_buf[decoder->in_fill], in_ptr, count);
+        }
+        decoder->in_fill += count;
+        in_ptr += count;
+        unit_size = NextUnitSize(decoder, decoder->in_buf, decoder->in_fill);
+        if (unit_size == 0) {
+          break;
+        }
+      }
+      if (UNLIKELY(unit_size >
+                   decoder->layout.header_size + decoder->layout.block_size)) {
+        DLOG("Invalid block size.");
+        status = HZR_FAIL;
+        break;
+      }
+      count = hzr_min(unit_size - decoder->in_fill, (size_t)(in_end - in_ptr));
+      if (count > 0) {
+        memcpy(&decoder->in_buf[decoder->in_fill], in_ptr, count);
+      }
+      decoder->in_fill += count;
+      in_ptr += count;
+      if (decoder->in_fill < unit_size) {
+        break;
+      }
+      unit = decoder->in_buf;
+      decoder->in_fill = 0;
+    }
+
+    // Process the unit.
+    size_t unit_out_size;
+    status = ProcessUnit(decoder, unit, unit_size, out_ptr,
+                         (size_t)(out_end - out_ptr), &unit_out_size);
     if (status != HZR_OK) {
-      return status;
+      break;
     }
-    out_data += this_block_size;
-    output_bytes_left -= this_block_size;
+    out_ptr += unit_out_size;
   }
 
-  // TODO: Better check!
-  if (UNLIKELY(!AtTheEnd(&stream))) {
-    DLOG("Decoder did not reach the end of the input buffer.");
+  *in_consumed = (size_t)(in_ptr - (const uint8_t*)in);
+  *out_written = (size_t)(out_ptr - (uint8_t*)out);
+  return status;
+}
+
+hzr_status_t hzr_decode_finish(const hzr_decoder_t* decoder) {
+  if (UNLIKELY(!decoder)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+  return (decoder->done && (decoder->out_pos == decoder->out_len)) ? HZR_OK
+                                                                    : HZR_FAIL;
+}
+
+// A work item of a pipelined decoder: a run of blocks that can be decoded
+// independently of the other items. An item starts with a block that has its
+// own tree or that starts a tree reuse group, so no item needs the tree of
+// another item.
+typedef struct {
+  uint8_t* in;
+  uint8_t* out;
+  size_t out_size;
+  size_t first_block;
+  size_t num_blocks;
+  size_t unit_sizes[HZR_TREE_REUSE_GROUP_SIZE];
+  size_t block_sizes[HZR_TREE_REUSE_GROUP_SIZE];
+} DecodePipelineItem;
+
+// Shared state of a pipelined decoder. The producer parses the stream with a
+// streaming decoder (without decoding any blocks). The block header that
+// starts the next item is pending in the input buffer of the decoder.
+typedef struct {
+  hzr_source_t source;
+  void* source_user;
+  hzr_block_sink_t sink;
+  void* sink_user;
+  const hzr_decode_options_t* options;
+  hzr_decoder_t* decoder;
+  hzr_bool pending;
+  size_t in_capacity;
+  size_t out_capacity;
+  DecodeTree** trees;
+  hzr_stats_t* stats;
+} DecodePipeline;
+
+// Read exactly size bytes from the source of a pipeline.
+static hzr_status_t ReadPipelineInput(DecodePipeline* pipeline,
+                                      uint8_t* buf,
+                                      size_t size) {
+  size_t read_size;
+  if (_hzr_read_source(pipeline->source, pipeline->source_user, buf, size,
+                       &read_size) != HZR_OK) {
     return HZR_FAIL;
   }
+  if (UNLIKELY(read_size < size)) {
+    DLOG("Input data ended prematurely.");
+    return HZR_FAIL;
+  }
+  return HZR_OK;
+}
+
+// Read units of input data until the header of a block is pending, or the end
+// of the encoded data is reached.
+static hzr_status_t ReadNextBlockHeader(DecodePipeline* pipeline) {
+  hzr_decoder_t* decoder = pipeline->decoder;
+  while (!pipeline->pending && !decoder->done) {
+    // A unit is never smaller than a block header (or the master header).
+    size_t header_size =
+        decoder->header_read ? decoder->layout.header_size : HZR_HEADER_SIZE;
+    if (ReadPipelineInput(pipeline, decoder->in_buf, header_size) != HZR_OK) {
+      return HZR_FAIL;
+    }
+    if (IsBlockUnit(decoder, decoder->in_buf)) {
+      pipeline->pending = HZR_TRUE;
+      break;
+    }
+    size_t unit_size = NextUnitSize(decoder, decoder->in_buf, header_size);
+    if (UNLIKELY(unit_size >
+                 decoder->layout.header_size + decoder->layout.block_size)) {
+      DLOG("Invalid block size.");
+      return HZR_FAIL;
+    }
+    if ((ReadPipelineInput(pipeline, &decoder->in_buf[header_size],
+                           unit_size - header_size) != HZR_OK) ||
+        (ProcessInfoUnit(decoder, decoder->in_buf, unit_size) != HZR_OK)) {
+      return HZR_FAIL;
+    }
+  }
+  return HZR_OK;
+}
+
+static hzr_status_t ProduceDecodeItem(void* context,
+                                      void* item_ptr,
+                                      hzr_bool* done) {
+  DecodePipeline* pipeline = (DecodePipeline*)context;
+  DecodePipelineItem* item = (DecodePipelineItem*)item_ptr;
+  hzr_decoder_t* decoder = pipeline->decoder;
+  const BlockLayout* layout = &decoder->layout;
+  item->out_size = 0;
+  item->first_block = (size_t)(decoder->decoded_so_far >>
+                               layout->block_size_log2);
+  item->num_blocks = 0;
+  size_t in_size = 0;
+  for (;;) {
+    if (ReadNextBlockHeader(pipeline) != HZR_OK) {
+      return HZR_FAIL;
+    }
+    if (!pipeline->pending) {
+      break;
+    }
+
+    // Does the pending block start a new item?
+    const size_t block = item->first_block + item->num_blocks;
+    const int encoding_mode =
+        (int)(decoder->in_buf[layout->header_size - 1] & HZR_ENCODING_MASK);
+    if ((item->num_blocks > 0) &&
+        (((block % HZR_TREE_REUSE_GROUP_SIZE) == 0) ||
+         HasOwnTree(encoding_mode))) {
+      break;
+    }
+
+    // Read the rest of the block.
+    size_t unit_size =
+        NextUnitSize(decoder, decoder->in_buf, layout->header_size);
+    if (UNLIKELY(unit_size > layout->header_size + layout->block_size)) {
+      DLOG("Invalid block size.");
+      return HZR_FAIL;
+    }
+    memcpy(&item->in[in_size], decoder->in_buf, layout->header_size);
+    if (ReadPipelineInput(pipeline, &item->in[in_size + layout->header_size],
+                          unit_size - layout->header_size) != HZR_OK) {
+      return HZR_FAIL;
+    }
+    pipeline->pending = HZR_FALSE;
+    const size_t block_size = NextBlockSize(decoder);
+    item->unit_sizes[item->num_blocks] = unit_size;
+    item->block_sizes[item->num_blocks] = block_size;
+    item->num_blocks++;
+    item->out_size += block_size;
+    in_size += unit_size;
+    CountBlock(decoder, block_size);
+  }
+  *done = (item->num_blocks == 0) ? HZR_TRUE : HZR_FALSE;
+  return HZR_OK;
+}
 
+static hzr_status_t ProcessDecodeItem(void* context,
+                                      int thread_no,
+                                      void* item_ptr) {
+  DecodePipeline* pipeline = (DecodePipeline*)context;
+  DecodePipelineItem* item = (DecodePipelineItem*)item_ptr;
+  DecodeTree* tree = pipeline->trees[thread_no];
+  hzr_stats_t* stats = pipeline->stats ? &pipeline->stats[thread_no] : NULL;
+
+  // The buffers of the item have HZR_DECODE_PADDING bytes of slack.
+  const uint8_t* in = item->in;
+  uint8_t* out = item->out;
+  uint8_t* out_end = item->out + pipeline->out_capacity;
+  for (size_t i = 0; i < item->num_blocks; ++i) {
+    StartTreeReuseGroup(tree, item->first_block + i);
+    ReadStream stream;
+    InitReadStream(&stream, in, item->unit_sizes[i]);
+    stream.read_end = item->in + pipeline->in_capacity;
+    const size_t block_size = item->block_sizes[i];
+    if (DecodeSingleBlock(&stream, &pipeline->decoder->layout, out,
+                          block_size, (size_t)(out_end - out) - block_size,
+                          HZR_TRUE, tree, pipeline->options->table,
+                          stats) != HZR_OK) {
+      return HZR_FAIL;
+    }
+    in += item->unit_sizes[i];
+    out += block_size;
+  }
   return HZR_OK;
 }
+
+static hzr_status_t ConsumeDecodeItem(void* context, void* item_ptr) {
+  DecodePipeline* pipeline = (DecodePipeline*)context;
+  DecodePipelineItem* item = (DecodePipelineItem*)item_ptr;
+  return pipeline->sink(item->out, item->out_size, pipeline->sink_user);
+}
+
+hzr_status_t hzr_decode_pipeline(hzr_source_t source,
+                                 void* source_user,
+                                 hzr_block_sink_t sink,
+                                 void* sink_user,
+                                 const hzr_decode_options_t* options) {
+  if (UNLIKELY(!source || !sink)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  // Use the default options if none were given.
+  hzr_decode_options_t default_options;
+  if (!options) {
+    hzr_init_decode_options(&default_options);
+    options = &default_options;
+  }
+
+  DecodePipeline pipeline;
+  pipeline.source = source;
+  pipeline.source_user = source_user;
+  pipeline.sink = sink;
+  pipeline.sink_user = sink_user;
+  pipeline.options = options;
+  pipeline.decoder = hzr_decoder_create();
+  pipeline.pending = HZR_FALSE;
+  if (UNLIKELY(!pipeline.decoder)) {
+    return HZR_FAIL;
+  }
+
+  // Read the headers, so that we know the block layout before we allocate the
+  // items.
+  hzr_status_t status = ReadNextBlockHeader(&pipeline);
+  if ((status != HZR_OK) || !pipeline.pending) {
+    hzr_decoder_destroy(pipeline.decoder);
+    return status;
+  }
+  const BlockLayout* layout = &pipeline.decoder->layout;
+  pipeline.in_capacity =
+      HZR_TREE_REUSE_GROUP_SIZE * (layout->header_size + layout->block_size) +
+      HZR_DECODE_PADDING;
+  pipeline.out_capacity =
+      HZR_TREE_REUSE_GROUP_SIZE * layout->block_size + HZR_DECODE_PADDING;
+
+  // Allocate the decoding trees of the workers, and the items.
+  const size_t num_threads = (size_t)hzr_max(options->num_threads, 1);
+  const size_t num_slots = num_threads * HZR_PIPELINE_SLOTS_PER_THREAD;
+  pipeline.trees = (DecodeTree**)calloc(num_threads, sizeof(DecodeTree*));
+  pipeline.stats = options->stats
+                       ? (hzr_stats_t*)calloc(num_threads, sizeof(hzr_stats_t))
+                       : NULL;
+  DecodePipelineItem* items =
+      (DecodePipelineItem*)calloc(num_slots, sizeof(DecodePipelineItem));
+  void** slots = (void**)malloc(sizeof(void*) * num_slots);
+  status = (pipeline.trees && items && slots &&
+            (pipeline.stats || !options->stats))
+               ? HZR_OK
+               : HZR_FAIL;
+  for (size_t i = 0; status == HZR_OK && i < num_threads; ++i) {
+    pipeline.trees[i] = (DecodeTree*)_hzr_aligned_alloc(sizeof(DecodeTree));
+    if (UNLIKELY(!pipeline.trees[i])) {
+      status = HZR_FAIL;
+    }
+  }
+  for (size_t i = 0; status == HZR_OK && i < num_slots; ++i) {
+    items[i].in = (uint8_t*)malloc(pipeline.in_capacity);
+    items[i].out = (uint8_t*)malloc(pipeline.out_capacity);
+    slots[i] = &items[i];
+    if (UNLIKELY(!items[i].in || !items[i].out)) {
+      status = HZR_FAIL;
+    }
+  }
+
+  if (status == HZR_OK) {
+    status = _hzr_pipeline(ProduceDecodeItem, ProcessDecodeItem,
+                           ConsumeDecodeItem, &pipeline, slots, num_slots,
+                           (int)num_threads);
+  } else {
+    DLOG("Out of memory.");
+  }
+  if (UNLIKELY(status == HZR_OK && !pipeline.decoder->done)) {
+    DLOG("Input data ended prematurely.");
+    status = HZR_FAIL;
+  }
+
+  if (items) {
+    for (size_t i = 0; i < num_slots; ++i) {
+      free(items[i].in);
+      free(items[i].out);
+    }
+  }
+  if (pipeline.trees) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      _hzr_aligned_free(pipeline.trees[i]);
+    }
+  }
+  if (pipeline.stats) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      _hzr_stats_add(options->stats, &pipeline.stats[i]);
+    }
+  }
+  free(pipeline.stats);
+  free(pipeline.trees);
+  free(items);
+  free(slots);
+  hzr_decoder_destroy(pipeline.decoder);
+  return status;
+}
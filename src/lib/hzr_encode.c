@@ -23,18 +23,26 @@
 #include "libhzr.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "hzr_crc32c.h"
 #include "hzr_internal.h"
-
-// A helper for decoding binary data.
+#include "hzr_runs.h"
+#include "hzr_stats.h"
+#include "hzr_table.h"
+#include "hzr_thread.h"
+#include "hzr_workspace.h"
+
+// A helper for encoding binary data.
+// The bit cache holds bit_pos bits that have not yet been written to the
+// stream.
 typedef struct {
   uint8_t* byte_ptr;
   uint8_t* end_ptr;
   int bit_pos;
-  uint32_t bit_cache;
-  hzr_bool write_failed;  // TODO(m): Implement buffer overflow checking!
+  uint64_t bit_cache;
+  hzr_bool write_failed;
 } WriteStream;
 
 // Initialize a bitstream.
@@ -59,63 +67,90 @@ FORCE_INLINE static uint8_t* GetBytePtr(WriteStream* stream) {
   return stream->byte_ptr + (stream->bit_pos >> 3);
 }
 
-// Write the bit cache to the write stream if necessary.
+// Write all the complete bytes of the bit cache to the write stream. After a
+// flush, the bit cache has room for at least 56 more bits.
+// Note: Unless we are close to the end of the buffer, this writes eight bytes
+// to the stream (the bytes after the complete bytes are overwritten later).
 FORCE_INLINE static void FlushBitCache(WriteStream* stream) {
-  while (stream->bit_pos >= 8) {
-    if (UNLIKELY(stream->byte_ptr >= stream->end_ptr)) {
+  int bytes = stream->bit_pos >> 3;
+  if (LIKELY(stream->end_ptr - stream->byte_ptr >= 8)) {
+    _hzr_store64le(stream->byte_ptr, stream->bit_cache);
+  } else {
+    if (UNLIKELY(stream->end_ptr - stream->byte_ptr < bytes)) {
+      // Drop the bits, so that it is safe to keep writing to the stream.
       stream->write_failed = HZR_TRUE;
+      stream->bit_cache = 0U;
+      stream->bit_pos = 0;
       return;
     }
-    *stream->byte_ptr = (uint8_t)stream->bit_cache;
-    stream->bit_cache >>= 8;
-    stream->bit_pos -= 8;
-    stream->byte_ptr++;
+    for (int i = 0; i < bytes; ++i) {
+      stream->byte_ptr[i] = (uint8_t)(stream->bit_cache >> (8 * i));
+    }
   }
+  stream->byte_ptr += bytes;
+  stream->bit_cache >>= 8 * bytes;
+  stream->bit_pos &= 7;
 }
 
 // Write the bit cache to the write stream - includig incomplete words.
 static void ForceFlushBitCache(WriteStream* stream) {
   FlushBitCache(stream);
-  if (stream->bit_pos > 0) {
+  if (stream->bit_pos > 0 && !stream->write_failed) {
     if (UNLIKELY(stream->byte_ptr >= stream->end_ptr)) {
       stream->write_failed = HZR_TRUE;
       return;
     }
-    *stream->byte_ptr =
-        (uint8_t)(stream->bit_cache & (0xff >> (8 - stream->bit_pos)));
+    *stream->byte_ptr = (uint8_t)stream->bit_cache;
     stream->bit_cache = 0U;
     stream->bit_pos = 0;
     stream->byte_ptr++;
   }
 }
 
+// Append bits to the bit cache, without flushing it.
+// NOTE: All unused bits of the input argument x must be zero, and the bits
+// must fit in the bit cache (use FlushBitCache() to make room).
+FORCE_INLINE static void AppendBits(WriteStream* stream, uint32_t x, int bits) {
+  ASSERT(bits <= 32);
+  ASSERT(stream->bit_pos + bits < 64);
+  stream->bit_cache |= ((uint64_t)x) << stream->bit_pos;
+  stream->bit_pos += bits;
+}
+
 // Write bits to a bitstream.
 // NOTE: All unused bits of the input argument x must be zero.
 FORCE_INLINE static void WriteBits(WriteStream* stream, uint32_t x, int bits) {
-  ASSERT(bits <= 32);
-  ASSERT(stream->bit_pos < 32);
-
-  int bits_to_write = hzr_min(32 - stream->bit_pos, bits);
-  stream->bit_cache |= (x << stream->bit_pos);
-  stream->bit_pos += bits_to_write;
-  bits -= bits_to_write;
+  AppendBits(stream, x, bits);
   FlushBitCache(stream);
+}
 
-  // In the very unlikely case that we didn't write all the bits in the first
-  // pass, we have to do a second pass (the caller has to write *at least*
-  // 24 bits at once for this to ever happen).
-  if (UNLIKELY(bits > 0 && !stream->write_failed)) {
-    x >>= bits_to_write;
-    stream->bit_cache |= (x << stream->bit_pos);
-    stream->bit_pos += bits;
-    FlushBitCache(stream);
+// Store a block header at the given position.
+static void StoreBlockHeader(uint8_t* ptr,
+                             const BlockLayout* layout,
+                             size_t encoded_size,
+                             uint32_t crc32,
+                             int encoding_mode) {
+  uint64_t size_minus_one = (uint64_t)(encoded_size - 1);
+  for (int i = 0; i < layout->size_bits; i += 8) {
+    *ptr++ = (uint8_t)(size_minus_one >> i);
   }
+  ptr[0] = (uint8_t)crc32;
+  ptr[1] = (uint8_t)(crc32 >> 8);
+  ptr[2] = (uint8_t)(crc32 >> 16);
+  ptr[3] = (uint8_t)(crc32 >> 24);
+  ptr[4] = (uint8_t)encoding_mode;
 }
 
+// Number of extra bits and the smallest zero count for each RLE symbol.
+static const int s_rle_bits[kNumSymbols - 256] = {0, 2, 4, 8, 14};
+static const size_t s_rle_base[kNumSymbols - 256] = {2, 3, 7, 23, 279};
+
+// The number of bits that always fit in the bit cache after a flush.
+#define kBitCacheRoom 56
+
 // Used by the encoder for building the optimal Huffman tree.
+// Note: SymbolInfo arrays are indexed by the symbol number.
 typedef struct {
-  Symbol symbol;  // TODO(m): Is this needed?!
-                  // All SymbolInfos seem to be indexed by the symbol no.
   int count;
   uint32_t code;
   int bits;
@@ -129,46 +164,502 @@ struct EncodeNode_struct {
   int symbol;
 };
 
-// Calculate histogram for a block of data.
-static void Histogram(const uint8_t* in, SymbolInfo* symbols, size_t in_size) {
-  // Clear/init histogram.
+// A symbol and its weight, used for sorting symbols by weight.
+typedef struct {
+  uint32_t weight;
+  int symbol;
+} WeightedSymbol;
+
+// The token buffer for a block holds one token per plain symbol or RLE symbol.
+// RLE symbols with extra bits are followed by a token that holds the extra
+// bits. Since every token pair covers at least two bytes of input, the number
+// of tokens is never larger than the block size.
+typedef uint16_t Token;
+
+// The item lists of the package-merge algorithm: Item weights for the current
+// and the previous list, and flags that tell if an item of a list is a package
+// (otherwise it is a leaf).
+typedef struct {
+  uint32_t weights[2][2 * kNumSymbols];
+  uint8_t is_package[kMaxCanonicalCodeLength][2 * kNumSymbols];
+} PackageMergeLists;
+
+// Scratch memory for encoding blocks. It is reused for all the blocks that are
+// encoded by a thread, and only the parts that are needed for a block are
+// initialized. The tokens array has room for the tokens of max_block_size
+// bytes.
+typedef struct {
+  SymbolInfo symbols[kNumSymbols];
+  WeightedSymbol leaves[kNumSymbols];
+  union {
+    EncodeNode nodes[kMaxTreeNodes];
+    PackageMergeLists lists;
+  } tree;
+  Token* tokens;
+  size_t max_block_size;
+
+  // The codes of the latest block in the current tree reuse group that has its
+  // own Huffman tree (only valid if has_reuse_codes is true), and if they are
+  // codes for 16-bit samples.
+  uint32_t reuse_codes[kNumSymbols];
+  uint8_t reuse_bits[kNumSymbols];
+  hzr_bool has_reuse_codes;
+  hzr_bool reuse_wide;
+} EncodeScratch;
+
+// Allocate scratch memory with room for the tokens of max_block_size bytes.
+// They are stored right after the scratch structure.
+static EncodeScratch* CreateEncodeScratch(size_t max_block_size) {
+  EncodeScratch* scratch = (EncodeScratch*)_hzr_aligned_alloc(
+      sizeof(EncodeScratch) + sizeof(Token) * max_block_size);
+  if (UNLIKELY(!scratch)) {
+    DLOG("Out of memory.");
+    return NULL;
+  }
+  scratch->tokens = (Token*)(scratch + 1);
+  scratch->max_block_size = max_block_size;
+  scratch->has_reuse_codes = HZR_FALSE;
+  return scratch;
+}
+
+// Get the scratch memory of a workspace, with room for blocks of
+// max_block_size bytes. Scratch memory that is too small is replaced by larger
+// scratch memory, which is kept in the workspace for later calls.
+static EncodeScratch* GetWorkspaceScratch(hzr_workspace_t* workspace,
+                                          size_t max_block_size) {
+  EncodeScratch* scratch = (EncodeScratch*)workspace->encode_scratch;
+  if (scratch->max_block_size < max_block_size) {
+    scratch = CreateEncodeScratch(max_block_size);
+    if (UNLIKELY(!scratch)) {
+      return NULL;
+    }
+    _hzr_aligned_free(workspace->encode_scratch);
+    workspace->encode_scratch = scratch;
+  }
+  return scratch;
+}
+
+// Forget the codes of the previous blocks at the start of each tree reuse
+// group.
+FORCE_INLINE static void StartTreeReuseGroup(EncodeScratch* scratch,
+                                             size_t block) {
+  if ((block % HZR_TREE_REUSE_GROUP_SIZE) == 0) {
+    scratch->has_reuse_codes = HZR_FALSE;
+  }
+}
+
+void* _hzr_create_encode_scratch(void) {
+  return CreateEncodeScratch(HZR_DEFAULT_BLOCK_SIZE);
+}
+
+// The smallest block that is split into multiple streams (smaller blocks are
+// not worth the overhead).
+#define kMinMultiStreamBlockSize 1024
+
+// The longest run of zeros that can be represented by a single RLE symbol.
+#define kMaxZeroRun 16662
+
+// Get the RLE symbol for a run of 2 or more zeros.
+FORCE_INLINE static int ZeroRunSymbol(size_t zeros) {
+  return (zeros == 2U)     ? kSymTwoZeros
+         : (zeros <= 6U)   ? kSymUpTo6Zeros
+         : (zeros <= 22U)  ? kSymUpTo22Zeros
+         : (zeros <= 278U) ? kSymUpTo278Zeros
+                           : kSymUpTo16662Zeros;
+}
+
+// Add the tokens for a run of 2 or more zeros, and count the RLE symbol in the
+// histogram. Returns the new token pointer.
+FORCE_INLINE static Token* AddZeroRun(Token* token_ptr,
+                                      SymbolInfo* symbols,
+                                      size_t zeros) {
+  int rle_symbol = ZeroRunSymbol(zeros);
+  int rle_idx = rle_symbol - kSymTwoZeros;
+  symbols[rle_symbol].count++;
+  *token_ptr++ = (Token)rle_symbol;
+  if (s_rle_bits[rle_idx] > 0) {
+    *token_ptr++ = (Token)(zeros - s_rle_base[rle_idx]);
+  }
+  return token_ptr;
+}
+
+// Get the number of extra bits that follow the code of a symbol (RLE symbols,
+// and the escape symbols of 16-bit samples).
+FORCE_INLINE static int SymbolExtraBits(int symbol, hzr_bool wide) {
+  if (symbol >= 256) {
+    return s_rle_bits[symbol - 256];
+  }
+  return (wide && symbol > kSymEscape16) ? symbol - kSymEscape16 : 0;
+}
+
+// Get a byte of the filtered data of a block.
+FORCE_INLINE static uint8_t FilteredByte(const uint8_t* in,
+                                         size_t in_size,
+                                         size_t pos,
+                                         int filter,
+                                         size_t stride) {
+  if (filter == HZR_BLOCK_FILTER_DELTA) {
+    return (uint8_t)(in[pos] - ((pos >= stride) ? in[pos - stride] : 0U));
+  }
+  if (filter == HZR_BLOCK_FILTER_DELTA16 && (pos | 1U) < in_size) {
+    // Get the byte of the difference between two 16-bit words.
+    const size_t word_pos = pos & ~(size_t)1;
+    const size_t byte_stride = stride * 2;
+    uint32_t x = ((uint32_t)in[word_pos]) | (((uint32_t)in[word_pos + 1]) << 8);
+    if (word_pos >= byte_stride) {
+      x -= ((uint32_t)in[word_pos - byte_stride]) |
+           (((uint32_t)in[word_pos - byte_stride + 1]) << 8);
+    }
+    return (uint8_t)(x >> ((pos & 1U) * 8U));
+  }
+  return in[pos];
+}
+
+// Get a byte of the filtered data of a block, like FilteredByte(), at a
+// position that is past the first filter stride of the block (two strides for
+// 16-bit words), and that is part of a whole 16-bit word for the 16-bit filter.
+FORCE_INLINE static uint8_t FilteredInnerByte(const uint8_t* in,
+                                              size_t pos,
+                                              int filter,
+                                              size_t stride) {
+  if (filter == HZR_BLOCK_FILTER_DELTA) {
+    return (uint8_t)(in[pos] - in[pos - stride]);
+  }
+  if (filter == HZR_BLOCK_FILTER_DELTA16) {
+    const size_t word_pos = pos & ~(size_t)1;
+    const size_t byte_stride = stride * 2;
+    uint32_t x = (((uint32_t)in[word_pos]) |
+                  (((uint32_t)in[word_pos + 1]) << 8)) -
+                 (((uint32_t)in[word_pos - byte_stride]) |
+                  (((uint32_t)in[word_pos - byte_stride + 1]) << 8));
+    return (uint8_t)(x >> ((pos & 1U) * 8U));
+  }
+  return in[pos];
+}
+
+// Get a 16-bit little endian sample of the filtered data of a block. The
+// position must be even, and the sample must be within the block.
+FORCE_INLINE static uint32_t FilteredSample(const uint8_t* in,
+                                            size_t in_size,
+                                            size_t pos,
+                                            int filter,
+                                            size_t stride) {
+  if (filter == HZR_BLOCK_FILTER_DELTA16) {
+    const size_t byte_stride = stride * 2;
+    uint32_t x = ((uint32_t)in[pos]) | (((uint32_t)in[pos + 1]) << 8);
+    if (pos >= byte_stride) {
+      x -= ((uint32_t)in[pos - byte_stride]) |
+           (((uint32_t)in[pos - byte_stride + 1]) << 8);
+    }
+    return x & 0xffffU;
+  }
+  return ((uint32_t)FilteredByte(in, in_size, pos, filter, stride)) |
+         (((uint32_t)FilteredByte(in, in_size, pos + 1, filter, stride)) << 8);
+}
+
+// A helper for finding runs of zero and non-zero bytes in the filtered data of
+// the bytes [begin, end) of a block (see FilteredByte()), without filtering the
+// data first. It uses a mask of the zero bytes for the 64 bytes starting at
+// mask_pos, so the positions that are scanned must never decrease. With the
+// 16-bit delta filter, mask_pos is always even.
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+  size_t end;
+  size_t stride;
+  size_t mask_pos;
+  uint64_t zero_mask;
+} RunScanner;
+
+// Get the mask of the filtered zero bytes for the (up to) 64 bytes starting at
+// pos. The bits for bytes past the end of the scanned range are cleared.
+FORCE_INLINE static uint64_t FilteredZeroMask(const RunScanner* scanner,
+                                              size_t pos,
+                                              const int filter) {
+  const uint8_t* data = scanner->data;
+  const size_t count = scanner->end - pos;
+  if (filter == HZR_BLOCK_FILTER_NONE) {
+    return _hzr_zero_mask(&data[pos], count);
+  }
+
+  // The SIMD masks need the bytes that the filter subtracts, and 64 bytes.
+  const hzr_bool wide =
+      (filter == HZR_BLOCK_FILTER_DELTA16) ? HZR_TRUE : HZR_FALSE;
+  const size_t byte_stride = wide ? scanner->stride * 2 : scanner->stride;
+  uint64_t mask = 0U;
+  if (LIKELY(pos >= byte_stride && scanner->size - pos >= 64)) {
+    mask = _hzr_delta_zero_mask(&data[pos], byte_stride, wide);
+  } else {
+    const size_t n = hzr_min(count, (size_t)64);
+    for (size_t i = 0; i < n; ++i) {
+      uint8_t x =
+          FilteredByte(data, scanner->size, pos + i, filter, scanner->stride);
+      mask |= ((uint64_t)(x == 0U)) << i;
+    }
+  }
+  if (count < 64) {
+    mask &= (((uint64_t)1) << count) - 1U;
+  }
+  return mask;
+}
+
+FORCE_INLINE static void InitRunScanner(RunScanner* scanner,
+                                        const uint8_t* data,
+                                        size_t size,
+                                        size_t begin,
+                                        size_t end,
+                                        size_t stride,
+                                        const int filter) {
+  scanner->data = data;
+  scanner->size = size;
+  scanner->end = end;
+  scanner->stride = stride;
+  scanner->mask_pos =
+      (filter == HZR_BLOCK_FILTER_DELTA16) ? (begin & ~(size_t)1) : begin;
+  scanner->zero_mask = FilteredZeroMask(scanner, scanner->mask_pos, filter);
+}
+
+// Get the length of the run of zeros (zeros = HZR_TRUE) or non-zero bytes
+// (zeros = HZR_FALSE) that starts at pos. The run is at most max_count bytes.
+FORCE_INLINE static size_t ScanRun(RunScanner* scanner,
+                                   size_t pos,
+                                   size_t max_count,
+                                   hzr_bool zeros,
+                                   const int filter) {
+  size_t count = 0;
+  while (count < max_count) {
+    size_t p = pos + count;
+    if (p - scanner->mask_pos >= 64) {
+      scanner->mask_pos =
+          (filter == HZR_BLOCK_FILTER_DELTA16) ? (p & ~(size_t)1) : p;
+      scanner->zero_mask = FilteredZeroMask(scanner, scanner->mask_pos, filter);
+    }
+
+    // Find the end of the run in the current mask.
+    int shift = (int)(p - scanner->mask_pos);
+    int bits_left = 64 - shift;
+    uint64_t end_mask =
+        (zeros ? ~scanner->zero_mask : scanner->zero_mask) >> shift;
+    int run = (end_mask != 0U) ? _hzr_ctz64(end_mask) : 64;
+    if (run < bits_left) {
+      count += (size_t)run;
+      break;
+    }
+    count += (size_t)bits_left;
+  }
+  return hzr_min(count, max_count);
+}
+
+// Clear/init the histogram.
+static void ClearHistogram(SymbolInfo* symbols) {
   for (int k = 0; k < kNumSymbols; ++k) {
-    symbols[k].symbol = (Symbol)k;
     symbols[k].count = 0;
     symbols[k].code = 0;
     symbols[k].bits = 0;
   }
+}
 
-  // Build the histogram for this block.
-  for (size_t k = 0; k < in_size;) {
-    Symbol symbol = (Symbol)in[k];
+// Add the tokens of a run of non-zero filtered bytes to a token array and to
+// the sub-histograms. With inner = HZR_TRUE, the run must be made up of inner
+// bytes (see FilteredInnerByte()).
+FORCE_INLINE static void AddPlainRun(const uint8_t* in,
+                                     size_t in_size,
+                                     size_t pos,
+                                     size_t run,
+                                     Token* token_ptr,
+                                     int (*counts)[256],
+                                     const int filter,
+                                     size_t stride,
+                                     const hzr_bool inner) {
+  size_t i = 0;
+  for (; i + 4 <= run; i += 4) {
+    const size_t p = pos + i;
+    const uint8_t x0 = inner ? FilteredInnerByte(in, p, filter, stride)
+                             : FilteredByte(in, in_size, p, filter, stride);
+    const uint8_t x1 = inner ? FilteredInnerByte(in, p + 1, filter, stride)
+                             : FilteredByte(in, in_size, p + 1, filter, stride);
+    const uint8_t x2 = inner ? FilteredInnerByte(in, p + 2, filter, stride)
+                             : FilteredByte(in, in_size, p + 2, filter, stride);
+    const uint8_t x3 = inner ? FilteredInnerByte(in, p + 3, filter, stride)
+                             : FilteredByte(in, in_size, p + 3, filter, stride);
+    counts[0][x0]++;
+    counts[1][x1]++;
+    counts[2][x2]++;
+    counts[3][x3]++;
+    token_ptr[i] = (Token)x0;
+    token_ptr[i + 1] = (Token)x1;
+    token_ptr[i + 2] = (Token)x2;
+    token_ptr[i + 3] = (Token)x3;
+  }
+  for (; i < run; ++i) {
+    const uint8_t x = inner
+                          ? FilteredInnerByte(in, pos + i, filter, stride)
+                          : FilteredByte(in, in_size, pos + i, filter, stride);
+    counts[0][x]++;
+    token_ptr[i] = (Token)x;
+  }
+}
 
-    // Possible RLE?
-    if (symbol == 0) {
-      size_t zeros;
-      for (zeros = 1U; zeros < 16662U && (k + zeros) < in_size; ++zeros) {
-        if (in[k + zeros] != 0) {
-          break;
-        }
-      }
+// Split the bytes [begin, end) of a block into tokens, and add the symbols to
+// the histogram, for a given filter. See Tokenize().
+FORCE_INLINE static size_t TokenizeFiltered(const uint8_t* in,
+                                            size_t in_size,
+                                            size_t begin,
+                                            size_t end,
+                                            Token* tokens,
+                                            SymbolInfo* symbols,
+                                            const int filter,
+                                            size_t stride) {
+  // We count the plain symbols in four separate sub-histograms, so that
+  // consecutive increments of the same counter do not have to wait for each
+  // other.
+  int counts[4][256];
+  memset(counts, 0, sizeof(counts));
+
+  // Tokenize the block. All the bytes from inner_begin up to inner_end are
+  // inner bytes (see FilteredInnerByte()).
+  const size_t byte_stride =
+      (filter == HZR_BLOCK_FILTER_DELTA16) ? stride * 2 : stride;
+  const size_t inner_begin = (filter == HZR_BLOCK_FILTER_NONE) ? 0 : byte_stride;
+  const size_t inner_end =
+      (filter == HZR_BLOCK_FILTER_DELTA16) ? (in_size & ~(size_t)1) : in_size;
+  Token* token_ptr = tokens;
+  RunScanner scanner;
+  InitRunScanner(&scanner, in, in_size, begin, end, stride, filter);
+  for (size_t k = begin; k < end;) {
+    // Copy a run of non-zero symbols.
+    size_t run = ScanRun(&scanner, k, end - k, HZR_FALSE, filter);
+    if (LIKELY(k >= inner_begin && k + run <= inner_end)) {
+      AddPlainRun(in, in_size, k, run, token_ptr, counts, filter, stride,
+                  HZR_TRUE);
+    } else {
+      AddPlainRun(in, in_size, k, run, token_ptr, counts, filter, stride,
+                  HZR_FALSE);
+    }
+    token_ptr += run;
+    k += run;
+
+    // Add a run of zeros.
+    if (k < end) {
+      size_t zeros =
+          ScanRun(&scanner, k, hzr_min(end - k, kMaxZeroRun), HZR_TRUE, filter);
       if (zeros == 1U) {
-        symbols[0].count++;
-      } else if (zeros == 2U) {
-        symbols[kSymTwoZeros].count++;
-      } else if (zeros <= 6U) {
-        symbols[kSymUpTo6Zeros].count++;
-      } else if (zeros <= 22U) {
-        symbols[kSymUpTo22Zeros].count++;
-      } else if (zeros <= 278U) {
-        symbols[kSymUpTo278Zeros].count++;
+        counts[0][0]++;
+        *token_ptr++ = 0;
       } else {
-        symbols[kSymUpTo16662Zeros].count++;
+        token_ptr = AddZeroRun(token_ptr, symbols, zeros);
       }
       k += zeros;
+    }
+  }
+
+  // Merge the sub-histograms.
+  for (int k = 0; k < 256; ++k) {
+    symbols[k].count +=
+        counts[0][k] + counts[1][k] + counts[2][k] + counts[3][k];
+  }
+
+  return (size_t)(token_ptr - tokens);
+}
+
+// Split the bytes [begin, end) of a block of in_size bytes into tokens, and add
+// the symbols to the histogram. Returns the number of tokens. The tokens are
+// made from the filtered data of the block (see FilteredByte()), which is
+// filtered on the fly so that the block is only read once.
+static size_t Tokenize(const uint8_t* in,
+                       size_t in_size,
+                       size_t begin,
+                       size_t end,
+                       Token* tokens,
+                       SymbolInfo* symbols,
+                       int filter,
+                       size_t stride) {
+  switch (filter) {
+    case HZR_BLOCK_FILTER_DELTA:
+      return TokenizeFiltered(in, in_size, begin, end, tokens, symbols,
+                              HZR_BLOCK_FILTER_DELTA, stride);
+    case HZR_BLOCK_FILTER_DELTA16:
+      return TokenizeFiltered(in, in_size, begin, end, tokens, symbols,
+                              HZR_BLOCK_FILTER_DELTA16, stride);
+    default:
+      return TokenizeFiltered(in, in_size, begin, end, tokens, symbols,
+                              HZR_BLOCK_FILTER_NONE, stride);
+  }
+}
+
+// Split the 16-bit samples [begin, end) of a block into tokens, for a given
+// filter. See Tokenize16().
+FORCE_INLINE static size_t Tokenize16Filtered(const uint8_t* in,
+                                              size_t in_size,
+                                              size_t begin,
+                                              size_t end,
+                                              Token* tokens,
+                                              SymbolInfo* symbols,
+                                              const int filter,
+                                              size_t stride) {
+  Token* token_ptr = tokens;
+  RunScanner scanner;
+  InitRunScanner(&scanner, in, in_size, begin, end, stride, filter);
+  for (size_t k = begin; k < end;) {
+    uint32_t sample = FilteredSample(in, in_size, k, filter, stride);
+    if (sample != 0U) {
+      uint32_t z = ((sample << 1) ^ (0U - (sample >> 15))) & 0xffffU;
+      if (z < kSymEscape16) {
+        symbols[z].count++;
+        *token_ptr++ = (Token)z;
+      } else {
+        uint32_t x = z - (kSymEscape16 - 1);
+        int n = 31 - _hzr_clz32(x);
+        symbols[kSymEscape16 + n].count++;
+        *token_ptr++ = (Token)(kSymEscape16 + n);
+        if (n > 0) {
+          *token_ptr++ = (Token)(x - (1U << n));
+        }
+      }
+      k += 2;
+      continue;
+    }
+
+    // Add a run of zero samples.
+    size_t zeros = ScanRun(&scanner, k, hzr_min(end - k, 2 * kMaxZeroRun),
+                           HZR_TRUE, filter) >>
+                   1;
+    if (zeros == 1U) {
+      symbols[0].count++;
+      *token_ptr++ = 0;
     } else {
-      symbols[symbol].count++;
-      k++;
+      token_ptr = AddZeroRun(token_ptr, symbols, zeros);
     }
+    k += zeros * 2;
+  }
+
+  return (size_t)(token_ptr - tokens);
+}
+
+// Split the 16-bit little endian samples [begin, end) of a block of in_size
+// bytes into tokens (see kSymEscape16), and add the symbols to the histogram.
+// Returns the number of tokens. The range must start at an even position and
+// have an even size. Escape symbols with extra bits are followed by a token
+// that holds the extra bits, so each sample gives at most two tokens. The
+// block is filtered on the fly, like in Tokenize().
+static size_t Tokenize16(const uint8_t* in,
+                         size_t in_size,
+                         size_t begin,
+                         size_t end,
+                         Token* tokens,
+                         SymbolInfo* symbols,
+                         int filter,
+                         size_t stride) {
+  switch (filter) {
+    case HZR_BLOCK_FILTER_DELTA:
+      return Tokenize16Filtered(in, in_size, begin, end, tokens, symbols,
+                                HZR_BLOCK_FILTER_DELTA, stride);
+    case HZR_BLOCK_FILTER_DELTA16:
+      return Tokenize16Filtered(in, in_size, begin, end, tokens, symbols,
+                                HZR_BLOCK_FILTER_DELTA16, stride);
+    default:
+      return Tokenize16Filtered(in, in_size, begin, end, tokens, symbols,
+                                HZR_BLOCK_FILTER_NONE, stride);
   }
 }
 
@@ -191,17 +682,9 @@ static void StoreTree(EncodeNode* node,
       return;
     }
 
-    // Find symbol index.
-    int sym_idx;
-    for (sym_idx = 0; sym_idx < kNumSymbols; ++sym_idx) {
-      if (symbols[sym_idx].symbol == (Symbol)node->symbol) {
-        break;
-      }
-    }
-
     // Store code info in symbol array.
-    symbols[sym_idx].code = code;
-    symbols[sym_idx].bits = bits;
+    symbols[node->symbol].code = code;
+    symbols[node->symbol].bits = bits;
     return;
   }
 
@@ -215,23 +698,90 @@ static void StoreTree(EncodeNode* node,
   StoreTree(node->child_a, symbols, stream, code, bits + 1);
 
   // Branch B.
-  StoreTree(node->child_b, symbols, stream, code + (1 << bits), bits + 1);
+  StoreTree(node->child_b, symbols, stream, code | (1U << bits), bits + 1);
 }
 
-// Generate a Huffman tree.
-static void MakeTree(SymbolInfo* sym, WriteStream* stream) {
-  // Initialize all leaf nodes.
-  EncodeNode nodes[kMaxTreeNodes];
-  int num_symbols = 0;
+// Get the depth of a Huffman tree (the length of its longest code).
+static int TreeDepth(const EncodeNode* node) {
+  if (node->symbol >= 0) {
+    return 0;
+  }
+  const int depth_a = TreeDepth(node->child_a);
+  const int depth_b = TreeDepth(node->child_b);
+  return 1 + hzr_max(depth_a, depth_b);
+}
+
+static int CompareWeightedSymbols(const void* a, const void* b) {
+  const WeightedSymbol* sa = (const WeightedSymbol*)a;
+  const WeightedSymbol* sb = (const WeightedSymbol*)b;
+  if (sa->weight != sb->weight) {
+    return (sa->weight < sb->weight) ? -1 : 1;
+  }
+  return sa->symbol - sb->symbol;
+}
+
+// Collect all the used symbols, sorted by increasing weight. Returns the
+// number of used symbols.
+static int SortSymbolsByWeight(const SymbolInfo* sym, WeightedSymbol* leaves) {
+  int num_leaves = 0;
   for (int k = 0; k < kNumSymbols; ++k) {
     if (sym[k].count > 0) {
-      nodes[num_symbols].symbol = (int)sym[k].symbol;
-      nodes[num_symbols].count = sym[k].count;
-      nodes[num_symbols].child_a = NULL;
-      nodes[num_symbols].child_b = NULL;
-      ++num_symbols;
+      leaves[num_leaves].weight = (uint32_t)sym[k].count;
+      leaves[num_leaves].symbol = k;
+      ++num_leaves;
+    }
+  }
+  qsort(leaves, (size_t)num_leaves, sizeof(leaves[0]), CompareWeightedSymbols);
+  return num_leaves;
+}
+
+// Build a Huffman tree from the leaves (sorted by weight) in the nodes array.
+// The root node is the last node.
+static void BuildTree(const WeightedSymbol* leaves,
+                      int num_symbols,
+                      EncodeNode* nodes) {
+  for (int k = 0; k < num_symbols; ++k) {
+    nodes[k].symbol = leaves[k].symbol;
+    nodes[k].count = (int)leaves[k].weight;
+    nodes[k].child_a = NULL;
+    nodes[k].child_b = NULL;
+  }
+
+  // Join the lightest nodes until there is only one node left (the root node).
+  // The leaf nodes are sorted by weight, and the branch nodes are created in
+  // order of non-decreasing weight, so the lightest node is always first in
+  // either the leaf queue or the branch queue.
+  const int num_nodes = 2 * num_symbols - 1;
+  int next_leaf = 0;
+  int next_branch = num_symbols;
+  for (int next_idx = num_symbols; next_idx < num_nodes; ++next_idx) {
+    EncodeNode* lightest[2];
+    for (int i = 0; i < 2; ++i) {
+      if (next_leaf < num_symbols &&
+          (next_branch >= next_idx ||
+           nodes[next_leaf].count <= nodes[next_branch].count)) {
+        lightest[i] = &nodes[next_leaf++];
+      } else {
+        lightest[i] = &nodes[next_branch++];
+      }
     }
+
+    // Join the two nodes into a new parent node.
+    EncodeNode* parent = &nodes[next_idx];
+    parent->child_a = lightest[0];
+    parent->child_b = lightest[1];
+    parent->count = lightest[0]->count + lightest[1]->count;
+    parent->symbol = -1;
   }
+}
+
+// Generate a Huffman tree.
+static void MakeTree(EncodeScratch* scratch, WriteStream* stream) {
+  // Collect all the used symbols, sorted by weight.
+  SymbolInfo* sym = scratch->symbols;
+  WeightedSymbol* leaves = scratch->leaves;
+  const int num_symbols = SortSymbolsByWeight(sym, leaves);
+  EncodeNode* nodes = scratch->tree.nodes;
 
   // Special case: No symbols at all - don't store anything in the output
   // stream.
@@ -239,47 +789,257 @@ static void MakeTree(SymbolInfo* sym, WriteStream* stream) {
     return;
   }
 
-  // Build tree by joining the lightest nodes until there is only one node left
-  // (the root node).
-  EncodeNode* root = NULL;
-  int nodes_left = num_symbols;
-  int next_idx = num_symbols;
-  while (nodes_left > 1) {
-    // Find the two lightest nodes.
-    EncodeNode* node_1 = NULL;
-    EncodeNode* node_2 = NULL;
-    for (int k = 0; k < next_idx; ++k) {
-      if (nodes[k].count > 0) {
-        if (!node_1 || (nodes[k].count <= node_1->count)) {
-          node_2 = node_1;
-          node_1 = &nodes[k];
-        } else if (!node_2 || (nodes[k].count <= node_2->count)) {
-          node_2 = &nodes[k];
-        }
-      }
-    }
+  // Special case: only one symbol => no binary tree.
+  if (num_symbols == 1) {
+    BuildTree(leaves, num_symbols, nodes);
+    StoreTree(&nodes[0], sym, stream, 0, 1);
+    return;
+  }
 
-    // Join the two nodes into a new parent node.
-    root = &nodes[next_idx];
-    root->child_a = node_1;
-    root->child_b = node_2;
-    root->count = node_1->count + node_2->count;
-    root->symbol = -1;
-    node_1->count = 0;
-    node_2->count = 0;
-    ++next_idx;
-    --nodes_left;
+  // Build the tree. Very skewed histograms of large blocks can give codes that
+  // are longer than the decoder supports, in which case we flatten the weights
+  // (which keeps them sorted) and try again.
+  const int num_nodes = 2 * num_symbols - 1;
+  BuildTree(leaves, num_symbols, nodes);
+  while (UNLIKELY(TreeDepth(&nodes[num_nodes - 1]) > kMaxCodeLength)) {
+    for (int k = 0; k < num_symbols; ++k) {
+      leaves[k].weight = (leaves[k].weight + 1U) >> 1;
+    }
+    BuildTree(leaves, num_symbols, nodes);
   }
 
   // Store the tree in the output stream, and in the sym[] array (the latter is
   // used as a look-up-table for faster encoding).
-  if (root) {
-    StoreTree(root, sym, stream, 0, 0);
-  } else {
-    // Special case: only one symbol => no binary tree.
-    root = &nodes[0];
-    StoreTree(root, sym, stream, 0, 1);
+  StoreTree(&nodes[num_nodes - 1], sym, stream, 0, 0);
+}
+
+// Calculate optimal length-limited code lengths using the package-merge
+// algorithm. The leaves must be sorted by increasing weight, and there must be
+// at least two leaves.
+static void PackageMerge(const WeightedSymbol* leaves,
+                         int num_leaves,
+                         int max_length,
+                         PackageMergeLists* lists,
+                         int* lengths) {
+  uint32_t(*weights)[2 * kNumSymbols] = lists->weights;
+  uint8_t(*is_package)[2 * kNumSymbols] = lists->is_package;
+  int list_size[kMaxCanonicalCodeLength];
+
+  // The list for the deepest level only contains the leaves.
+  int level = max_length - 1;
+  for (int i = 0; i < num_leaves; ++i) {
+    weights[level & 1][i] = leaves[i].weight;
+    is_package[level][i] = 0;
+  }
+  list_size[level] = num_leaves;
+
+  // For each level, merge the leaves with pairs of items (packages) from the
+  // list of the level below.
+  for (--level; level >= 0; --level) {
+    const uint32_t* prev = weights[(level + 1) & 1];
+    uint32_t* cur = weights[level & 1];
+    const int num_packages = list_size[level + 1] / 2;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+    while (i < num_leaves || j < num_packages) {
+      uint32_t package_weight =
+          (j < num_packages) ? prev[2 * j] + prev[2 * j + 1] : 0U;
+      if (j >= num_packages ||
+          (i < num_leaves && leaves[i].weight <= package_weight)) {
+        cur[k] = leaves[i++].weight;
+        is_package[level][k] = 0;
+      } else {
+        cur[k] = package_weight;
+        is_package[level][k] = 1;
+        ++j;
+      }
+      ++k;
+    }
+    list_size[level] = k;
+  }
+
+  // Select the 2n - 2 lightest items of the top list. The code length of a
+  // symbol is the number of times that its leaf is part of the selection
+  // (directly or via packages). Since the leaves of each list are sorted, the
+  // selected leaves of a list are always the lightest ones.
+  for (int i = 0; i < num_leaves; ++i) {
+    lengths[i] = 0;
+  }
+  int num_selected = 2 * num_leaves - 2;
+  for (level = 0; level < max_length && num_selected > 0; ++level) {
+    int num_packages = 0;
+    int num_selected_leaves = 0;
+    for (int k = 0; k < num_selected; ++k) {
+      if (is_package[level][k]) {
+        ++num_packages;
+      } else {
+        lengths[num_selected_leaves++]++;
+      }
+    }
+    num_selected = 2 * num_packages;
+  }
+}
+
+// Reverse the order of the lowest bits of a code.
+static uint32_t ReverseBits(uint32_t code, int bits) {
+  uint32_t result = 0U;
+  for (int i = 0; i < bits; ++i) {
+    result = (result << 1) | ((code >> i) & 1U);
+  }
+  return result;
+}
+
+// Assign the canonical codes for the code lengths of the symbols (in symbol
+// order for each code length). The codes are bit reversed, since the bits are
+// stored LSB first.
+static void AssignCanonicalCodes(SymbolInfo* sym) {
+  int length_count[kMaxCanonicalCodeLength + 1] = {0};
+  for (int k = 0; k < kNumSymbols; ++k) {
+    length_count[sym[k].bits]++;
+  }
+  length_count[0] = 0;
+  uint32_t next_code[kMaxCanonicalCodeLength + 1];
+  uint32_t code = 0U;
+  for (int bits = 1; bits <= kMaxCanonicalCodeLength; ++bits) {
+    code = (code + (uint32_t)length_count[bits - 1]) << 1;
+    next_code[bits] = code;
+  }
+  for (int k = 0; k < kNumSymbols; ++k) {
+    int bits = sym[k].bits;
+    if (bits > 0) {
+      sym[k].code = ReverseBits(next_code[bits]++, bits);
+    }
+  }
+}
+
+// Generate length-limited canonical Huffman codes, and write the code lengths
+// to the output stream.
+static void MakeCanonicalCodes(EncodeScratch* scratch, WriteStream* stream) {
+  // Collect all the used symbols, sorted by weight.
+  SymbolInfo* sym = scratch->symbols;
+  WeightedSymbol* leaves = scratch->leaves;
+  const int num_leaves = SortSymbolsByWeight(sym, leaves);
+
+  // Calculate the code lengths.
+  if (num_leaves == 1) {
+    // Special case: only one symbol => use a 1-bit code.
+    sym[leaves[0].symbol].bits = 1;
+  } else if (num_leaves > 1) {
+    int lengths[kNumSymbols];
+    PackageMerge(leaves, num_leaves, kMaxCanonicalCodeLength,
+                 &scratch->tree.lists, lengths);
+    for (int i = 0; i < num_leaves; ++i) {
+      sym[leaves[i].symbol].bits = lengths[i];
+    }
+  }
+
+  AssignCanonicalCodes(sym);
+
+  // Write the code lengths, coded relative to the previous code length.
+  int prev = 0;
+  for (int k = 0; k < kNumSymbols;) {
+    int bits = sym[k].bits;
+    if (bits == 0) {
+      // Unused symbols: Use relative coding for short runs, and an explicit
+      // run length for long runs.
+      int run = 1;
+      while (k + run < kNumSymbols && sym[k + run].bits == 0 &&
+             run < kMaxCodeLengthZeroRun) {
+        ++run;
+      }
+      int relative_cost = (prev == 0) ? run : (prev == 1) ? run + 2 : 1000;
+      if (relative_cost > 14) {
+        WriteBits(stream, 3U, 2);
+        WriteBits(stream, 0U, 4);
+        WriteBits(stream, (uint32_t)(run - 1), 8);
+        k += run;
+        prev = 0;
+        continue;
+      }
+    }
+
+    if (bits == prev) {
+      WriteBits(stream, 0U, 1);
+    } else if (bits == prev + 1) {
+      WriteBits(stream, 1U, 3);
+    } else if (bits == prev - 1) {
+      WriteBits(stream, 5U, 3);
+    } else {
+      WriteBits(stream, 3U, 2);
+      WriteBits(stream, (uint32_t)bits, 4);
+      if (bits == 0) {
+        WriteBits(stream, 0U, 8);
+      }
+    }
+    prev = bits;
+    ++k;
+  }
+}
+
+// The largest symbol count that is used for training a shared table (larger
+// counts are scaled down, so that the package-merge weights can not overflow).
+#define kMaxTrainingCount (1 << 22)
+
+hzr_status_t _hzr_train_code_lengths(const uint8_t* sample,
+                                     size_t sample_size,
+                                     uint8_t* lengths) {
+  EncodeScratch* scratch =
+      CreateEncodeScratch(hzr_min(sample_size, HZR_DEFAULT_BLOCK_SIZE));
+  if (UNLIKELY(!scratch)) {
+    return HZR_FAIL;
+  }
+
+  // Collect the histogram of the sample data, block by block.
+  SymbolInfo* sym = scratch->symbols;
+  ClearHistogram(sym);
+  for (size_t pos = 0; pos < sample_size; pos += HZR_DEFAULT_BLOCK_SIZE) {
+    size_t block_size = hzr_min(sample_size - pos, HZR_DEFAULT_BLOCK_SIZE);
+    (void)Tokenize(&sample[pos], block_size, 0, block_size, scratch->tokens,
+                   sym, HZR_BLOCK_FILTER_NONE, 1);
+    int max_count = 0;
+    for (int k = 0; k < kNumSymbols; ++k) {
+      max_count = hzr_max(max_count, sym[k].count);
+    }
+    if (max_count > kMaxTrainingCount) {
+      for (int k = 0; k < kNumSymbols; ++k) {
+        sym[k].count >>= 1;
+      }
+    }
+  }
+
+  // Every symbol must have a code, so that any data can be encoded.
+  for (int k = 0; k < kNumSymbols; ++k) {
+    sym[k].count++;
+  }
+
+  // Calculate the length-limited code lengths.
+  WeightedSymbol* leaves = scratch->leaves;
+  const int num_leaves = SortSymbolsByWeight(sym, leaves);
+  int leaf_lengths[kNumSymbols];
+  PackageMerge(leaves, num_leaves, kMaxCanonicalCodeLength,
+               &scratch->tree.lists, leaf_lengths);
+  for (int i = 0; i < num_leaves; ++i) {
+    lengths[leaves[i].symbol] = (uint8_t)leaf_lengths[i];
+  }
+
+  _hzr_aligned_free(scratch);
+  return HZR_OK;
+}
+
+void* _hzr_create_encode_table(const uint8_t* lengths) {
+  SymbolInfo* sym = (SymbolInfo*)malloc(sizeof(SymbolInfo) * kNumSymbols);
+  if (UNLIKELY(!sym)) {
+    DLOG("Out of memory.");
+    return NULL;
+  }
+  for (int k = 0; k < kNumSymbols; ++k) {
+    sym[k].count = 0;
+    sym[k].code = 0U;
+    sym[k].bits = lengths[k];
   }
+  AssignCanonicalCodes(sym);
+  return sym;
 }
 
 static hzr_bool OnlySingleCode(const SymbolInfo* const symbols) {
@@ -288,8 +1048,7 @@ static hzr_bool OnlySingleCode(const SymbolInfo* const symbols) {
   int num_nonzero_codes = 0;
   for (int k = 0; k < kNumSymbols; ++k) {
     if (symbols[k].count > 0) {
-      Symbol x = symbols[k].symbol;
-      if ((x == 0) || (x >= 256)) {
+      if ((k == 0) || (k >= 256)) {
         has_zeros = 1;
       } else {
         ++num_nonzero_codes;
@@ -304,196 +1063,1019 @@ static hzr_bool OnlySingleCode(const SymbolInfo* const symbols) {
   return (used_codes == 1) ? HZR_TRUE : HZR_FALSE;
 }
 
+// Check if all the bytes of the filtered data of a block are the same.
+static hzr_bool AllBytesEqual(const uint8_t* in,
+                              size_t in_size,
+                              int filter,
+                              size_t stride) {
+  for (size_t k = 1; k < in_size; ++k) {
+    if (FilteredByte(in, in_size, k, filter, stride) != in[0]) {
+      return HZR_FALSE;
+    }
+  }
+  return HZR_TRUE;
+}
+
 static hzr_status_t PlainCopy(const uint8_t* in,
                               size_t in_size,
                               WriteStream* stream,
+                              const BlockLayout* layout,
                               size_t* encoded_size) {
+  ASSERT(stream->bit_pos == 0);
+
   // Check that the output buffer is large enough.
-  if (UNLIKELY((GetBytePtr(stream) + HZR_BLOCK_HEADER_SIZE + in_size) >
-               stream->end_ptr)) {
+  const size_t header_size = layout->header_size;
+  uint8_t* block_start = GetBytePtr(stream);
+  if (UNLIKELY((block_start + header_size + in_size) > stream->end_ptr)) {
     DLOG("Output buffer too small for a plain copy.");
     return HZR_FAIL;
   }
 
-  // Calculate the CRC for the buffer.
-  uint32_t crc32 = _hzr_crc32(in, in_size);
+  // Copy the input buffer to the output buffer, and calculate the CRC for it
+  // at the same time.
+  uint32_t crc32 = _hzr_crc32_copy(block_start + header_size, in, in_size);
 
   // Write the block header.
-  WriteBits(stream, (uint32_t)(in_size - 1), 16);
-  WriteBits(stream, crc32, 32);
-  WriteBits(stream, HZR_ENCODING_COPY, 8);
-  ForceFlushBitCache(stream);
-
-  // Copy the input buffer to the output buffer.
-  memcpy(GetBytePtr(stream), in, in_size);
+  StoreBlockHeader(block_start, layout, in_size, crc32, HZR_ENCODING_COPY);
 
   // Advance the stream.
   // Note: It is safe to just increase the byte pointer here, since the stream
   // is byte aligned.
-  stream->byte_ptr += in_size;
+  stream->byte_ptr += header_size + in_size;
 
   // Calculate the encoded size.
-  *encoded_size = in_size + HZR_BLOCK_HEADER_SIZE;
+  *encoded_size = in_size + header_size;
 
   return HZR_OK;
 }
 
+// Encode a fill block. For filtered blocks, the fill code is the first byte of
+// the filtered data, and it is preceded by the filter stride.
 static hzr_status_t EncodeFill(const uint8_t* in,
                                WriteStream* stream,
+                               const BlockLayout* layout,
+                               int filter,
+                               size_t stride,
                                size_t* encoded_size) {
+  ASSERT(stream->bit_pos == 0);
+
   // Check that the output buffer is large enough.
-  if (UNLIKELY((GetBytePtr(stream) + HZR_BLOCK_HEADER_SIZE + 1) >
-               stream->end_ptr)) {
+  const size_t header_size = layout->header_size;
+  const size_t data_size = (filter != HZR_BLOCK_FILTER_NONE) ? 2 : 1;
+  uint8_t* block_start = GetBytePtr(stream);
+  if (UNLIKELY((block_start + header_size + data_size) > stream->end_ptr)) {
     DLOG("Output buffer too small for fill encoding.");
     return HZR_FAIL;
   }
 
-  // Calculate the CRC for the buffer.
-  uint32_t crc32 = _hzr_crc32(in, 1);
+  // Write the filter stride and the fill code, and calculate the CRC for them.
+  uint8_t* data = block_start + header_size;
+  if (filter != HZR_BLOCK_FILTER_NONE) {
+    *data++ = (uint8_t)stride;
+  }
+  *data = *in;
+  uint32_t crc32 = _hzr_crc32(block_start + header_size, data_size);
 
   // Write the block header.
-  WriteBits(stream, 0U, 16);
-  WriteBits(stream, crc32, 32);
-  WriteBits(stream, HZR_ENCODING_FILL, 8);
-
-  // Write the fill code.
-  WriteBits(stream, (uint32_t)(*in), 8);
-  ForceFlushBitCache(stream);
+  StoreBlockHeader(block_start, layout, data_size, crc32,
+                   HZR_ENCODING_FILL | (filter << HZR_FILTER_SHIFT));
+  stream->byte_ptr += header_size + data_size;
 
   // Calculate the encoded size.
-  *encoded_size = HZR_BLOCK_HEADER_SIZE + 1;
+  *encoded_size = header_size + data_size;
 
   return HZR_OK;
 }
 
-static hzr_status_t EncodeSingleBlock(WriteStream* stream,
-                                      const uint8_t* in,
-                                      size_t in_size,
-                                      size_t* encoded_size) {
-  ASSERT((stream->bit_pos & 7) == 0);
+// Emit tokens to the stream. We only flush the bit cache (and check for buffer
+// overruns) once per batch of symbols. The wide flag tells if the tokens are
+// for 16-bit samples, and it must be a compile time constant.
+FORCE_INLINE static void EmitTokens(WriteStream* stream,
+                                    const SymbolInfo* symbols,
+                                    const Token* tokens,
+                                    size_t num_tokens,
+                                    int batch_size,
+                                    const hzr_bool wide) {
+  for (size_t k = 0; k < num_tokens;) {
+    FlushBitCache(stream);
+    if (UNLIKELY(stream->write_failed)) {
+      return;
+    }
 
-  // Create a stream that is limited to this block (this is required to detect
-  // block buffer overruns).
-  WriteStream block_stream = *stream;
-  block_stream.end_ptr =
-      GetBytePtr(&block_stream) + HZR_BLOCK_HEADER_SIZE + in_size;
-  if (block_stream.end_ptr > stream->end_ptr) {
-    block_stream.end_ptr = stream->end_ptr;
-  }
+    for (int n = 0; n < batch_size && k < num_tokens; ++n) {
+      int symbol = (int)tokens[k++];
+      AppendBits(stream, symbols[symbol].code, symbols[symbol].bits);
 
-  // Zero out the block header (will be filled out later).
-  if (UNLIKELY((GetBytePtr(&block_stream) + HZR_BLOCK_HEADER_SIZE) >
-               block_stream.end_ptr)) {
-    DLOG("Block buffer is too small for holding the block header.");
-    return HZR_FAIL;
+      // RLE (or escape) extra bits?
+      if (symbol > kSymTwoZeros) {
+        AppendBits(stream, (uint32_t)tokens[k++],
+                   s_rle_bits[symbol - kSymTwoZeros]);
+      } else if (wide && symbol > kSymEscape16 && symbol < 256) {
+        AppendBits(stream, (uint32_t)tokens[k++], symbol - kSymEscape16);
+      }
+    }
   }
-  WriteBits(&block_stream, 0U, 16);
-  WriteBits(&block_stream, 0U, 32);
-  WriteBits(&block_stream, 0U, 8);
+}
 
-  // Calculate the histogram for input data.
-  SymbolInfo symbols[kNumSymbols];
-  Histogram(in, symbols, in_size);
+// Emit the tokens of one stream, with the token format of the block.
+static void EmitStreamTokens(WriteStream* stream,
+                             const SymbolInfo* symbols,
+                             const Token* tokens,
+                             size_t num_tokens,
+                             int batch_size,
+                             hzr_bool wide) {
+  if (wide) {
+    EmitTokens(stream, symbols, tokens, num_tokens, batch_size, HZR_TRUE);
+  } else {
+    EmitTokens(stream, symbols, tokens, num_tokens, batch_size, HZR_FALSE);
+  }
+}
 
-  // Check if we have a single symbol.
-  if (OnlySingleCode(symbols)) {
-    return EncodeFill(in, stream, encoded_size);
+// Decide if a block should be coded with the codes of a previous block instead
+// of with its own Huffman tree, by comparing the estimated coded size of the
+// block (from its histogram) with the previous codes, and with its own codes
+// plus the description of its tree (tree_bits). The RLE extra bits are the
+// same either way, so they are left out. The previous codes must be for the
+// same kind of symbols (wide = 16-bit samples).
+static hzr_bool ShouldReuseCodes(const EncodeScratch* scratch,
+                                 size_t tree_bits,
+                                 hzr_bool wide) {
+  if (!scratch->has_reuse_codes || scratch->reuse_wide != wide) {
+    return HZR_FALSE;
+  }
+  const SymbolInfo* sym = scratch->symbols;
+  uint64_t own_bits = (uint64_t)tree_bits;
+  uint64_t reuse_bits = 0U;
+  for (int k = 0; k < kNumSymbols; ++k) {
+    if (sym[k].count > 0) {
+      if (scratch->reuse_bits[k] == 0U) {
+        // The symbol has no code in the previous tree.
+        return HZR_FALSE;
+      }
+      own_bits += (uint64_t)sym[k].count * (uint64_t)sym[k].bits;
+      reuse_bits += (uint64_t)sym[k].count * (uint64_t)scratch->reuse_bits[k];
+    }
   }
+  return (reuse_bits <= own_bits) ? HZR_TRUE : HZR_FALSE;
+}
 
-  // Build the Huffman tree, and write it to the output stream.
-  MakeTree(symbols, &block_stream);
-  if (UNLIKELY(block_stream.write_failed)) {
-    return PlainCopy(in, in_size, stream, encoded_size);
+// The incompressibility check samples kNumSampleChunks chunks of
+// kSampleChunkSize bytes each (2^kSampleSizeLog2 bytes in total) from blocks
+// that are at least kMinSampledBlockSize bytes large.
+#define kNumSampleChunks 8
+#define kSampleChunkSize 256
+#define kSampleSizeLog2 11
+#define kMinSampledBlockSize 16384
+
+// The number of fractional bits of the fixed point logarithms.
+#define kLog2FracBits 8
+
+// Blocks are considered incompressible if their estimated entropy is within
+// this margin (in bits per byte, with kLog2FracBits fractional bits) from the
+// limit, since the Huffman codes are never better than the entropy, and the
+// tree adds some overhead.
+#define kSampleEntropyMargin 13
+
+// Calculate log2(x) as a fixed point number with kLog2FracBits fractional bits
+// (x > 0).
+static uint32_t FixedLog2(uint32_t x) {
+  uint32_t result = 0U;
+  while (x >= 2U) {
+    x >>= 1;
+    result += 1U << kLog2FracBits;
   }
+  return result;
+}
 
-  // Encode the input stream.
-  const uint8_t* in_data = in;
-  for (size_t k = 0; k < in_size;) {
-    uint8_t symbol = in_data[k];
+// Calculate c * log2(c) as a fixed point number with kLog2FracBits fractional
+// bits. The fractional part of the logarithm is calculated by repeated
+// squaring (for c > 0).
+static uint64_t CountTimesLog2(uint32_t c) {
+  uint32_t log2_c = FixedLog2(c);
+  int int_bits = (int)(log2_c >> kLog2FracBits);
+
+  // Normalize c to a 1.16 fixed point number in [1, 2).
+  uint64_t y = (((uint64_t)c) << 16) >> int_bits;
+  for (int k = kLog2FracBits - 1; k >= 0; --k) {
+    y = (y * y) >> 16;
+    if (y >= (2U << 16)) {
+      y >>= 1;
+      log2_c |= 1U << k;
+    }
+  }
+  return (uint64_t)c * (uint64_t)log2_c;
+}
 
-    // Possible RLE?
-    if (symbol == 0) {
-      size_t zeros;
-      for (zeros = 1U; zeros < 16662U && (k + zeros) < in_size; ++zeros) {
-        if (in_data[k + zeros] != 0) {
-          break;
-        }
-      }
-      if (zeros == 1) {
-        WriteBits(&block_stream, symbols[0].code, symbols[0].bits);
-      } else if (zeros == 2) {
-        WriteBits(&block_stream, symbols[kSymTwoZeros].code,
-                  symbols[kSymTwoZeros].bits);
-      } else if (zeros <= 6) {
-        uint32_t count = (uint32_t)(zeros - 3);
-        WriteBits(&block_stream, symbols[kSymUpTo6Zeros].code,
-                  symbols[kSymUpTo6Zeros].bits);
-        WriteBits(&block_stream, count, 2);
-      } else if (zeros <= 22) {
-        uint32_t count = (uint32_t)(zeros - 7);
-        WriteBits(&block_stream, symbols[kSymUpTo22Zeros].code,
-                  symbols[kSymUpTo22Zeros].bits);
-        WriteBits(&block_stream, count, 4);
-      } else if (zeros <= 278) {
-        uint32_t count = (uint32_t)(zeros - 23);
-        WriteBits(&block_stream, symbols[kSymUpTo278Zeros].code,
-                  symbols[kSymUpTo278Zeros].bits);
-        WriteBits(&block_stream, count, 8);
-      } else {
-        uint32_t count = (uint32_t)(zeros - 279);
-        WriteBits(&block_stream, symbols[kSymUpTo16662Zeros].code,
-                  symbols[kSymUpTo16662Zeros].bits);
-        WriteBits(&block_stream, count, 14);
-      }
-      k += zeros;
-    } else {
-      WriteBits(&block_stream, symbols[symbol].code, symbols[symbol].bits);
-      k++;
+// Estimate the entropy of a filtered block from kNumSampleChunks chunks of
+// chunk_size bytes each, which are evenly spread over the block. The result is
+// in bits per byte, with kLog2FracBits fractional bits.
+static uint64_t EstimateEntropy(const uint8_t* in,
+                                size_t in_size,
+                                size_t chunk_size,
+                                int filter,
+                                size_t stride) {
+  // Calculate the histogram of the sample chunks.
+  uint32_t counts[256];
+  memset(counts, 0, sizeof(counts));
+  for (int i = 0; i < kNumSampleChunks; ++i) {
+    size_t offset =
+        ((in_size - chunk_size) * (size_t)i) / (kNumSampleChunks - 1);
+    for (size_t k = offset; k < offset + chunk_size; ++k) {
+      counts[FilteredByte(in, in_size, k, filter, stride)]++;
     }
+  }
 
-    if (UNLIKELY(block_stream.write_failed)) {
-      return PlainCopy(in, in_size, stream, encoded_size);
+  // The entropy of the sample (in bits) is S * log2(S) - sum(c * log2(c)),
+  // where S is the sample size and c are the symbol counts.
+  const uint32_t sample_size = (uint32_t)chunk_size * kNumSampleChunks;
+  uint64_t entropy = CountTimesLog2(sample_size);
+  int num_used = 0;
+  for (int k = 0; k < 256; ++k) {
+    if (counts[k] > 0U) {
+      entropy -= CountTimesLog2(counts[k]);
+      ++num_used;
     }
   }
 
-  // Write final bits to the stream.
-  ForceFlushBitCache(&block_stream);
+  // The entropy of a sample is lower than the entropy of the source, since a
+  // sample never has the symbols in their exact proportions. We correct for
+  // that bias by adding (K - 1) / (2 * S * ln(2)) bits per byte, where K is
+  // the number of used symbols (185 / 2^kLog2FracBits ~= 1 / (2 * ln(2))).
+  return (entropy / sample_size) +
+         (((uint64_t)(num_used - 1) * 185U) / sample_size);
+}
 
-  // Make sure that the compressed buffer fit into this block.
-  size_t encoded_size_wo_hdr =
-      (size_t)(GetBytePtr(&block_stream) - GetBytePtr(stream)) -
-      HZR_BLOCK_HEADER_SIZE;
-  if (UNLIKELY(block_stream.write_failed ||
-               (encoded_size_wo_hdr >= HZR_MAX_BLOCK_SIZE))) {
-    return PlainCopy(in, in_size, stream, encoded_size);
+// Check if a (filtered) block is so close to random that Huffman coding it
+// would save less than min_savings percent of the block size, from the
+// estimated entropy of a sample of its bytes. This is much cheaper than
+// building the Huffman codes, which we can then skip for random or already
+// compressed data.
+static hzr_bool LooksIncompressible(const uint8_t* in,
+                                    size_t in_size,
+                                    int min_savings,
+                                    int filter,
+                                    size_t stride) {
+  if (in_size < kMinSampledBlockSize) {
+    return HZR_FALSE;
+  }
+  uint64_t bits_per_byte =
+      EstimateEntropy(in, in_size, kSampleChunkSize, filter, stride);
+
+  // Compare the entropy to the largest coded size that is worth the effort.
+  const uint64_t max_bits_per_byte =
+      ((uint64_t)(8 << kLog2FracBits) * (uint64_t)(100 - min_savings)) / 100U;
+  return (bits_per_byte + kSampleEntropyMargin >= max_bits_per_byte)
+             ? HZR_TRUE
+             : HZR_FALSE;
+}
+
+// The smallest sample chunk that is used for picking the filter of a block
+// (smaller blocks are not filtered by HZR_FILTER_AUTO).
+#define kMinFilterSampleChunkSize 16
+
+// Get the filter (HZR_BLOCK_FILTER_*) to use for a block. For HZR_FILTER_AUTO,
+// the filter that gives the lowest estimated entropy is used. Small blocks are
+// sampled in full.
+static int SelectFilter(const uint8_t* in,
+                        size_t in_size,
+                        int filter_option,
+                        size_t stride) {
+  // With the filter stride, a filtered single byte block would be larger than
+  // a plain copy.
+  if (in_size < 2) {
+    return HZR_BLOCK_FILTER_NONE;
+  }
+  if (filter_option == HZR_FILTER_DELTA) {
+    return HZR_BLOCK_FILTER_DELTA;
+  }
+  if (filter_option == HZR_FILTER_DELTA16) {
+    return HZR_BLOCK_FILTER_DELTA16;
+  }
+  const size_t chunk_size = hzr_min(in_size / kNumSampleChunks,
+                                    (size_t)kSampleChunkSize);
+  if (filter_option != HZR_FILTER_AUTO ||
+      chunk_size < kMinFilterSampleChunkSize) {
+    return HZR_BLOCK_FILTER_NONE;
+  }
+  int best_filter = HZR_BLOCK_FILTER_NONE;
+  uint64_t best_entropy =
+      EstimateEntropy(in, in_size, chunk_size, HZR_BLOCK_FILTER_NONE, stride);
+  for (int filter = HZR_BLOCK_FILTER_DELTA; filter <= HZR_BLOCK_FILTER_LAST;
+       ++filter) {
+    uint64_t entropy = EstimateEntropy(in, in_size, chunk_size, filter, stride);
+    if (entropy < best_entropy) {
+      best_filter = filter;
+      best_entropy = entropy;
+    }
+  }
+  return best_filter;
+}
+
+// Get the minimum savings option, in percent.
+static int MinSavings(const hzr_encode_options_t* options) {
+  return hzr_min(hzr_max(options->min_savings, 0), 100);
+}
+
+// Get the filter stride option.
+static size_t FilterStride(const hzr_encode_options_t* options) {
+  return (size_t)hzr_min(hzr_max(options->filter_stride, 1),
+                         HZR_MAX_FILTER_STRIDE);
+}
+
+// Encode the data of a single block. The scratch memory must have room for
+// in_size tokens. If statistics are collected, the time of each phase from
+// start_ticks and on is added to the statistics.
+static hzr_status_t EncodeBlockData(WriteStream* stream,
+                                    const uint8_t* in,
+                                    size_t in_size,
+                                    EncodeScratch* scratch,
+                                    const BlockLayout* layout,
+                                    size_t* encoded_size,
+                                    const hzr_encode_options_t* options,
+                                    hzr_stats_t* stats,
+                                    uint64_t* start_ticks) {
+  ASSERT((stream->bit_pos & 7) == 0);
+
+  // Create a stream that is limited to this block (this is required to detect
+  // block buffer overruns).
+  const size_t header_size = layout->header_size;
+  WriteStream block_stream = *stream;
+  block_stream.end_ptr = GetBytePtr(&block_stream) + header_size + in_size;
+  if (block_stream.end_ptr > stream->end_ptr) {
+    block_stream.end_ptr = stream->end_ptr;
+  }
+
+  // Leave room for the block header (will be filled out later).
+  if (UNLIKELY((GetBytePtr(&block_stream) + header_size) >
+               block_stream.end_ptr)) {
+    DLOG("Block buffer is too small for holding the block header.");
+    return HZR_FAIL;
+  }
+  block_stream.byte_ptr += header_size;
+  const uint8_t* const data_start = block_stream.byte_ptr;
+
+  // Pick the filter of the block.
+  const size_t stride = FilterStride(options);
+  const int filter = SelectFilter(in, in_size, options->filter, stride);
+
+  // Skip the Huffman coding altogether if the data looks incompressible.
+  const int min_savings = MinSavings(options);
+  const hzr_bool incompressible =
+      LooksIncompressible(in, in_size, min_savings, filter, stride);
+  HZR_STATS_LAP(stats, filter_ticks, *start_ticks);
+  if (incompressible) {
+    return PlainCopy(in, in_size, stream, layout, encoded_size);
+  }
+
+  // The filter stride is the first byte of the encoded data. The block data is
+  // filtered on the fly by the tokenizer. Plain copies (e.g. if compression
+  // fails) hold the original data.
+  if (filter != HZR_BLOCK_FILTER_NONE) {
+    WriteBits(&block_stream, (uint32_t)stride, 8);
+  }
+
+  // Tokenize the input data and calculate the histogram. For multiple streams,
+  // the tokens of each segment are stored at the start offset of the segment.
+  // Blocks of 16-bit samples (wide symbols) must have an even size.
+  const hzr_bool multi_stream =
+      (options->multi_stream && !options->table &&
+       in_size >= kMinMultiStreamBlockSize)
+          ? HZR_TRUE
+          : HZR_FALSE;
+  const hzr_bool wide =
+      (options->wide_symbols && !options->table && (in_size & 1U) == 0U)
+          ? HZR_TRUE
+          : HZR_FALSE;
+  const int num_streams = multi_stream ? kNumMultiStreams : 1;
+  SymbolInfo* symbols = scratch->symbols;
+  Token* tokens = scratch->tokens;
+  size_t num_tokens[kNumMultiStreams];
+  ClearHistogram(symbols);
+  if (multi_stream) {
+    for (int i = 0; i < kNumMultiStreams; ++i) {
+      size_t start = wide ? _hzr_segment_start16(in_size, i)
+                          : _hzr_segment_start(in_size, i);
+      size_t end = wide ? _hzr_segment_start16(in_size, i + 1)
+                        : _hzr_segment_start(in_size, i + 1);
+      num_tokens[i] = wide ? Tokenize16(in, in_size, start, end, &tokens[start],
+                                        symbols, filter, stride)
+                           : Tokenize(in, in_size, start, end, &tokens[start],
+                                      symbols, filter, stride);
+    }
+  } else {
+    num_tokens[0] =
+        wide ? Tokenize16(in, in_size, 0, in_size, tokens, symbols, filter,
+                          stride)
+             : Tokenize(in, in_size, 0, in_size, tokens, symbols, filter,
+                        stride);
+  }
+  HZR_STATS_LAP(stats, histogram_ticks, *start_ticks);
+
+  // Check if we have a single symbol. With 16-bit samples, that is only a fill
+  // if all the bytes are the same (e.g. all the samples are zero).
+  if (OnlySingleCode(symbols) &&
+      (!wide || AllBytesEqual(in, in_size, filter, stride))) {
+    return EncodeFill(in, stream, layout, filter, stride, encoded_size);
+  }
+
+  // Build the Huffman codes, and write them to the output stream (a shared
+  // table is only referenced by its ID).
+  int encoding_mode;
+  if (options->table) {
+    const SymbolInfo* table_sym =
+        (const SymbolInfo*)options->table->encode_table;
+    for (int k = 0; k < kNumSymbols; ++k) {
+      symbols[k].code = table_sym[k].code;
+      symbols[k].bits = table_sym[k].bits;
+    }
+    WriteBits(&block_stream, options->table->id, 16);
+    encoding_mode = HZR_ENCODING_TABLE;
+  } else {
+    WriteStream tree_start = block_stream;
+    if (wide) {
+      MakeTree(scratch, &block_stream);
+      encoding_mode =
+          multi_stream ? HZR_ENCODING_HUFF16_MULTI : HZR_ENCODING_HUFF16;
+    } else if (options->canonical_codes) {
+      MakeCanonicalCodes(scratch, &block_stream);
+      encoding_mode =
+          multi_stream ? HZR_ENCODING_CANONICAL_MULTI : HZR_ENCODING_CANONICAL;
+    } else {
+      MakeTree(scratch, &block_stream);
+      encoding_mode =
+          multi_stream ? HZR_ENCODING_HUFF_RLE_MULTI : HZR_ENCODING_HUFF_RLE;
+    }
+
+    // Drop the new tree if the codes of a previous block are good enough.
+    if (options->reuse_trees) {
+      size_t tree_bits =
+          block_stream.write_failed
+              ? SIZE_MAX / 2
+              : ((size_t)(block_stream.byte_ptr - tree_start.byte_ptr)) * 8 +
+                    (size_t)block_stream.bit_pos;
+      if (ShouldReuseCodes(scratch, tree_bits, wide)) {
+        CopyWriteState(&block_stream, &tree_start);
+        for (int k = 0; k < kNumSymbols; ++k) {
+          symbols[k].code = scratch->reuse_codes[k];
+          symbols[k].bits = (int)scratch->reuse_bits[k];
+        }
+        encoding_mode =
+            multi_stream ? HZR_ENCODING_REUSE_MULTI : HZR_ENCODING_REUSE;
+      }
+    }
+  }
+  HZR_STATS_LAP(stats, tree_ticks, *start_ticks);
+  if (UNLIKELY(block_stream.write_failed)) {
+    return PlainCopy(in, in_size, stream, layout, encoded_size);
+  }
+
+  // Determine how many symbols that fit in the bit cache after a flush (the
+  // longest code for each symbol, including any RLE count). At the same time,
+  // calculate the size of the coded data (in addition to the tree and the
+  // stream sizes, plus stream padding).
+  const int size_bytes = layout->size_bits / 8;
+  int max_symbol_bits = 1;
+  uint64_t num_symbols = 0U;
+  uint64_t symbol_bits = 0U;
+  for (int k = 0; k < kNumSymbols; ++k) {
+    if (symbols[k].count > 0) {
+      int bits = symbols[k].bits + SymbolExtraBits(k, wide);
+      max_symbol_bits = hzr_max(max_symbol_bits, bits);
+      num_symbols += (uint64_t)symbols[k].count;
+      symbol_bits += (uint64_t)symbols[k].count * (uint64_t)bits;
+    }
+  }
+  uint64_t coded_bits =
+      ((uint64_t)(block_stream.byte_ptr - data_start)) * 8U +
+      (uint64_t)block_stream.bit_pos + (uint64_t)(num_streams * 7) +
+      symbol_bits;
+  if (multi_stream) {
+    coded_bits += (uint64_t)(size_bytes * (kNumMultiStreams - 1) * 8);
+  }
+  const int batch_size = kBitCacheRoom / max_symbol_bits;
+
+  // Don't emit the tokens if the coded data would not be smaller than a plain
+  // copy (minus the requested savings).
+  const uint64_t max_coded_size =
+      (uint64_t)in_size - ((uint64_t)in_size * (uint64_t)min_savings) / 100U;
+  if (((coded_bits + 7U) >> 3) >= max_coded_size) {
+    return PlainCopy(in, in_size, stream, layout, encoded_size);
+  }
+
+  // Emit the tokens.
+  if (multi_stream) {
+    // Reserve room for the stream sizes at the next byte boundary.
+    ForceFlushBitCache(&block_stream);
+    uint8_t* sizes_ptr = GetBytePtr(&block_stream);
+    if (UNLIKELY(block_stream.write_failed ||
+                 (block_stream.end_ptr - sizes_ptr <
+                  size_bytes * (kNumMultiStreams - 1)))) {
+      return PlainCopy(in, in_size, stream, layout, encoded_size);
+    }
+    block_stream.byte_ptr += size_bytes * (kNumMultiStreams - 1);
+
+    for (int i = 0; i < num_streams; ++i) {
+      uint8_t* stream_start = GetBytePtr(&block_stream);
+      const size_t start = wide ? _hzr_segment_start16(in_size, i)
+                                : _hzr_segment_start(in_size, i);
+      EmitStreamTokens(&block_stream, symbols, &tokens[start], num_tokens[i],
+                       batch_size, wide);
+      ForceFlushBitCache(&block_stream);
+      if (UNLIKELY(block_stream.write_failed)) {
+        return PlainCopy(in, in_size, stream, layout, encoded_size);
+      }
+      if (i < num_streams - 1) {
+        uint64_t stream_size =
+            (uint64_t)(GetBytePtr(&block_stream) - stream_start);
+        for (int k = 0; k < size_bytes; ++k) {
+          *sizes_ptr++ = (uint8_t)(stream_size >> (8 * k));
+        }
+      }
+    }
+  } else {
+    EmitStreamTokens(&block_stream, symbols, tokens, num_tokens[0], batch_size,
+                     wide);
+    ForceFlushBitCache(&block_stream);
+  }
+
+  // Make sure that the compressed buffer fit into this block.
+  size_t encoded_size_wo_hdr =
+      (size_t)(GetBytePtr(&block_stream) - GetBytePtr(stream)) - header_size;
+  if (UNLIKELY(block_stream.write_failed ||
+               (encoded_size_wo_hdr >= layout->block_size))) {
+    return PlainCopy(in, in_size, stream, layout, encoded_size);
   }
 
   // Return the size of the encoded output data.
-  *encoded_size = encoded_size_wo_hdr + HZR_BLOCK_HEADER_SIZE;
+  *encoded_size = encoded_size_wo_hdr + header_size;
 
   // Calculate the CRC for the compressed buffer.
-  uint8_t* encoded_start = GetBytePtr(stream) + HZR_BLOCK_HEADER_SIZE;
+  HZR_STATS_LAP(stats, coding_ticks, *start_ticks);
+  uint8_t* encoded_start = GetBytePtr(stream) + header_size;
   uint32_t crc32 = _hzr_crc32(encoded_start, encoded_size_wo_hdr);
+  HZR_STATS_LAP(stats, crc_ticks, *start_ticks);
 
   // Write the block header.
-  WriteBits(stream, (uint32_t)(encoded_size_wo_hdr - 1), 16);
-  WriteBits(stream, crc32, 32);
-  WriteBits(stream, HZR_ENCODING_HUFF_RLE, 8);
+  StoreBlockHeader(GetBytePtr(stream), layout, encoded_size_wo_hdr, crc32,
+                   encoding_mode | (filter << HZR_FILTER_SHIFT));
+
+  // Later blocks in the same tree reuse group may use the codes of this block.
+  if (options->reuse_trees && (encoding_mode != HZR_ENCODING_TABLE) &&
+      (encoding_mode != HZR_ENCODING_REUSE) &&
+      (encoding_mode != HZR_ENCODING_REUSE_MULTI)) {
+    for (int k = 0; k < kNumSymbols; ++k) {
+      scratch->reuse_codes[k] = symbols[k].code;
+      scratch->reuse_bits[k] =
+          (symbols[k].count > 0) ? (uint8_t)symbols[k].bits : 0U;
+    }
+    scratch->has_reuse_codes = HZR_TRUE;
+    scratch->reuse_wide = wide;
+  }
 
   // Commit the stream state.
   CopyWriteState(stream, &block_stream);
 
+  if (stats) {
+    stats->coded_symbols += num_symbols;
+    stats->coded_bits += symbol_bits;
+  }
+
   return HZR_OK;
 }
 
+// Encode a single block, and update the statistics (if any). The time that is
+// not part of any other phase (e.g. plain copies) counts as coding time.
+static hzr_status_t EncodeSingleBlock(WriteStream* stream,
+                                      const uint8_t* in,
+                                      size_t in_size,
+                                      EncodeScratch* scratch,
+                                      const BlockLayout* layout,
+                                      size_t* encoded_size,
+                                      const hzr_encode_options_t* options,
+                                      hzr_stats_t* stats) {
+  uint64_t start_ticks = _hzr_stats_start(stats);
+  hzr_status_t status =
+      EncodeBlockData(stream, in, in_size, scratch, layout, encoded_size,
+                      options, stats, &start_ticks);
+  if (stats && status == HZR_OK) {
+    HZR_STATS_LAP(stats, coding_ticks, start_ticks);
+    const uint8_t* block_start = GetBytePtr(stream) - *encoded_size;
+    _hzr_stats_add_block(stats, block_start[layout->header_size - 1], in_size,
+                         *encoded_size);
+  }
+  return status;
+}
+
+// A gather list of input segments, that are encoded as one concatenated
+// buffer. The segment cursor is the segment that holds the last block that was
+// looked up, and segment_start is the offset of that segment in the input.
+// Blocks that span several segments are gathered into the block buffer.
+typedef struct {
+  const hzr_iovec_t* segments;
+  size_t num_segments;
+  size_t segment;
+  size_t segment_start;
+  uint8_t* block_buf;
+  size_t block_buf_size;
+} GatherInput;
+
+static void InitGatherInput(GatherInput* gather,
+                            const hzr_iovec_t* segments,
+                            size_t num_segments) {
+  gather->segments = segments;
+  gather->num_segments = num_segments;
+  gather->segment = 0;
+  gather->segment_start = 0;
+  gather->block_buf = NULL;
+  gather->block_buf_size = 0;
+}
+
+// Get the input data of a block, which starts in_offset bytes into the
+// concatenated input. The data is used in place if the block is contained in a
+// single segment. Returns NULL on failure.
+// Note: The segments must hold at least in_offset + size bytes.
+static const uint8_t* GatherBlock(GatherInput* gather,
+                                  size_t in_offset,
+                                  size_t size) {
+  // Find the segment that holds the first byte of the block (blocks are usually
+  // looked up in order, so start at the current segment).
+  if (in_offset < gather->segment_start) {
+    gather->segment = 0;
+    gather->segment_start = 0;
+  }
+  while (gather->segment_start + gather->segments[gather->segment].size <=
+         in_offset) {
+    gather->segment_start += gather->segments[gather->segment].size;
+    ++gather->segment;
+  }
+  const hzr_iovec_t* segment = &gather->segments[gather->segment];
+  size_t pos = in_offset - gather->segment_start;
+  if (segment->size - pos >= size) {
+    return ((const uint8_t*)segment->data) + pos;
+  }
+
+  // Gather the block from several segments.
+  if (gather->block_buf_size < size) {
+    free(gather->block_buf);
+    gather->block_buf = (uint8_t*)malloc(size);
+    gather->block_buf_size = gather->block_buf ? size : 0;
+    if (UNLIKELY(!gather->block_buf)) {
+      DLOG("Out of memory.");
+      return NULL;
+    }
+  }
+  for (size_t count = 0; count < size; ++segment, pos = 0) {
+    size_t n = hzr_min(segment->size - pos, size - count);
+    if (n > 0) {
+      memcpy(&gather->block_buf[count], ((const uint8_t*)segment->data) + pos,
+             n);
+    }
+    count += n;
+  }
+  return gather->block_buf;
+}
+
+// Shared state for a multi-threaded encode job. Each block is reserved an
+// output slot of slot_size bytes (i.e. the worst case encoded block size).
+// The blocks are handed out to the threads in units of blocks_per_item blocks.
+// If statistics are collected, each thread has its own statistics. The input
+// is either a buffer or a gather list (in is NULL), and each thread gathers
+// blocks into a block buffer of its own.
+typedef struct {
+  const uint8_t* in;
+  const GatherInput* gather;
+  size_t in_size;
+  uint8_t* out;
+  size_t slot_size;
+  size_t num_blocks;
+  size_t blocks_per_item;
+  size_t* encoded_sizes;
+  EncodeScratch** scratch;
+  hzr_stats_t* stats;
+  const BlockLayout* layout;
+  const hzr_encode_options_t* options;
+} EncodeJob;
+
+static hzr_status_t EncodeBlocksTask(void* context,
+                                     int thread_no,
+                                     size_t begin,
+                                     size_t end) {
+  EncodeJob* job = (EncodeJob*)context;
+  EncodeScratch* scratch = job->scratch[thread_no];
+  hzr_stats_t* stats = job->stats ? &job->stats[thread_no] : NULL;
+  const BlockLayout* layout = job->layout;
+  const size_t first_block = begin * job->blocks_per_item;
+  const size_t end_block = hzr_min(end * job->blocks_per_item, job->num_blocks);
+  GatherInput gather;
+  if (job->gather) {
+    InitGatherInput(&gather, job->gather->segments, job->gather->num_segments);
+  }
+  hzr_status_t status = HZR_OK;
+  for (size_t block = first_block; block < end_block; ++block) {
+    StartTreeReuseGroup(scratch, block);
+    size_t in_offset = block * layout->block_size;
+    size_t this_block_size =
+        hzr_min(job->in_size - in_offset, layout->block_size);
+    const uint8_t* block_in =
+        job->gather ? GatherBlock(&gather, in_offset, this_block_size)
+                    : &job->in[in_offset];
+    if (UNLIKELY(!block_in)) {
+      status = HZR_FAIL;
+      break;
+    }
+
+    // Encode the block into its own worst case sized slot of the output
+    // buffer.
+    WriteStream stream;
+    InitWriteStream(&stream, job->out + block * job->slot_size,
+                    layout->header_size + this_block_size);
+    status = EncodeSingleBlock(&stream, block_in, this_block_size, scratch,
+                               layout, &job->encoded_sizes[block],
+                               job->options, stats);
+    if (status != HZR_OK) {
+      break;
+    }
+  }
+  if (job->gather) {
+    free(gather.block_buf);
+  }
+  return status;
+}
+
+// Encode all the blocks using several threads. The input is either a buffer or
+// a gather list (in is NULL).
+// Note: The output stream must have room for worst case sized blocks.
+static hzr_status_t EncodeBlocksMT(WriteStream* stream,
+                                   const uint8_t* in,
+                                   const GatherInput* gather,
+                                   size_t in_size,
+                                   size_t num_blocks,
+                                   const BlockLayout* layout,
+                                   const hzr_encode_options_t* options) {
+  ASSERT(stream->bit_pos == 0);
+
+  EncodeJob job;
+  job.in = in;
+  job.gather = gather;
+  job.in_size = in_size;
+  job.out = stream->byte_ptr;
+  job.slot_size = layout->block_size + layout->header_size;
+  job.num_blocks = num_blocks;
+  job.layout = layout;
+  job.options = options;
+  job.encoded_sizes = (size_t*)malloc(sizeof(size_t) * num_blocks);
+
+  // With tree reuse, a thread must encode whole tree reuse groups (otherwise
+  // the result would depend on how the blocks are split between the threads).
+  job.blocks_per_item = options->reuse_trees ? HZR_TREE_REUSE_GROUP_SIZE : 1;
+  const size_t num_items =
+      (num_blocks + job.blocks_per_item - 1) / job.blocks_per_item;
+
+  // Each thread needs its own scratch memory.
+  size_t num_threads = hzr_min((size_t)options->num_threads, num_items);
+  job.scratch = (EncodeScratch**)calloc(num_threads, sizeof(EncodeScratch*));
+  job.stats = options->stats
+                  ? (hzr_stats_t*)calloc(num_threads, sizeof(hzr_stats_t))
+                  : NULL;
+  hzr_status_t status = (job.encoded_sizes && job.scratch &&
+                         (job.stats || !options->stats))
+                            ? HZR_OK
+                            : HZR_FAIL;
+  for (size_t i = 0; status == HZR_OK && i < num_threads; ++i) {
+    job.scratch[i] = CreateEncodeScratch(layout->block_size);
+    if (UNLIKELY(!job.scratch[i])) {
+      status = HZR_FAIL;
+    }
+  }
+
+  // Encode all the blocks in parallel.
+  if (status == HZR_OK) {
+    status = _hzr_parallel_for(EncodeBlocksTask, &job, num_items,
+                               (int)num_threads);
+  } else {
+    DLOG("Out of memory.");
+  }
+
+  // Move the encoded blocks into place. This is safe to do in place, since
+  // the final position of a block is never after its slot position.
+  if (status == HZR_OK) {
+    for (size_t block = 0; block < num_blocks; ++block) {
+      memmove(stream->byte_ptr, job.out + block * job.slot_size,
+              job.encoded_sizes[block]);
+      stream->byte_ptr += job.encoded_sizes[block];
+    }
+  }
+
+  if (job.scratch) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      _hzr_aligned_free(job.scratch[i]);
+    }
+  }
+  if (job.stats) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      _hzr_stats_add(options->stats, &job.stats[i]);
+    }
+  }
+  free(job.stats);
+  free(job.scratch);
+  free(job.encoded_sizes);
+  return status;
+}
+
+// Encode all the blocks in the calling thread. The input is either a buffer or
+// a gather list (in is NULL). If no scratch memory is given, temporary scratch
+// memory is allocated.
+static hzr_status_t EncodeBlocks(WriteStream* stream,
+                                 const uint8_t* in,
+                                 GatherInput* gather,
+                                 size_t in_size,
+                                 EncodeScratch* scratch,
+                                 const BlockLayout* layout,
+                                 const hzr_encode_options_t* options) {
+  if (in_size == 0) {
+    return HZR_OK;
+  }
+
+  EncodeScratch* own_scratch = NULL;
+  if (!scratch) {
+    own_scratch = CreateEncodeScratch(hzr_min(in_size, layout->block_size));
+    if (UNLIKELY(!own_scratch)) {
+      return HZR_FAIL;
+    }
+    scratch = own_scratch;
+  }
+
+  hzr_status_t status = HZR_OK;
+  for (size_t block = 0, in_offset = 0; in_offset < in_size; ++block) {
+    StartTreeReuseGroup(scratch, block);
+    size_t this_block_size = hzr_min(in_size - in_offset, layout->block_size);
+    const uint8_t* block_in =
+        gather ? GatherBlock(gather, in_offset, this_block_size)
+               : &in[in_offset];
+    if (UNLIKELY(!block_in)) {
+      status = HZR_FAIL;
+      break;
+    }
+    size_t this_encoded_size = 0;
+    status = EncodeSingleBlock(stream, block_in, this_block_size, scratch,
+                               layout, &this_encoded_size, options,
+                               options->stats);
+    if (status != HZR_OK) {
+      break;
+    }
+    in_offset += this_block_size;
+  }
+
+  _hzr_aligned_free(own_scratch);
+  return status;
+}
+
+// Get the block layout for the block size of the encoder options. Returns
+// HZR_FAIL if the block size is not supported.
+static hzr_status_t GetBlockLayout(const hzr_encode_options_t* options,
+                                   BlockLayout* layout) {
+  size_t block_size = options ? options->block_size : 0;
+  if (block_size == 0) {
+    block_size = HZR_DEFAULT_BLOCK_SIZE;
+  }
+  int block_size_log2 = HZR_MIN_BLOCK_SIZE_LOG2;
+  while ((block_size_log2 < HZR_MAX_BLOCK_SIZE_LOG2) &&
+         ((((size_t)1) << block_size_log2) < block_size)) {
+    ++block_size_log2;
+  }
+  _hzr_init_block_layout(layout, block_size_log2);
+  if (UNLIKELY(layout->block_size != block_size)) {
+    DLOG("Unsupported block size.");
+    _hzr_init_block_layout(layout, HZR_DEFAULT_BLOCK_SIZE_LOG2);
+    return HZR_FAIL;
+  }
+  return HZR_OK;
+}
+
+// The plain master header can only represent sizes up to 4 GiB - 2 bytes, so
+// larger buffers always get an extended header. So do buffers with other block
+// sizes than the default.
+static hzr_bool UseExtendedHeader(size_t in_size,
+                                  const BlockLayout* layout,
+                                  const hzr_encode_options_t* options) {
+  return ((uint64_t)in_size >= (uint64_t)HZR_SIZE_STREAMED ||
+          layout->block_size != HZR_DEFAULT_BLOCK_SIZE ||
+          (options && options->extended_header))
+             ? HZR_TRUE
+             : HZR_FALSE;
+}
+
+// Write an extended master header.
+static void WriteExtendedHeader(WriteStream* stream,
+                                uint64_t decoded_size,
+                                const BlockLayout* layout,
+                                unsigned flags) {
+  uint8_t data[HZR_EXT_HEADER_DATA_SIZE];
+  data[0] = HZR_FORMAT_VERSION;
+  data[1] = (uint8_t)flags;
+  data[2] = (uint8_t)layout->block_size_log2;
+  for (int i = 0; i < 8; ++i) {
+    data[3 + i] = (uint8_t)(decoded_size >> (8 * i));
+  }
+
+  WriteBits(stream, HZR_SIZE_STREAMED, 32);
+  WriteBits(stream, HZR_EXT_HEADER_DATA_SIZE - 1, 16);
+  WriteBits(stream, _hzr_crc32(data, HZR_EXT_HEADER_DATA_SIZE), 32);
+  WriteBits(stream, HZR_ENCODING_HEADER, 8);
+  for (int i = 0; i < HZR_EXT_HEADER_DATA_SIZE; ++i) {
+    WriteBits(stream, data[i], 8);
+  }
+  ForceFlushBitCache(stream);
+}
+
+// Calculate the size of the block index (in bytes).
+static size_t IndexSize(size_t num_blocks) {
+  return num_blocks * HZR_INDEX_ENTRY_SIZE + HZR_INDEX_FOOTER_SIZE;
+}
+
+// Append a block index to the output stream. The block offsets are found by
+// following the chain of block headers that have already been written.
+static hzr_status_t WriteIndex(WriteStream* stream,
+                               const uint8_t* out,
+                               size_t header_size,
+                               const BlockLayout* layout,
+                               size_t num_blocks) {
+  ASSERT(stream->bit_pos == 0);
+
+  uint8_t* index_start = GetBytePtr(stream);
+  if (UNLIKELY((index_start + IndexSize(num_blocks)) > stream->end_ptr)) {
+    DLOG("Output buffer too small for the block index.");
+    return HZR_FAIL;
+  }
+
+  uint64_t block_offset = (uint64_t)header_size;
+  for (size_t block = 0; block < num_blocks; ++block) {
+    uint64_t decoded_offset = (uint64_t)block * layout->block_size;
+    WriteBits(stream, (uint32_t)block_offset, 32);
+    WriteBits(stream, (uint32_t)(block_offset >> 32), 32);
+    WriteBits(stream, (uint32_t)decoded_offset, 32);
+    WriteBits(stream, (uint32_t)(decoded_offset >> 32), 32);
+
+    // Skip to the next block.
+    const uint8_t* header = &out[block_offset];
+    size_t encoded_size = 0;
+    for (int i = 0; i < layout->size_bits; i += 8) {
+      encoded_size |= ((size_t)*header++) << i;
+    }
+    block_offset += layout->header_size + encoded_size + 1;
+  }
+  WriteBits(stream, (uint32_t)num_blocks, 32);
+  ForceFlushBitCache(stream);
+
+  // Write the index footer.
+  uint32_t crc32 =
+      _hzr_crc32(index_start, (size_t)(GetBytePtr(stream) - index_start));
+  WriteBits(stream, crc32, 32);
+  WriteBits(stream, HZR_INDEX_SIGNATURE, 32);
+  ForceFlushBitCache(stream);
+
+  return stream->write_failed ? HZR_FAIL : HZR_OK;
+}
+
+void hzr_init_encode_options(hzr_encode_options_t* options) {
+  options->num_threads = 1;
+  options->add_index = 0;
+  options->canonical_codes = 0;
+  options->multi_stream = 0;
+  options->table = NULL;
+  options->extended_header = 0;
+  options->block_size = HZR_DEFAULT_BLOCK_SIZE;
+  options->reuse_trees = 0;
+  options->min_savings = 0;
+  options->filter = HZR_FILTER_NONE;
+  options->filter_stride = 1;
+  options->wide_symbols = 0;
+  options->stats = NULL;
+}
+
+// Calculate the worst case size of the encoded blocks (in bytes).
+static size_t MaxBlocksSize(const BlockLayout* layout,
+                            size_t uncompressed_size) {
+  return (_hzr_num_blocks(layout, uncompressed_size) * layout->header_size) +
+         uncompressed_size;
+}
+
 size_t hzr_max_compressed_size(size_t uncompressed_size) {
-  size_t data_size = 0;
-  if (uncompressed_size > 0) {
-    size_t num_blocks =
-        (uncompressed_size + HZR_MAX_BLOCK_SIZE - 1) / HZR_MAX_BLOCK_SIZE;
-    data_size = (num_blocks * HZR_BLOCK_HEADER_SIZE) + uncompressed_size;
+  return hzr_max_compressed_size_ex(uncompressed_size, NULL);
+}
+
+size_t hzr_max_compressed_size_ex(size_t uncompressed_size,
+                                  const hzr_encode_options_t* options) {
+  BlockLayout layout;
+  (void)GetBlockLayout(options, &layout);
+  size_t max_size = MaxBlocksSize(&layout, uncompressed_size);
+  max_size += UseExtendedHeader(uncompressed_size, &layout, options)
+                  ? HZR_EXT_HEADER_SIZE
+                  : HZR_HEADER_SIZE;
+  if (options && options->add_index) {
+    max_size += IndexSize(_hzr_num_blocks(&layout, uncompressed_size));
   }
-  return HZR_HEADER_SIZE + data_size;
+  return max_size;
 }
 
 hzr_status_t hzr_encode(const void* in,
@@ -501,14 +2083,39 @@ hzr_status_t hzr_encode(const void* in,
                         void* out,
                         size_t out_size,
                         size_t* encoded_size) {
-  // Check input arguments.
-  if (UNLIKELY(!in || !out || !encoded_size)) {
-    DLOG("Invalid input arguments.");
-    return HZR_FAIL;
-  }
+  return hzr_encode_ex(in, in_size, out, out_size, encoded_size, NULL);
+}
 
+hzr_status_t hzr_encode_mt(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           size_t* encoded_size,
+                           int num_threads) {
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  options.num_threads = num_threads;
+  return hzr_encode_ex(in, in_size, out, out_size, encoded_size, &options);
+}
+
+// Encode a buffer or a gather list (in is NULL) with a given block layout (the
+// options must have been checked by GetBlockLayout()). The scratch memory is
+// used by the single threaded encoder (NULL to allocate temporary scratch
+// memory), and it must have room for the tokens of a block.
+static hzr_status_t EncodeWithLayout(const void* in,
+                                     GatherInput* gather,
+                                     size_t in_size,
+                                     void* out,
+                                     size_t out_size,
+                                     size_t* encoded_size,
+                                     const hzr_encode_options_t* options,
+                                     const BlockLayout* layout,
+                                     EncodeScratch* scratch) {
   // Check that there is enough space in the output buffer for the header.
-  if (UNLIKELY(out_size < HZR_HEADER_SIZE)) {
+  const hzr_bool extended = UseExtendedHeader(in_size, layout, options);
+  const size_t header_size =
+      extended ? HZR_EXT_HEADER_SIZE : (size_t)HZR_HEADER_SIZE;
+  if (UNLIKELY(out_size < header_size)) {
     DLOG("The output buffer is too small.");
     return HZR_FAIL;
   }
@@ -518,27 +2125,719 @@ hzr_status_t hzr_encode(const void* in,
   InitWriteStream(&stream, out, out_size);
 
   // Write the master header.
-  WriteBits(&stream, (uint32_t)in_size, 32);
-  ForceFlushBitCache(&stream);
-  size_t total_encoded_size = HZR_HEADER_SIZE;
-
-  // Compress the input data block by block.
-  const uint8_t* in_data = (const uint8_t*)in;
-  size_t input_bytes_left = in_size;
-  while (input_bytes_left > 0) {
-    size_t this_block_size = hzr_min(input_bytes_left, HZR_MAX_BLOCK_SIZE);
-    size_t this_encoded_size = 0;
-    hzr_status_t status = EncodeSingleBlock(&stream, in_data, this_block_size,
-                                            &this_encoded_size);
+  if (extended) {
+    WriteExtendedHeader(&stream, (uint64_t)in_size, layout,
+                        options->add_index ? HZR_HEADER_FLAG_INDEX : 0U);
+  } else {
+    WriteBits(&stream, (uint32_t)in_size, 32);
+    ForceFlushBitCache(&stream);
+  }
+
+  // Compress the input data block by block. The multi-threaded encoder needs
+  // room for worst case sized blocks. If we don't have that, or if there is
+  // not enough work for several threads, we use the single threaded encoder.
+  size_t num_blocks = _hzr_num_blocks(layout, in_size);
+  hzr_status_t status;
+  if (options->num_threads > 1 && num_blocks > 1 &&
+      out_size - header_size >= MaxBlocksSize(layout, in_size)) {
+    status = EncodeBlocksMT(&stream, (const uint8_t*)in, gather, in_size,
+                            num_blocks, layout, options);
+  } else {
+    status = EncodeBlocks(&stream, (const uint8_t*)in, gather, in_size,
+                          scratch, layout, options);
+  }
+  if (status != HZR_OK) {
+    return status;
+  }
+
+  // Append the block index.
+  if (options->add_index) {
+    status = WriteIndex(&stream, (const uint8_t*)out, header_size, layout,
+                        num_blocks);
     if (status != HZR_OK) {
       return status;
     }
-    total_encoded_size += this_encoded_size;
-    in_data += this_block_size;
-    input_bytes_left -= this_block_size;
   }
 
   // Compression succeeded.
-  *encoded_size = total_encoded_size;
+  *encoded_size = (size_t)(GetBytePtr(&stream) - (uint8_t*)out);
+  return HZR_OK;
+}
+
+// Encode a buffer or a gather list (in is NULL). The scratch memory of the
+// workspace is used by the single threaded encoder (NULL to allocate temporary
+// scratch memory), and it is grown to fit the blocks if necessary.
+static hzr_status_t Encode(const void* in,
+                           GatherInput* gather,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           size_t* encoded_size,
+                           const hzr_encode_options_t* options,
+                           hzr_workspace_t* workspace) {
+  // Check input arguments.
+  if (UNLIKELY((!in && !gather) || !out || !encoded_size)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  // Use the default options if none were given.
+  hzr_encode_options_t default_options;
+  if (!options) {
+    hzr_init_encode_options(&default_options);
+    options = &default_options;
+  }
+  BlockLayout layout;
+  if (GetBlockLayout(options, &layout) != HZR_OK) {
+    return HZR_FAIL;
+  }
+  EncodeScratch* scratch = NULL;
+  if (workspace && options->num_threads <= 1) {
+    scratch =
+        GetWorkspaceScratch(workspace, hzr_min(in_size, layout.block_size));
+    if (UNLIKELY(!scratch)) {
+      DLOG("Out of memory.");
+      return HZR_FAIL;
+    }
+  }
+
+  return EncodeWithLayout(in, gather, in_size, out, out_size, encoded_size,
+                          options, &layout, scratch);
+}
+
+hzr_status_t hzr_encode_ex(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           size_t* encoded_size,
+                           const hzr_encode_options_t* options) {
+  return Encode(in, NULL, in_size, out, out_size, encoded_size, options,
+                NULL);
+}
+
+hzr_status_t hzr_encode_ws(const void* in,
+                           size_t in_size,
+                           void* out,
+                           size_t out_size,
+                           size_t* encoded_size,
+                           const hzr_encode_options_t* options,
+                           hzr_workspace_t* workspace) {
+  if (UNLIKELY(!workspace)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+  return Encode(in, NULL, in_size, out, out_size, encoded_size, options,
+                workspace);
+}
+
+hzr_status_t hzr_encode_iov(const hzr_iovec_t* in,
+                            size_t in_count,
+                            void* out,
+                            size_t out_size,
+                            size_t* encoded_size,
+                            const hzr_encode_options_t* options) {
+  // Check input arguments, and get the total input size.
+  if (UNLIKELY(!in && in_count > 0)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+  size_t in_size = 0;
+  for (size_t i = 0; i < in_count; ++i) {
+    if (UNLIKELY((!in[i].data && in[i].size > 0) ||
+                 in[i].size > SIZE_MAX - in_size)) {
+      DLOG("Invalid input segment.");
+      return HZR_FAIL;
+    }
+    in_size += in[i].size;
+  }
+
+  GatherInput gather;
+  InitGatherInput(&gather, in, in_count);
+  hzr_status_t status = Encode(NULL, &gather, in_size, out, out_size,
+                               encoded_size, options, NULL);
+  free(gather.block_buf);
+  return status;
+}
+
+// State of a batch encoding job. If statistics are collected, each thread has
+// its own statistics.
+typedef struct {
+  hzr_batch_item_t* items;
+  EncodeScratch** scratch;
+  hzr_stats_t* stats;
+  const BlockLayout* layout;
+  const hzr_encode_options_t* options;
+} EncodeBatchJob;
+
+static hzr_status_t EncodeBatchTask(void* context,
+                                    int thread_no,
+                                    size_t begin,
+                                    size_t end) {
+  EncodeBatchJob* job = (EncodeBatchJob*)context;
+  EncodeScratch* scratch = job->scratch[thread_no];
+  hzr_encode_options_t options = *job->options;
+  if (job->stats) {
+    options.stats = &job->stats[thread_no];
+  }
+  for (size_t i = begin; i < end; ++i) {
+    // A failing item does not stop the other items from being encoded.
+    hzr_batch_item_t* item = &job->items[i];
+    item->result_size = 0;
+    if (UNLIKELY(!item->in || !item->out)) {
+      DLOG("Invalid input arguments.");
+      item->status = HZR_FAIL;
+      continue;
+    }
+    item->status =
+        EncodeWithLayout(item->in, NULL, item->in_size, item->out,
+                         item->out_size, &item->result_size, &options,
+                         job->layout, scratch);
+  }
+  return HZR_OK;
+}
+
+hzr_status_t hzr_encode_batch(hzr_batch_item_t* items,
+                              size_t num_items,
+                              const hzr_encode_options_t* options,
+                              hzr_workspace_t* workspace) {
+  if (UNLIKELY((!items && num_items > 0) || !workspace)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  // The options are checked once for all the items. Each item is encoded by
+  // a single thread.
+  hzr_encode_options_t item_options;
+  if (options) {
+    item_options = *options;
+  } else {
+    hzr_init_encode_options(&item_options);
+  }
+  const int num_threads = item_options.num_threads;
+  item_options.num_threads = 1;
+  BlockLayout layout;
+  if (GetBlockLayout(&item_options, &layout) != HZR_OK) {
+    return HZR_FAIL;
+  }
+
+  // The calling thread uses the workspace (its scratch memory is grown to fit
+  // the largest item if necessary), and the other threads need their own
+  // scratch memory.
+  size_t max_block_size = 0;
+  for (size_t i = 0; i < num_items; ++i) {
+    max_block_size = hzr_max(max_block_size, items[i].in_size);
+  }
+  max_block_size = hzr_min(max_block_size, layout.block_size);
+  size_t num_scratch = (num_threads > 1) ? (size_t)num_threads : 1;
+  num_scratch = hzr_max(hzr_min(num_scratch, num_items), (size_t)1);
+  EncodeScratch** scratch =
+      (EncodeScratch**)calloc(num_scratch, sizeof(EncodeScratch*));
+  hzr_stats_t* stats =
+      item_options.stats
+          ? (hzr_stats_t*)calloc(num_scratch, sizeof(hzr_stats_t))
+          : NULL;
+  hzr_status_t status =
+      (scratch && (stats || !item_options.stats)) ? HZR_OK : HZR_FAIL;
+  for (size_t i = 0; status == HZR_OK && i < num_scratch; ++i) {
+    scratch[i] = (i == 0) ? GetWorkspaceScratch(workspace, max_block_size)
+                          : CreateEncodeScratch(max_block_size);
+    if (UNLIKELY(!scratch[i])) {
+      status = HZR_FAIL;
+    }
+  }
+
+  if (status == HZR_OK) {
+    EncodeBatchJob job;
+    job.items = items;
+    job.scratch = scratch;
+    job.stats = stats;
+    job.layout = &layout;
+    job.options = &item_options;
+    status = _hzr_parallel_for(EncodeBatchTask, &job, num_items,
+                               (int)num_scratch);
+    for (size_t i = 0; status == HZR_OK && i < num_items; ++i) {
+      if (items[i].status != HZR_OK) {
+        status = HZR_FAIL;
+      }
+    }
+  } else {
+    DLOG("Out of memory.");
+  }
+
+  if (scratch) {
+    for (size_t i = 0; i < num_scratch; ++i) {
+      if (scratch[i] != (EncodeScratch*)workspace->encode_scratch) {
+        _hzr_aligned_free(scratch[i]);
+      }
+    }
+  }
+  if (stats) {
+    for (size_t i = 0; i < num_scratch; ++i) {
+      _hzr_stats_add(item_options.stats, &stats[i]);
+    }
+  }
+  free(stats);
+  free(scratch);
+  return status;
+}
+
+// Store an end marker (HZR_END_MARKER_SIZE bytes) for a stream of total_size
+// bytes.
+static void StoreEndMarker(uint8_t* marker,
+                           const BlockLayout* layout,
+                           uint64_t total_size) {
+  for (int i = 0; i < 8; ++i) {
+    marker[HZR_BLOCK_HEADER_SIZE + i] = (uint8_t)(total_size >> (8 * i));
+  }
+  StoreBlockHeader(marker, layout, 8,
+                   _hzr_crc32(&marker[HZR_BLOCK_HEADER_SIZE], 8),
+                   HZR_ENCODING_END);
+}
+
+// Size of the output buffer of a streaming encoder. It has room for the end
+// marker and one worst case sized block.
+#define kStreamOutBufSize \
+  (HZR_END_MARKER_SIZE + HZR_BLOCK_HEADER_SIZE + HZR_DEFAULT_BLOCK_SIZE)
+
+// State of a streaming encoder.
+struct hzr_encoder_struct {
+  hzr_encode_options_t options;
+  BlockLayout layout;
+  EncodeScratch* scratch;
+
+  // Buffered input data (less than one block).
+  uint8_t* in_buf;
+  size_t in_fill;
+
+  // Encoded data that has not been delivered yet.
+  uint8_t* out_buf;
+  size_t out_pos;
+  size_t out_len;
+
+  uint64_t total_size;
+  hzr_bool finished;
+};
+
+hzr_encoder_t* hzr_encoder_create(const hzr_encode_options_t* options) {
+  hzr_encoder_t* encoder = (hzr_encoder_t*)malloc(sizeof(hzr_encoder_t));
+  if (UNLIKELY(!encoder)) {
+    DLOG("Out of memory.");
+    return NULL;
+  }
+  encoder->scratch = CreateEncodeScratch(HZR_DEFAULT_BLOCK_SIZE);
+  encoder->in_buf = (uint8_t*)malloc(HZR_DEFAULT_BLOCK_SIZE);
+  encoder->out_buf = (uint8_t*)malloc(kStreamOutBufSize);
+  if (UNLIKELY(!encoder->scratch || !encoder->in_buf || !encoder->out_buf)) {
+    DLOG("Out of memory.");
+    hzr_encoder_destroy(encoder);
+    return NULL;
+  }
+
+  if (options) {
+    encoder->options = *options;
+  } else {
+    hzr_init_encode_options(&encoder->options);
+  }
+  _hzr_init_block_layout(&encoder->layout, HZR_DEFAULT_BLOCK_SIZE_LOG2);
+  encoder->in_fill = 0;
+  encoder->total_size = 0;
+  encoder->finished = HZR_FALSE;
+
+  // The master header is the first pending output.
+  WriteStream stream;
+  InitWriteStream(&stream, encoder->out_buf, HZR_HEADER_SIZE);
+  WriteBits(&stream, HZR_SIZE_STREAMED, 32);
+  encoder->out_pos = 0;
+  encoder->out_len = HZR_HEADER_SIZE;
+
+  return encoder;
+}
+
+void hzr_encoder_destroy(hzr_encoder_t* encoder) {
+  if (encoder) {
+    _hzr_aligned_free(encoder->scratch);
+    free(encoder->in_buf);
+    free(encoder->out_buf);
+    free(encoder);
+  }
+}
+
+// Deliver pending encoded data to the output buffer.
+static void DrainEncoder(hzr_encoder_t* encoder,
+                         uint8_t** out_ptr,
+                         uint8_t* out_end) {
+  size_t count = hzr_min(encoder->out_len - encoder->out_pos,
+                         (size_t)(out_end - *out_ptr));
+  if (count > 0) {
+    memcpy(*out_ptr, &encoder->out_buf[encoder->out_pos], count);
+    encoder->out_pos += count;
+    *out_ptr += count;
+  }
+}
+
+// Encode a block of a stream. The block is encoded directly to the output
+// buffer if there is no pending output and there is room for a worst case
+// sized block, otherwise it is appended to the pending output.
+static hzr_status_t EncodeStreamBlock(hzr_encoder_t* encoder,
+                                      const uint8_t* in,
+                                      size_t in_size,
+                                      uint8_t** out_ptr,
+                                      uint8_t* out_end) {
+  hzr_bool direct =
+      ((encoder->out_pos == encoder->out_len) &&
+       ((size_t)(out_end - *out_ptr) >= HZR_BLOCK_HEADER_SIZE + in_size))
+          ? HZR_TRUE
+          : HZR_FALSE;
+  WriteStream stream;
+  if (direct) {
+    InitWriteStream(&stream, *out_ptr, (size_t)(out_end - *out_ptr));
+  } else {
+    InitWriteStream(&stream, &encoder->out_buf[encoder->out_len],
+                    kStreamOutBufSize - encoder->out_len);
+  }
+  size_t encoded_size;
+  StartTreeReuseGroup(encoder->scratch,
+                      (size_t)(encoder->total_size >>
+                               encoder->layout.block_size_log2));
+  hzr_status_t status =
+      EncodeSingleBlock(&stream, in, in_size, encoder->scratch,
+                        &encoder->layout, &encoded_size, &encoder->options,
+                        encoder->options.stats);
+  if (status != HZR_OK) {
+    return status;
+  }
+  if (direct) {
+    *out_ptr += encoded_size;
+  } else {
+    encoder->out_len += encoded_size;
+  }
+  encoder->total_size += in_size;
   return HZR_OK;
 }
+
+hzr_status_t hzr_encode_update(hzr_encoder_t* encoder,
+                               const void* in,
+                               size_t in_size,
+                               size_t* in_consumed,
+                               void* out,
+                               size_t out_size,
+                               size_t* out_written) {
+  // Check input parameters.
+  if (UNLIKELY(!encoder || (!in && in_size > 0) || (!out && out_size > 0) ||
+               !in_consumed || !out_written || encoder->finished)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  const uint8_t* in_ptr = (const uint8_t*)in;
+  const uint8_t* in_end = (in_size > 0) ? in_ptr + in_size : in_ptr;
+  uint8_t* out_ptr = (uint8_t*)out;
+  uint8_t* out_end = (out_size > 0) ? out_ptr + out_size : out_ptr;
+  hzr_status_t status = HZR_OK;
+  for (;;) {
+    DrainEncoder(encoder, &out_ptr, out_end);
+    if ((encoder->out_pos < encoder->out_len) || (in_ptr == in_end)) {
+      break;
+    }
+    encoder->out_pos = 0;
+    encoder->out_len = 0;
+
+    // Encode whole blocks directly from the input buffer if possible,
+    // otherwise collect a block in the input buffer.
+    size_t in_left = (size_t)(in_end - in_ptr);
+    if ((encoder->in_fill == 0) && (in_left >= HZR_DEFAULT_BLOCK_SIZE)) {
+      status = EncodeStreamBlock(encoder, in_ptr, HZR_DEFAULT_BLOCK_SIZE,
+                                 &out_ptr, out_end);
+      if (status != HZR_OK) {
+        break;
+      }
+      in_ptr += HZR_DEFAULT_BLOCK_SIZE;
+    } else {
+      size_t count = hzr_min((size_t)HZR_DEFAULT_BLOCK_SIZE - encoder->in_fill,
+                             in_left);
+      memcpy(&encoder->in_buf[encoder->in_fill], in_ptr, count);
+      encoder->in_fill += count;
+      in_ptr += count;
+      if (encoder->in_fill == HZR_DEFAULT_BLOCK_SIZE) {
+        status = EncodeStreamBlock(encoder, encoder->in_buf,
+                                   HZR_DEFAULT_BLOCK_SIZE, &out_ptr, out_end);
+        if (status != HZR_OK) {
+          break;
+        }
+        encoder->in_fill = 0;
+      }
+    }
+  }
+
+  *in_consumed = (size_t)(in_ptr - (const uint8_t*)in);
+  *out_written = (size_t)(out_ptr - (uint8_t*)out);
+  return status;
+}
+
+hzr_status_t hzr_encode_finish(hzr_encoder_t* encoder,
+                               void* out,
+                               size_t out_size,
+                               size_t* out_written) {
+  // Check input parameters.
+  if (UNLIKELY(!encoder || (!out && out_size > 0) || !out_written)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  uint8_t* out_ptr = (uint8_t*)out;
+  uint8_t* out_end = (out_size > 0) ? out_ptr + out_size : out_ptr;
+  hzr_status_t status = HZR_OK;
+  DrainEncoder(encoder, &out_ptr, out_end);
+  if (!encoder->finished && (encoder->out_pos == encoder->out_len)) {
+    // Write the end marker, followed by the last block (if any).
+    StoreEndMarker(encoder->out_buf, &encoder->layout,
+                   encoder->total_size + encoder->in_fill);
+    encoder->out_pos = 0;
+    encoder->out_len = HZR_END_MARKER_SIZE;
+    if (encoder->in_fill > 0) {
+      status = EncodeStreamBlock(encoder, encoder->in_buf, encoder->in_fill,
+                                 &out_ptr, out_end);
+      encoder->in_fill = 0;
+    }
+    encoder->finished = HZR_TRUE;
+    DrainEncoder(encoder, &out_ptr, out_end);
+  }
+
+  *out_written = (size_t)(out_ptr - (uint8_t*)out);
+  return status;
+}
+
+// A work item of a pipelined encoder: up to blocks_per_item blocks of input
+// data, and the encoded blocks. If the input data ends with a partial block in
+// this item, the end marker is written before that block (as in
+// hzr_encode_finish()).
+typedef struct {
+  uint8_t* in;
+  size_t in_size;
+  uint8_t* out;
+  size_t out_size;
+  size_t first_block;
+  size_t last_block_pos;
+  uint64_t total_size;
+  hzr_bool partial;
+} EncodePipelineItem;
+
+// Shared state of a pipelined encoder. The producer and the consumer have some
+// state of their own, and each worker thread has its own scratch memory (and
+// statistics).
+typedef struct {
+  hzr_source_t source;
+  void* source_user;
+  hzr_block_sink_t sink;
+  void* sink_user;
+  const hzr_encode_options_t* options;
+  BlockLayout layout;
+  size_t blocks_per_item;
+  EncodeScratch** scratch;
+  hzr_stats_t* stats;
+
+  // Producer state.
+  size_t next_block;
+  uint64_t total_size;
+  hzr_bool in_done;
+
+  // Consumer state.
+  hzr_bool end_written;
+} EncodePipeline;
+
+static hzr_status_t ProduceEncodeItem(void* context,
+                                      void* item_ptr,
+                                      hzr_bool* done) {
+  EncodePipeline* pipeline = (EncodePipeline*)context;
+  EncodePipelineItem* item = (EncodePipelineItem*)item_ptr;
+  if (pipeline->in_done) {
+    *done = HZR_TRUE;
+    return HZR_OK;
+  }
+  const size_t capacity =
+      pipeline->blocks_per_item * pipeline->layout.block_size;
+  if (_hzr_read_source(pipeline->source, pipeline->source_user, item->in,
+                       capacity, &item->in_size) != HZR_OK) {
+    return HZR_FAIL;
+  }
+  if (item->in_size < capacity) {
+    pipeline->in_done = HZR_TRUE;
+    if (item->in_size == 0) {
+      *done = HZR_TRUE;
+      return HZR_OK;
+    }
+  }
+  item->first_block = pipeline->next_block;
+  item->partial = (item->in_size % pipeline->layout.block_size) != 0;
+  pipeline->next_block += _hzr_num_blocks(&pipeline->layout, item->in_size);
+  pipeline->total_size += item->in_size;
+  item->total_size = pipeline->total_size;
+  return HZR_OK;
+}
+
+static hzr_status_t ProcessEncodeItem(void* context,
+                                      int thread_no,
+                                      void* item_ptr) {
+  EncodePipeline* pipeline = (EncodePipeline*)context;
+  EncodePipelineItem* item = (EncodePipelineItem*)item_ptr;
+  EncodeScratch* scratch = pipeline->scratch[thread_no];
+  hzr_stats_t* stats = pipeline->stats ? &pipeline->stats[thread_no] : NULL;
+  const BlockLayout* layout = &pipeline->layout;
+  const size_t slot_size = layout->header_size + layout->block_size;
+  WriteStream stream;
+  InitWriteStream(&stream, item->out, pipeline->blocks_per_item * slot_size);
+  item->out_size = 0;
+  size_t block = item->first_block;
+  for (size_t in_offset = 0; in_offset < item->in_size; ++block) {
+    StartTreeReuseGroup(scratch, block);
+    size_t this_block_size =
+        hzr_min(item->in_size - in_offset, layout->block_size);
+    size_t encoded_size;
+    if (EncodeSingleBlock(&stream, &item->in[in_offset], this_block_size,
+                          scratch, layout, &encoded_size, pipeline->options,
+                          stats) != HZR_OK) {
+      return HZR_FAIL;
+    }
+    item->last_block_pos = item->out_size;
+    item->out_size += encoded_size;
+    in_offset += this_block_size;
+  }
+  return HZR_OK;
+}
+
+static hzr_status_t ConsumeEncodeItem(void* context, void* item_ptr) {
+  EncodePipeline* pipeline = (EncodePipeline*)context;
+  EncodePipelineItem* item = (EncodePipelineItem*)item_ptr;
+  if (!item->partial) {
+    return pipeline->sink(item->out, item->out_size, pipeline->sink_user);
+  }
+
+  // The last block is a partial block, which follows the end marker.
+  uint8_t marker[HZR_END_MARKER_SIZE];
+  StoreEndMarker(marker, &pipeline->layout, item->total_size);
+  pipeline->end_written = HZR_TRUE;
+  if ((item->last_block_pos > 0 &&
+       pipeline->sink(item->out, item->last_block_pos, pipeline->sink_user) !=
+           HZR_OK) ||
+      pipeline->sink(marker, HZR_END_MARKER_SIZE, pipeline->sink_user) !=
+          HZR_OK) {
+    return HZR_FAIL;
+  }
+  return pipeline->sink(&item->out[item->last_block_pos],
+                        item->out_size - item->last_block_pos,
+                        pipeline->sink_user);
+}
+
+hzr_status_t hzr_encode_pipeline(hzr_source_t source,
+                                 void* source_user,
+                                 hzr_block_sink_t sink,
+                                 void* sink_user,
+                                 const hzr_encode_options_t* options) {
+  if (UNLIKELY(!source || !sink)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  // Use the default options if none were given.
+  hzr_encode_options_t default_options;
+  if (!options) {
+    hzr_init_encode_options(&default_options);
+    options = &default_options;
+  }
+
+  // Like the streaming encoder, we use the default block size. With tree
+  // reuse, a worker must encode whole tree reuse groups.
+  EncodePipeline pipeline;
+  pipeline.source = source;
+  pipeline.source_user = source_user;
+  pipeline.sink = sink;
+  pipeline.sink_user = sink_user;
+  pipeline.options = options;
+  _hzr_init_block_layout(&pipeline.layout, HZR_DEFAULT_BLOCK_SIZE_LOG2);
+  pipeline.blocks_per_item =
+      options->reuse_trees ? HZR_TREE_REUSE_GROUP_SIZE : 1;
+  pipeline.next_block = 0;
+  pipeline.total_size = 0;
+  pipeline.in_done = HZR_FALSE;
+  pipeline.end_written = HZR_FALSE;
+
+  // Allocate the scratch memory of the workers, and the items.
+  const size_t num_threads = (size_t)hzr_max(options->num_threads, 1);
+  const size_t num_slots = num_threads * HZR_PIPELINE_SLOTS_PER_THREAD;
+  const size_t in_capacity =
+      pipeline.blocks_per_item * pipeline.layout.block_size;
+  const size_t out_capacity =
+      pipeline.blocks_per_item *
+      (pipeline.layout.header_size + pipeline.layout.block_size);
+  pipeline.scratch =
+      (EncodeScratch**)calloc(num_threads, sizeof(EncodeScratch*));
+  pipeline.stats = options->stats
+                       ? (hzr_stats_t*)calloc(num_threads, sizeof(hzr_stats_t))
+                       : NULL;
+  EncodePipelineItem* items =
+      (EncodePipelineItem*)calloc(num_slots, sizeof(EncodePipelineItem));
+  void** slots = (void**)malloc(sizeof(void*) * num_slots);
+  hzr_status_t status = (pipeline.scratch && items && slots &&
+                         (pipeline.stats || !options->stats))
+                            ? HZR_OK
+                            : HZR_FAIL;
+  for (size_t i = 0; status == HZR_OK && i < num_threads; ++i) {
+    pipeline.scratch[i] = CreateEncodeScratch(pipeline.layout.block_size);
+    if (UNLIKELY(!pipeline.scratch[i])) {
+      status = HZR_FAIL;
+    }
+  }
+  for (size_t i = 0; status == HZR_OK && i < num_slots; ++i) {
+    items[i].in = (uint8_t*)malloc(in_capacity);
+    items[i].out = (uint8_t*)malloc(out_capacity);
+    slots[i] = &items[i];
+    if (UNLIKELY(!items[i].in || !items[i].out)) {
+      status = HZR_FAIL;
+    }
+  }
+  if (UNLIKELY(status != HZR_OK)) {
+    DLOG("Out of memory.");
+  }
+
+  // Write the master header, run the pipeline, and finish the stream with the
+  // end marker (unless it preceded a partial last block).
+  if (status == HZR_OK) {
+    uint8_t header[HZR_HEADER_SIZE];
+    WriteStream stream;
+    InitWriteStream(&stream, header, HZR_HEADER_SIZE);
+    WriteBits(&stream, HZR_SIZE_STREAMED, 32);
+    status = sink(header, HZR_HEADER_SIZE, sink_user);
+  }
+  if (status == HZR_OK) {
+    status = _hzr_pipeline(ProduceEncodeItem, ProcessEncodeItem,
+                           ConsumeEncodeItem, &pipeline, slots, num_slots,
+                           (int)num_threads);
+  }
+  if (status == HZR_OK && !pipeline.end_written) {
+    uint8_t marker[HZR_END_MARKER_SIZE];
+    StoreEndMarker(marker, &pipeline.layout, pipeline.total_size);
+    status = sink(marker, HZR_END_MARKER_SIZE, sink_user);
+  }
+
+  if (items) {
+    for (size_t i = 0; i < num_slots; ++i) {
+      free(items[i].in);
+      free(items[i].out);
+    }
+  }
+  if (pipeline.scratch) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      _hzr_aligned_free(pipeline.scratch[i]);
+    }
+  }
+  if (pipeline.stats) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      _hzr_stats_add(options->stats, &pipeline.stats[i]);
+    }
+  }
+  free(pipeline.stats);
+  free(pipeline.scratch);
+  free(items);
+  free(slots);
+  return status;
+}
@@ -0,0 +1,409 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+// We need POSIX declarations (e.g. mmap() and ftruncate()) in C99 mode, and
+// 64-bit file offsets on 32-bit systems.
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "libhzr.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define HZR_HAS_WIN32_MMAP
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HZR_HAS_POSIX_MMAP
+#endif
+
+#include "hzr_internal.h"
+
+// A file that is mapped into memory. Empty files are not mapped (they are
+// represented by a dummy buffer, since the encoder and decoder do not accept
+// NULL buffers).
+// Note: Without memory mapping support, the file data is read into (or written
+// from) a heap allocated buffer.
+typedef struct {
+  uint8_t* data;
+  size_t size;
+  hzr_bool mapped;
+#if defined(HZR_HAS_WIN32_MMAP)
+  HANDLE file;
+  HANDLE mapping;
+#elif defined(HZR_HAS_POSIX_MMAP)
+  int fd;
+#else
+  FILE* file;
+  hzr_bool writable;
+#endif
+} MappedFile;
+
+static uint8_t s_empty_file_data[1];
+
+static void InitEmptyFile(MappedFile* file) {
+  file->data = s_empty_file_data;
+  file->size = 0;
+  file->mapped = HZR_FALSE;
+}
+
+#if defined(HZR_HAS_WIN32_MMAP)
+
+static hzr_status_t MapInputFile(MappedFile* file, const char* path) {
+  InitEmptyFile(file);
+  file->mapping = NULL;
+  file->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file->file == INVALID_HANDLE_VALUE) {
+    DLOG("Unable to open the input file.");
+    return HZR_FAIL;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file->file, &size) ||
+      (uint64_t)size.QuadPart > (uint64_t)SIZE_MAX) {
+    DLOG("Unable to get the size of the input file.");
+    CloseHandle(file->file);
+    return HZR_FAIL;
+  }
+  if (size.QuadPart == 0) {
+    return HZR_OK;
+  }
+  file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0,
+                                     NULL);
+  void* data = file->mapping
+                   ? MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0)
+                   : NULL;
+  if (!data) {
+    DLOG("Unable to map the input file.");
+    if (file->mapping) {
+      CloseHandle(file->mapping);
+    }
+    CloseHandle(file->file);
+    return HZR_FAIL;
+  }
+  file->data = (uint8_t*)data;
+  file->size = (size_t)size.QuadPart;
+  file->mapped = HZR_TRUE;
+  return HZR_OK;
+}
+
+static hzr_status_t MapOutputFile(MappedFile* file,
+                                  const char* path,
+                                  size_t size) {
+  InitEmptyFile(file);
+  file->mapping = NULL;
+  file->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file->file == INVALID_HANDLE_VALUE) {
+    DLOG("Unable to create the output file.");
+    return HZR_FAIL;
+  }
+  if (size == 0) {
+    return HZR_OK;
+  }
+
+  // Mapping the file extends it to the requested size.
+  file->mapping = CreateFileMappingA(
+      file->file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32),
+      (DWORD)((uint64_t)size & 0xffffffffU), NULL);
+  void* data = file->mapping
+                   ? MapViewOfFile(file->mapping, FILE_MAP_WRITE, 0, 0, 0)
+                   : NULL;
+  if (!data) {
+    DLOG("Unable to map the output file.");
+    if (file->mapping) {
+      CloseHandle(file->mapping);
+    }
+    CloseHandle(file->file);
+    return HZR_FAIL;
+  }
+  file->data = (uint8_t*)data;
+  file->size = size;
+  file->mapped = HZR_TRUE;
+  return HZR_OK;
+}
+
+static hzr_status_t CloseFile(MappedFile* file, size_t final_size) {
+  hzr_status_t status = HZR_OK;
+  if (file->mapped) {
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+  }
+  if (final_size != file->size) {
+    LARGE_INTEGER pos;
+    pos.QuadPart = (LONGLONG)final_size;
+    if (!SetFilePointerEx(file->file, pos, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(file->file)) {
+      DLOG("Unable to set the size of the output file.");
+      status = HZR_FAIL;
+    }
+  }
+  CloseHandle(file->file);
+  return status;
+}
+
+#elif defined(HZR_HAS_POSIX_MMAP)
+
+static hzr_status_t MapInputFile(MappedFile* file, const char* path) {
+  InitEmptyFile(file);
+  file->fd = open(path, O_RDONLY);
+  if (file->fd < 0) {
+    DLOG("Unable to open the input file.");
+    return HZR_FAIL;
+  }
+  struct stat st;
+  if (fstat(file->fd, &st) != 0 || (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+    DLOG("Unable to get the size of the input file.");
+    close(file->fd);
+    return HZR_FAIL;
+  }
+  if (st.st_size == 0) {
+    return HZR_OK;
+  }
+  void* data =
+      mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+  if (data == MAP_FAILED) {
+    DLOG("Unable to map the input file.");
+    close(file->fd);
+    return HZR_FAIL;
+  }
+  file->data = (uint8_t*)data;
+  file->size = (size_t)st.st_size;
+  file->mapped = HZR_TRUE;
+  return HZR_OK;
+}
+
+static hzr_status_t MapOutputFile(MappedFile* file,
+                                  const char* path,
+                                  size_t size) {
+  InitEmptyFile(file);
+  file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (file->fd < 0) {
+    DLOG("Unable to create the output file.");
+    return HZR_FAIL;
+  }
+  if (size == 0) {
+    return HZR_OK;
+  }
+  if (ftruncate(file->fd, (off_t)size) != 0) {
+    DLOG("Unable to set the size of the output file.");
+    close(file->fd);
+    return HZR_FAIL;
+  }
+  void* data =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+  if (data == MAP_FAILED) {
+    DLOG("Unable to map the output file.");
+    close(file->fd);
+    return HZR_FAIL;
+  }
+  file->data = (uint8_t*)data;
+  file->size = size;
+  file->mapped = HZR_TRUE;
+  return HZR_OK;
+}
+
+static hzr_status_t CloseFile(MappedFile* file, size_t final_size) {
+  hzr_status_t status = HZR_OK;
+  if (file->mapped) {
+    munmap(file->data, file->size);
+  }
+  if (final_size != file->size && ftruncate(file->fd, (off_t)final_size) != 0) {
+    DLOG("Unable to set the size of the output file.");
+    status = HZR_FAIL;
+  }
+  if (close(file->fd) != 0) {
+    status = HZR_FAIL;
+  }
+  return status;
+}
+
+#else  // No memory mapping support.
+
+static hzr_status_t MapInputFile(MappedFile* file, const char* path) {
+  InitEmptyFile(file);
+  file->writable = HZR_FALSE;
+  file->file = fopen(path, "rb");
+  if (!file->file) {
+    DLOG("Unable to open the input file.");
+    return HZR_FAIL;
+  }
+  long size = -1L;
+  if (fseek(file->file, 0L, SEEK_END) == 0) {
+    size = ftell(file->file);
+  }
+  if (size < 0L || fseek(file->file, 0L, SEEK_SET) != 0) {
+    DLOG("Unable to get the size of the input file.");
+    fclose(file->file);
+    return HZR_FAIL;
+  }
+  if (size > 0L) {
+    file->data = (uint8_t*)malloc((size_t)size);
+    if (!file->data ||
+        fread(file->data, 1, (size_t)size, file->file) != (size_t)size) {
+      DLOG("Unable to read the input file.");
+      free(file->data);
+      fclose(file->file);
+      return HZR_FAIL;
+    }
+    file->size = (size_t)size;
+    file->mapped = HZR_TRUE;
+  }
+  return HZR_OK;
+}
+
+static hzr_status_t MapOutputFile(MappedFile* file,
+                                  const char* path,
+                                  size_t size) {
+  InitEmptyFile(file);
+  file->writable = HZR_TRUE;
+  file->file = fopen(path, "wb");
+  if (!file->file) {
+    DLOG("Unable to create the output file.");
+    return HZR_FAIL;
+  }
+  if (size > 0) {
+    file->data = (uint8_t*)malloc(size);
+    if (!file->data) {
+      DLOG("Out of memory.");
+      fclose(file->file);
+      return HZR_FAIL;
+    }
+    file->size = size;
+    file->mapped = HZR_TRUE;
+  }
+  return HZR_OK;
+}
+
+static hzr_status_t CloseFile(MappedFile* file, size_t final_size) {
+  hzr_status_t status = HZR_OK;
+  if (file->mapped) {
+    // Output files are written here.
+    if (file->writable &&
+        fwrite(file->data, 1, final_size, file->file) != final_size) {
+      DLOG("Unable to write the output file.");
+      status = HZR_FAIL;
+    }
+    free(file->data);
+  }
+  if (fclose(file->file) != 0) {
+    status = HZR_FAIL;
+  }
+  return status;
+}
+
+#endif
+
+hzr_status_t hzr_encode_file(const char* in_path,
+                             const char* out_path,
+                             const hzr_encode_options_t* options) {
+  if (UNLIKELY(!in_path || !out_path)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  MappedFile in;
+  if (MapInputFile(&in, in_path) != HZR_OK) {
+    return HZR_FAIL;
+  }
+
+  // Encode directly into the mapped output file, and cut it to the actual
+  // encoded size.
+  MappedFile out;
+  hzr_status_t status = MapOutputFile(
+      &out, out_path, hzr_max_compressed_size_ex(in.size, options));
+  if (status == HZR_OK) {
+    size_t encoded_size = 0;
+    status = hzr_encode_ex(in.data, in.size, out.data, out.size, &encoded_size,
+                           options);
+    if (CloseFile(&out, (status == HZR_OK) ? encoded_size : 0) != HZR_OK) {
+      status = HZR_FAIL;
+    }
+    if (status != HZR_OK) {
+      (void)remove(out_path);
+    }
+  }
+
+  (void)CloseFile(&in, in.size);
+  return status;
+}
+
+hzr_status_t hzr_decode_file(const char* in_path,
+                             const char* out_path,
+                             const hzr_decode_options_t* options) {
+  if (UNLIKELY(!in_path || !out_path)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+
+  // The input and output files are mapped with their exact sizes, so there is
+  // no padding after them (whatever the caller's options say).
+  hzr_decode_options_t file_options;
+  if (options) {
+    file_options = *options;
+  } else {
+    hzr_init_decode_options(&file_options);
+  }
+  file_options.out_padding = 0;
+  file_options.in_padding = 0;
+
+  MappedFile in;
+  if (MapInputFile(&in, in_path) != HZR_OK) {
+    return HZR_FAIL;
+  }
+
+  // Get the size of the decoded data from the header before creating the
+  // output file. The blocks are checked by the decoder (CRC checks are left to
+  // options->check_crc).
+  size_t decoded_size = 0;
+  hzr_status_t status = _hzr_get_decoded_size(in.data, in.size, &decoded_size);
+
+  // Decode directly into the mapped output file.
+  MappedFile out;
+  if (status == HZR_OK) {
+    status = MapOutputFile(&out, out_path, decoded_size);
+    if (status == HZR_OK) {
+      if (decoded_size > 0) {
+        status = hzr_decode_ex(in.data, in.size, out.data, out.size,
+                               &file_options);
+      }
+      if (CloseFile(&out, (status == HZR_OK) ? decoded_size : 0) != HZR_OK) {
+        status = HZR_FAIL;
+      }
+      if (status != HZR_OK) {
+        (void)remove(out_path);
+      }
+    }
+  }
+
+  (void)CloseFile(&in, in.size);
+  return status;
+}
@@ -0,0 +1,123 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_filter.h"
+
+#include "hzr_internal.h"
+#include "hzr_thread.h"
+
+#if defined(HZR_ARCH_X86)
+#include "hzr_filter_sse2.h"
+#include "hzr_runs_sse2.h"
+#elif defined(HZR_ARCH_ARM)
+#include "hzr_filter_neon.h"
+#include "hzr_runs_neon.h"
+#endif
+
+FORCE_INLINE static uint32_t Load16LE(const uint8_t* ptr) {
+  return ((uint32_t)ptr[0]) | (((uint32_t)ptr[1]) << 8);
+}
+
+FORCE_INLINE static void Store16LE(uint8_t* ptr, uint32_t x) {
+  ptr[0] = (uint8_t)x;
+  ptr[1] = (uint8_t)(x >> 8);
+}
+
+// Portable versions of the unfilters, which process the bytes start...end (an
+// even start for the 16-bit filters).
+static void UndeltaFallback(uint8_t* buf,
+                            size_t start,
+                            size_t end,
+                            size_t stride) {
+  for (size_t i = hzr_max(start, stride); i < end; ++i) {
+    buf[i] = (uint8_t)(buf[i] + buf[i - stride]);
+  }
+}
+
+static void Undelta16Fallback(uint8_t* buf,
+                              size_t start,
+                              size_t end,
+                              size_t stride) {
+  const size_t byte_stride = stride * 2;
+  const size_t even_end = end & ~(size_t)1;
+  for (size_t i = hzr_max(start, byte_stride); i < even_end; i += 2) {
+    Store16LE(&buf[i], Load16LE(&buf[i]) + Load16LE(&buf[i - byte_stride]));
+  }
+}
+
+// A vector kernel that does not process anything (the portable versions do all
+// the work).
+static size_t UndeltaNone(uint8_t* buf,
+                          size_t start,
+                          size_t end,
+                          size_t stride) {
+  (void)buf;
+  (void)end;
+  (void)stride;
+  return start;
+}
+
+typedef size_t (*UndeltaFn)(uint8_t* buf,
+                            size_t start,
+                            size_t end,
+                            size_t stride);
+
+// The selected vector kernels. These are resolved once, since the decoder calls
+// them for every chunk of the filtered blocks.
+static UndeltaFn s_undelta = NULL;
+static UndeltaFn s_undelta16 = NULL;
+static _hzr_once_t s_undelta_once = HZR_ONCE_INIT;
+
+// Select the fastest vector kernels for this CPU.
+static void SelectUndelta(void) {
+#if defined(HZR_ARCH_X86)
+  if (_hzr_can_use_sse2()) {
+    s_undelta = _hzr_undelta_sse2;
+    s_undelta16 = _hzr_undelta16_sse2;
+    return;
+  }
+#elif defined(HZR_ARCH_ARM)
+  if (_hzr_can_use_neon()) {
+    s_undelta = _hzr_undelta_neon;
+    s_undelta16 = _hzr_undelta16_neon;
+    return;
+  }
+#endif
+  s_undelta = UndeltaNone;
+  s_undelta16 = UndeltaNone;
+}
+
+void _hzr_unfilter(uint8_t* buf,
+                   size_t start,
+                   size_t end,
+                   int filter,
+                   size_t stride) {
+  if (filter == HZR_BLOCK_FILTER_NONE || start >= end) {
+    return;
+  }
+  _hzr_call_once(&s_undelta_once, SelectUndelta);
+  if (filter == HZR_BLOCK_FILTER_DELTA) {
+    UndeltaFallback(buf, s_undelta(buf, start, end, stride), end, stride);
+  } else if (filter == HZR_BLOCK_FILTER_DELTA16) {
+    Undelta16Fallback(buf, s_undelta16(buf, start, end, stride), end, stride);
+  }
+}
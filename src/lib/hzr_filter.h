@@ -0,0 +1,42 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#ifndef HZR_FILTER_H_
+#define HZR_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Undo a block filter (HZR_BLOCK_FILTER_*) with the given stride in place, for
+// the bytes start...end of a block that starts at buf. The bytes before start
+// must already be unfiltered, and start must be zero or a multiple of
+// HZR_UNFILTER_ALIGN, so that the decoder can undo the filter of each chunk of
+// a block right after decoding it. The encoder applies the filters on the fly
+// while tokenizing the blocks.
+#define HZR_UNFILTER_ALIGN 16
+void _hzr_unfilter(uint8_t* buf,
+                   size_t start,
+                   size_t end,
+                   int filter,
+                   size_t stride);
+
+#endif  // HZR_FILTER_H_
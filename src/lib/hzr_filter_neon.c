@@ -0,0 +1,153 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_filter_neon.h"
+
+#include "hzr_internal.h"
+
+// Check if we are compiling with NEON support.
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+// Add the bytes or the 16-bit elements of two vectors.
+#define ADD8(a, b) vaddq_u8((a), (b))
+#define ADD16(a, b)                                        \
+  vreinterpretq_u8_u16(vaddq_u16(vreinterpretq_u16_u8(a), \
+                                 vreinterpretq_u16_u8(b)))
+
+// Shift the bytes of a vector up by N bytes, shifting in zeros (like
+// _mm_slli_si128(), a shift of 16 bytes or more gives a zero vector). The shift
+// must be an immediate value.
+#define SHIFT_UP(x, N) vextq_u8(zero, (x), 16 - (((N) < 16) ? (N) : 16))
+
+// Undo a delta filter with a small stride (S bytes) by a prefix sum within
+// each vector, using the elements of the previous vector as the start values
+// (see hzr_filter_sse2.c). S must be a constant.
+#define UNDELTA_SMALL_STRIDE(add, S)              \
+  do {                                            \
+    const uint8x16_t zero = vdupq_n_u8(0);        \
+    uint8x16_t prev = zero;                       \
+    if (i >= 16) {                                \
+      prev = vld1q_u8(&buf[i - 16]);              \
+    }                                             \
+    for (; i + 16 <= end; i += 16) {              \
+      uint8x16_t x = vld1q_u8(&buf[i]);           \
+      x = add(x, vextq_u8(prev, zero, 16 - (S))); \
+      x = add(x, SHIFT_UP(x, (S)));               \
+      x = add(x, SHIFT_UP(x, 2 * (S)));           \
+      x = add(x, SHIFT_UP(x, 4 * (S)));           \
+      x = add(x, SHIFT_UP(x, 8 * (S)));           \
+      vst1q_u8(&buf[i], x);                       \
+      prev = x;                                   \
+    }                                             \
+  } while (0)
+
+// Undo a delta filter with a stride of at least 16 bytes, where the elements
+// that are added to a vector are all in previous vectors (the first S bytes of
+// the block are not filtered).
+#define UNDELTA_LARGE_STRIDE(add, S)                    \
+  do {                                                  \
+    for (i = hzr_max(i, (S)); i + 16 <= end; i += 16) { \
+      uint8x16_t x = vld1q_u8(&buf[i]);                 \
+      uint8x16_t y = vld1q_u8(&buf[i - (S)]);           \
+      vst1q_u8(&buf[i], add(x, y));                     \
+    }                                                   \
+  } while (0)
+
+size_t _hzr_undelta_neon(uint8_t* buf,
+                         size_t start,
+                         size_t end,
+                         size_t stride) {
+  size_t i = start;
+  switch (stride) {
+    case 1:
+      UNDELTA_SMALL_STRIDE(ADD8, 1);
+      break;
+    case 2:
+      UNDELTA_SMALL_STRIDE(ADD8, 2);
+      break;
+    case 3:
+      UNDELTA_SMALL_STRIDE(ADD8, 3);
+      break;
+    case 4:
+      UNDELTA_SMALL_STRIDE(ADD8, 4);
+      break;
+    case 8:
+      UNDELTA_SMALL_STRIDE(ADD8, 8);
+      break;
+    default:
+      if (stride >= 16 && end >= stride) {
+        UNDELTA_LARGE_STRIDE(ADD8, stride);
+      }
+      break;
+  }
+  return i;
+}
+
+size_t _hzr_undelta16_neon(uint8_t* buf,
+                           size_t start,
+                           size_t end,
+                           size_t stride) {
+  size_t i = start;
+  switch (stride) {
+    case 1:
+      UNDELTA_SMALL_STRIDE(ADD16, 2);
+      break;
+    case 2:
+      UNDELTA_SMALL_STRIDE(ADD16, 4);
+      break;
+    case 4:
+      UNDELTA_SMALL_STRIDE(ADD16, 8);
+      break;
+    default:
+      if (stride >= 8 && end >= stride * 2) {
+        UNDELTA_LARGE_STRIDE(ADD16, stride * 2);
+      }
+      break;
+  }
+  return i;
+}
+
+#else
+
+size_t _hzr_undelta_neon(uint8_t* buf,
+                         size_t start,
+                         size_t end,
+                         size_t stride) {
+  (void)buf;
+  (void)end;
+  (void)stride;
+  return start;
+}
+
+size_t _hzr_undelta16_neon(uint8_t* buf,
+                           size_t start,
+                           size_t end,
+                           size_t stride) {
+  (void)buf;
+  (void)end;
+  (void)stride;
+  return start;
+}
+
+#endif  // __ARM_NEON
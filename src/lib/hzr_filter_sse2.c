@@ -0,0 +1,142 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_filter_sse2.h"
+
+#include "hzr_internal.h"
+
+// Check if we are compiling with SSE2 support.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+
+#include <emmintrin.h>
+
+// Undo a delta filter with a small stride (S bytes) by a prefix sum within
+// each vector, using the elements of the previous vector as the start values.
+// The shifts must be immediate values, so S must be a constant.
+#define UNDELTA_SMALL_STRIDE(add, S)                        \
+  do {                                                      \
+    __m128i prev = _mm_setzero_si128();                     \
+    if (i >= 16) {                                          \
+      prev = _mm_loadu_si128((const __m128i*)&buf[i - 16]); \
+    }                                                       \
+    for (; i + 16 <= end; i += 16) {                        \
+      __m128i x = _mm_loadu_si128((const __m128i*)&buf[i]); \
+      x = add(x, _mm_srli_si128(prev, 16 - (S)));           \
+      x = add(x, _mm_slli_si128(x, (S)));                   \
+      x = add(x, _mm_slli_si128(x, 2 * (S)));               \
+      x = add(x, _mm_slli_si128(x, 4 * (S)));               \
+      x = add(x, _mm_slli_si128(x, 8 * (S)));               \
+      _mm_storeu_si128((__m128i*)&buf[i], x);               \
+      prev = x;                                             \
+    }                                                       \
+  } while (0)
+
+// Undo a delta filter with a stride of at least 16 bytes, where the elements
+// that are added to a vector are all in previous vectors (the first S bytes of
+// the block are not filtered).
+#define UNDELTA_LARGE_STRIDE(add, S)                              \
+  do {                                                            \
+    for (i = hzr_max(i, (S)); i + 16 <= end; i += 16) {           \
+      __m128i x = _mm_loadu_si128((const __m128i*)&buf[i]);       \
+      __m128i y = _mm_loadu_si128((const __m128i*)&buf[i - (S)]); \
+      _mm_storeu_si128((__m128i*)&buf[i], add(x, y));             \
+    }                                                             \
+  } while (0)
+
+size_t _hzr_undelta_sse2(uint8_t* buf,
+                         size_t start,
+                         size_t end,
+                         size_t stride) {
+  size_t i = start;
+  switch (stride) {
+    case 1:
+      UNDELTA_SMALL_STRIDE(_mm_add_epi8, 1);
+      break;
+    case 2:
+      UNDELTA_SMALL_STRIDE(_mm_add_epi8, 2);
+      break;
+    case 3:
+      UNDELTA_SMALL_STRIDE(_mm_add_epi8, 3);
+      break;
+    case 4:
+      UNDELTA_SMALL_STRIDE(_mm_add_epi8, 4);
+      break;
+    case 8:
+      UNDELTA_SMALL_STRIDE(_mm_add_epi8, 8);
+      break;
+    default:
+      if (stride >= 16 && end >= stride) {
+        UNDELTA_LARGE_STRIDE(_mm_add_epi8, stride);
+      }
+      break;
+  }
+  return i;
+}
+
+size_t _hzr_undelta16_sse2(uint8_t* buf,
+                           size_t start,
+                           size_t end,
+                           size_t stride) {
+  size_t i = start;
+  switch (stride) {
+    case 1:
+      UNDELTA_SMALL_STRIDE(_mm_add_epi16, 2);
+      break;
+    case 2:
+      UNDELTA_SMALL_STRIDE(_mm_add_epi16, 4);
+      break;
+    case 4:
+      UNDELTA_SMALL_STRIDE(_mm_add_epi16, 8);
+      break;
+    default:
+      if (stride >= 8 && end >= stride * 2) {
+        UNDELTA_LARGE_STRIDE(_mm_add_epi16, stride * 2);
+      }
+      break;
+  }
+  return i;
+}
+
+#else
+
+size_t _hzr_undelta_sse2(uint8_t* buf,
+                         size_t start,
+                         size_t end,
+                         size_t stride) {
+  (void)buf;
+  (void)end;
+  (void)stride;
+  return start;
+}
+
+size_t _hzr_undelta16_sse2(uint8_t* buf,
+                           size_t start,
+                           size_t end,
+                           size_t stride) {
+  (void)buf;
+  (void)end;
+  (void)stride;
+  return start;
+}
+
+#endif  // SSE2
@@ -23,7 +23,11 @@
 #ifndef HZR_INTERNAL_H_
 #define HZR_INTERNAL_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#include "libhzr.h"
 
 // Branch optimization macros. Use these sparingly! The most useful and obvious
 // situations where these should be used are in error handling code (e.g. it's
@@ -81,18 +85,173 @@
 // Types.
 typedef enum { HZR_FALSE = 0, HZR_TRUE = 1 } hzr_bool;
 
+// Endianity detection.
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HZR_LITTLE_ENDIAN
+#endif
+#elif defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM) || \
+    defined(_M_ARM64)
+#define HZR_LITTLE_ENDIAN
+#endif
+
+// Unaligned little endian 64-bit load and store. On little endian machines
+// these compile to a single load or store instruction.
+FORCE_INLINE static uint64_t _hzr_load64le(const uint8_t* ptr) {
+#if defined(HZR_LITTLE_ENDIAN)
+  uint64_t x;
+  memcpy(&x, ptr, sizeof(x));
+  return x;
+#else
+  uint64_t x = 0U;
+  for (int i = 0; i < 8; ++i) {
+    x |= ((uint64_t)ptr[i]) << (8 * i);
+  }
+  return x;
+#endif
+}
+
+FORCE_INLINE static void _hzr_store64le(uint8_t* ptr, uint64_t x) {
+#if defined(HZR_LITTLE_ENDIAN)
+  memcpy(ptr, &x, sizeof(x));
+#else
+  for (int i = 0; i < 8; ++i) {
+    ptr[i] = (uint8_t)(x >> (8 * i));
+  }
+#endif
+}
+
+// Count the number of trailing zero bits of a non-zero word.
+FORCE_INLINE static int _hzr_ctz32(uint32_t x) {
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#else
+  int count = 0;
+  while ((x & 1U) == 0U) {
+    x >>= 1;
+    ++count;
+  }
+  return count;
+#endif
+}
+
+// Count the number of leading zero bits of a non-zero word.
+FORCE_INLINE static int _hzr_clz32(uint32_t x) {
+#if defined(__GNUC__)
+  return __builtin_clz(x);
+#else
+  int count = 0;
+  while ((x & 0x80000000U) == 0U) {
+    x <<= 1;
+    ++count;
+  }
+  return count;
+#endif
+}
+
+FORCE_INLINE static int _hzr_ctz64(uint64_t x) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(x);
+#else
+  uint32_t lo = (uint32_t)x;
+  return (lo != 0U) ? _hzr_ctz32(lo) : 32 + _hzr_ctz32((uint32_t)(x >> 32));
+#endif
+}
+
 // The HZR data format is as follows:
 // * A master header:
 //    0: Size of the decoded data (32 bits).
 //
-// * Blocks, each representing a decompressed size of a maximum of 65536 bytes,
-//   and each having the following header:
+// * Blocks, each representing a decompressed size of a maximum of 65536 bytes
+//   (or the block size that is given by the extended header, see below), and
+//   each having the following header:
 //    0: Size of the encoded data - 1 (16 bits).
 //    2: CRC32 of the encoded data (32 bits).
 //    6: Encoding mode (8 bits):
 //       0 = Plain copy (no compression)
 //       1 = Huffman + RLE
 //       2 = Fill
+//       3 = Huffman + RLE, with length-limited canonical codes
+//       4 = Huffman + RLE, with multiple streams
+//       5 = Huffman + RLE, with length-limited canonical codes and multiple
+//           streams
+//       6 = Huffman + RLE, with a shared table (the encoded data starts with
+//           the ID of the table, 16 bits)
+//       7 = Huffman + RLE, with the Huffman tree of a previous block (see
+//           below)
+//       8 = Huffman + RLE, with the Huffman tree of a previous block and
+//           multiple streams
+//       9 = Huffman + RLE of 16-bit samples (see below)
+//       10 = Huffman + RLE of 16-bit samples, with multiple streams
+//       254 = Extended header (only first in the data, see below)
+//       255 = End marker (only in streamed data, see below)
+//       The high four bits of encoding modes 1 - 10 may instead hold the
+//       filter of the block (see below).
+//
+// * The decoded data of a block may be filtered, which is given by the high
+//   four bits of the encoding mode:
+//       0 = No filter
+//       1 = Delta: Each byte is the difference between the original byte and
+//           the original byte N bytes before it (N = the stride).
+//       2 = 16-bit delta: Like delta, but for 16-bit little endian words, and
+//           with a stride of N words. If the block has an odd size, the last
+//           byte is not filtered.
+//   The first N bytes (or words) of a block are stored as is, so each block can
+//   be decoded on its own. For filtered blocks, the encoded data starts with
+//   the stride (8 bits, 1 - 255). Plain copies (encoding mode 0) are never
+//   filtered.
+//
+// * The blocks are grouped in tree reuse groups of eight consecutive blocks
+//   (the first group starts with the first block). Blocks with the encoding
+//   modes 7 and 8 have no Huffman tree of their own. Instead they use the tree
+//   of the closest preceding block in the same group that has one (encoding
+//   modes 1, 3, 4, 5, 9 and 10), which must exist. They code the same kind of
+//   symbols (bytes or 16-bit samples) as that block.
+//
+// * Blocks with the encoding modes 9 and 10 code the decoded data as 16-bit
+//   little endian samples (the decoded size of such a block must be even), with
+//   the same tree description and RLE symbols as mode 1 (the RLE symbols count
+//   zero samples instead of zero bytes). See kSymEscape16 for the alphabet.
+//
+// * Streamed data, which is written before the decoded size is known, has the
+//   decoded size 0xffffffff in the master header. All the blocks are full
+//   sized, except the last block, which is preceded by an end marker block.
+//   The end marker holds the size of the decoded data (64 bits), and it is
+//   always present (if the decoded size is a multiple of the block size, there
+//   is no block after the end marker).
+//
+// * Older versions of HZR wrote regular (non-streamed) data with the decoded
+//   size 0xffffffff (4 GiB - 1) in the master header. Such data has neither an
+//   extended header nor an end marker, so it is decoded as regular data when no
+//   end marker follows the blocks. The incremental decoders (hzr_decoder_t and
+//   hzr_decode_pipeline) can not tell such data from streamed data, and do not
+//   support it.
+//
+// * Data with an extended header (which is required for decoded sizes of
+//   4 GiB or more) has the decoded size 0xffffffff in the master header, just
+//   like streamed data, followed by a block with the encoding mode 254. The
+//   data of the extended header block is:
+//    0: Format version (8 bits), currently 1.
+//    1: Flags (8 bits). Bit 0 is set if the data has a block index. All other
+//       bits must be zero.
+//    2: Log2 of the block size (8 bits), 10 - 24.
+//    3: Size of the decoded data (64 bits).
+//   Decoders must reject unknown versions and flags, but ignore any trailing
+//   data in the header block (room for future fields). The blocks that follow
+//   are laid out just like after a 32-bit master header (no end marker).
+//
+// * For block sizes larger than 65536 bytes, the size fields are wider: The
+//   encoded size in the block header is 32 bits (which makes the header 9
+//   bytes), and so are the stream sizes of multi-stream blocks. The extended
+//   header block itself always has a 7 byte header.
+//
+// * An optional block index, following the last block:
+//    0: For each block, the offset of the block header relative to the start
+//       of the encoded data (64 bits), followed by the offset of the first
+//       decoded byte of the block (64 bits).
+//    N*16: Number of blocks (32 bits).
+//    N*16+4: CRC32 of the index entries and the number of blocks (32 bits).
+//    N*16+8: Index signature, "HZRX" (32 bits).
 
 // Size of the master header (in bytes).
 #define HZR_HEADER_SIZE 4
@@ -103,10 +262,96 @@ typedef enum { HZR_FALSE = 0, HZR_TRUE = 1 } hzr_bool;
 #define HZR_ENCODING_COPY 0
 #define HZR_ENCODING_HUFF_RLE 1
 #define HZR_ENCODING_FILL 2
-#define HZR_ENCODING_LAST HZR_ENCODING_FILL
+#define HZR_ENCODING_CANONICAL 3
+#define HZR_ENCODING_HUFF_RLE_MULTI 4
+#define HZR_ENCODING_CANONICAL_MULTI 5
+#define HZR_ENCODING_TABLE 6
+#define HZR_ENCODING_REUSE 7
+#define HZR_ENCODING_REUSE_MULTI 8
+#define HZR_ENCODING_HUFF16 9
+#define HZR_ENCODING_HUFF16_MULTI 10
+#define HZR_ENCODING_LAST HZR_ENCODING_HUFF16_MULTI
+#define HZR_ENCODING_HEADER 254
+#define HZR_ENCODING_END 255
+
+// Block filters (the high bits of the encoding mode).
+#define HZR_ENCODING_MASK 0x0fU
+#define HZR_FILTER_SHIFT 4
+#define HZR_BLOCK_FILTER_NONE 0
+#define HZR_BLOCK_FILTER_DELTA 1
+#define HZR_BLOCK_FILTER_DELTA16 2
+#define HZR_BLOCK_FILTER_LAST HZR_BLOCK_FILTER_DELTA16
+
+// Number of blocks in a tree reuse group.
+#define HZR_TREE_REUSE_GROUP_SIZE 8
+
+// The decoded size in the master header of streamed data.
+#define HZR_SIZE_STREAMED 0xffffffffU
+
+// Size of the block header with wide size fields (in bytes).
+#define HZR_WIDE_BLOCK_HEADER_SIZE 9
+
+// Extended header fields.
+#define HZR_FORMAT_VERSION 1
+#define HZR_HEADER_FLAG_INDEX 0x01U
+#define HZR_HEADER_FLAGS_KNOWN HZR_HEADER_FLAG_INDEX
+#define HZR_MIN_BLOCK_SIZE_LOG2 10
+#define HZR_MAX_BLOCK_SIZE_LOG2 24
+#define HZR_DEFAULT_BLOCK_SIZE_LOG2 16
+
+// Size of the extended header, including the master header (in bytes).
+#define HZR_EXT_HEADER_DATA_SIZE 11
+#define HZR_EXT_HEADER_SIZE \
+  (HZR_HEADER_SIZE + HZR_BLOCK_HEADER_SIZE + HZR_EXT_HEADER_DATA_SIZE)
+
+// Size of the end marker block in streamed data (in bytes).
+#define HZR_END_MARKER_SIZE (HZR_BLOCK_HEADER_SIZE + 8)
+
+// Size of a block index entry and of the block index footer (in bytes).
+#define HZR_INDEX_ENTRY_SIZE 16
+#define HZR_INDEX_FOOTER_SIZE 12
+
+// The block index signature ("HZRX" in little endian byte order).
+#define HZR_INDEX_SIGNATURE 0x58525a48U
+
+// Get the decoded size of encoded data from its master header (or extended
+// header, or end marker), without checking the blocks (implemented by the
+// decoder).
+hzr_status_t _hzr_get_decoded_size(const void* in,
+                                   size_t in_size,
+                                   size_t* decoded_size);
 
-// Maximum number of decoded bytes in a block.
-#define HZR_MAX_BLOCK_SIZE 65536
+// The block layout of encoded data, which follows from the block size.
+typedef struct {
+  // Maximum number of decoded bytes in a block (a power of two).
+  size_t block_size;
+  int block_size_log2;
+
+  // Size of a block header (in bytes).
+  size_t header_size;
+
+  // Number of bits of the encoded size of a block, and of the stream sizes of
+  // multi-stream blocks (16 or 32).
+  int size_bits;
+} BlockLayout;
+
+// Set up the block layout for a block size of (1 << block_size_log2) bytes.
+FORCE_INLINE static void _hzr_init_block_layout(BlockLayout* layout,
+                                               int block_size_log2) {
+  const hzr_bool wide = (block_size_log2 > 16) ? HZR_TRUE : HZR_FALSE;
+  layout->block_size = ((size_t)1) << block_size_log2;
+  layout->block_size_log2 = block_size_log2;
+  layout->header_size =
+      wide ? HZR_WIDE_BLOCK_HEADER_SIZE : (size_t)HZR_BLOCK_HEADER_SIZE;
+  layout->size_bits = wide ? 32 : 16;
+}
+
+// Get the number of blocks for a given decoded size.
+FORCE_INLINE static size_t _hzr_num_blocks(const BlockLayout* layout,
+                                           size_t decoded_size) {
+  return (decoded_size >> layout->block_size_log2) +
+         (((decoded_size & (layout->block_size - 1)) != 0) ? 1 : 0);
+}
 
 // A symbol is a 9-bit unsigned number.
 typedef uint16_t Symbol;
@@ -120,6 +365,57 @@ typedef uint16_t Symbol;
 #define kSymUpTo278Zeros 259    // 23 - 278     (8 bits)
 #define kSymUpTo16662Zeros 260  // 279 - 16662  (14 bits)
 
+// The symbols of blocks with 16-bit samples. A sample s (a signed 16-bit
+// number) is coded by its zigzag value z = (s << 1) ^ (s >> 15), so that small
+// magnitudes get small values:
+//    0 - 239:   z = the symbol (0 bits).
+//    240 - 255: An escape symbol for larger values: z = 239 + 2^n + x, where
+//               n = symbol - 240, and x is an n-bit number that follows the
+//               code (0 - 15 bits).
+// Single zero samples are coded by symbol 0, and runs of zero samples by the
+// RLE symbols.
+#define kSymEscape16 240
+
+// The longest supported Huffman code (in bits).
+#define kMaxCodeLength 32
+
+// The longest canonical Huffman code (in bits).
+//
+// The canonical codes (HZR_ENCODING_CANONICAL) are described by the code length
+// of each symbol (zero for unused symbols), in symbol order. Each code length
+// is coded relative to the previous code length (initially zero):
+//    0:      Same as the previous code length.
+//    10s:    The previous code length + 1 (s = 0) or - 1 (s = 1).
+//    11xxxx: The code length xxxx (4 bits). If the code length is zero, it is
+//            followed by the number of unused symbols - 1 (8 bits).
+//
+// The codes are assigned in order of increasing code length, and in symbol
+// order for each code length (i.e. like in DEFLATE), and are stored in the
+// bitstream starting with the most significant bit of the code.
+#define kMaxCanonicalCodeLength 11
+#define kMaxCodeLengthZeroRun 256
+
+// The number of streams in the multi-stream encoding modes.
+//
+// The decoded data of a multi-stream block is split into kNumMultiStreams
+// segments of (almost) equal size (see _hzr_segment_start()), and each segment
+// is coded as a separate stream. All the streams use the Huffman codes of the
+// block. The streams start at the first byte boundary after the Huffman code
+// description, and they are preceded by the size of each stream except the
+// last one (16 bits each, or 32 bits each with wide size fields).
+#define kNumMultiStreams 4
+
+// Get the start offset of a segment of a multi-stream block.
+FORCE_INLINE static size_t _hzr_segment_start(size_t size, int segment) {
+  return (size * (size_t)segment) / kNumMultiStreams;
+}
+
+// Get the start offset of a segment of a multi-stream block with 16-bit
+// samples (the segments are split between samples).
+FORCE_INLINE static size_t _hzr_segment_start16(size_t size, int segment) {
+  return _hzr_segment_start(size >> 1, segment) << 1;
+}
+
 // The maximum number of nodes in the Huffman tree (branch nodes + leaf nodes).
 #define kMaxTreeNodes ((kNumSymbols * 2) - 1)
 
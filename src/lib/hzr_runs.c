@@ -0,0 +1,126 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_runs.h"
+
+#include "hzr_internal.h"
+#include "hzr_thread.h"
+
+#if defined(HZR_ARCH_X86)
+#include "hzr_runs_avx2.h"
+#include "hzr_runs_sse2.h"
+#elif defined(HZR_ARCH_ARM)
+#include "hzr_runs_neon.h"
+#endif
+
+// Get the zero mask for 64 bytes, eight bytes at a time.
+static uint64_t ZeroMaskFallback(const uint8_t* ptr) {
+  const uint64_t kLowBits = 0x7f7f7f7f7f7f7f7fULL;
+  const uint64_t kGatherBits = 0x0102040810204080ULL;
+  uint64_t mask = 0U;
+  for (int i = 0; i < 8; ++i) {
+    // Get the high bit of each byte that is zero (this does not carry between
+    // bytes), and gather the eight high bits into a single byte.
+    uint64_t x = _hzr_load64le(&ptr[i * 8]);
+    uint64_t zero_bits = ~((((x & kLowBits) + kLowBits) | x) | kLowBits);
+    mask |= (((zero_bits >> 7) * kGatherBits) >> 56) << (i * 8);
+  }
+  return mask;
+}
+
+// Get the delta filtered zero mask for 64 bytes, one byte at a time.
+static uint64_t DeltaZeroMaskFallback(const uint8_t* ptr,
+                                      size_t byte_stride,
+                                      hzr_bool wide) {
+  const uint8_t* prev = ptr - byte_stride;
+  uint64_t mask = 0U;
+  if (wide) {
+    for (int i = 0; i < 64; i += 2) {
+      uint32_t x = ((uint32_t)ptr[i]) | (((uint32_t)ptr[i + 1]) << 8);
+      uint32_t y = ((uint32_t)prev[i]) | (((uint32_t)prev[i + 1]) << 8);
+      uint32_t d = x - y;
+      mask |= ((uint64_t)((d & 0xffU) == 0U)) << i;
+      mask |= ((uint64_t)((d & 0xff00U) == 0U)) << (i + 1);
+    }
+  } else {
+    for (int i = 0; i < 64; ++i) {
+      mask |= ((uint64_t)(ptr[i] == prev[i])) << i;
+    }
+  }
+  return mask;
+}
+
+typedef uint64_t (*ZeroMaskFn)(const uint8_t* ptr);
+typedef uint64_t (*DeltaZeroMaskFn)(const uint8_t* ptr,
+                                    size_t byte_stride,
+                                    hzr_bool wide);
+
+// The selected implementations. These are resolved once, since the functions
+// are called far too often for doing a CPU feature check each time.
+static ZeroMaskFn s_zero_mask = NULL;
+static DeltaZeroMaskFn s_delta_zero_mask = NULL;
+static _hzr_once_t s_zero_mask_once = HZR_ONCE_INIT;
+
+// Select the fastest implementations for this CPU.
+static void SelectZeroMask(void) {
+#if defined(HZR_ARCH_X86)
+  if (_hzr_can_use_avx2()) {
+    s_zero_mask = _hzr_zero_mask_avx2;
+    s_delta_zero_mask = _hzr_delta_zero_mask_avx2;
+    return;
+  }
+  if (_hzr_can_use_sse2()) {
+    s_zero_mask = _hzr_zero_mask_sse2;
+    s_delta_zero_mask = _hzr_delta_zero_mask_sse2;
+    return;
+  }
+#elif defined(HZR_ARCH_ARM)
+  if (_hzr_can_use_neon()) {
+    s_zero_mask = _hzr_zero_mask_neon;
+    s_delta_zero_mask = _hzr_delta_zero_mask_neon;
+    return;
+  }
+#endif
+  s_zero_mask = ZeroMaskFallback;
+  s_delta_zero_mask = DeltaZeroMaskFallback;
+}
+
+uint64_t _hzr_zero_mask(const uint8_t* ptr, size_t size) {
+  // Partial mask?
+  if (UNLIKELY(size < 64)) {
+    uint64_t mask = 0U;
+    for (size_t i = 0; i < size; ++i) {
+      mask |= ((uint64_t)(ptr[i] == 0)) << i;
+    }
+    return mask;
+  }
+
+  _hzr_call_once(&s_zero_mask_once, SelectZeroMask);
+  return s_zero_mask(ptr);
+}
+
+uint64_t _hzr_delta_zero_mask(const uint8_t* ptr,
+                              size_t byte_stride,
+                              hzr_bool wide) {
+  _hzr_call_once(&s_zero_mask_once, SelectZeroMask);
+  return s_delta_zero_mask(ptr, byte_stride, wide);
+}
@@ -0,0 +1,101 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_runs_avx2.h"
+
+// Check if we are compiling with AVX2 support.
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#include "hzr_cpuid_x86.h"
+
+// Check if we can use AVX2, at runtime (this requires support from both the
+// CPU and the OS).
+hzr_bool _hzr_can_use_avx2(void) {
+  unsigned a, b, c, d;
+  _hzr_cpuid(CPUID_VENDOR_ID, 0, &a, &b, &c, &d);
+  if (a < CPUID_EXTENDED_FEATURES) {
+    return HZR_FALSE;
+  }
+  _hzr_cpuid(CPUID_FEATURES, 0, &a, &b, &c, &d);
+  const unsigned kOSXSAVE = 1U << 27;
+  const unsigned kAVX = 1U << 28;
+  if ((c & (kOSXSAVE | kAVX)) != (kOSXSAVE | kAVX)) {
+    return HZR_FALSE;
+  }
+  if ((_hzr_xgetbv() & 6U) != 6U) {
+    return HZR_FALSE;
+  }
+  _hzr_cpuid(CPUID_EXTENDED_FEATURES, 0, &a, &b, &c, &d);
+  return (b & (1U << 5)) ? HZR_TRUE : HZR_FALSE;
+}
+
+// AVX2 optimized zero mask, 32 bytes at a time.
+uint64_t _hzr_zero_mask_avx2(const uint8_t* ptr) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i lo = _mm256_loadu_si256((const __m256i*)&ptr[0]);
+  __m256i hi = _mm256_loadu_si256((const __m256i*)&ptr[32]);
+  uint32_t lo_bits = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero));
+  uint32_t hi_bits = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, zero));
+  return ((uint64_t)hi_bits << 32) | (uint64_t)lo_bits;
+}
+
+// AVX2 optimized delta filtered zero mask, 32 bytes at a time.
+uint64_t _hzr_delta_zero_mask_avx2(const uint8_t* ptr,
+                                   size_t byte_stride,
+                                   hzr_bool wide) {
+  const uint8_t* prev = ptr - byte_stride;
+  const __m256i zero = _mm256_setzero_si256();
+  uint64_t mask = 0U;
+  for (int i = 0; i < 2; ++i) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&ptr[i * 32]);
+    __m256i y = _mm256_loadu_si256((const __m256i*)&prev[i * 32]);
+    __m256i is_zero = wide ? _mm256_cmpeq_epi8(_mm256_sub_epi16(x, y), zero)
+                           : _mm256_cmpeq_epi8(x, y);
+    uint64_t bits = (uint64_t)(uint32_t)_mm256_movemask_epi8(is_zero);
+    mask |= bits << (i * 32);
+  }
+  return mask;
+}
+
+#else
+
+hzr_bool _hzr_can_use_avx2(void) {
+  return HZR_FALSE;
+}
+
+uint64_t _hzr_zero_mask_avx2(const uint8_t* ptr) {
+  (void)ptr;
+  return 0U;
+}
+
+uint64_t _hzr_delta_zero_mask_avx2(const uint8_t* ptr,
+                                   size_t byte_stride,
+                                   hzr_bool wide) {
+  (void)ptr;
+  (void)byte_stride;
+  (void)wide;
+  return 0U;
+}
+
+#endif  // __AVX2__
@@ -0,0 +1,101 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_runs_neon.h"
+
+// Check if we are compiling with NEON support.
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+// Check if we can use NEON, at runtime. NEON is mandatory in ARMv8-A, and for
+// older architectures we trust the compiler target.
+hzr_bool _hzr_can_use_neon(void) {
+  return HZR_TRUE;
+}
+
+// Get a 16-bit mask from 16 bytes that are either 0x00 or 0xff.
+static uint64_t MoveMask(uint8x16_t is_zero) {
+  static const uint8_t kBitWeights[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                          1, 2, 4, 8, 16, 32, 64, 128};
+  // Keep one weighted bit per byte, and sum the bits of each half (three
+  // pairwise additions turn eight bytes into one).
+  uint8x16_t bits = vandq_u8(is_zero, vld1q_u8(kBitWeights));
+  uint8x8_t sum = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+  sum = vpadd_u8(sum, sum);
+  sum = vpadd_u8(sum, sum);
+  return (uint64_t)vget_lane_u16(vreinterpret_u16_u8(sum), 0);
+}
+
+// NEON optimized zero mask, 16 bytes at a time.
+uint64_t _hzr_zero_mask_neon(const uint8_t* ptr) {
+  uint64_t mask = 0U;
+  for (int i = 0; i < 4; ++i) {
+    uint8x16_t is_zero = vceqq_u8(vld1q_u8(&ptr[i * 16]), vdupq_n_u8(0));
+    mask |= MoveMask(is_zero) << (i * 16);
+  }
+  return mask;
+}
+
+// NEON optimized delta filtered zero mask, 16 bytes at a time.
+uint64_t _hzr_delta_zero_mask_neon(const uint8_t* ptr,
+                                   size_t byte_stride,
+                                   hzr_bool wide) {
+  const uint8_t* prev = ptr - byte_stride;
+  uint64_t mask = 0U;
+  for (int i = 0; i < 4; ++i) {
+    uint8x16_t x = vld1q_u8(&ptr[i * 16]);
+    uint8x16_t y = vld1q_u8(&prev[i * 16]);
+    uint8x16_t is_zero;
+    if (wide) {
+      uint16x8_t d =
+          vsubq_u16(vreinterpretq_u16_u8(x), vreinterpretq_u16_u8(y));
+      is_zero = vceqq_u8(vreinterpretq_u8_u16(d), vdupq_n_u8(0));
+    } else {
+      is_zero = vceqq_u8(x, y);
+    }
+    mask |= MoveMask(is_zero) << (i * 16);
+  }
+  return mask;
+}
+
+#else
+
+hzr_bool _hzr_can_use_neon(void) {
+  return HZR_FALSE;
+}
+
+uint64_t _hzr_zero_mask_neon(const uint8_t* ptr) {
+  (void)ptr;
+  return 0U;
+}
+
+uint64_t _hzr_delta_zero_mask_neon(const uint8_t* ptr,
+                                   size_t byte_stride,
+                                   hzr_bool wide) {
+  (void)ptr;
+  (void)byte_stride;
+  (void)wide;
+  return 0U;
+}
+
+#endif  // __ARM_NEON
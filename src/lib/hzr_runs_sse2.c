@@ -0,0 +1,99 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_runs_sse2.h"
+
+// Check if we are compiling with SSE2 support.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+
+#include <emmintrin.h>
+
+#include "hzr_cpuid_x86.h"
+
+// Check if we can use SSE2, at runtime.
+hzr_bool _hzr_can_use_sse2(void) {
+#if defined(__x86_64__) || defined(_M_X64)
+  // SSE2 is part of the x86-64 baseline.
+  return HZR_TRUE;
+#else
+  unsigned a, b, c, d;
+  _hzr_cpuid(CPUID_VENDOR_ID, 0, &a, &b, &c, &d);
+  if (a >= CPUID_FEATURES) {
+    _hzr_cpuid(CPUID_FEATURES, 0, &a, &b, &c, &d);
+    return (d & (1U << 26)) ? HZR_TRUE : HZR_FALSE;
+  }
+  return HZR_FALSE;
+#endif
+}
+
+// SSE2 optimized zero mask, 16 bytes at a time.
+uint64_t _hzr_zero_mask_sse2(const uint8_t* ptr) {
+  const __m128i zero = _mm_setzero_si128();
+  uint64_t mask = 0U;
+  for (int i = 0; i < 4; ++i) {
+    __m128i x = _mm_loadu_si128((const __m128i*)&ptr[i * 16]);
+    uint64_t bits = (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero));
+    mask |= bits << (i * 16);
+  }
+  return mask;
+}
+
+// SSE2 optimized delta filtered zero mask, 16 bytes at a time.
+uint64_t _hzr_delta_zero_mask_sse2(const uint8_t* ptr,
+                                   size_t byte_stride,
+                                   hzr_bool wide) {
+  const uint8_t* prev = ptr - byte_stride;
+  const __m128i zero = _mm_setzero_si128();
+  uint64_t mask = 0U;
+  for (int i = 0; i < 4; ++i) {
+    __m128i x = _mm_loadu_si128((const __m128i*)&ptr[i * 16]);
+    __m128i y = _mm_loadu_si128((const __m128i*)&prev[i * 16]);
+    __m128i is_zero = wide ? _mm_cmpeq_epi8(_mm_sub_epi16(x, y), zero)
+                           : _mm_cmpeq_epi8(x, y);
+    uint64_t bits = (uint64_t)_mm_movemask_epi8(is_zero);
+    mask |= bits << (i * 16);
+  }
+  return mask;
+}
+
+#else
+
+hzr_bool _hzr_can_use_sse2(void) {
+  return HZR_FALSE;
+}
+
+uint64_t _hzr_zero_mask_sse2(const uint8_t* ptr) {
+  (void)ptr;
+  return 0U;
+}
+
+uint64_t _hzr_delta_zero_mask_sse2(const uint8_t* ptr,
+                                   size_t byte_stride,
+                                   hzr_bool wide) {
+  (void)ptr;
+  (void)byte_stride;
+  (void)wide;
+  return 0U;
+}
+
+#endif  // SSE2
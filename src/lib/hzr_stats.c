@@ -0,0 +1,112 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+// We need POSIX declarations (e.g. clock_gettime()) in C99 mode.
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "hzr_stats.h"
+
+#include <string.h>
+
+#if defined(HZR_ARCH_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#define HZR_HAS_RDTSC
+#elif defined(HZR_ARCH_X86) && (defined(__GNUC__) || defined(__clang__))
+#include <x86intrin.h>
+#define HZR_HAS_RDTSC
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t _hzr_ticks(void) {
+#if defined(HZR_HAS_RDTSC)
+  return (uint64_t)__rdtsc();
+#elif defined(_WIN32)
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)counter.QuadPart;
+#else
+  struct timespec t;
+  if (clock_gettime(CLOCK_MONOTONIC, &t) != 0) {
+    return 0U;
+  }
+  return ((uint64_t)t.tv_sec) * 1000000000U + (uint64_t)t.tv_nsec;
+#endif
+}
+
+void _hzr_stats_add_block(hzr_stats_t* stats,
+                          int mode_byte,
+                          size_t decoded_size,
+                          size_t encoded_size) {
+  switch (mode_byte & (int)HZR_ENCODING_MASK) {
+    case HZR_ENCODING_COPY:
+      ++stats->copy_blocks;
+      break;
+    case HZR_ENCODING_FILL:
+      ++stats->fill_blocks;
+      break;
+    case HZR_ENCODING_TABLE:
+      ++stats->table_blocks;
+      break;
+    case HZR_ENCODING_REUSE:
+    case HZR_ENCODING_REUSE_MULTI:
+      ++stats->reuse_blocks;
+      break;
+    default:
+      ++stats->tree_blocks;
+      break;
+  }
+  if ((mode_byte >> HZR_FILTER_SHIFT) != HZR_BLOCK_FILTER_NONE) {
+    ++stats->filtered_blocks;
+  }
+  stats->decoded_bytes += (uint64_t)decoded_size;
+  stats->encoded_bytes += (uint64_t)encoded_size;
+}
+
+void _hzr_stats_add(hzr_stats_t* dst, const hzr_stats_t* src) {
+  dst->copy_blocks += src->copy_blocks;
+  dst->fill_blocks += src->fill_blocks;
+  dst->tree_blocks += src->tree_blocks;
+  dst->reuse_blocks += src->reuse_blocks;
+  dst->table_blocks += src->table_blocks;
+  dst->filtered_blocks += src->filtered_blocks;
+  dst->decoded_bytes += src->decoded_bytes;
+  dst->encoded_bytes += src->encoded_bytes;
+  dst->coded_symbols += src->coded_symbols;
+  dst->coded_bits += src->coded_bits;
+  dst->filter_ticks += src->filter_ticks;
+  dst->histogram_ticks += src->histogram_ticks;
+  dst->tree_ticks += src->tree_ticks;
+  dst->coding_ticks += src->coding_ticks;
+  dst->crc_ticks += src->crc_ticks;
+  dst->lut_lookups += src->lut_lookups;
+  dst->lut_misses += src->lut_misses;
+}
+
+void hzr_init_stats(hzr_stats_t* stats) {
+  memset(stats, 0, sizeof(hzr_stats_t));
+}
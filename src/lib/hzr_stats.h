@@ -0,0 +1,71 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#ifndef HZR_STATS_H_
+#define HZR_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hzr_internal.h"
+#include "libhzr.h"
+
+// Read the timer that is used for the per-phase times of the statistics (the
+// timestamp counter on x86).
+uint64_t _hzr_ticks(void);
+
+// Start timing a phase. Returns zero (without reading the timer) if no
+// statistics are collected.
+FORCE_INLINE static uint64_t _hzr_stats_start(const hzr_stats_t* stats) {
+  return stats ? _hzr_ticks() : 0U;
+}
+
+// Add the time since start to the given phase time of the statistics (if any),
+// and restart the timing at the current time.
+#define HZR_STATS_LAP(stats, field, start) \
+  do {                                     \
+    if (stats) {                           \
+      const uint64_t now_ = _hzr_ticks();  \
+      (stats)->field += now_ - (start);    \
+      (start) = now_;                      \
+    }                                      \
+  } while (0)
+
+// Counters that are updated in the innermost loops are only compiled in when
+// the library is built with HZR_ENABLE_STATS.
+#if defined(HZR_ENABLE_STATS)
+#define HZR_STATS_COUNT(counter, n) ((counter) += (uint64_t)(n))
+#else
+#define HZR_STATS_COUNT(counter, n) ((void)0)
+#endif
+
+// Count a block, given the mode byte of its block header, its decoded size and
+// its encoded size (including the block header).
+void _hzr_stats_add_block(hzr_stats_t* stats,
+                          int mode_byte,
+                          size_t decoded_size,
+                          size_t encoded_size);
+
+// Add the statistics of src to dst.
+void _hzr_stats_add(hzr_stats_t* dst, const hzr_stats_t* src);
+
+#endif  // HZR_STATS_H_
@@ -0,0 +1,142 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_table.h"
+
+#include <stdlib.h>
+
+#include "hzr_crc32c.h"
+
+// The saved table format is as follows:
+//    0: Signature, "HZRT" (32 bits).
+//    4: Table ID (16 bits).
+//    6: The code length of each symbol (4 bits each, two per byte, with the
+//       lower bits first).
+//    137: CRC32 of the preceding bytes (32 bits).
+#define kTableSignature 0x54525a48U
+#define kTableLengthsOffset 6
+#define kTableCrcOffset (kTableLengthsOffset + (kNumSymbols + 1) / 2)
+
+static void WriteLE16(uint8_t* ptr, uint32_t x) {
+  ptr[0] = (uint8_t)x;
+  ptr[1] = (uint8_t)(x >> 8);
+}
+
+static void WriteLE32(uint8_t* ptr, uint32_t x) {
+  WriteLE16(ptr, x);
+  WriteLE16(ptr + 2, x >> 16);
+}
+
+static uint32_t ReadLE16(const uint8_t* ptr) {
+  return ((uint32_t)ptr[0]) | (((uint32_t)ptr[1]) << 8);
+}
+
+static uint32_t ReadLE32(const uint8_t* ptr) {
+  return ReadLE16(ptr) | (ReadLE16(ptr + 2) << 16);
+}
+
+// Create a table from a set of code lengths.
+static hzr_table_t* CreateTable(const uint8_t* lengths, unsigned id) {
+  hzr_table_t* table = (hzr_table_t*)malloc(sizeof(hzr_table_t));
+  if (UNLIKELY(!table)) {
+    DLOG("Out of memory.");
+    return NULL;
+  }
+  table->id = id;
+  memcpy(table->lengths, lengths, sizeof(table->lengths));
+  table->encode_table = _hzr_create_encode_table(lengths);
+  table->decode_table = _hzr_create_decode_table(lengths);
+  if (UNLIKELY(!table->encode_table || !table->decode_table)) {
+    hzr_table_destroy(table);
+    return NULL;
+  }
+  return table;
+}
+
+hzr_table_t* hzr_table_train(const void* sample,
+                             size_t sample_size,
+                             unsigned id) {
+  if (UNLIKELY((!sample && sample_size > 0) || id > HZR_MAX_TABLE_ID)) {
+    DLOG("Invalid input arguments.");
+    return NULL;
+  }
+  uint8_t lengths[kNumSymbols];
+  if (_hzr_train_code_lengths((const uint8_t*)sample, sample_size, lengths) !=
+      HZR_OK) {
+    return NULL;
+  }
+  return CreateTable(lengths, id);
+}
+
+void hzr_table_destroy(hzr_table_t* table) {
+  if (table) {
+    free(table->encode_table);
+    free(table->decode_table);
+    free(table);
+  }
+}
+
+unsigned hzr_table_id(const hzr_table_t* table) {
+  return table->id;
+}
+
+hzr_status_t hzr_table_save(const hzr_table_t* table,
+                            void* out,
+                            size_t out_size,
+                            size_t* saved_size) {
+  if (UNLIKELY(!table || !out || !saved_size ||
+               out_size < HZR_SAVED_TABLE_SIZE)) {
+    DLOG("Invalid input arguments.");
+    return HZR_FAIL;
+  }
+  uint8_t* ptr = (uint8_t*)out;
+  WriteLE32(ptr, kTableSignature);
+  WriteLE16(&ptr[4], table->id);
+  uint8_t* lengths = &ptr[kTableLengthsOffset];
+  for (int k = 0; k < kNumSymbols; k += 2) {
+    uint8_t hi = (k + 1 < kNumSymbols) ? table->lengths[k + 1] : 0U;
+    lengths[k / 2] = (uint8_t)(table->lengths[k] | (hi << 4));
+  }
+  WriteLE32(&ptr[kTableCrcOffset], _hzr_crc32(ptr, kTableCrcOffset));
+  *saved_size = HZR_SAVED_TABLE_SIZE;
+  return HZR_OK;
+}
+
+hzr_table_t* hzr_table_load(const void* in, size_t in_size) {
+  const uint8_t* ptr = (const uint8_t*)in;
+  if (UNLIKELY(!in || in_size < HZR_SAVED_TABLE_SIZE)) {
+    DLOG("Invalid input arguments.");
+    return NULL;
+  }
+  if (UNLIKELY(ReadLE32(ptr) != kTableSignature ||
+               ReadLE32(&ptr[kTableCrcOffset]) !=
+                   _hzr_crc32(ptr, kTableCrcOffset))) {
+    DLOG("Invalid table data.");
+    return NULL;
+  }
+  uint8_t lengths[kNumSymbols];
+  const uint8_t* packed = &ptr[kTableLengthsOffset];
+  for (int k = 0; k < kNumSymbols; ++k) {
+    lengths[k] = (uint8_t)((packed[k / 2] >> (4 * (k & 1))) & 15U);
+  }
+  return CreateTable(lengths, (unsigned)ReadLE16(&ptr[4]));
+}
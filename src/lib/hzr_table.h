@@ -0,0 +1,53 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#ifndef HZR_TABLE_H_
+#define HZR_TABLE_H_
+
+#include <stdint.h>
+
+#include "hzr_internal.h"
+#include "libhzr.h"
+
+// A shared Huffman table. The table is described by the code length of each
+// symbol (all symbols have codes), and the encoder and the decoder build their
+// own tables from the code lengths.
+struct hzr_table_struct {
+  unsigned id;
+  uint8_t lengths[kNumSymbols];
+  void* encode_table;
+  void* decode_table;
+};
+
+// Calculate the code lengths for a table from sample data (implemented by the
+// encoder).
+hzr_status_t _hzr_train_code_lengths(const uint8_t* sample,
+                                     size_t sample_size,
+                                     uint8_t* lengths);
+
+// Build the encoder and decoder tables for a set of code lengths (implemented
+// by the encoder and the decoder). NULL is returned if the code lengths are
+// invalid or if we are out of memory. The tables are freed with free().
+void* _hzr_create_encode_table(const uint8_t* lengths);
+void* _hzr_create_decode_table(const uint8_t* lengths);
+
+#endif  // HZR_TABLE_H_
@@ -0,0 +1,522 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_thread.h"
+
+#include <stdlib.h>
+
+// Maximum number of chunks per thread that the items are split into. More
+// chunks give better load balancing, fewer chunks give less locking.
+#define CHUNKS_PER_THREAD 4
+
+hzr_status_t _hzr_read_source(hzr_source_t source,
+                              void* user,
+                              uint8_t* buf,
+                              size_t size,
+                              size_t* read_size) {
+  *read_size = 0;
+  while (*read_size < size) {
+    size_t count = 0;
+    if (UNLIKELY(source(&buf[*read_size], size - *read_size, &count, user) !=
+                     HZR_OK ||
+                 count > size - *read_size)) {
+      DLOG("Unable to read from the source.");
+      return HZR_FAIL;
+    }
+    if (count == 0) {
+      break;
+    }
+    *read_size += count;
+  }
+  return HZR_OK;
+}
+
+#if defined(_WIN32)
+// The once callback gets a pointer to the init function as its parameter.
+static BOOL CALLBACK OnceMain(PINIT_ONCE once, PVOID param, PVOID* context) {
+  (void)once;
+  (void)context;
+  (*(void (**)(void))param)();
+  return TRUE;
+}
+
+void _hzr_call_once(_hzr_once_t* once, void (*init)(void)) {
+  (void)InitOnceExecuteOnce(once, OnceMain, (PVOID)&init, NULL);
+}
+#elif defined(HZR_HAS_PTHREADS)
+void _hzr_call_once(_hzr_once_t* once, void (*init)(void)) {
+  (void)pthread_once(once, init);
+}
+#else
+void _hzr_call_once(_hzr_once_t* once, void (*init)(void)) {
+  // Without thread support the library never runs any threads of its own.
+  if (!*once) {
+    *once = HZR_TRUE;
+    init();
+  }
+}
+#endif
+
+#if defined(HZR_HAS_THREADS)
+
+#if defined(_WIN32)
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+typedef HANDLE Thread;
+#define MutexInit(m) InitializeCriticalSection(m)
+#define MutexDestroy(m) DeleteCriticalSection(m)
+#define MutexLock(m) EnterCriticalSection(m)
+#define MutexUnlock(m) LeaveCriticalSection(m)
+#define CondInit(c) InitializeConditionVariable(c)
+#define CondDestroy(c) ((void)(c))
+#define CondWait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define CondBroadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+typedef pthread_t Thread;
+#define MutexInit(m) pthread_mutex_init(m, NULL)
+#define MutexDestroy(m) pthread_mutex_destroy(m)
+#define MutexLock(m) pthread_mutex_lock(m)
+#define MutexUnlock(m) pthread_mutex_unlock(m)
+#define CondInit(c) pthread_cond_init(c, NULL)
+#define CondDestroy(c) pthread_cond_destroy(c)
+#define CondWait(c, m) pthread_cond_wait(c, m)
+#define CondBroadcast(c) pthread_cond_broadcast(c)
+#endif
+
+// State that is shared between all the threads of a parallel job.
+typedef struct {
+  _hzr_task_fn task;
+  void* context;
+  size_t num_items;
+  size_t chunk_size;
+  size_t next_item;
+  hzr_bool failed;
+  Mutex mutex;
+} Job;
+
+// Per-thread state.
+typedef struct {
+  Job* job;
+  int thread_no;
+} Worker;
+
+static void RunWorker(void* arg) {
+  Worker* worker = (Worker*)arg;
+  Job* job = worker->job;
+  for (;;) {
+    // Grab the next chunk of items.
+    MutexLock(&job->mutex);
+    size_t begin = job->next_item;
+    size_t end = hzr_min(begin + job->chunk_size, job->num_items);
+    if (job->failed) {
+      begin = end;
+    }
+    job->next_item = end;
+    MutexUnlock(&job->mutex);
+    if (begin >= end) {
+      break;
+    }
+
+    // Process the items.
+    if (UNLIKELY(job->task(job->context, worker->thread_no, begin, end) !=
+                 HZR_OK)) {
+      MutexLock(&job->mutex);
+      job->failed = HZR_TRUE;
+      MutexUnlock(&job->mutex);
+      break;
+    }
+  }
+}
+
+// A thread entry point.
+typedef void (*ThreadFn)(void* arg);
+
+// The entry point and the argument of a started thread.
+typedef struct {
+  ThreadFn fn;
+  void* arg;
+} ThreadStart;
+
+#if defined(_WIN32)
+static DWORD WINAPI ThreadMain(LPVOID arg) {
+  ThreadStart* start = (ThreadStart*)arg;
+  start->fn(start->arg);
+  return 0;
+}
+
+static hzr_bool StartThread(Thread* thread, ThreadStart* start) {
+  *thread = CreateThread(NULL, 0, ThreadMain, start, 0, NULL);
+  return (*thread != NULL) ? HZR_TRUE : HZR_FALSE;
+}
+
+static void JoinThread(Thread* thread) {
+  WaitForSingleObject(*thread, INFINITE);
+  CloseHandle(*thread);
+}
+#else
+static void* ThreadMain(void* arg) {
+  ThreadStart* start = (ThreadStart*)arg;
+  start->fn(start->arg);
+  return NULL;
+}
+
+static hzr_bool StartThread(Thread* thread, ThreadStart* start) {
+  return (pthread_create(thread, NULL, ThreadMain, start) == 0) ? HZR_TRUE
+                                                                : HZR_FALSE;
+}
+
+static void JoinThread(Thread* thread) {
+  (void)pthread_join(*thread, NULL);
+}
+#endif
+
+hzr_status_t _hzr_parallel_for(_hzr_task_fn task,
+                               void* context,
+                               size_t num_items,
+                               int num_threads) {
+  if (num_items == 0) {
+    return HZR_OK;
+  }
+
+  // Don't start more threads than there are items.
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  if ((size_t)num_threads > num_items) {
+    num_threads = (int)num_items;
+  }
+  if (num_threads == 1) {
+    return task(context, 0, 0, num_items);
+  }
+
+  Thread* threads = (Thread*)malloc(sizeof(Thread) * (size_t)num_threads);
+  Worker* workers = (Worker*)malloc(sizeof(Worker) * (size_t)num_threads);
+  ThreadStart* starts =
+      (ThreadStart*)malloc(sizeof(ThreadStart) * (size_t)num_threads);
+  if (UNLIKELY(!threads || !workers || !starts)) {
+    DLOG("Out of memory.");
+    free(threads);
+    free(workers);
+    free(starts);
+    return HZR_FAIL;
+  }
+
+  Job job;
+  job.task = task;
+  job.context = context;
+  job.num_items = num_items;
+  job.chunk_size = hzr_max(
+      num_items / ((size_t)num_threads * CHUNKS_PER_THREAD), (size_t)1);
+  job.next_item = 0;
+  job.failed = HZR_FALSE;
+  MutexInit(&job.mutex);
+
+  // Start the worker threads (the calling thread is worker number zero).
+  int num_started = 1;
+  for (int i = 0; i < num_threads; ++i) {
+    workers[i].job = &job;
+    workers[i].thread_no = i;
+    starts[i].fn = RunWorker;
+    starts[i].arg = &workers[i];
+    if (i > 0) {
+      if (!StartThread(&threads[i], &starts[i])) {
+        // Carry on with the threads that we have.
+        DLOG("Unable to start a worker thread.");
+        break;
+      }
+      ++num_started;
+    }
+  }
+
+  // Do our share of the work, and wait for the other threads to finish.
+  RunWorker(&workers[0]);
+  for (int i = 1; i < num_started; ++i) {
+    JoinThread(&threads[i]);
+  }
+
+  MutexDestroy(&job.mutex);
+  free(threads);
+  free(workers);
+  free(starts);
+
+  return job.failed ? HZR_FAIL : HZR_OK;
+}
+
+// Shared state of a pipeline. Item number n is stored in slot n % num_slots.
+// The items [num_consumed, num_produced) are in flight, and the items
+// [num_consumed, num_taken) have been taken by the workers. The processed flag
+// of a slot tells if the worker is done with the item.
+typedef struct {
+  _hzr_produce_fn produce;
+  _hzr_process_fn process;
+  _hzr_consume_fn consume;
+  void* context;
+  void* const* slots;
+  size_t num_slots;
+  hzr_bool* processed;
+  size_t num_produced;
+  size_t num_taken;
+  size_t num_consumed;
+  hzr_bool produce_done;
+  hzr_bool failed;
+  Mutex mutex;
+  Cond cond;
+} Pipeline;
+
+// Per-thread state of a pipeline worker.
+typedef struct {
+  Pipeline* pipeline;
+  int thread_no;
+} PipelineWorker;
+
+// Stop the pipeline (called with the mutex locked).
+static void FailPipeline(Pipeline* pipeline) {
+  pipeline->failed = HZR_TRUE;
+  CondBroadcast(&pipeline->cond);
+}
+
+static void RunProducer(void* arg) {
+  Pipeline* pipeline = (Pipeline*)arg;
+  MutexLock(&pipeline->mutex);
+  for (;;) {
+    // Wait for a free slot.
+    while (!pipeline->failed &&
+           (pipeline->num_produced - pipeline->num_consumed) ==
+               pipeline->num_slots) {
+      CondWait(&pipeline->cond, &pipeline->mutex);
+    }
+    if (pipeline->failed) {
+      break;
+    }
+    size_t slot = pipeline->num_produced % pipeline->num_slots;
+    MutexUnlock(&pipeline->mutex);
+
+    hzr_bool done = HZR_FALSE;
+    hzr_status_t status =
+        pipeline->produce(pipeline->context, pipeline->slots[slot], &done);
+
+    MutexLock(&pipeline->mutex);
+    if (UNLIKELY(status != HZR_OK)) {
+      FailPipeline(pipeline);
+      break;
+    }
+    if (done) {
+      pipeline->produce_done = HZR_TRUE;
+      CondBroadcast(&pipeline->cond);
+      break;
+    }
+    pipeline->processed[slot] = HZR_FALSE;
+    ++pipeline->num_produced;
+    CondBroadcast(&pipeline->cond);
+  }
+  MutexUnlock(&pipeline->mutex);
+}
+
+static void RunPipelineWorker(void* arg) {
+  PipelineWorker* worker = (PipelineWorker*)arg;
+  Pipeline* pipeline = worker->pipeline;
+  MutexLock(&pipeline->mutex);
+  for (;;) {
+    // Wait for an item to process.
+    while (!pipeline->failed && !pipeline->produce_done &&
+           pipeline->num_taken == pipeline->num_produced) {
+      CondWait(&pipeline->cond, &pipeline->mutex);
+    }
+    if (pipeline->failed || pipeline->num_taken == pipeline->num_produced) {
+      break;
+    }
+    size_t slot = pipeline->num_taken % pipeline->num_slots;
+    ++pipeline->num_taken;
+    MutexUnlock(&pipeline->mutex);
+
+    hzr_status_t status = pipeline->process(
+        pipeline->context, worker->thread_no, pipeline->slots[slot]);
+
+    MutexLock(&pipeline->mutex);
+    if (UNLIKELY(status != HZR_OK)) {
+      FailPipeline(pipeline);
+      break;
+    }
+    pipeline->processed[slot] = HZR_TRUE;
+    CondBroadcast(&pipeline->cond);
+  }
+  MutexUnlock(&pipeline->mutex);
+}
+
+static void RunConsumer(Pipeline* pipeline) {
+  MutexLock(&pipeline->mutex);
+  for (;;) {
+    // Wait for the next item to be processed (or for the end of the items).
+    size_t slot = pipeline->num_consumed % pipeline->num_slots;
+    while (!pipeline->failed &&
+           !(pipeline->num_consumed < pipeline->num_produced &&
+             pipeline->processed[slot]) &&
+           !(pipeline->produce_done &&
+             pipeline->num_consumed == pipeline->num_produced)) {
+      CondWait(&pipeline->cond, &pipeline->mutex);
+    }
+    if (pipeline->failed || pipeline->num_consumed == pipeline->num_produced) {
+      break;
+    }
+    MutexUnlock(&pipeline->mutex);
+
+    hzr_status_t status =
+        pipeline->consume(pipeline->context, pipeline->slots[slot]);
+
+    MutexLock(&pipeline->mutex);
+    if (UNLIKELY(status != HZR_OK)) {
+      FailPipeline(pipeline);
+      break;
+    }
+    ++pipeline->num_consumed;
+    CondBroadcast(&pipeline->cond);
+  }
+  MutexUnlock(&pipeline->mutex);
+}
+
+hzr_status_t _hzr_pipeline(_hzr_produce_fn produce,
+                           _hzr_process_fn process,
+                           _hzr_consume_fn consume,
+                           void* context,
+                           void* const* slots,
+                           size_t num_slots,
+                           int num_threads) {
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  // Thread zero is the producer, and the rest are the workers.
+  const size_t num_started_max = (size_t)num_threads + 1;
+  Thread* threads = (Thread*)malloc(sizeof(Thread) * num_started_max);
+  ThreadStart* starts =
+      (ThreadStart*)malloc(sizeof(ThreadStart) * num_started_max);
+  PipelineWorker* workers =
+      (PipelineWorker*)malloc(sizeof(PipelineWorker) * (size_t)num_threads);
+  hzr_bool* processed = (hzr_bool*)malloc(sizeof(hzr_bool) * num_slots);
+  if (UNLIKELY(!threads || !starts || !workers || !processed)) {
+    DLOG("Out of memory.");
+    free(threads);
+    free(starts);
+    free(workers);
+    free(processed);
+    return HZR_FAIL;
+  }
+
+  Pipeline pipeline;
+  pipeline.produce = produce;
+  pipeline.process = process;
+  pipeline.consume = consume;
+  pipeline.context = context;
+  pipeline.slots = slots;
+  pipeline.num_slots = num_slots;
+  pipeline.processed = processed;
+  pipeline.num_produced = 0;
+  pipeline.num_taken = 0;
+  pipeline.num_consumed = 0;
+  pipeline.produce_done = HZR_FALSE;
+  pipeline.failed = HZR_FALSE;
+  MutexInit(&pipeline.mutex);
+  CondInit(&pipeline.cond);
+
+  // Start the producer and the workers. A pipeline needs all its stages, so
+  // we give up if the producer or the first worker can not be started.
+  size_t num_started = 0;
+  for (size_t i = 0; i < num_started_max; ++i) {
+    if (i == 0) {
+      starts[i].fn = RunProducer;
+      starts[i].arg = &pipeline;
+    } else {
+      workers[i - 1].pipeline = &pipeline;
+      workers[i - 1].thread_no = (int)(i - 1);
+      starts[i].fn = RunPipelineWorker;
+      starts[i].arg = &workers[i - 1];
+    }
+    if (!StartThread(&threads[i], &starts[i])) {
+      DLOG("Unable to start a pipeline thread.");
+      if (i < 2) {
+        MutexLock(&pipeline.mutex);
+        FailPipeline(&pipeline);
+        MutexUnlock(&pipeline.mutex);
+      }
+      break;
+    }
+    ++num_started;
+  }
+
+  // Consume the items, and wait for the other threads to finish.
+  RunConsumer(&pipeline);
+  for (size_t i = 0; i < num_started; ++i) {
+    JoinThread(&threads[i]);
+  }
+
+  CondDestroy(&pipeline.cond);
+  MutexDestroy(&pipeline.mutex);
+  free(threads);
+  free(starts);
+  free(workers);
+  free(processed);
+
+  return pipeline.failed ? HZR_FAIL : HZR_OK;
+}
+
+#else  // HZR_HAS_THREADS
+
+hzr_status_t _hzr_parallel_for(_hzr_task_fn task,
+                               void* context,
+                               size_t num_items,
+                               int num_threads) {
+  // No thread support: Do all the work in the calling thread.
+  (void)num_threads;
+  if (num_items == 0) {
+    return HZR_OK;
+  }
+  return task(context, 0, 0, num_items);
+}
+
+hzr_status_t _hzr_pipeline(_hzr_produce_fn produce,
+                           _hzr_process_fn process,
+                           _hzr_consume_fn consume,
+                           void* context,
+                           void* const* slots,
+                           size_t num_slots,
+                           int num_threads) {
+  // No thread support: Run the stages in turn, using the first slot.
+  (void)num_slots;
+  (void)num_threads;
+  for (;;) {
+    hzr_bool done = HZR_FALSE;
+    if (produce(context, slots[0], &done) != HZR_OK) {
+      return HZR_FAIL;
+    }
+    if (done) {
+      return HZR_OK;
+    }
+    if (process(context, 0, slots[0]) != HZR_OK ||
+        consume(context, slots[0]) != HZR_OK) {
+      return HZR_FAIL;
+    }
+  }
+}
+
+#endif  // HZR_HAS_THREADS
@@ -0,0 +1,116 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#ifndef HZR_THREAD_H_
+#define HZR_THREAD_H_
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define HZR_HAS_THREADS
+#elif defined(HZR_HAS_PTHREADS)
+#include <pthread.h>
+#define HZR_HAS_THREADS
+#endif
+
+#include "hzr_internal.h"
+#include "libhzr.h"
+
+// A flag for _hzr_call_once(), which must be initialized with HZR_ONCE_INIT.
+#if defined(_WIN32)
+typedef INIT_ONCE _hzr_once_t;
+#define HZR_ONCE_INIT INIT_ONCE_STATIC_INIT
+#elif defined(HZR_HAS_PTHREADS)
+typedef pthread_once_t _hzr_once_t;
+#define HZR_ONCE_INIT PTHREAD_ONCE_INIT
+#else
+typedef hzr_bool _hzr_once_t;
+#define HZR_ONCE_INIT HZR_FALSE
+#endif
+
+// Call init exactly once for a given flag, even if several threads call this
+// function concurrently. When this function returns, init has completed and
+// everything that it wrote is visible to the calling thread. This is used for
+// selecting the CPU specific implementations of functions.
+void _hzr_call_once(_hzr_once_t* once, void (*init)(void));
+
+// A parallel task that processes the items [begin, end). The thread_no
+// argument is in the range [0, num_threads) and is unique for each concurrently
+// running thread, which makes it useful for indexing per-thread scratch data.
+typedef hzr_status_t (*_hzr_task_fn)(void* context,
+                                     int thread_no,
+                                     size_t begin,
+                                     size_t end);
+
+// Process num_items items using at most num_threads threads (the calling
+// thread is one of them). Items are handed out to the threads in small
+// contiguous chunks. If any task fails, no more items are handed out and
+// HZR_FAIL is returned.
+hzr_status_t _hzr_parallel_for(_hzr_task_fn task,
+                               void* context,
+                               size_t num_items,
+                               int num_threads);
+
+// The number of item slots per worker thread of a pipeline, which bounds the
+// number of items that are in flight.
+#define HZR_PIPELINE_SLOTS_PER_THREAD 2
+
+// The stages of an ordered pipeline. The produce stage fills the next item. It
+// sets *done instead if there are no more items (the item is then discarded).
+// The process stage is run concurrently by the worker threads. thread_no is in
+// the range [0, num_threads) and is unique for each worker. The consume stage
+// gets the processed items in the order that they were produced.
+typedef hzr_status_t (*_hzr_produce_fn)(void* context,
+                                        void* item,
+                                        hzr_bool* done);
+typedef hzr_status_t (*_hzr_process_fn)(void* context,
+                                        int thread_no,
+                                        void* item);
+typedef hzr_status_t (*_hzr_consume_fn)(void* context, void* item);
+
+// Run an ordered pipeline over num_slots items (slots points to them), which
+// bounds the number of items in flight. The items are produced by a thread of
+// their own and processed by num_threads worker threads. The calling thread
+// consumes them, so the I/O of the produce and consume stages overlaps with
+// the processing of other items. Without thread support, the calling thread
+// runs the stages in turn. If any stage fails, the pipeline stops and
+// HZR_FAIL is returned.
+hzr_status_t _hzr_pipeline(_hzr_produce_fn produce,
+                           _hzr_process_fn process,
+                           _hzr_consume_fn consume,
+                           void* context,
+                           void* const* slots,
+                           size_t num_slots,
+                           int num_threads);
+
+// Read from a pipeline source until size bytes have been read, or until the
+// input data ends (then *read_size < size). Returns HZR_FAIL if the source
+// fails.
+hzr_status_t _hzr_read_source(hzr_source_t source,
+                              void* user,
+                              uint8_t* buf,
+                              size_t size,
+                              size_t* read_size);
+
+#endif  // HZR_THREAD_H_
@@ -0,0 +1,72 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#include "hzr_workspace.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+void* _hzr_aligned_alloc(size_t size) {
+  // Over-allocate, and store the original pointer just before the aligned
+  // memory.
+  uint8_t* raw = (uint8_t*)malloc(size + HZR_CACHE_LINE_SIZE + sizeof(void*));
+  if (UNLIKELY(!raw)) {
+    return NULL;
+  }
+  uintptr_t addr = (uintptr_t)(raw + sizeof(void*));
+  addr = (addr + (HZR_CACHE_LINE_SIZE - 1)) &
+         ~((uintptr_t)(HZR_CACHE_LINE_SIZE - 1));
+  void** aligned = (void**)addr;
+  aligned[-1] = raw;
+  return aligned;
+}
+
+void _hzr_aligned_free(void* ptr) {
+  if (ptr) {
+    free(((void**)ptr)[-1]);
+  }
+}
+
+hzr_workspace_t* hzr_workspace_create(void) {
+  hzr_workspace_t* workspace =
+      (hzr_workspace_t*)malloc(sizeof(hzr_workspace_t));
+  if (UNLIKELY(!workspace)) {
+    DLOG("Out of memory.");
+    return NULL;
+  }
+  workspace->encode_scratch = _hzr_create_encode_scratch();
+  workspace->decode_scratch = _hzr_create_decode_scratch();
+  if (UNLIKELY(!workspace->encode_scratch || !workspace->decode_scratch)) {
+    DLOG("Out of memory.");
+    hzr_workspace_destroy(workspace);
+    return NULL;
+  }
+  return workspace;
+}
+
+void hzr_workspace_destroy(hzr_workspace_t* workspace) {
+  if (workspace) {
+    _hzr_aligned_free(workspace->encode_scratch);
+    _hzr_aligned_free(workspace->decode_scratch);
+    free(workspace);
+  }
+}
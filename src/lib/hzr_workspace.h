@@ -0,0 +1,51 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+#ifndef HZR_WORKSPACE_H_
+#define HZR_WORKSPACE_H_
+
+#include <stddef.h>
+
+#include "hzr_internal.h"
+#include "libhzr.h"
+
+// The size of a cache line (the alignment of workspace memory).
+#define HZR_CACHE_LINE_SIZE 64
+
+// A workspace holds the scratch memory of the encoder and of the decoder. The
+// layout of each part is private to the encoder and the decoder, respectively.
+struct hzr_workspace_struct {
+  void* encode_scratch;
+  void* decode_scratch;
+};
+
+// Allocate memory that is aligned to a cache line. The memory must be freed
+// with _hzr_aligned_free().
+void* _hzr_aligned_alloc(size_t size);
+void _hzr_aligned_free(void* ptr);
+
+// Allocate the encoder and decoder parts of a workspace (implemented by the
+// encoder and the decoder). The memory is freed with _hzr_aligned_free().
+void* _hzr_create_encode_scratch(void);
+void* _hzr_create_decode_scratch(void);
+
+#endif  // HZR_WORKSPACE_H_
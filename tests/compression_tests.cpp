@@ -23,12 +23,27 @@
 #include <doctest.h>
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <iostream>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include <libhzr.h>
 
+#include "random.h"
+
 namespace {
 
+const char* const TEST_FILE_IN = "hzr_test_in.bin";
+const char* const TEST_FILE_HZR = "hzr_test_in.bin.hzr";
+const char* const TEST_FILE_OUT = "hzr_test_out.bin";
+
 const size_t MAX_UNCOMPRESSED_SIZE = 500000;
 
 const size_t SIZES[] = {
@@ -44,15 +59,154 @@ const size_t SIZES[] = {
     0};
 const size_t NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
 
-// This is an approximation (rounded up) of the maximum compressed size.
+// This is an approximation (rounded up) of the maximum compressed size, with
+// room for the overhead of the smallest block size and a block index.
 const size_t MAX_COMPRESSED_SIZE =
-    MAX_UNCOMPRESSED_SIZE + (MAX_UNCOMPRESSED_SIZE >> 13) + 4;
+    MAX_UNCOMPRESSED_SIZE + (MAX_UNCOMPRESSED_SIZE >> 5) + 64;
 
 // Statically allocate memory for the compression/decompression.
 unsigned char s_uncompressed[MAX_UNCOMPRESSED_SIZE];
 unsigned char s_compressed[MAX_COMPRESSED_SIZE];
+unsigned char s_compressed2[MAX_COMPRESSED_SIZE];
 unsigned char s_uncompressed2[MAX_UNCOMPRESSED_SIZE];
 
+// Number of threads to use for the multi-threaded tests.
+const int NUM_THREADS = 4;
+
+// Decode a few different ranges of the encoded data and check the result.
+void check_ranges(const unsigned char* compressed,
+                  size_t compressed_size,
+                  size_t uncompressed_size) {
+  const size_t BLOCK_SIZE = 65536;
+  const size_t RANGES[][2] = {
+      {0, uncompressed_size},
+      {uncompressed_size / 3, uncompressed_size / 3},
+      {uncompressed_size / 2, uncompressed_size - uncompressed_size / 2},
+      {uncompressed_size > 0 ? uncompressed_size - 1 : 0,
+       uncompressed_size > 0 ? size_t(1) : size_t(0)},
+      {BLOCK_SIZE - 10, 20},
+      {BLOCK_SIZE, BLOCK_SIZE + 1}};
+  for (const auto& range : RANGES) {
+    const size_t offset = range[0];
+    const size_t length = range[1];
+    if (offset + length > uncompressed_size) {
+      continue;
+    }
+    std::fill(s_uncompressed2, s_uncompressed2 + length, 0xaa);
+    CHECK(hzr_decode_range(compressed, compressed_size, offset, length,
+                           s_uncompressed2));
+    CHECK(std::equal(s_uncompressed + offset, s_uncompressed + offset + length,
+                     s_uncompressed2));
+  }
+
+  // Ranges outside of the decoded data must be rejected.
+  CHECK(!hzr_decode_range(compressed, compressed_size, uncompressed_size, 1,
+                          s_uncompressed2));
+}
+
+// Compress the data with the given options, and check that it decodes
+// correctly. Returns the compressed size.
+size_t check_encode_options(size_t uncompressed_size,
+                            const hzr_encode_options_t& options) {
+  const size_t max_compressed_size =
+      hzr_max_compressed_size_ex(uncompressed_size, &options);
+  REQUIRE(max_compressed_size <= MAX_COMPRESSED_SIZE);
+  size_t compressed_size;
+  REQUIRE(hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed2,
+                        max_compressed_size, &compressed_size, &options));
+  size_t uncompressed_size2;
+  CHECK(hzr_verify(s_compressed2, compressed_size, &uncompressed_size2));
+  CHECK(uncompressed_size2 == uncompressed_size);
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode(s_compressed2, compressed_size, s_uncompressed2,
+                   uncompressed_size));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  return compressed_size;
+}
+
+// Compress the data with the streaming encoder, and check that it decodes
+// correctly with both the regular decoder and the streaming decoder.
+void check_streaming(size_t uncompressed_size) {
+  // Feed the encoder with odd sized chunks, into odd sized output chunks.
+  const size_t IN_CHUNK_SIZE = 10007;
+  const size_t OUT_CHUNK_SIZE = 4093;
+  hzr_encoder_t* encoder = hzr_encoder_create(nullptr);
+  REQUIRE(encoder != nullptr);
+  size_t in_pos = 0;
+  size_t compressed_size = 0;
+  while (in_pos < uncompressed_size) {
+    size_t in_size = std::min(IN_CHUNK_SIZE, uncompressed_size - in_pos);
+    size_t out_size =
+        std::min(OUT_CHUNK_SIZE, MAX_COMPRESSED_SIZE - compressed_size);
+    size_t in_consumed, out_written;
+    REQUIRE(hzr_encode_update(encoder, &s_uncompressed[in_pos], in_size,
+                              &in_consumed, &s_compressed2[compressed_size],
+                              out_size, &out_written));
+    in_pos += in_consumed;
+    compressed_size += out_written;
+  }
+  for (;;) {
+    size_t out_size =
+        std::min(OUT_CHUNK_SIZE, MAX_COMPRESSED_SIZE - compressed_size);
+    size_t out_written;
+    REQUIRE(hzr_encode_finish(encoder, &s_compressed2[compressed_size],
+                              out_size, &out_written));
+    compressed_size += out_written;
+    if (out_written < out_size) {
+      break;
+    }
+  }
+  hzr_encoder_destroy(encoder);
+
+  // Decode the stream with the regular decoder.
+  size_t uncompressed_size2;
+  CHECK(hzr_verify(s_compressed2, compressed_size, &uncompressed_size2));
+  CHECK(uncompressed_size2 == uncompressed_size);
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_mt(s_compressed2, compressed_size, s_uncompressed2,
+                      uncompressed_size, NUM_THREADS));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  check_ranges(s_compressed2, compressed_size, uncompressed_size);
+
+  // Decode the stream with the streaming decoder.
+  hzr_decoder_t* decoder = hzr_decoder_create();
+  REQUIRE(decoder != nullptr);
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  in_pos = 0;
+  size_t out_pos = 0;
+  for (;;) {
+    size_t in_size = std::min(OUT_CHUNK_SIZE, compressed_size - in_pos);
+    size_t out_size = std::min(IN_CHUNK_SIZE, uncompressed_size - out_pos);
+    size_t in_consumed, out_written;
+    REQUIRE(hzr_decode_update(decoder, &s_compressed2[in_pos], in_size,
+                              &in_consumed, &s_uncompressed2[out_pos],
+                              out_size, &out_written));
+    in_pos += in_consumed;
+    out_pos += out_written;
+    if (in_consumed == 0 && out_written == 0) {
+      break;
+    }
+  }
+  CHECK(in_pos == compressed_size);
+  CHECK(out_pos == uncompressed_size);
+  CHECK(hzr_decode_finish(decoder));
+  hzr_decoder_destroy(decoder);
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+
+  // A truncated stream must be detected.
+  decoder = hzr_decoder_create();
+  REQUIRE(decoder != nullptr);
+  size_t in_consumed, out_written;
+  REQUIRE(hzr_decode_update(decoder, s_compressed2, compressed_size - 1,
+                            &in_consumed, s_uncompressed2, uncompressed_size,
+                            &out_written));
+  CHECK(!hzr_decode_finish(decoder));
+  hzr_decoder_destroy(decoder);
+}
+
 void perform_test(size_t uncompressed_size) {
   // Compress the data.
   const size_t max_compressed_size = hzr_max_compressed_size(uncompressed_size);
@@ -75,6 +229,323 @@ void perform_test(size_t uncompressed_size) {
   // Check that the data is correct.
   CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
                    s_uncompressed2));
+
+  // The multi-threaded encoder must produce identical data.
+  size_t compressed_size2;
+  REQUIRE(hzr_encode_mt(s_uncompressed, uncompressed_size, s_compressed2,
+                        max_compressed_size, &compressed_size2, NUM_THREADS));
+  CHECK(compressed_size2 == compressed_size);
+  CHECK(std::equal(s_compressed, s_compressed + compressed_size,
+                   s_compressed2));
+
+  // Decompress the data using the multi-threaded decoder.
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_mt(s_compressed, compressed_size, s_uncompressed2,
+                      uncompressed_size2, NUM_THREADS));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+
+  // Decode ranges of the data (without a block index).
+  check_ranges(s_compressed, compressed_size, uncompressed_size);
+
+  // Compress the data with a block index.
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  options.add_index = 1;
+  const size_t max_indexed_size =
+      hzr_max_compressed_size_ex(uncompressed_size, &options);
+  REQUIRE(max_indexed_size <= MAX_COMPRESSED_SIZE);
+  size_t indexed_size;
+  REQUIRE(hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed2,
+                        max_indexed_size, &indexed_size, &options));
+  CHECK(indexed_size > compressed_size);
+  CHECK(std::equal(s_compressed, s_compressed + compressed_size,
+                   s_compressed2));
+  CHECK(hzr_verify(s_compressed2, indexed_size, &uncompressed_size2));
+  CHECK(uncompressed_size2 == uncompressed_size);
+
+  // Decode the indexed data.
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode(s_compressed2, indexed_size, s_uncompressed2,
+                   uncompressed_size));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_mt(s_compressed2, indexed_size, s_uncompressed2,
+                      uncompressed_size, NUM_THREADS));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  check_ranges(s_compressed2, indexed_size, uncompressed_size);
+
+  // A corrupt block index must be detected.
+  s_compressed2[indexed_size - 8] ^= 1;
+  CHECK(!hzr_verify(s_compressed2, indexed_size, &uncompressed_size2));
+
+  // Length-limited canonical codes.
+  hzr_init_encode_options(&options);
+  options.canonical_codes = 1;
+  const size_t canonical_size =
+      check_encode_options(uncompressed_size, options);
+  std::cout << "  Canonical codes: " << canonical_size << " bytes"
+            << std::endl;
+
+  // Multiple streams per block.
+  hzr_init_encode_options(&options);
+  options.multi_stream = 1;
+  const size_t multi_stream_size =
+      check_encode_options(uncompressed_size, options);
+  std::cout << "  Multi-stream: " << multi_stream_size << " bytes"
+            << std::endl;
+  options.canonical_codes = 1;
+  (void)check_encode_options(uncompressed_size, options);
+
+  // Extended header, with and without a block index.
+  hzr_encode_options_t extended_options;
+  hzr_init_encode_options(&extended_options);
+  extended_options.extended_header = 1;
+  CHECK(check_encode_options(uncompressed_size, extended_options) ==
+        compressed_size + 18);
+  extended_options.add_index = 1;
+  const size_t extended_size =
+      check_encode_options(uncompressed_size, extended_options);
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_mt(s_compressed2, extended_size, s_uncompressed2,
+                      uncompressed_size, NUM_THREADS));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  check_ranges(s_compressed2, extended_size, uncompressed_size);
+  hzr_decoder_t* extended_decoder = hzr_decoder_create();
+  REQUIRE(extended_decoder != nullptr);
+  size_t extended_consumed, extended_written;
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_update(extended_decoder, s_compressed2, extended_size,
+                          &extended_consumed, s_uncompressed2,
+                          uncompressed_size, &extended_written));
+  CHECK(extended_written == uncompressed_size);
+  CHECK(hzr_decode_finish(extended_decoder));
+  hzr_decoder_destroy(extended_decoder);
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+
+  // A missing block index or a corrupt extended header must be detected.
+  CHECK(!hzr_verify(s_compressed2, extended_size - 1, &uncompressed_size2));
+  s_compressed2[12] ^= 1;
+  CHECK(!hzr_verify(s_compressed2, extended_size, &uncompressed_size2));
+  CHECK(!hzr_decode(s_compressed2, extended_size, s_uncompressed2,
+                    uncompressed_size));
+
+  // Other block sizes, with and without wide block headers.
+  const size_t block_sizes[] = {1024, 4096, 262144, 1048576};
+  for (size_t block_size : block_sizes) {
+    hzr_encode_options_t block_options;
+    hzr_init_encode_options(&block_options);
+    block_options.block_size = block_size;
+    block_options.multi_stream = 1;
+    block_options.add_index = 1;
+    block_options.num_threads = NUM_THREADS;
+    const size_t block_size_size =
+        check_encode_options(uncompressed_size, block_options);
+    std::cout << "  Block size " << block_size << ": " << block_size_size
+              << " bytes" << std::endl;
+    std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+    CHECK(hzr_decode_mt(s_compressed2, block_size_size, s_uncompressed2,
+                        uncompressed_size, NUM_THREADS));
+    CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                     s_uncompressed2));
+    check_ranges(s_compressed2, block_size_size, uncompressed_size);
+
+    // Feed the streaming decoder in small pieces.
+    hzr_decoder_t* block_decoder = hzr_decoder_create();
+    REQUIRE(block_decoder != nullptr);
+    std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+    size_t block_in_pos = 0, block_out_pos = 0;
+    while (block_in_pos < block_size_size) {
+      const size_t piece = std::min<size_t>(3, block_size_size - block_in_pos);
+      size_t consumed, written;
+      REQUIRE(hzr_decode_update(block_decoder, &s_compressed2[block_in_pos],
+                                piece, &consumed,
+                                &s_uncompressed2[block_out_pos],
+                                uncompressed_size - block_out_pos, &written));
+      block_in_pos += consumed;
+      block_out_pos += written;
+      if (consumed == 0) {
+        break;
+      }
+    }
+    CHECK(block_out_pos == uncompressed_size);
+    CHECK(hzr_decode_finish(block_decoder));
+    hzr_decoder_destroy(block_decoder);
+    CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                     s_uncompressed2));
+  }
+
+  // Huffman tree reuse between blocks never gives larger output, and must give
+  // the same output when the blocks are encoded in parallel.
+  hzr_encode_options_t reuse_options;
+  hzr_init_encode_options(&reuse_options);
+  reuse_options.reuse_trees = 1;
+  CHECK(check_encode_options(uncompressed_size, reuse_options) <=
+        compressed_size);
+  reuse_options.block_size = 4096;
+  reuse_options.multi_stream = 1;
+  (void)check_encode_options(uncompressed_size, reuse_options);
+  reuse_options.multi_stream = 0;
+  const size_t reuse_size =
+      check_encode_options(uncompressed_size, reuse_options);
+  std::cout << "  Tree reuse: " << reuse_size << " bytes" << std::endl;
+  const std::vector<unsigned char> reuse_data(s_compressed2,
+                                              s_compressed2 + reuse_size);
+  reuse_options.num_threads = NUM_THREADS;
+  CHECK(check_encode_options(uncompressed_size, reuse_options) ==
+        reuse_size);
+  CHECK(std::equal(reuse_data.begin(), reuse_data.end(), s_compressed2));
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_mt(s_compressed2, reuse_size, s_uncompressed2,
+                      uncompressed_size, NUM_THREADS));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  check_ranges(s_compressed2, reuse_size, uncompressed_size);
+  reuse_options.add_index = 1;
+  const size_t reuse_indexed_size =
+      check_encode_options(uncompressed_size, reuse_options);
+  check_ranges(s_compressed2, reuse_indexed_size, uncompressed_size);
+
+  // Unsupported block sizes must be rejected.
+  hzr_encode_options_t bad_block_options;
+  hzr_init_encode_options(&bad_block_options);
+  size_t bad_block_size;
+  bad_block_options.block_size = 3000;
+  CHECK(!hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed2,
+                       MAX_COMPRESSED_SIZE, &bad_block_size,
+                       &bad_block_options));
+  bad_block_options.block_size = 512;
+  CHECK(!hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed2,
+                       MAX_COMPRESSED_SIZE, &bad_block_size,
+                       &bad_block_options));
+
+  // Decode with CRC checks.
+  hzr_decode_options_t decode_options;
+  hzr_init_decode_options(&decode_options);
+  decode_options.check_crc = 1;
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_ex(s_compressed, compressed_size, s_uncompressed2,
+                      uncompressed_size, &decode_options));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  decode_options.num_threads = NUM_THREADS;
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_ex(s_compressed, compressed_size, s_uncompressed2,
+                      uncompressed_size, &decode_options));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+
+  // Decode with output padding. The padding may be overwritten, but nothing
+  // after it.
+  const size_t GUARD_SIZE = 16;
+  std::vector<unsigned char> padded(
+      uncompressed_size + HZR_DECODE_PADDING + GUARD_SIZE, 0xaa);
+  decode_options.out_padding = HZR_DECODE_PADDING;
+  for (int num_threads = 1; num_threads <= NUM_THREADS; num_threads += 3) {
+    decode_options.num_threads = num_threads;
+    std::fill(padded.begin(), padded.end(), 0xaa);
+    CHECK(hzr_decode_ex(s_compressed, compressed_size, padded.data(),
+                        uncompressed_size, &decode_options));
+    CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                     padded.begin()));
+    CHECK(std::all_of(padded.end() - GUARD_SIZE, padded.end(),
+                      [](unsigned char x) { return x == 0xaa; }));
+  }
+
+  // Decode with input padding too. The padding may be read, but it must not
+  // change the result.
+  std::vector<unsigned char> padded_in(s_compressed,
+                                       s_compressed + compressed_size);
+  padded_in.resize(compressed_size + HZR_DECODE_PADDING, 0x5a);
+  decode_options.in_padding = HZR_DECODE_PADDING;
+  for (int num_threads = 1; num_threads <= NUM_THREADS; num_threads += 3) {
+    decode_options.num_threads = num_threads;
+    std::fill(padded.begin(), padded.end(), 0xaa);
+    CHECK(hzr_decode_ex(padded_in.data(), compressed_size, padded.data(),
+                        uncompressed_size, &decode_options));
+    CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                     padded.begin()));
+  }
+  decode_options.in_padding = 0;
+  decode_options.out_padding = 0;
+
+  if (uncompressed_size > 0) {
+    // A corrupt block must be detected by the CRC check (the last byte
+    // belongs to the encoded data of the last block).
+    std::copy(s_compressed, s_compressed + compressed_size, s_compressed2);
+    s_compressed2[compressed_size - 1] ^= 0x10;
+    CHECK(!hzr_decode_ex(s_compressed2, compressed_size, s_uncompressed2,
+                         uncompressed_size, &decode_options));
+
+    // Decoding corrupt data without CRC checks must be memory safe (the result
+    // is undefined, though).
+    hzr_decode_options_t padded_options;
+    hzr_init_decode_options(&padded_options);
+    padded_options.in_padding = HZR_DECODE_PADDING;
+    for (size_t k = 0; k < 64; ++k) {
+      std::copy(s_compressed, s_compressed + compressed_size, s_compressed2);
+      s_compressed2[(k * compressed_size) / 64] ^= static_cast<uint8_t>(k + 1);
+      (void)hzr_decode(s_compressed2, compressed_size, s_uncompressed2,
+                       uncompressed_size);
+
+      // ...also when the decoder may read past the end of the input.
+      std::copy(s_compressed2, s_compressed2 + compressed_size,
+                padded_in.begin());
+      (void)hzr_decode_ex(padded_in.data(), compressed_size, s_uncompressed2,
+                          uncompressed_size, &padded_options);
+    }
+  }
+
+  // The streaming decoder must handle data from the regular encoder.
+  hzr_decoder_t* decoder = hzr_decoder_create();
+  REQUIRE(decoder != nullptr);
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  size_t in_consumed, out_written;
+  CHECK(hzr_decode_update(decoder, s_compressed, compressed_size, &in_consumed,
+                          s_uncompressed2, uncompressed_size, &out_written));
+  CHECK(in_consumed == compressed_size);
+  CHECK(out_written == uncompressed_size);
+  CHECK(hzr_decode_finish(decoder));
+  hzr_decoder_destroy(decoder);
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+
+  // The streaming encoder.
+  check_streaming(uncompressed_size);
+
+  // Encoding and decoding with a workspace, which is reused between calls
+  // (also with blocks that are larger than the initial scratch memory of the
+  // workspace).
+  hzr_workspace_t* workspace = hzr_workspace_create();
+  REQUIRE(workspace != nullptr);
+  decode_options.num_threads = 1;
+  hzr_encode_options_t ws_options = options;
+  for (int i = 0; i < 4; ++i) {
+    ws_options.block_size = (i < 2) ? options.block_size : 1048576;
+    const size_t ws_max_size =
+        hzr_max_compressed_size_ex(uncompressed_size, &ws_options);
+    REQUIRE(ws_max_size <= MAX_COMPRESSED_SIZE);
+    size_t ws_size = 0;
+    CHECK(hzr_encode_ws(s_uncompressed, uncompressed_size, s_compressed2,
+                        ws_max_size, &ws_size, &ws_options, workspace));
+    if (i >= 2) {
+      size_t ex_size = 0;
+      CHECK(hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed,
+                          ws_max_size, &ex_size, &ws_options));
+      REQUIRE(ex_size == ws_size);
+      CHECK(std::equal(s_compressed, s_compressed + ex_size, s_compressed2));
+    }
+    std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+    CHECK(hzr_decode_ws(s_compressed2, ws_size, s_uncompressed2,
+                        uncompressed_size, &decode_options, workspace));
+    CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                     s_uncompressed2));
+  }
+  hzr_workspace_destroy(workspace);
 }
 
 }  // namespace
@@ -131,3 +602,1008 @@ TEST_CASE("Test 5") {
     perform_test(uncompressed_size);
   }
 }
+
+TEST_CASE("Test 6 (gaussian)") {
+  std::cout << "Test 6 (gaussian)" << std::endl;
+  const uint8_t STD_DEVS[] = {1, 2, 8, 30};
+  for (const auto std_dev : STD_DEVS) {
+    for (size_t k = 0; k < NUM_SIZES; ++k) {
+      const size_t uncompressed_size = SIZES[k];
+      random_t random(1234);
+      for (size_t i = 0; i < uncompressed_size; ++i) {
+        s_uncompressed[i] = random.gaussian(std_dev);
+      }
+      perform_test(uncompressed_size);
+    }
+  }
+}
+
+TEST_CASE("Test 7 (long codes)") {
+  std::cout << "Test 7 (long codes)" << std::endl;
+  for (size_t k = 0; k < NUM_SIZES; ++k) {
+    const size_t uncompressed_size = SIZES[k];
+    // A geometric distribution gives a very skewed Huffman tree, with codes
+    // that are much longer than the decoder LUT index.
+    random_t random(1234);
+    for (size_t i = 0; i < uncompressed_size; ++i) {
+      uint8_t value = 1;
+      while ((random.rnd() & 1) != 0 && value < 255) {
+        ++value;
+      }
+      s_uncompressed[i] = value;
+    }
+    perform_test(uncompressed_size);
+  }
+
+  // Small blocks get a small root LUT, where the shortest codes are paired up
+  // (codes that are longer than the LUT index must not be paired). Fibonacci
+  // distributed symbol counts give codes that are far longer than the LUT
+  // index, even in small blocks.
+  const size_t SMALL_SIZES[] = {300, 1000, 3000};
+  for (const auto uncompressed_size : SMALL_SIZES) {
+    size_t pos = 0;
+    size_t count = 1;
+    size_t prev_count = 0;
+    for (unsigned char value = 1; pos < uncompressed_size; ++value) {
+      const size_t end = std::min(pos + count, uncompressed_size);
+      std::fill(s_uncompressed + pos, s_uncompressed + end, value);
+      pos = end;
+      const size_t next_count = count + prev_count;
+      prev_count = count;
+      count = next_count;
+    }
+    perform_test(uncompressed_size);
+  }
+
+  // Fibonacci distributed symbol counts (with the last symbol filling up the
+  // block) in a block of the largest size would give an unbounded Huffman tree
+  // that is deeper than the decoder supports.
+  const size_t uncompressed_size = HZR_MAX_BLOCK_SIZE;
+  const unsigned char NUM_VALUES = 34;
+  std::vector<unsigned char> uncompressed(uncompressed_size);
+  size_t pos = 0;
+  size_t count = 1;
+  size_t prev_count = 0;
+  for (unsigned char value = 1; value <= NUM_VALUES; ++value) {
+    const size_t end = (value == NUM_VALUES)
+                           ? uncompressed_size
+                           : std::min(pos + count, uncompressed_size);
+    std::fill(uncompressed.begin() + pos, uncompressed.begin() + end, value);
+    pos = end;
+    const size_t next_count = count + prev_count;
+    prev_count = count;
+    count = next_count;
+  }
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  options.block_size = HZR_MAX_BLOCK_SIZE;
+  std::vector<unsigned char> compressed(
+      hzr_max_compressed_size_ex(uncompressed_size, &options));
+  size_t compressed_size;
+  REQUIRE(hzr_encode_ex(uncompressed.data(), uncompressed_size,
+                        compressed.data(), compressed.size(), &compressed_size,
+                        &options));
+  std::vector<unsigned char> uncompressed2(uncompressed_size);
+  CHECK(hzr_decode(compressed.data(), compressed_size, uncompressed2.data(),
+                   uncompressed_size));
+  CHECK(uncompressed2 == uncompressed);
+}
+
+TEST_CASE("Test 8 (shared table)") {
+  std::cout << "Test 8 (shared table)" << std::endl;
+
+  // Train a table on sample data that resembles small telemetry packets.
+  random_t random(1234);
+  for (size_t i = 0; i < MAX_UNCOMPRESSED_SIZE; ++i) {
+    s_uncompressed[i] = (i % 7 < 3) ? 0 : random.gaussian(8);
+  }
+  hzr_table_t* table = hzr_table_train(s_uncompressed, 100000, 42);
+  REQUIRE(table != nullptr);
+  CHECK(hzr_table_id(table) == 42);
+
+  // Save and load the table.
+  unsigned char saved[HZR_SAVED_TABLE_SIZE];
+  size_t saved_size = 0;
+  CHECK(hzr_table_save(table, saved, sizeof(saved), &saved_size));
+  CHECK(saved_size == HZR_SAVED_TABLE_SIZE);
+  hzr_table_t* loaded = hzr_table_load(saved, saved_size);
+  REQUIRE(loaded != nullptr);
+  CHECK(hzr_table_id(loaded) == 42);
+  saved[10] ^= 1;
+  CHECK(hzr_table_load(saved, saved_size) == nullptr);
+
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  options.table = table;
+  hzr_decode_options_t decode_options;
+  hzr_init_decode_options(&decode_options);
+  decode_options.table = loaded;
+  decode_options.check_crc = 1;
+
+  const size_t PACKET_SIZES[] = {10, 200, 1000, 4096, 200000};
+  for (const auto size : PACKET_SIZES) {
+    const unsigned char* packet = &s_uncompressed[MAX_UNCOMPRESSED_SIZE - size];
+
+    // Encode with and without the table.
+    size_t plain_size = 0;
+    CHECK(hzr_encode(packet, size, s_compressed2, MAX_COMPRESSED_SIZE,
+                     &plain_size));
+    size_t table_size = 0;
+    CHECK(hzr_encode_ex(packet, size, s_compressed, MAX_COMPRESSED_SIZE,
+                        &table_size, &options));
+    std::cout << "  Size " << size << ": " << plain_size << " -> "
+              << table_size << " bytes" << std::endl;
+    if (size >= 200 && size <= 4096) {
+      CHECK(table_size < plain_size);
+    }
+
+    // Decode with the loaded table.
+    size_t decoded_size = 0;
+    CHECK(hzr_verify(s_compressed, table_size, &decoded_size));
+    CHECK(decoded_size == size);
+    std::fill(s_uncompressed2, s_uncompressed2 + size, 0xaa);
+    CHECK(hzr_decode_ex(s_compressed, table_size, s_uncompressed2, size,
+                        &decode_options));
+    CHECK(std::equal(packet, packet + size, s_uncompressed2));
+    decode_options.num_threads = NUM_THREADS;
+    std::fill(s_uncompressed2, s_uncompressed2 + size, 0xaa);
+    CHECK(hzr_decode_ex(s_compressed, table_size, s_uncompressed2, size,
+                        &decode_options));
+    CHECK(std::equal(packet, packet + size, s_uncompressed2));
+    decode_options.num_threads = 1;
+
+    // Decoding without the table must fail.
+    if (size >= 200) {
+      CHECK(!hzr_decode(s_compressed, table_size, s_uncompressed2, size));
+    }
+  }
+
+  // Decoding with a table with another ID must fail.
+  hzr_table_t* other = hzr_table_train(s_uncompressed, 100000, 43);
+  REQUIRE(other != nullptr);
+  size_t table_size = 0;
+  CHECK(hzr_encode_ex(s_uncompressed, 1000, s_compressed, MAX_COMPRESSED_SIZE,
+                      &table_size, &options));
+  decode_options.table = other;
+  CHECK(!hzr_decode_ex(s_compressed, table_size, s_uncompressed2, 1000,
+                       &decode_options));
+
+  // Data that does not resemble the sample data must still round trip.
+  for (size_t i = 0; i < 5000; ++i) {
+    s_uncompressed[i] = static_cast<unsigned char>(255 - (i & 15));
+  }
+  CHECK(hzr_encode_ex(s_uncompressed, 5000, s_compressed, MAX_COMPRESSED_SIZE,
+                      &table_size, &options));
+  decode_options.table = table;
+  CHECK(hzr_decode_ex(s_compressed, table_size, s_uncompressed2, 5000,
+                      &decode_options));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + 5000, s_uncompressed2));
+
+  hzr_table_destroy(other);
+  hzr_table_destroy(loaded);
+  hzr_table_destroy(table);
+}
+
+#if defined(__linux__)
+// Reserve an address range for a mapping of the given size with an
+// inaccessible page after it, so that reading past the end of the mapping
+// faults. Linux places a new mapping in the highest free address range that
+// fits, so the next mapping of the same size takes the range. Returns the
+// guard page, which is freed with release_guard_page().
+void* reserve_guarded_range(size_t size) {
+  const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const size_t range_size = ((size + page_size - 1) / page_size) * page_size;
+  void* range = mmap(nullptr, range_size + page_size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (range == MAP_FAILED) {
+    return nullptr;
+  }
+  munmap(range, range_size);
+  return static_cast<uint8_t*>(range) + range_size;
+}
+
+void release_guard_page(void* guard) {
+  if (guard) {
+    munmap(guard, static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+  }
+}
+#endif
+
+TEST_CASE("Test 9 (files)") {
+  std::cout << "Test 9 (files)" << std::endl;
+
+  random_t random(4321);
+  for (size_t i = 0; i < MAX_UNCOMPRESSED_SIZE; ++i) {
+    s_uncompressed[i] = random.gaussian(16);
+  }
+
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  options.num_threads = NUM_THREADS;
+  options.add_index = 1;
+  hzr_decode_options_t decode_options;
+  hzr_init_decode_options(&decode_options);
+  decode_options.check_crc = 1;
+
+  const size_t FILE_SIZES[] = {MAX_UNCOMPRESSED_SIZE, 1000, 1, 0};
+  for (const auto size : FILE_SIZES) {
+    std::FILE* f = std::fopen(TEST_FILE_IN, "wb");
+    REQUIRE(f != nullptr);
+    CHECK(std::fwrite(s_uncompressed, 1, size, f) == size);
+    std::fclose(f);
+
+    // Compress and decompress the file.
+    CHECK(hzr_encode_file(TEST_FILE_IN, TEST_FILE_HZR, &options));
+    CHECK(hzr_decode_file(TEST_FILE_HZR, TEST_FILE_OUT, &decode_options));
+
+    // The decoded file must be identical to the original data.
+    f = std::fopen(TEST_FILE_OUT, "rb");
+    REQUIRE(f != nullptr);
+    const size_t read_size =
+        std::fread(s_compressed2, 1, MAX_COMPRESSED_SIZE, f);
+    std::fclose(f);
+    CHECK(read_size == size);
+    CHECK(std::equal(s_uncompressed, s_uncompressed + size, s_compressed2));
+
+    // The compressed file must be identical to hzr_encode_ex() output.
+    size_t encoded_size = 0;
+    CHECK(hzr_encode_ex(s_uncompressed, size, s_compressed,
+                        MAX_COMPRESSED_SIZE, &encoded_size, &options));
+    f = std::fopen(TEST_FILE_HZR, "rb");
+    REQUIRE(f != nullptr);
+    const size_t hzr_size =
+        std::fread(s_compressed2, 1, MAX_COMPRESSED_SIZE, f);
+    std::fclose(f);
+    CHECK(hzr_size == encoded_size);
+    CHECK(std::equal(s_compressed, s_compressed + encoded_size, s_compressed2));
+  }
+
+  // The files are mapped with their exact sizes, so the padding options must
+  // be ignored (a page sized output file has no writable memory after it, and
+  // a page sized input file has no readable memory after it).
+  {
+    const size_t PAGE_SIZE = 4096;
+
+    // The block index would keep the fast loop away from the end of the input.
+    hzr_encode_options_t page_options = options;
+    page_options.add_index = 0;
+
+    // Use data with two symbols (about one bit per byte), so that the last few
+    // decoded bytes are coded by the last few encoded bytes, and find a size
+    // that is encoded into a whole number of pages.
+    for (size_t i = 0; i < MAX_UNCOMPRESSED_SIZE; ++i) {
+      s_uncompressed[i] = static_cast<uint8_t>(1 + (random.rnd() & 1));
+    }
+    size_t page_input_size = 0;
+    for (size_t size = 7 * PAGE_SIZE; size < MAX_UNCOMPRESSED_SIZE; ++size) {
+      size_t encoded_size = 0;
+      if (!hzr_encode_ex(s_uncompressed, size, s_compressed,
+                         MAX_COMPRESSED_SIZE, &encoded_size, &page_options)) {
+        break;
+      }
+      if ((encoded_size % PAGE_SIZE) == 0) {
+        page_input_size = size;
+        break;
+      }
+    }
+    REQUIRE(page_input_size != 0);
+
+    hzr_decode_options_t padding_options = decode_options;
+    padding_options.out_padding = HZR_DECODE_PADDING;
+    padding_options.in_padding = HZR_DECODE_PADDING;
+    for (const auto size : {PAGE_SIZE, page_input_size}) {
+      std::FILE* f = std::fopen(TEST_FILE_IN, "wb");
+      REQUIRE(f != nullptr);
+      CHECK(std::fwrite(s_uncompressed, 1, size, f) == size);
+      std::fclose(f);
+      CHECK(hzr_encode_file(TEST_FILE_IN, TEST_FILE_HZR, &page_options));
+#if defined(__linux__)
+      size_t encoded_size = 0;
+      CHECK(hzr_encode_ex(s_uncompressed, size, s_compressed,
+                          MAX_COMPRESSED_SIZE, &encoded_size, &page_options));
+      void* guard = reserve_guarded_range(encoded_size);
+      CHECK(hzr_decode_file(TEST_FILE_HZR, TEST_FILE_OUT, &padding_options));
+      release_guard_page(guard);
+#else
+      CHECK(hzr_decode_file(TEST_FILE_HZR, TEST_FILE_OUT, &padding_options));
+#endif
+
+      f = std::fopen(TEST_FILE_OUT, "rb");
+      REQUIRE(f != nullptr);
+      const size_t read_size =
+          std::fread(s_compressed2, 1, MAX_COMPRESSED_SIZE, f);
+      std::fclose(f);
+      CHECK(read_size == size);
+      CHECK(std::equal(s_uncompressed, s_uncompressed + size, s_compressed2));
+    }
+  }
+
+  // Decompressing a corrupt file must fail, and not leave an output file.
+  std::remove(TEST_FILE_OUT);
+  std::FILE* f = std::fopen(TEST_FILE_HZR, "wb");
+  REQUIRE(f != nullptr);
+  CHECK(std::fwrite(s_uncompressed, 1, 1000, f) == 1000);
+  std::fclose(f);
+  CHECK(!hzr_decode_file(TEST_FILE_HZR, TEST_FILE_OUT, &decode_options));
+  CHECK(std::fopen(TEST_FILE_OUT, "rb") == nullptr);
+
+  // Missing input files must fail.
+  std::remove(TEST_FILE_IN);
+  CHECK(!hzr_encode_file(TEST_FILE_IN, TEST_FILE_HZR, nullptr));
+
+  std::remove(TEST_FILE_HZR);
+}
+
+TEST_CASE("Test 10 (noise without zeros)") {
+  std::cout << "Test 10 (noise without zeros)" << std::endl;
+  // Without zeros there are no RLE symbols, and the codes are short enough
+  // for the plain decoding kernels.
+  const uint8_t STD_DEVS[] = {2, 8};
+  for (const auto std_dev : STD_DEVS) {
+    for (size_t k = 0; k < NUM_SIZES; ++k) {
+      const size_t uncompressed_size = SIZES[k];
+      random_t random(1234);
+      for (size_t i = 0; i < uncompressed_size; ++i) {
+        s_uncompressed[i] = random.gaussian(std_dev) ^ 0x80;
+      }
+      perform_test(uncompressed_size);
+    }
+  }
+}
+
+TEST_CASE("Test 11 (incompressible data)") {
+  std::cout << "Test 11 (incompressible data)" << std::endl;
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  for (size_t k = 0; k < NUM_SIZES; ++k) {
+    const size_t uncompressed_size = SIZES[k];
+    random_t random(1234);
+    for (size_t i = 0; i < uncompressed_size; ++i) {
+      s_uncompressed[i] = random.rnd();
+    }
+    perform_test(uncompressed_size);
+
+    // All the blocks must be stored as plain copies.
+    CHECK(check_encode_options(uncompressed_size, options) ==
+          hzr_max_compressed_size(uncompressed_size));
+  }
+
+  // Blocks that do not give the minimum savings must be stored as plain
+  // copies.
+  const size_t uncompressed_size = MAX_UNCOMPRESSED_SIZE;
+  random_t random(1234);
+  for (size_t i = 0; i < uncompressed_size; ++i) {
+    s_uncompressed[i] = random.gaussian(30);
+  }
+  options.min_savings = 5;
+  CHECK(check_encode_options(uncompressed_size, options) <
+        hzr_max_compressed_size(uncompressed_size));
+  options.min_savings = 50;
+  CHECK(check_encode_options(uncompressed_size, options) ==
+        hzr_max_compressed_size(uncompressed_size));
+}
+
+TEST_CASE("Test 12 (batch)") {
+  std::cout << "Test 12 (batch)" << std::endl;
+  random_t random(1234);
+  for (size_t i = 0; i < MAX_UNCOMPRESSED_SIZE; ++i) {
+    s_uncompressed[i] = (random.rnd() % 3 == 0) ? 0 : random.gaussian(8);
+  }
+
+  // Split the data into buffers of different sizes, each with its own worst
+  // case sized output buffer.
+  const size_t BUFFER_SIZES[] = {1000, 0, 8192, 1, 100000, 4096, 300};
+  std::vector<hzr_batch_item_t> items;
+  std::vector<std::vector<unsigned char>> compressed;
+  size_t offset = 0;
+  for (int pass = 0; pass < 20; ++pass) {
+    for (const auto size : BUFFER_SIZES) {
+      if (offset + size > MAX_UNCOMPRESSED_SIZE) {
+        offset = 0;
+      }
+      compressed.emplace_back(hzr_max_compressed_size(size));
+      hzr_batch_item_t item;
+      item.in = &s_uncompressed[offset];
+      item.in_size = size;
+      item.out = nullptr;
+      item.out_size = compressed.back().size();
+      items.push_back(item);
+      offset += size;
+    }
+  }
+  for (size_t i = 0; i < items.size(); ++i) {
+    items[i].out = compressed[i].data();
+  }
+
+  hzr_workspace_t* workspace = hzr_workspace_create();
+  REQUIRE(workspace != nullptr);
+  const int THREAD_COUNTS[] = {1, NUM_THREADS};
+  for (const auto num_threads : THREAD_COUNTS) {
+    // Each buffer must be encoded exactly as by hzr_encode().
+    hzr_encode_options_t options;
+    hzr_init_encode_options(&options);
+    options.num_threads = num_threads;
+    REQUIRE(HZR_OK ==
+            hzr_encode_batch(items.data(), items.size(), &options, workspace));
+    for (const auto& item : items) {
+      CHECK(item.status == HZR_OK);
+      size_t encoded_size = 0;
+      REQUIRE(HZR_OK == hzr_encode(item.in, item.in_size, s_compressed,
+                                   MAX_COMPRESSED_SIZE, &encoded_size));
+      REQUIRE(item.result_size == encoded_size);
+      CHECK(std::equal(s_compressed, s_compressed + encoded_size,
+                       static_cast<const unsigned char*>(item.out)));
+    }
+
+    // Decode all the buffers, each into its own output buffer.
+    std::vector<hzr_batch_item_t> decode_items(items.size());
+    std::vector<std::vector<unsigned char>> decompressed(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+      decompressed[i].resize(items[i].in_size + 1);
+      decode_items[i].in = items[i].out;
+      decode_items[i].in_size = items[i].result_size;
+      decode_items[i].out = decompressed[i].data();
+      decode_items[i].out_size = decompressed[i].size();
+    }
+    hzr_decode_options_t decode_options;
+    hzr_init_decode_options(&decode_options);
+    decode_options.num_threads = num_threads;
+    REQUIRE(HZR_OK == hzr_decode_batch(decode_items.data(), decode_items.size(),
+                                       &decode_options, workspace));
+    for (size_t i = 0; i < items.size(); ++i) {
+      CHECK(decode_items[i].status == HZR_OK);
+      REQUIRE(decode_items[i].result_size == items[i].in_size);
+      const auto* in = static_cast<const unsigned char*>(items[i].in);
+      CHECK(std::equal(in, in + items[i].in_size, decompressed[i].begin()));
+    }
+  }
+
+  // A failing buffer must not stop the other buffers from being encoded.
+  items[2].out_size = 2;
+  CHECK(HZR_FAIL == hzr_encode_batch(items.data(), items.size(), nullptr,
+                                     workspace));
+  for (size_t i = 0; i < items.size(); ++i) {
+    CHECK(items[i].status == ((i == 2) ? HZR_FAIL : HZR_OK));
+  }
+
+  hzr_workspace_destroy(workspace);
+}
+
+TEST_CASE("Test 13 (filters)") {
+  std::cout << "Test 13 (filters)" << std::endl;
+  // Image-like data with three interleaved channels of smooth gradients.
+  const size_t uncompressed_size = MAX_UNCOMPRESSED_SIZE - 1;
+  random_t random(1234);
+  for (size_t i = 0; i < uncompressed_size; ++i) {
+    const size_t pixel = i / 3;
+    const size_t channel = i % 3;
+    s_uncompressed[i] = static_cast<unsigned char>(
+        (pixel % 640) * (channel + 1) / 5 + (pixel / 640) / 3 +
+        random.rnd() % 3);
+  }
+
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  const size_t plain_size = check_encode_options(uncompressed_size, options);
+  options.filter = HZR_FILTER_DELTA;
+  options.filter_stride = 3;
+  const size_t delta_size = check_encode_options(uncompressed_size, options);
+  std::cout << "  Delta: " << plain_size << " -> " << delta_size << " bytes"
+            << std::endl;
+  CHECK(delta_size < plain_size / 2);
+  options.filter = HZR_FILTER_AUTO;
+  CHECK(check_encode_options(uncompressed_size, options) <= delta_size);
+
+  // Every filter and stride must survive a round trip, including strides that
+  // are larger than the smallest blocks, and single stream blocks that are
+  // unfiltered in several chunks while they are decoded.
+  const int FILTERS[] = {HZR_FILTER_DELTA, HZR_FILTER_DELTA16, HZR_FILTER_AUTO};
+  const int STRIDES[] = {1, 2, 3, 4, 7, 8, 16, 33, HZR_MAX_FILTER_STRIDE};
+  const int FILTER_BLOCK_SIZES[] = {1024, 65536};
+  for (const auto filter : FILTERS) {
+    for (const auto stride : STRIDES) {
+      for (const auto block_size : FILTER_BLOCK_SIZES) {
+        hzr_init_encode_options(&options);
+        options.filter = filter;
+        options.filter_stride = stride;
+        options.block_size = block_size;
+        options.multi_stream = (block_size == 1024) ? (stride & 1) : 0;
+        options.reuse_trees = (stride & 2) ? 1 : 0;
+        (void)check_encode_options(uncompressed_size, options);
+      }
+    }
+  }
+
+  // 16-bit audio-like data.
+  for (size_t i = 0; i + 1 < uncompressed_size; i += 2) {
+    const int sample =
+        static_cast<int>(8000.0 * std::sin(static_cast<double>(i) * 0.001)) +
+        static_cast<int8_t>(random.gaussian(8));
+    s_uncompressed[i] = static_cast<unsigned char>(sample & 0xff);
+    s_uncompressed[i + 1] = static_cast<unsigned char>((sample >> 8) & 0xff);
+  }
+  hzr_init_encode_options(&options);
+  const size_t plain_size16 = check_encode_options(uncompressed_size, options);
+  options.filter = HZR_FILTER_DELTA16;
+  const size_t delta_size16 = check_encode_options(uncompressed_size, options);
+  std::cout << "  Delta16: " << plain_size16 << " -> " << delta_size16
+            << " bytes" << std::endl;
+  CHECK(delta_size16 < plain_size16);
+
+  // Blocks that reuse the tree of an earlier block must also decode correctly
+  // with the multi-threaded decoder, even when plain copies come between them.
+  options.filter = HZR_FILTER_AUTO;
+  options.block_size = 4096;
+  options.reuse_trees = 1;
+  options.add_index = 1;
+  const size_t max_compressed_size =
+      hzr_max_compressed_size_ex(uncompressed_size, &options);
+  size_t compressed_size;
+  REQUIRE(hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed,
+                        max_compressed_size, &compressed_size, &options));
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_mt(s_compressed, compressed_size, s_uncompressed2,
+                      uncompressed_size, NUM_THREADS));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  check_ranges(s_compressed, compressed_size, uncompressed_size);
+}
+
+TEST_CASE("Test 14 (statistics)") {
+  std::cout << "Test 14 (statistics)" << std::endl;
+  // Compressible data, followed by a fill block and incompressible data.
+  const size_t uncompressed_size = MAX_UNCOMPRESSED_SIZE;
+  random_t random(1234);
+  for (size_t i = 0; i < uncompressed_size; ++i) {
+    if (i < 300000) {
+      s_uncompressed[i] = (random.rnd() % 3 == 0) ? 0 : random.gaussian(8);
+    } else if (i < 400000) {
+      s_uncompressed[i] = 42;
+    } else {
+      s_uncompressed[i] = random.rnd();
+    }
+  }
+
+  const int THREAD_COUNTS[] = {1, NUM_THREADS};
+  for (const auto num_threads : THREAD_COUNTS) {
+    hzr_stats_t encode_stats;
+    hzr_init_stats(&encode_stats);
+    hzr_encode_options_t options;
+    hzr_init_encode_options(&options);
+    options.num_threads = num_threads;
+    options.reuse_trees = 1;
+    options.stats = &encode_stats;
+    size_t compressed_size;
+    REQUIRE(hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed,
+                          MAX_COMPRESSED_SIZE, &compressed_size, &options));
+
+    // Every block is counted once, and the blocks make up the whole buffer
+    // (except for the master header).
+    const uint64_t num_blocks =
+        (uncompressed_size + HZR_DEFAULT_BLOCK_SIZE - 1) /
+        HZR_DEFAULT_BLOCK_SIZE;
+    CHECK(encode_stats.copy_blocks + encode_stats.fill_blocks +
+              encode_stats.tree_blocks + encode_stats.reuse_blocks +
+              encode_stats.table_blocks ==
+          num_blocks);
+    CHECK(encode_stats.copy_blocks >= 1);
+    CHECK(encode_stats.fill_blocks == 1);
+    CHECK(encode_stats.tree_blocks >= 1);
+    CHECK(encode_stats.filtered_blocks == 0);
+    CHECK(encode_stats.decoded_bytes == uncompressed_size);
+    CHECK(encode_stats.encoded_bytes + 4 == compressed_size);
+    CHECK(encode_stats.coded_symbols > 0);
+    CHECK(encode_stats.coded_bits > encode_stats.coded_symbols);
+    CHECK(encode_stats.coded_bits < encode_stats.coded_symbols * 32);
+
+    // The decoder sees the same blocks.
+    hzr_stats_t decode_stats;
+    hzr_init_stats(&decode_stats);
+    hzr_decode_options_t decode_options;
+    hzr_init_decode_options(&decode_options);
+    decode_options.num_threads = num_threads;
+    decode_options.stats = &decode_stats;
+    CHECK(hzr_decode_ex(s_compressed, compressed_size, s_uncompressed2,
+                        uncompressed_size, &decode_options));
+    CHECK(decode_stats.copy_blocks == encode_stats.copy_blocks);
+    CHECK(decode_stats.fill_blocks == encode_stats.fill_blocks);
+    CHECK(decode_stats.tree_blocks == encode_stats.tree_blocks);
+    CHECK(decode_stats.reuse_blocks == encode_stats.reuse_blocks);
+    CHECK(decode_stats.decoded_bytes == encode_stats.decoded_bytes);
+    CHECK(decode_stats.encoded_bytes == encode_stats.encoded_bytes);
+    CHECK(decode_stats.lut_misses <= decode_stats.lut_lookups);
+
+    // The statistics of several calls add up.
+    CHECK(hzr_decode_ex(s_compressed, compressed_size, s_uncompressed2,
+                        uncompressed_size, &decode_options));
+    CHECK(decode_stats.decoded_bytes == 2 * encode_stats.decoded_bytes);
+  }
+}
+
+TEST_CASE("Test 15 (scatter / gather)") {
+  std::cout << "Test 15 (scatter / gather)" << std::endl;
+  const size_t uncompressed_size = 300000;
+  random_t random(4321);
+  for (size_t i = 0; i < uncompressed_size; ++i) {
+    s_uncompressed[i] = (random.rnd() % 3 == 0) ? 0 : random.gaussian(8);
+  }
+
+  // Segments of different sizes, so that some blocks are contained in a single
+  // segment and some blocks span several segments.
+  const size_t SEGMENT_SIZES[] = {1, 0, 70000, 1000, 65536, 100000};
+  std::vector<hzr_iovec_t> in_segments;
+  size_t offset = 0;
+  for (size_t i = 0; offset < uncompressed_size; ++i) {
+    const size_t size =
+        (i < sizeof(SEGMENT_SIZES) / sizeof(SEGMENT_SIZES[0]))
+            ? SEGMENT_SIZES[i]
+            : uncompressed_size - offset;
+    in_segments.push_back({&s_uncompressed[offset], size});
+    offset += size;
+  }
+
+  const size_t block_sizes[] = {HZR_DEFAULT_BLOCK_SIZE, 4096};
+  for (size_t block_size : block_sizes) {
+    // Gathered input must be encoded exactly as the concatenated input.
+    hzr_encode_options_t options;
+    hzr_init_encode_options(&options);
+    options.block_size = block_size;
+    size_t compressed_size;
+    REQUIRE(hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed,
+                          MAX_COMPRESSED_SIZE, &compressed_size, &options));
+    for (int num_threads = 1; num_threads <= NUM_THREADS; num_threads += 3) {
+      options.num_threads = num_threads;
+      size_t gather_size;
+      REQUIRE(hzr_encode_iov(in_segments.data(), in_segments.size(),
+                             s_compressed2, MAX_COMPRESSED_SIZE, &gather_size,
+                             &options));
+      REQUIRE(gather_size == compressed_size);
+      CHECK(std::equal(s_compressed, s_compressed + compressed_size,
+                       s_compressed2));
+    }
+
+    // Scatter the decoded data over output segments of the same sizes (plus
+    // some guard bytes that must not be touched).
+    const size_t GUARD_SIZE = 64;
+    std::vector<std::vector<unsigned char>> out_buffers;
+    std::vector<hzr_iovec_t> out_segments;
+    for (const auto& segment : in_segments) {
+      out_buffers.emplace_back(segment.size + GUARD_SIZE, 0xaa);
+    }
+    for (size_t i = 0; i < in_segments.size(); ++i) {
+      out_segments.push_back({out_buffers[i].data(), in_segments[i].size});
+    }
+    REQUIRE(hzr_decode_iov(s_compressed, compressed_size, out_segments.data(),
+                           out_segments.size(), nullptr));
+    for (size_t i = 0; i < in_segments.size(); ++i) {
+      const auto* in = static_cast<const unsigned char*>(in_segments[i].data);
+      CHECK(std::equal(in, in + in_segments[i].size, out_buffers[i].begin()));
+      CHECK(std::all_of(out_buffers[i].end() - GUARD_SIZE,
+                        out_buffers[i].end(),
+                        [](unsigned char x) { return x == 0xaa; }));
+    }
+
+    // The output segments must have room for the decoded data.
+    CHECK(!hzr_decode_iov(s_compressed, compressed_size, out_segments.data(),
+                          out_segments.size() - 1, nullptr));
+
+    // The sink gets every block, in order.
+    struct sink_t {
+      std::vector<unsigned char> data;
+      size_t num_blocks;
+      size_t max_blocks;
+    } sink = {{}, 0, 1000};
+    auto on_block = [](const void* data, size_t size, void* user) {
+      auto* sink = static_cast<sink_t*>(user);
+      const auto* bytes = static_cast<const unsigned char*>(data);
+      sink->data.insert(sink->data.end(), bytes, bytes + size);
+      ++sink->num_blocks;
+      return (sink->num_blocks < sink->max_blocks) ? HZR_OK : HZR_FAIL;
+    };
+    REQUIRE(hzr_decode_sink(s_compressed, compressed_size, on_block, &sink,
+                            nullptr));
+    CHECK(sink.num_blocks == (uncompressed_size + block_size - 1) / block_size);
+    REQUIRE(sink.data.size() == uncompressed_size);
+    CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                     sink.data.begin()));
+
+    // A failing sink stops the decoding.
+    sink = {{}, 0, 2};
+    CHECK(!hzr_decode_sink(s_compressed, compressed_size, on_block, &sink,
+                           nullptr));
+    CHECK(sink.num_blocks == 2);
+  }
+}
+
+TEST_CASE("Test 16 (pipeline)") {
+  std::cout << "Test 16 (pipeline)" << std::endl;
+  // Use more data than the static buffers can hold, to get several tree reuse
+  // groups.
+  const size_t uncompressed_size = 20 * HZR_DEFAULT_BLOCK_SIZE + 1000;
+  std::vector<unsigned char> uncompressed(uncompressed_size);
+  std::vector<unsigned char> compressed(
+      hzr_max_compressed_size(uncompressed_size) + 1024);
+  random_t random(8765);
+  for (auto& x : uncompressed) {
+    x = (random.rnd() % 3 == 0) ? 0 : random.gaussian(8);
+  }
+
+  // A source that delivers data from memory in small, random sized pieces (and
+  // that can fail after a given number of bytes).
+  struct source_t {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    size_t fail_pos;
+    random_t random;
+  };
+  auto read_source = [](void* buf, size_t size, size_t* read_size,
+                        void* user) {
+    auto* source = static_cast<source_t*>(user);
+    if (source->pos >= source->fail_pos) {
+      return HZR_FAIL;
+    }
+    size_t count = std::min(size, source->size - source->pos);
+    const size_t max_count = 1 + source->random.rnd() % 50000;
+    count = std::min(count, max_count);
+    std::copy(source->data + source->pos, source->data + source->pos + count,
+              static_cast<unsigned char*>(buf));
+    source->pos += count;
+    *read_size = count;
+    return HZR_OK;
+  };
+
+  // A sink that collects all the data in memory (and that can fail after a
+  // given number of calls).
+  struct sink_t {
+    std::vector<unsigned char> data;
+    size_t num_calls;
+    size_t max_calls;
+  };
+  auto write_sink = [](const void* data, size_t size, void* user) {
+    auto* sink = static_cast<sink_t*>(user);
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    sink->data.insert(sink->data.end(), bytes, bytes + size);
+    ++sink->num_calls;
+    return (sink->num_calls < sink->max_calls) ? HZR_OK : HZR_FAIL;
+  };
+
+  const size_t sizes[] = {uncompressed_size, 16 * HZR_DEFAULT_BLOCK_SIZE, 1000,
+                          0};
+  for (size_t size : sizes) {
+    for (int reuse_trees = 0; reuse_trees <= 1; ++reuse_trees) {
+      hzr_encode_options_t options;
+      hzr_init_encode_options(&options);
+      options.reuse_trees = reuse_trees;
+
+      // The reference result of the streaming encoder.
+      hzr_encoder_t* encoder = hzr_encoder_create(&options);
+      REQUIRE(encoder != nullptr);
+      size_t in_consumed, out_written;
+      REQUIRE(hzr_encode_update(encoder, uncompressed.data(), size,
+                                &in_consumed, compressed.data(),
+                                compressed.size(), &out_written));
+      REQUIRE(in_consumed == size);
+      size_t compressed_size = out_written;
+      REQUIRE(hzr_encode_finish(encoder, &compressed[compressed_size],
+                                compressed.size() - compressed_size,
+                                &out_written));
+      compressed_size += out_written;
+      hzr_encoder_destroy(encoder);
+
+      for (int num_threads = 1; num_threads <= NUM_THREADS; num_threads += 3) {
+        // The pipeline must produce the same stream as the streaming encoder.
+        options.num_threads = num_threads;
+        source_t source = {uncompressed.data(), size, 0, SIZE_MAX,
+                           random_t(17)};
+        sink_t sink = {{}, 0, SIZE_MAX};
+        REQUIRE(hzr_encode_pipeline(read_source, &source, write_sink, &sink,
+                                    &options));
+        REQUIRE(sink.data.size() == compressed_size);
+        CHECK(std::equal(compressed.begin(),
+                         compressed.begin() + compressed_size,
+                         sink.data.begin()));
+
+        // Decode the stream with the decoding pipeline.
+        hzr_decode_options_t decode_options;
+        hzr_init_decode_options(&decode_options);
+        decode_options.num_threads = num_threads;
+        source = {compressed.data(), compressed_size, 0, SIZE_MAX,
+                  random_t(23)};
+        sink = {{}, 0, SIZE_MAX};
+        REQUIRE(hzr_decode_pipeline(read_source, &source, write_sink, &sink,
+                                    &decode_options));
+        REQUIRE(sink.data.size() == size);
+        CHECK(std::equal(uncompressed.begin(), uncompressed.begin() + size,
+                         sink.data.begin()));
+      }
+    }
+  }
+
+  // Regular (non-streamed) data can also be decoded with the pipeline, and no
+  // data is read after the end of the encoded data.
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  options.reuse_trees = 1;
+  options.extended_header = 1;
+  options.block_size = 16384;
+  size_t compressed_size;
+  REQUIRE(hzr_encode_ex(uncompressed.data(), uncompressed_size,
+                        compressed.data(), compressed.size(), &compressed_size,
+                        &options));
+  compressed[compressed_size] = 0xaa;
+  hzr_decode_options_t decode_options;
+  hzr_init_decode_options(&decode_options);
+  decode_options.num_threads = NUM_THREADS;
+  source_t source = {compressed.data(), compressed_size + 1, 0, SIZE_MAX,
+                     random_t(29)};
+  sink_t sink = {{}, 0, SIZE_MAX};
+  REQUIRE(hzr_decode_pipeline(read_source, &source, write_sink, &sink,
+                              &decode_options));
+  CHECK(source.pos == compressed_size);
+  REQUIRE(sink.data.size() == uncompressed_size);
+  CHECK(sink.data == uncompressed);
+
+  // Truncated input must fail.
+  source = {compressed.data(), compressed_size - 1, 0, SIZE_MAX, random_t(31)};
+  sink = {{}, 0, SIZE_MAX};
+  CHECK(!hzr_decode_pipeline(read_source, &source, write_sink, &sink,
+                             &decode_options));
+
+  // Failing sources and sinks must make the pipelines fail.
+  options.num_threads = NUM_THREADS;
+  source = {uncompressed.data(), uncompressed_size, 0, 100000, random_t(37)};
+  sink = {{}, 0, SIZE_MAX};
+  CHECK(!hzr_encode_pipeline(read_source, &source, write_sink, &sink,
+                             &options));
+  source = {uncompressed.data(), uncompressed_size, 0, SIZE_MAX, random_t(41)};
+  sink = {{}, 0, 2};
+  CHECK(!hzr_encode_pipeline(read_source, &source, write_sink, &sink,
+                             &options));
+  source = {compressed.data(), compressed_size, 0, compressed_size / 2,
+            random_t(43)};
+  sink = {{}, 0, SIZE_MAX};
+  CHECK(!hzr_decode_pipeline(read_source, &source, write_sink, &sink,
+                             &decode_options));
+  source = {compressed.data(), compressed_size, 0, SIZE_MAX, random_t(47)};
+  sink = {{}, 0, 2};
+  CHECK(!hzr_decode_pipeline(read_source, &source, write_sink, &sink,
+                             &decode_options));
+}
+
+TEST_CASE("Test 17 (16-bit samples)") {
+  std::cout << "Test 17 (16-bit samples)" << std::endl;
+  // Residual-like 16-bit samples: Mostly small values of both signs, with
+  // occasional runs of silence and a few large values (which need escape
+  // codes with many extra bits).
+  const size_t uncompressed_size = MAX_UNCOMPRESSED_SIZE;
+  random_t random(4321);
+  for (size_t i = 0; i + 1 < uncompressed_size; i += 2) {
+    int sample =
+        static_cast<int8_t>(random.gaussian(40)) * 4 + random.rnd() % 4;
+    if ((i / 2000) % 7 == 3) {
+      sample = 0;
+    } else if (random.rnd() == 0) {
+      sample = (random.rnd() & 1) ? 32767 : -32768;
+    }
+    s_uncompressed[i] = static_cast<unsigned char>(sample & 0xff);
+    s_uncompressed[i + 1] = static_cast<unsigned char>((sample >> 8) & 0xff);
+  }
+
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  const size_t plain_size = check_encode_options(uncompressed_size, options);
+  options.wide_symbols = 1;
+  const size_t wide_size = check_encode_options(uncompressed_size, options);
+  std::cout << "  16-bit: " << plain_size << " -> " << wide_size << " bytes"
+            << std::endl;
+  CHECK(wide_size < plain_size);
+
+  // Every combination with the other block options must survive a round
+  // trip, including odd sizes (where the last block is coded as bytes).
+  for (int combination = 0; combination < 16; ++combination) {
+    hzr_init_encode_options(&options);
+    options.wide_symbols = 1;
+    options.multi_stream = combination & 1;
+    options.reuse_trees = (combination >> 1) & 1;
+    options.filter = (combination & 4) ? HZR_FILTER_DELTA16 : HZR_FILTER_NONE;
+    options.block_size = (combination & 8) ? 1024 : HZR_DEFAULT_BLOCK_SIZE;
+    for (size_t k = 0; k < NUM_SIZES; ++k) {
+      (void)check_encode_options(SIZES[k], options);
+      (void)check_encode_options(SIZES[k] > 0 ? SIZES[k] - 1 : 0, options);
+    }
+  }
+
+  // The multi-threaded, range and streaming decoders must handle the blocks
+  // too.
+  hzr_init_encode_options(&options);
+  options.wide_symbols = 1;
+  options.multi_stream = 1;
+  options.reuse_trees = 1;
+  options.add_index = 1;
+  options.block_size = 4096;
+  const size_t max_compressed_size =
+      hzr_max_compressed_size_ex(uncompressed_size, &options);
+  size_t compressed_size;
+  REQUIRE(hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed,
+                        max_compressed_size, &compressed_size, &options));
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  CHECK(hzr_decode_mt(s_compressed, compressed_size, s_uncompressed2,
+                      uncompressed_size, NUM_THREADS));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  check_ranges(s_compressed, compressed_size, uncompressed_size);
+  hzr_decoder_t* decoder = hzr_decoder_create();
+  REQUIRE(decoder != nullptr);
+  std::fill(s_uncompressed2, s_uncompressed2 + uncompressed_size, 0xaa);
+  size_t in_pos = 0;
+  size_t out_pos = 0;
+  for (;;) {
+    size_t in_consumed, out_written;
+    REQUIRE(hzr_decode_update(decoder, &s_compressed[in_pos],
+                              compressed_size - in_pos, &in_consumed,
+                              &s_uncompressed2[out_pos],
+                              uncompressed_size - out_pos, &out_written));
+    in_pos += in_consumed;
+    out_pos += out_written;
+    if (in_consumed == 0 && out_written == 0) {
+      break;
+    }
+  }
+  CHECK(out_pos == uncompressed_size);
+  CHECK(hzr_decode_finish(decoder));
+  CHECK(std::equal(s_uncompressed, s_uncompressed + uncompressed_size,
+                   s_uncompressed2));
+  hzr_decoder_destroy(decoder);
+
+  // Silence must still be coded as fill blocks, but a constant sample value
+  // with two different bytes must not (a fill block repeats a single byte).
+  std::fill(s_uncompressed, s_uncompressed + uncompressed_size, 0);
+  hzr_init_encode_options(&options);
+  options.wide_symbols = 1;
+  CHECK(check_encode_options(uncompressed_size, options) < 100);
+  for (size_t i = 0; i < uncompressed_size; ++i) {
+    s_uncompressed[i] = static_cast<unsigned char>((i & 1) ? 0x01 : 0x00);
+  }
+  (void)check_encode_options(uncompressed_size, options);
+}
+
+TEST_CASE("Test 18 (old data of 4 GiB - 1 bytes)") {
+  std::cout << "Test 18 (old data of 4 GiB - 1 bytes)" << std::endl;
+  // Older versions of HZR wrote the decoded size 0xffffffff in the master
+  // header of regular data, without an end marker. Build such data from fill
+  // blocks of zeros (65535 full blocks and a last block of 65535 bytes).
+  const size_t BLOCK_SIZE = HZR_DEFAULT_BLOCK_SIZE;
+  const size_t uncompressed_size = 0xffffffffU;
+  std::vector<unsigned char> zeros(BLOCK_SIZE, 0);
+  std::vector<unsigned char> compressed = {0xff, 0xff, 0xff, 0xff};
+  for (size_t block_size = BLOCK_SIZE; block_size >= BLOCK_SIZE - 1;
+       --block_size) {
+    size_t encoded_size;
+    REQUIRE(hzr_encode(zeros.data(), block_size, s_compressed,
+                       MAX_COMPRESSED_SIZE, &encoded_size));
+    REQUIRE(encoded_size > 4);
+    const size_t num_blocks = (block_size == BLOCK_SIZE)
+                                  ? uncompressed_size / BLOCK_SIZE
+                                  : size_t(1);
+    for (size_t i = 0; i < num_blocks; ++i) {
+      compressed.insert(compressed.end(), s_compressed + 4,
+                        s_compressed + encoded_size);
+    }
+  }
+
+  size_t uncompressed_size2;
+  REQUIRE(hzr_verify(compressed.data(), compressed.size(),
+                     &uncompressed_size2));
+  CHECK(uncompressed_size2 == uncompressed_size);
+  std::fill(s_uncompressed2, s_uncompressed2 + 100, 0xaa);
+  CHECK(hzr_decode_range(compressed.data(), compressed.size(),
+                         uncompressed_size - 100, 100, s_uncompressed2));
+  CHECK(std::all_of(s_uncompressed2, s_uncompressed2 + 100,
+                    [](unsigned char x) { return x == 0; }));
+
+  // Without the last block, it is neither old data nor streamed data.
+  compressed.resize(compressed.size() - 1);
+  CHECK(!hzr_verify(compressed.data(), compressed.size(),
+                    &uncompressed_size2));
+}
@@ -0,0 +1,948 @@
+//------------------------------------------------------------------------------
+//  hzr - A Huffman + RLE compression library.
+//
+// Copyright (C) 2016 Marcus Geelnard
+//
+// This software is provided 'as-is', without any express or implied warranty.
+// In no event will the authors be held liable for any damages arising from the
+// use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software in
+//     a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//  3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+
+// A benchmark for HZR (and other codecs, for comparison) on user supplied
+// files or on synthetic data, with a sweep over buffer sizes and thread
+// counts. Run "hzr_bench -h" for usage information.
+
+#include <libhzr.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef HZR_HAS_ZLIB
+#include <zlib.h>
+#endif  // HZR_HAS_ZLIB
+
+#ifdef HZR_HAS_ZSTD
+#include <zstd.h>
+#endif  // HZR_HAS_ZSTD
+
+#ifdef HZR_HAS_LZ4
+#include <lz4.h>
+#endif  // HZR_HAS_LZ4
+
+#include "random.h"
+
+namespace {
+
+using buffer_t = std::vector<unsigned char>;
+using clock_type = std::chrono::steady_clock;
+
+const size_t KIB = 1024;
+const size_t MIB = 1024 * KIB;
+const size_t GIB = 1024 * MIB;
+
+// A sample is a batch of calls that takes at least this long, so that the
+// clock resolution does not matter for small buffers.
+const double MIN_SAMPLE_TIME = 0.001;
+
+// The longest time that we spend on calibrating the number of calls per
+// sample.
+const double MAX_CALIBRATION_TIME = 1.0;
+
+// The largest number of samples per benchmark.
+const int MAX_SAMPLES = 1000;
+
+// A corpus is either the data of a file, or a generator for synthetic data
+// (the data is only generated while the corpus is benchmarked).
+struct corpus_t {
+  std::string name;
+  buffer_t data;
+  void (*generator)(buffer_t& data, random_t& random);
+};
+
+struct bench_options_t {
+  size_t min_size = KIB;
+  size_t max_size = 16 * MIB;
+  bool sweep = false;
+  std::vector<int> threads = {1};
+  int warmup = 1;
+  int min_samples = 5;
+  double min_time = 0.2;
+  std::string format = "text";
+  std::string output;
+  bool compare = true;
+  int zlib_level = 1;
+  hzr_encode_options_t encode_options;
+};
+
+// A codec to benchmark. The statistics pointer is only used by HZR (and may be
+// nullptr).
+struct codec_t {
+  std::string name;
+  bool threaded;
+  std::function<size_t(size_t)> max_compressed_size;
+  std::function<bool(const buffer_t& in,
+                     size_t in_size,
+                     buffer_t& out,
+                     size_t* out_size,
+                     int num_threads,
+                     hzr_stats_t* stats)>
+      encode;
+  std::function<bool(const buffer_t& in,
+                     size_t in_size,
+                     buffer_t& out,
+                     size_t out_size,
+                     int num_threads,
+                     hzr_stats_t* stats)>
+      decode;
+};
+
+struct result_t {
+  std::string corpus;
+  size_t size;
+  std::string codec;
+  std::string operation;
+  int threads;
+  size_t compressed_size;
+  double median_time;  // Seconds per call.
+  double fast_time;    // 10th percentile (seconds per call).
+  double slow_time;    // 90th percentile (seconds per call).
+  int samples;
+  double speedup;  // Relative to a single thread (0 if unknown).
+  bool has_stats;
+  hzr_stats_t stats;
+};
+
+double seconds_since(clock_type::time_point t0) {
+  return std::chrono::duration<double>(clock_type::now() - t0).count();
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+  const double pos = p * static_cast<double>(sorted.size() - 1);
+  const size_t idx = static_cast<size_t>(pos);
+  if (idx + 1 >= sorted.size()) {
+    return sorted.back();
+  }
+  const double frac = pos - static_cast<double>(idx);
+  return sorted[idx] * (1.0 - frac) + sorted[idx + 1] * frac;
+}
+
+// Time a function. After the warmup calls, the number of calls per sample is
+// calibrated, and then samples are collected until we have at least
+// min_samples samples and min_time seconds of samples. Returns false if any
+// call fails.
+bool measure(const std::function<bool()>& fun,
+             const bench_options_t& options,
+             result_t& result) {
+  for (int i = 0; i < options.warmup; ++i) {
+    if (!fun()) {
+      return false;
+    }
+  }
+
+  int calls_per_sample = 1;
+  for (auto t0 = clock_type::now();;) {
+    const auto t1 = clock_type::now();
+    for (int i = 0; i < calls_per_sample; ++i) {
+      if (!fun()) {
+        return false;
+      }
+    }
+    if (seconds_since(t1) >= MIN_SAMPLE_TIME ||
+        seconds_since(t0) >= MAX_CALIBRATION_TIME) {
+      break;
+    }
+    calls_per_sample *= 2;
+  }
+
+  std::vector<double> samples;
+  double total_time = 0.0;
+  while (samples.size() < MAX_SAMPLES &&
+         (samples.size() < static_cast<size_t>(options.min_samples) ||
+          total_time < options.min_time)) {
+    const auto t0 = clock_type::now();
+    for (int i = 0; i < calls_per_sample; ++i) {
+      if (!fun()) {
+        return false;
+      }
+    }
+    const double dt = seconds_since(t0);
+    samples.push_back(dt / static_cast<double>(calls_per_sample));
+    total_time += dt;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  result.median_time = percentile(samples, 0.5);
+  result.fast_time = percentile(samples, 0.1);
+  result.slow_time = percentile(samples, 0.9);
+  result.samples = static_cast<int>(samples.size());
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Codecs.
+//------------------------------------------------------------------------------
+
+codec_t make_hzr_codec(const hzr_encode_options_t& encode_options) {
+  codec_t codec;
+  codec.name = "hzr";
+  codec.threaded = true;
+  codec.max_compressed_size = [encode_options](size_t size) {
+    return hzr_max_compressed_size_ex(size, &encode_options);
+  };
+  codec.encode = [encode_options](const buffer_t& in, size_t in_size,
+                                  buffer_t& out, size_t* out_size,
+                                  int num_threads, hzr_stats_t* stats) {
+    hzr_encode_options_t options = encode_options;
+    options.num_threads = num_threads;
+    options.stats = stats;
+    return hzr_encode_ex(in.data(), in_size, out.data(), out.size(), out_size,
+                         &options) == HZR_OK;
+  };
+  codec.decode = [](const buffer_t& in, size_t in_size, buffer_t& out,
+                    size_t out_size, int num_threads, hzr_stats_t* stats) {
+    hzr_decode_options_t options;
+    hzr_init_decode_options(&options);
+    options.num_threads = num_threads;
+    options.stats = stats;
+    return hzr_decode_ex(in.data(), in_size, out.data(), out_size, &options) ==
+           HZR_OK;
+  };
+  return codec;
+}
+
+#ifdef HZR_HAS_ZLIB
+codec_t make_zlib_codec(int level) {
+  codec_t codec;
+  codec.name = "zlib-" + std::to_string(level);
+  codec.threaded = false;
+  codec.max_compressed_size = [](size_t size) {
+    return static_cast<size_t>(compressBound(static_cast<uLong>(size)));
+  };
+  codec.encode = [level](const buffer_t& in, size_t in_size, buffer_t& out,
+                         size_t* out_size, int, hzr_stats_t*) {
+    uLongf dest_size = static_cast<uLongf>(out.size());
+    if (compress2(out.data(), &dest_size, in.data(),
+                  static_cast<uLong>(in_size), level) != Z_OK) {
+      return false;
+    }
+    *out_size = static_cast<size_t>(dest_size);
+    return true;
+  };
+  codec.decode = [](const buffer_t& in, size_t in_size, buffer_t& out,
+                    size_t out_size, int, hzr_stats_t*) {
+    uLongf dest_size = static_cast<uLongf>(out_size);
+    return uncompress(out.data(), &dest_size, in.data(),
+                      static_cast<uLong>(in_size)) == Z_OK &&
+           dest_size == out_size;
+  };
+  return codec;
+}
+#endif  // HZR_HAS_ZLIB
+
+#ifdef HZR_HAS_ZSTD
+codec_t make_zstd_codec(int level) {
+  codec_t codec;
+  codec.name = "zstd-" + std::to_string(level);
+  codec.threaded = false;
+  codec.max_compressed_size = [](size_t size) {
+    return ZSTD_compressBound(size);
+  };
+  codec.encode = [level](const buffer_t& in, size_t in_size, buffer_t& out,
+                         size_t* out_size, int, hzr_stats_t*) {
+    size_t size =
+        ZSTD_compress(out.data(), out.size(), in.data(), in_size, level);
+    if (ZSTD_isError(size)) {
+      return false;
+    }
+    *out_size = size;
+    return true;
+  };
+  codec.decode = [](const buffer_t& in, size_t in_size, buffer_t& out,
+                    size_t out_size, int, hzr_stats_t*) {
+    size_t size = ZSTD_decompress(out.data(), out_size, in.data(), in_size);
+    return !ZSTD_isError(size) && size == out_size;
+  };
+  return codec;
+}
+#endif  // HZR_HAS_ZSTD
+
+#ifdef HZR_HAS_LZ4
+codec_t make_lz4_codec() {
+  codec_t codec;
+  codec.name = "lz4";
+  codec.threaded = false;
+  codec.max_compressed_size = [](size_t size) {
+    return static_cast<size_t>(LZ4_compressBound(static_cast<int>(size)));
+  };
+  codec.encode = [](const buffer_t& in, size_t in_size, buffer_t& out,
+                    size_t* out_size, int, hzr_stats_t*) {
+    int size = LZ4_compress_default(
+        reinterpret_cast<const char*>(in.data()),
+        reinterpret_cast<char*>(out.data()), static_cast<int>(in_size),
+        static_cast<int>(out.size()));
+    if (size <= 0) {
+      return false;
+    }
+    *out_size = static_cast<size_t>(size);
+    return true;
+  };
+  codec.decode = [](const buffer_t& in, size_t in_size, buffer_t& out,
+                    size_t out_size, int, hzr_stats_t*) {
+    int size = LZ4_decompress_safe(reinterpret_cast<const char*>(in.data()),
+                                   reinterpret_cast<char*>(out.data()),
+                                   static_cast<int>(in_size),
+                                   static_cast<int>(out_size));
+    return size >= 0 && static_cast<size_t>(size) == out_size;
+  };
+  return codec;
+}
+#endif  // HZR_HAS_LZ4
+
+std::vector<codec_t> make_codecs(const bench_options_t& options) {
+  std::vector<codec_t> codecs;
+  codecs.push_back(make_hzr_codec(options.encode_options));
+  if (options.compare) {
+#ifdef HZR_HAS_ZLIB
+    codecs.push_back(make_zlib_codec(options.zlib_level));
+#endif  // HZR_HAS_ZLIB
+#ifdef HZR_HAS_ZSTD
+    codecs.push_back(make_zstd_codec(1));
+#endif  // HZR_HAS_ZSTD
+#ifdef HZR_HAS_LZ4
+    codecs.push_back(make_lz4_codec());
+#endif  // HZR_HAS_LZ4
+  }
+  return codecs;
+}
+
+//------------------------------------------------------------------------------
+// Corpora.
+//------------------------------------------------------------------------------
+
+// Noise with many zeros (the kind of data that HZR is designed for).
+void make_gaussian(buffer_t& data, random_t& random) {
+  for (auto& x : data) {
+    x = (random.rnd() % 3 == 0) ? 0 : random.gaussian(8);
+  }
+}
+
+// Text made from a small vocabulary with a skewed word distribution.
+void make_text(buffer_t& data, random_t& random) {
+  static const char* const WORDS[] = {
+      "the ",  "of ",      "and ",   "to ",    "in ",       "is ",
+      "that ", "for ",     "it ",    "as ",    "with ",     "was ",
+      "data ", "block ",   "tree ",  "code ",  "stream ",   "buffer ",
+      "huff",  "man ",     "zero ",  "run ",   "length ",   "symbol ",
+      "bits ", "decoder ", "table ", "fast ",  "compress ", "entropy ",
+      ".\n",   ", "};
+  const size_t num_words = sizeof(WORDS) / sizeof(WORDS[0]);
+  size_t pos = 0;
+  while (pos < data.size()) {
+    // Pick the lower of two random indices, which favors the first words.
+    size_t idx = std::min(random.rnd() % num_words, random.rnd() % num_words);
+    for (const char* c = WORDS[idx]; *c && pos < data.size(); ++c) {
+      data[pos++] = static_cast<unsigned char>(*c);
+    }
+  }
+}
+
+// RGB pixels with smooth gradients and some noise.
+void make_image(buffer_t& data, random_t& random) {
+  for (size_t i = 0; i < data.size(); ++i) {
+    const size_t pixel = i / 3;
+    const size_t channel = i % 3;
+    data[i] = static_cast<unsigned char>((pixel % 640) * (channel + 1) / 5 +
+                                         (pixel / 640) / 3 + random.rnd() % 3);
+  }
+}
+
+// 16-bit little endian audio samples.
+void make_audio(buffer_t& data, random_t& random) {
+  for (size_t i = 0; i + 1 < data.size(); i += 2) {
+    const double t = static_cast<double>(i / 2);
+    const int sample =
+        static_cast<int>(6000.0 * std::sin(t * 0.01) +
+                         2000.0 * std::sin(t * 0.0713)) +
+        static_cast<int8_t>(random.gaussian(8));
+    data[i] = static_cast<unsigned char>(sample & 0xff);
+    data[i + 1] = static_cast<unsigned char>((sample >> 8) & 0xff);
+  }
+}
+
+// Incompressible data.
+void make_random(buffer_t& data, random_t& random) {
+  for (auto& x : data) {
+    x = random.rnd();
+  }
+}
+
+std::vector<corpus_t> make_synthetic_corpora() {
+  return {{"gaussian", buffer_t(), make_gaussian},
+          {"text", buffer_t(), make_text},
+          {"image", buffer_t(), make_image},
+          {"audio", buffer_t(), make_audio},
+          {"random", buffer_t(), make_random}};
+}
+
+bool load_file(const std::filesystem::path& path,
+               std::vector<corpus_t>& corpora) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Unable to open " << path.string() << "\n";
+    return false;
+  }
+  corpus_t corpus;
+  corpus.name = path.filename().string();
+  corpus.data.assign(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+  corpus.generator = nullptr;
+  if (corpus.data.empty()) {
+    std::cerr << "Skipping empty file " << path.string() << "\n";
+    return true;
+  }
+  corpora.push_back(std::move(corpus));
+  return true;
+}
+
+// Load a file, or all the regular files of a directory (sorted by name).
+bool load_corpus(const std::string& path_name,
+                 std::vector<corpus_t>& corpora) {
+  std::error_code error;
+  const std::filesystem::path path(path_name);
+  if (!std::filesystem::is_directory(path, error)) {
+    return load_file(path, corpora);
+  }
+  std::vector<std::filesystem::path> files;
+  for (const auto& entry : std::filesystem::directory_iterator(path, error)) {
+    if (entry.is_regular_file(error)) {
+      files.push_back(entry.path());
+    }
+  }
+  if (error) {
+    std::cerr << "Unable to read the directory " << path_name << "\n";
+    return false;
+  }
+  std::sort(files.begin(), files.end());
+  for (const auto& file : files) {
+    if (!load_file(file, corpora)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Get the first size bytes of a corpus, repeating the corpus if it is too
+// small.
+void get_input(const corpus_t& corpus, size_t size, buffer_t& in) {
+  in.resize(size);
+  for (size_t pos = 0; pos < size;) {
+    const size_t count = std::min(corpus.data.size(), size - pos);
+    std::memcpy(&in[pos], corpus.data.data(), count);
+    pos += count;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Benchmarking.
+//------------------------------------------------------------------------------
+
+std::vector<size_t> get_sizes(const corpus_t& corpus,
+                              const bench_options_t& options) {
+  // Files are benchmarked as a whole, unless a size sweep is requested.
+  std::vector<size_t> sizes;
+  if (!corpus.generator && !options.sweep) {
+    sizes.push_back(corpus.data.size());
+    return sizes;
+  }
+  for (size_t size = options.min_size; size < options.max_size; size *= 4) {
+    sizes.push_back(size);
+  }
+  sizes.push_back(options.max_size);
+  return sizes;
+}
+
+// Benchmark encoding and decoding of a buffer with a codec, with each of the
+// thread counts (for threaded codecs). Returns false on failure.
+bool bench_codec(const codec_t& codec,
+                 const std::string& corpus_name,
+                 const buffer_t& in,
+                 const bench_options_t& options,
+                 std::vector<result_t>& results) {
+  const size_t size = in.size();
+  buffer_t compressed(codec.max_compressed_size(size));
+  buffer_t out(size);
+
+  const std::vector<int> single_thread = {1};
+  const auto& thread_counts = codec.threaded ? options.threads : single_thread;
+  double single_encode_time = 0.0;
+  double single_decode_time = 0.0;
+  for (const auto num_threads : thread_counts) {
+    result_t encode_result = result_t();
+    encode_result.corpus = corpus_name;
+    encode_result.size = size;
+    encode_result.codec = codec.name;
+    encode_result.threads = num_threads;
+    result_t decode_result = encode_result;
+    encode_result.operation = "encode";
+    decode_result.operation = "decode";
+
+    size_t compressed_size = 0;
+    if (!measure(
+            [&] {
+              return codec.encode(in, size, compressed, &compressed_size,
+                                  num_threads, nullptr);
+            },
+            options, encode_result)) {
+      std::cerr << codec.name << ": Encoding failed\n";
+      return false;
+    }
+    if (!measure(
+            [&] {
+              return codec.decode(compressed, compressed_size, out, size,
+                                  num_threads, nullptr);
+            },
+            options, decode_result)) {
+      std::cerr << codec.name << ": Decoding failed\n";
+      return false;
+    }
+    if (out != in) {
+      std::cerr << codec.name << ": The decoded data does not match\n";
+      return false;
+    }
+    encode_result.compressed_size = compressed_size;
+    decode_result.compressed_size = compressed_size;
+
+    // Collect the per-phase statistics with a separate (untimed) call.
+    hzr_stats_t stats;
+    hzr_init_stats(&stats);
+    if (codec.encode(in, size, compressed, &compressed_size, num_threads,
+                     &stats) &&
+        stats.decoded_bytes > 0) {
+      encode_result.has_stats = true;
+      encode_result.stats = stats;
+    }
+    hzr_init_stats(&stats);
+    if (codec.decode(compressed, compressed_size, out, size, num_threads,
+                     &stats) &&
+        stats.decoded_bytes > 0) {
+      decode_result.has_stats = true;
+      decode_result.stats = stats;
+    }
+
+    // Thread scaling, relative to a single thread.
+    if (num_threads == 1) {
+      single_encode_time = encode_result.median_time;
+      single_decode_time = decode_result.median_time;
+    }
+    if (single_encode_time > 0.0) {
+      encode_result.speedup = single_encode_time / encode_result.median_time;
+      decode_result.speedup = single_decode_time / decode_result.median_time;
+    }
+
+    results.push_back(encode_result);
+    results.push_back(decode_result);
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Output.
+//------------------------------------------------------------------------------
+
+double mb_per_s(size_t size, double time) {
+  return (time > 0.0) ? static_cast<double>(size) / (time * 1024.0 * 1024.0)
+                      : 0.0;
+}
+
+double ratio(const result_t& result) {
+  return (result.compressed_size > 0)
+             ? static_cast<double>(result.size) /
+                   static_cast<double>(result.compressed_size)
+             : 0.0;
+}
+
+// The names and values of the per-phase times of the statistics.
+std::vector<std::pair<const char*, uint64_t>> phases(const hzr_stats_t& s) {
+  return {{"filter", s.filter_ticks},
+          {"histogram", s.histogram_ticks},
+          {"tree", s.tree_ticks},
+          {"coding", s.coding_ticks},
+          {"crc", s.crc_ticks}};
+}
+
+std::string format_size(size_t size) {
+  if (size >= GIB && size % GIB == 0) {
+    return std::to_string(size / GIB) + "G";
+  }
+  if (size >= MIB && size % MIB == 0) {
+    return std::to_string(size / MIB) + "M";
+  }
+  if (size >= KIB && size % KIB == 0) {
+    return std::to_string(size / KIB) + "K";
+  }
+  return std::to_string(size);
+}
+
+void write_text(std::ostream& os, const std::vector<result_t>& results) {
+  char line[256];
+  std::snprintf(line, sizeof(line),
+                "%-16s %6s %-8s %-6s %3s %7s %10s %10s %10s %7s\n", "corpus",
+                "size", "codec", "op", "thr", "ratio", "MB/s", "p10", "p90",
+                "scaling");
+  os << line;
+  for (const auto& r : results) {
+    std::snprintf(line, sizeof(line),
+                  "%-16.16s %6s %-8s %-6s %3d %7.3f %10.1f %10.1f %10.1f",
+                  r.corpus.c_str(), format_size(r.size).c_str(),
+                  r.codec.c_str(), r.operation.c_str(), r.threads, ratio(r),
+                  mb_per_s(r.size, r.median_time),
+                  mb_per_s(r.size, r.slow_time),
+                  mb_per_s(r.size, r.fast_time));
+    os << line;
+    if (r.threads > 1 && r.speedup > 0.0) {
+      std::snprintf(line, sizeof(line), " %6.2fx", r.speedup);
+      os << line;
+    }
+    os << "\n";
+    if (r.has_stats) {
+      uint64_t total = 0;
+      for (const auto& phase : phases(r.stats)) {
+        total += phase.second;
+      }
+      os << "    phases:";
+      for (const auto& phase : phases(r.stats)) {
+        if (phase.second > 0) {
+          std::snprintf(line, sizeof(line), " %s %.1f%%", phase.first,
+                        100.0 * static_cast<double>(phase.second) /
+                            static_cast<double>(std::max(total, uint64_t(1))));
+          os << line;
+        }
+      }
+      if (r.stats.lut_lookups > 0) {
+        std::snprintf(line, sizeof(line), ", LUT misses %.3f%%",
+                      100.0 * static_cast<double>(r.stats.lut_misses) /
+                          static_cast<double>(r.stats.lut_lookups));
+        os << line;
+      }
+      os << "\n";
+    }
+  }
+}
+
+std::string json_escape(const std::string& str) {
+  std::string escaped;
+  for (const char c : str) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char code[8];
+      std::snprintf(code, sizeof(code), "\\u%04x", c);
+      escaped += code;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+void write_json(std::ostream& os, const std::vector<result_t>& results) {
+  os << "{\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    os << (i > 0 ? "," : "") << "\n    {\"corpus\": \""
+       << json_escape(r.corpus) << "\", \"size\": " << r.size
+       << ", \"codec\": \"" << r.codec << "\", \"operation\": \""
+       << r.operation << "\", \"threads\": " << r.threads
+       << ", \"compressed_size\": " << r.compressed_size
+       << ", \"ratio\": " << ratio(r)
+       << ", \"mb_per_s\": " << mb_per_s(r.size, r.median_time)
+       << ", \"mb_per_s_p10\": " << mb_per_s(r.size, r.slow_time)
+       << ", \"mb_per_s_p90\": " << mb_per_s(r.size, r.fast_time)
+       << ", \"samples\": " << r.samples;
+    if (r.speedup > 0.0) {
+      os << ", \"speedup\": " << r.speedup;
+    }
+    if (r.has_stats) {
+      os << ", \"ticks\": {";
+      bool first = true;
+      for (const auto& phase : phases(r.stats)) {
+        os << (first ? "" : ", ") << "\"" << phase.first
+           << "\": " << phase.second;
+        first = false;
+      }
+      os << "}, \"lut_lookups\": " << r.stats.lut_lookups
+         << ", \"lut_misses\": " << r.stats.lut_misses;
+    }
+    os << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+std::string csv_escape(const std::string& str) {
+  if (str.find_first_of(",\"\n") == std::string::npos) {
+    return str;
+  }
+  std::string escaped = "\"";
+  for (const char c : str) {
+    escaped += c;
+    if (c == '"') {
+      escaped += c;
+    }
+  }
+  return escaped + "\"";
+}
+
+void write_csv(std::ostream& os, const std::vector<result_t>& results) {
+  os << "corpus,size,codec,operation,threads,compressed_size,ratio,mb_per_s,"
+        "mb_per_s_p10,mb_per_s_p90,samples,speedup";
+  for (const auto& phase : phases(hzr_stats_t())) {
+    os << "," << phase.first << "_ticks";
+  }
+  os << ",lut_lookups,lut_misses\n";
+  for (const auto& r : results) {
+    os << csv_escape(r.corpus) << "," << r.size << "," << r.codec << ","
+       << r.operation << "," << r.threads << "," << r.compressed_size << ","
+       << ratio(r) << "," << mb_per_s(r.size, r.median_time) << ","
+       << mb_per_s(r.size, r.slow_time) << ","
+       << mb_per_s(r.size, r.fast_time) << "," << r.samples << ","
+       << r.speedup;
+    for (const auto& phase : phases(r.stats)) {
+      os << "," << phase.second;
+    }
+    os << "," << r.stats.lut_lookups << "," << r.stats.lut_misses << "\n";
+  }
+}
+
+//------------------------------------------------------------------------------
+// Command line parsing.
+//------------------------------------------------------------------------------
+
+void print_usage(const char* prog) {
+  std::cerr
+      << "Usage: " << prog << " [options] [FILE|DIRECTORY ...]\n"
+      << "\n"
+      << "Benchmark HZR on the given files (all the files of a directory), or "
+         "on\n"
+      << "synthetic data if no files are given.\n"
+      << "\n"
+      << "Options:\n"
+      << "  --sizes MIN:MAX  Sweep buffer sizes from MIN to MAX bytes, e.g. "
+         "1K:1G\n"
+      << "                   (default: 1K:16M, files are used as a whole "
+         "unless\n"
+      << "                   this option is given)\n"
+      << "  --threads LIST   Comma separated thread counts (default: 1)\n"
+      << "  --warmup N       Number of warmup calls (default: 1)\n"
+      << "  --samples N      Minimum number of samples (default: 5)\n"
+      << "  --min-time S     Minimum time per benchmark in seconds (default: "
+         "0.2)\n"
+      << "  --format F       Output format: text, csv or json (default: "
+         "text)\n"
+      << "  --output FILE    Write the results to FILE (default: stdout)\n"
+      << "  --zlib-level N   The zlib compression level (default: 1)\n"
+      << "  --no-compare     Only benchmark HZR\n"
+      << "\n"
+      << "HZR encoder options (see the hzr tool):\n"
+      << "  -b N  Block size    -i  Block index   -C  Canonical codes\n"
+      << "  -m    Multi-stream  -r  Reuse trees   -f N  Filter  -s N  Stride\n";
+}
+
+bool parse_size(const std::string& str, size_t* size) {
+  char* end;
+  const double value = std::strtod(str.c_str(), &end);
+  size_t scale = 1;
+  const std::string suffix(end);
+  if (suffix == "K" || suffix == "k") {
+    scale = KIB;
+  } else if (suffix == "M" || suffix == "m") {
+    scale = MIB;
+  } else if (suffix == "G" || suffix == "g") {
+    scale = GIB;
+  } else if (!suffix.empty()) {
+    return false;
+  }
+  if (end == str.c_str() || value < 1.0) {
+    return false;
+  }
+  *size = static_cast<size_t>(value * static_cast<double>(scale));
+  return true;
+}
+
+bool parse_threads(const std::string& str, std::vector<int>& threads) {
+  threads.clear();
+  std::istringstream ss(str);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    const int num_threads = std::atoi(item.c_str());
+    if (num_threads < 1) {
+      return false;
+    }
+    threads.push_back(num_threads);
+  }
+  // Make sure that the single threaded case comes first (for the scaling).
+  std::sort(threads.begin(), threads.end());
+  threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+  if (threads.empty() || threads[0] != 1) {
+    threads.insert(threads.begin(), 1);
+  }
+  return true;
+}
+
+// Parse the command line. Returns false if the arguments are invalid.
+bool parse_args(int argc,
+                const char** argv,
+                bench_options_t& options,
+                std::vector<std::string>& paths) {
+  hzr_init_encode_options(&options.encode_options);
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--sizes" && has_value) {
+      const std::string range = argv[++i];
+      const size_t colon = range.find(':');
+      if (colon == std::string::npos ||
+          !parse_size(range.substr(0, colon), &options.min_size) ||
+          !parse_size(range.substr(colon + 1), &options.max_size) ||
+          options.min_size > options.max_size) {
+        return false;
+      }
+      options.sweep = true;
+    } else if (arg == "--threads" && has_value) {
+      if (!parse_threads(argv[++i], options.threads)) {
+        return false;
+      }
+    } else if (arg == "--warmup" && has_value) {
+      options.warmup = std::max(std::atoi(argv[++i]), 0);
+    } else if (arg == "--samples" && has_value) {
+      options.min_samples = std::max(std::atoi(argv[++i]), 1);
+    } else if (arg == "--min-time" && has_value) {
+      options.min_time = std::max(std::atof(argv[++i]), 0.0);
+    } else if (arg == "--format" && has_value) {
+      options.format = argv[++i];
+      if (options.format != "text" && options.format != "csv" &&
+          options.format != "json") {
+        return false;
+      }
+    } else if (arg == "--output" && has_value) {
+      options.output = argv[++i];
+    } else if (arg == "--zlib-level" && has_value) {
+      options.zlib_level = std::atoi(argv[++i]);
+    } else if (arg == "--no-compare") {
+      options.compare = false;
+    } else if (arg == "-b" && has_value) {
+      options.encode_options.block_size =
+          static_cast<size_t>(std::atol(argv[++i]));
+    } else if (arg == "-i") {
+      options.encode_options.add_index = 1;
+    } else if (arg == "-C") {
+      options.encode_options.canonical_codes = 1;
+    } else if (arg == "-m") {
+      options.encode_options.multi_stream = 1;
+    } else if (arg == "-r") {
+      options.encode_options.reuse_trees = 1;
+    } else if (arg == "-f" && has_value) {
+      options.encode_options.filter = std::atoi(argv[++i]);
+    } else if (arg == "-s" && has_value) {
+      options.encode_options.filter_stride = std::atoi(argv[++i]);
+    } else if (!arg.empty() && arg[0] == '-') {
+      return false;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+  bench_options_t options;
+  std::vector<std::string> paths;
+  if (!parse_args(argc, argv, options, paths)) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // Load the corpora.
+  std::vector<corpus_t> corpora;
+  for (const auto& path : paths) {
+    if (!load_corpus(path, corpora)) {
+      return 1;
+    }
+  }
+  if (paths.empty()) {
+    corpora = make_synthetic_corpora();
+  }
+  if (corpora.empty()) {
+    std::cerr << "No data to benchmark\n";
+    return 1;
+  }
+
+  // Run the benchmarks.
+  const std::vector<codec_t> codecs = make_codecs(options);
+  std::vector<result_t> results;
+  buffer_t in;
+  for (auto& corpus : corpora) {
+    if (corpus.generator) {
+      corpus.data.resize(options.max_size);
+      random_t random(1234);
+      corpus.generator(corpus.data, random);
+    }
+    for (const auto size : get_sizes(corpus, options)) {
+      get_input(corpus, size, in);
+      std::cerr << "Benchmarking " << corpus.name << " (" << format_size(size)
+                << ")\n";
+      for (const auto& codec : codecs) {
+        if (!bench_codec(codec, corpus.name, in, options, results)) {
+          return 1;
+        }
+      }
+    }
+    if (corpus.generator) {
+      buffer_t().swap(corpus.data);
+    }
+  }
+
+  // Write the results.
+  std::ofstream file;
+  if (!options.output.empty()) {
+    file.open(options.output);
+    if (!file) {
+      std::cerr << "Unable to create " << options.output << "\n";
+      return 1;
+    }
+  }
+  std::ostream& os = options.output.empty() ? std::cout : file;
+  if (options.format == "json") {
+    write_json(os, results);
+  } else if (options.format == "csv") {
+    write_csv(os, results);
+  } else {
+    write_text(os, results);
+  }
+  return os ? 0 : 1;
+}
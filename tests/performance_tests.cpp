@@ -22,8 +22,10 @@
 
 #include <doctest.h>
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <vector>
 
 #if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
@@ -48,9 +50,10 @@ const size_t SIZES[] = {MAX_UNCOMPRESSED_SIZE, MAX_UNCOMPRESSED_SIZE / 4,
                         MAX_UNCOMPRESSED_SIZE / 8, MAX_UNCOMPRESSED_SIZE / 32};
 const size_t NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
 
-// This is an approximation (rounded up) of the maximum compressed size.
+// This is an approximation (rounded up) of the maximum compressed size, with
+// room for the overhead of the smallest block size.
 const size_t MAX_COMPRESSED_SIZE =
-    MAX_UNCOMPRESSED_SIZE + (MAX_UNCOMPRESSED_SIZE >> 13) + 4;
+    MAX_UNCOMPRESSED_SIZE + (MAX_UNCOMPRESSED_SIZE >> 6) + 64;
 
 // Statically allocate memory for the compression/decompression.
 unsigned char s_uncompressed[MAX_UNCOMPRESSED_SIZE];
@@ -77,6 +80,9 @@ double get_time() {
 
 const int NUM_BENCHMARK_ITERATIONS = 1000;
 
+// Number of threads to use for the multi-threaded benchmarks.
+const int NUM_THREADS = 4;
+
 void print_results(const char* str, double dt, size_t num_bytes) {
   double speed = static_cast<double>(NUM_BENCHMARK_ITERATIONS * num_bytes) / dt;
   std::cout << "  " << str << ": " << speed / (1024.0 * 1024.0) << " MB/s\n";
@@ -138,6 +144,120 @@ void perform_test(size_t uncompressed_size) {
   print_results("Decode", dt, uncompressed_size);
   CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
 
+  // Decompress the data with CRC checks.
+  hzr_decode_options_t decode_options;
+  hzr_init_decode_options(&decode_options);
+  decode_options.check_crc = 1;
+  success_count = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BENCHMARK_ITERATIONS; ++i) {
+    hzr_status_t status =
+        hzr_decode_ex(s_compressed, compressed_size, s_uncompressed2,
+                      uncompressed_size2, &decode_options);
+    if (status == HZR_OK) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  print_results("Decode (check CRC)", dt, uncompressed_size);
+  CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
+
+  // Compress the data using several threads.
+  success_count = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BENCHMARK_ITERATIONS; ++i) {
+    size_t mt_compressed_size = 0;
+    hzr_status_t status =
+        hzr_encode_mt(s_uncompressed, uncompressed_size, s_compressed,
+                      max_compressed_size, &mt_compressed_size, NUM_THREADS);
+    if (status == HZR_OK && mt_compressed_size == compressed_size) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  print_results("Encode (MT)", dt, uncompressed_size);
+  CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
+
+  // Decompress the data using several threads.
+  success_count = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BENCHMARK_ITERATIONS; ++i) {
+    hzr_status_t status =
+        hzr_decode_mt(s_compressed, compressed_size, s_uncompressed2,
+                      uncompressed_size2, NUM_THREADS);
+    if (status == HZR_OK) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  print_results("Decode (MT)", dt, uncompressed_size);
+  CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
+
+  // Compress the data using length-limited canonical codes.
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  options.canonical_codes = 1;
+  success_count = 0;
+  size_t canonical_size = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BENCHMARK_ITERATIONS; ++i) {
+    hzr_status_t status =
+        hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed,
+                      max_compressed_size, &canonical_size, &options);
+    if (status == HZR_OK) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  print_results("Encode (canonical)", dt, uncompressed_size);
+  CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
+
+  // Decompress the data that uses canonical codes.
+  success_count = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BENCHMARK_ITERATIONS; ++i) {
+    hzr_status_t status = hzr_decode(s_compressed, canonical_size,
+                                     s_uncompressed2, uncompressed_size2);
+    if (status == HZR_OK) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  print_results("Decode (canonical)", dt, uncompressed_size);
+  CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
+
+  // Compress the data using multiple streams per block.
+  hzr_init_encode_options(&options);
+  options.multi_stream = 1;
+  success_count = 0;
+  size_t multi_stream_size = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BENCHMARK_ITERATIONS; ++i) {
+    hzr_status_t status =
+        hzr_encode_ex(s_uncompressed, uncompressed_size, s_compressed,
+                      max_compressed_size, &multi_stream_size, &options);
+    if (status == HZR_OK) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  print_results("Encode (multi-stream)", dt, uncompressed_size);
+  CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
+
+  // Decompress the data that uses multiple streams per block.
+  success_count = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BENCHMARK_ITERATIONS; ++i) {
+    hzr_status_t status = hzr_decode(s_compressed, multi_stream_size,
+                                     s_uncompressed2, uncompressed_size2);
+    if (status == HZR_OK) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  print_results("Decode (multi-stream)", dt, uncompressed_size);
+  CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
+
 #ifdef HZR_HAS_ZLIB
   {
     t0 = get_time();
@@ -190,6 +310,196 @@ void perform_test(size_t uncompressed_size) {
   print_results("memcpy (reference)", dt, uncompressed_size);
 }
 
+// Small blocks that use most symbols, so that building the Huffman tree is a
+// large part of the encoding time.
+const size_t TREE_BUILD_SIZES[] = {4096, 1024, 512};
+const int NUM_TREE_BUILD_ITERATIONS = 10000;
+
+// Time the building of the Huffman codes of each block (MakeTree() and
+// StoreTree(), or the canonical codes), as reported by the tree_ticks phase of
+// the encoder statistics. The ticks are timestamp counter cycles on x86, and
+// nanoseconds on other POSIX systems.
+// Note: The codes are built even if the block is then stored as a plain copy,
+// because the Huffman coded block would not be smaller.
+void perform_tree_build_test(size_t uncompressed_size,
+                             hzr_encode_options_t options,
+                             hzr_workspace_t* workspace = nullptr) {
+  const size_t max_compressed_size =
+      hzr_max_compressed_size_ex(uncompressed_size, &options);
+  REQUIRE(sizeof(s_compressed) >= max_compressed_size);
+  hzr_stats_t stats;
+  hzr_init_stats(&stats);
+  options.stats = &stats;
+
+  int success_count = 0;
+  for (int i = 0; i < NUM_TREE_BUILD_ITERATIONS; ++i) {
+    size_t compressed_size = 0;
+    hzr_status_t status =
+        workspace ? hzr_encode_ws(s_uncompressed, uncompressed_size,
+                                  s_compressed, max_compressed_size,
+                                  &compressed_size, &options, workspace)
+                  : hzr_encode_ex(s_uncompressed, uncompressed_size,
+                                  s_compressed, max_compressed_size,
+                                  &compressed_size, &options);
+    if (status == HZR_OK) {
+      ++success_count;
+    }
+  }
+  CHECK(success_count == NUM_TREE_BUILD_ITERATIONS);
+
+  const uint64_t phase_ticks = stats.filter_ticks + stats.histogram_ticks +
+                               stats.tree_ticks + stats.coding_ticks +
+                               stats.crc_ticks;
+  std::cout << "  Size " << uncompressed_size << ": "
+            << (static_cast<double>(stats.tree_ticks) /
+                NUM_TREE_BUILD_ITERATIONS)
+            << " ticks/block ("
+            << (100.0 * static_cast<double>(stats.tree_ticks) /
+                static_cast<double>(std::max(phase_ticks, uint64_t(1))))
+            << "% of the encoding phases)\n";
+}
+
+// Block sizes to compare, from small blocks (fine grained random access) to
+// large blocks (less per-block overhead).
+const size_t SWEEP_BLOCK_SIZES[] = {1024, 4096, 16384, 65536, 262144};
+
+// Small block sizes, where the Huffman trees are a large part of the encoded
+// data (so that reusing them pays off).
+const size_t TREE_REUSE_BLOCK_SIZES[] = {HZR_MIN_BLOCK_SIZE, 4096, 16384};
+
+void perform_block_size_test(size_t block_size, bool reuse_trees = false) {
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  options.block_size = block_size;
+  options.reuse_trees = reuse_trees ? 1 : 0;
+  const size_t max_compressed_size =
+      hzr_max_compressed_size_ex(MAX_UNCOMPRESSED_SIZE, &options);
+  REQUIRE(sizeof(s_compressed) >= max_compressed_size);
+
+  std::cout << " Block size: " << block_size
+            << (reuse_trees ? " (tree reuse)\n" : "\n");
+
+  int success_count = 0;
+  size_t compressed_size = 0;
+  double t0 = get_time();
+  for (int i = 0; i < NUM_BENCHMARK_ITERATIONS; ++i) {
+    if (hzr_encode_ex(s_uncompressed, MAX_UNCOMPRESSED_SIZE, s_compressed,
+                      max_compressed_size, &compressed_size,
+                      &options) == HZR_OK) {
+      ++success_count;
+    }
+  }
+  double dt = get_time() - t0;
+  print_results("Encode", dt, MAX_UNCOMPRESSED_SIZE);
+  CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
+
+  success_count = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BENCHMARK_ITERATIONS; ++i) {
+    if (hzr_decode(s_compressed, compressed_size, s_uncompressed2,
+                   MAX_UNCOMPRESSED_SIZE) == HZR_OK) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  print_results("Decode", dt, MAX_UNCOMPRESSED_SIZE);
+  CHECK(success_count == NUM_BENCHMARK_ITERATIONS);
+
+  std::cout << "  Compression ratio: "
+            << static_cast<double>(MAX_UNCOMPRESSED_SIZE) /
+                   static_cast<double>(compressed_size)
+            << ":1\n";
+}
+
+// Small buffers (e.g. network messages) that are encoded and decoded in
+// batches. The per-call overhead is significant for such buffers.
+const size_t BATCH_BUFFER_SIZE = 4096;
+const int NUM_BATCH_ITERATIONS = 100;
+
+void perform_batch_test(int num_threads) {
+  const size_t num_items = MAX_UNCOMPRESSED_SIZE / BATCH_BUFFER_SIZE;
+  const size_t slot_size = hzr_max_compressed_size(BATCH_BUFFER_SIZE);
+  std::vector<unsigned char> compressed(num_items * slot_size);
+  std::vector<hzr_batch_item_t> items(num_items);
+  std::vector<hzr_batch_item_t> decode_items(num_items);
+  for (size_t i = 0; i < num_items; ++i) {
+    items[i].in = &s_uncompressed[i * BATCH_BUFFER_SIZE];
+    items[i].in_size = BATCH_BUFFER_SIZE;
+    items[i].out = &compressed[i * slot_size];
+    items[i].out_size = slot_size;
+    decode_items[i].in = items[i].out;
+    decode_items[i].out = &s_uncompressed2[i * BATCH_BUFFER_SIZE];
+    decode_items[i].out_size = BATCH_BUFFER_SIZE;
+  }
+
+  hzr_workspace_t* workspace = hzr_workspace_create();
+  REQUIRE(workspace != nullptr);
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  options.num_threads = num_threads;
+  hzr_decode_options_t decode_options;
+  hzr_init_decode_options(&decode_options);
+  decode_options.num_threads = num_threads;
+
+  std::cout << " Threads: " << num_threads << "\n";
+
+  // One call per buffer.
+  int success_count = 0;
+  double t0 = get_time();
+  for (int i = 0; i < NUM_BATCH_ITERATIONS; ++i) {
+    for (auto& item : items) {
+      item.status = hzr_encode_ws(item.in, item.in_size, item.out,
+                                  item.out_size, &item.result_size, &options,
+                                  workspace);
+      if (item.status == HZR_OK) {
+        ++success_count;
+      }
+    }
+  }
+  double dt = get_time() - t0;
+  CHECK(success_count == NUM_BATCH_ITERATIONS * static_cast<int>(num_items));
+  std::cout << "  Encode (one call per buffer): "
+            << (1e6 * dt / (NUM_BATCH_ITERATIONS * num_items))
+            << " us/buffer\n";
+
+  // One call per batch.
+  success_count = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BATCH_ITERATIONS; ++i) {
+    if (hzr_encode_batch(items.data(), num_items, &options, workspace) ==
+        HZR_OK) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  CHECK(success_count == NUM_BATCH_ITERATIONS);
+  std::cout << "  Encode (batch): "
+            << (1e6 * dt / (NUM_BATCH_ITERATIONS * num_items))
+            << " us/buffer\n";
+
+  for (size_t i = 0; i < num_items; ++i) {
+    decode_items[i].in_size = items[i].result_size;
+  }
+  success_count = 0;
+  t0 = get_time();
+  for (int i = 0; i < NUM_BATCH_ITERATIONS; ++i) {
+    if (hzr_decode_batch(decode_items.data(), num_items, &decode_options,
+                         workspace) == HZR_OK) {
+      ++success_count;
+    }
+  }
+  dt = get_time() - t0;
+  CHECK(success_count == NUM_BATCH_ITERATIONS);
+  std::cout << "  Decode (batch): "
+            << (1e6 * dt / (NUM_BATCH_ITERATIONS * num_items))
+            << " us/buffer\n";
+  const size_t total_size = num_items * BATCH_BUFFER_SIZE;
+  CHECK(std::equal(s_uncompressed, s_uncompressed + total_size,
+                   s_uncompressed2));
+
+  hzr_workspace_destroy(workspace);
+}
+
 }  // namespace
 
 TEST_CASE("Test 1 (all zeros)") {
@@ -246,3 +556,84 @@ TEST_CASE("Test 5 (all ones)") {
     perform_test(uncompressed_size);
   }
 }
+
+TEST_CASE("Test 6 (tree build)") {
+  std::cout << "Test 6 (tree build)" << std::endl;
+  random_t random(1234);
+  for (size_t i = 0; i < MAX_UNCOMPRESSED_SIZE; ++i) {
+    s_uncompressed[i] = random.gaussian(30);
+  }
+  hzr_encode_options_t options;
+  hzr_init_encode_options(&options);
+  std::cout << " Huffman tree:\n";
+  for (const auto size : TREE_BUILD_SIZES) {
+    perform_tree_build_test(size, options);
+  }
+  options.canonical_codes = 1;
+  std::cout << " Canonical codes:\n";
+  for (const auto size : TREE_BUILD_SIZES) {
+    perform_tree_build_test(size, options);
+  }
+  hzr_workspace_t* workspace = hzr_workspace_create();
+  REQUIRE(workspace != nullptr);
+  options.canonical_codes = 0;
+  std::cout << " Huffman tree (workspace):\n";
+  for (const auto size : TREE_BUILD_SIZES) {
+    perform_tree_build_test(size, options, workspace);
+  }
+  hzr_workspace_destroy(workspace);
+  hzr_table_t* table =
+      hzr_table_train(s_uncompressed, MAX_UNCOMPRESSED_SIZE, 1);
+  REQUIRE(table != nullptr);
+  options.table = table;
+  std::cout << " Shared table:\n";
+  for (const auto size : TREE_BUILD_SIZES) {
+    perform_tree_build_test(size, options);
+  }
+  hzr_table_destroy(table);
+}
+
+TEST_CASE("Test 7 (block size)") {
+  std::cout << "Test 7 (block size)" << std::endl;
+  random_t random(1234);
+  for (size_t i = 0; i < MAX_UNCOMPRESSED_SIZE; ++i) {
+    s_uncompressed[i] = random.gaussian(8);
+  }
+  for (const auto block_size : SWEEP_BLOCK_SIZES) {
+    perform_block_size_test(block_size);
+  }
+}
+
+TEST_CASE("Test 8 (tree reuse)") {
+  std::cout << "Test 8 (tree reuse)" << std::endl;
+  random_t random(1234);
+  for (size_t i = 0; i < MAX_UNCOMPRESSED_SIZE; ++i) {
+    s_uncompressed[i] = random.gaussian(8);
+  }
+  for (const auto block_size : TREE_REUSE_BLOCK_SIZES) {
+    perform_block_size_test(block_size);
+    perform_block_size_test(block_size, true);
+  }
+}
+
+TEST_CASE("Test 9 (gaussian(8), no zeros)") {
+  std::cout << "Test 9 (gaussian(8), no zeros)" << std::endl;
+  for (size_t k = 0; k < NUM_SIZES; ++k) {
+    const size_t uncompressed_size = SIZES[k];
+    random_t random(1234);
+    for (size_t i = 0; i < uncompressed_size; ++i) {
+      s_uncompressed[i] = random.gaussian(8) ^ 0x80;
+    }
+    perform_test(uncompressed_size);
+  }
+}
+
+TEST_CASE("Test 10 (batch)") {
+  std::cout << "Test 10 (batch)" << std::endl;
+  random_t random(1234);
+  for (size_t i = 0; i < MAX_UNCOMPRESSED_SIZE; ++i) {
+    s_uncompressed[i] = random.gaussian(8);
+  }
+  perform_batch_test(1);
+  perform_batch_test(NUM_THREADS);
+}